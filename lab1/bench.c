@@ -0,0 +1,464 @@
+/** bench.c
+ * @brief microbenchmarks for the PNG core: crc(), update_crc(), mem_def(),
+ *        mem_inf(), get_idat_chunk() and concatenate_pngs_fd().
+ *
+ * @Usage
+ * bench [-s MAX_MB] [-r TRIALS] [-w WARMUP] [-f FILTER] [-j THREADS]
+ *
+ * Every case is run WARMUP times untimed and then TRIALS times timed. For each
+ * case the min, median and p99 of the trial times are reported both as MB/s
+ * and as ns/byte, where bytes are the uncompressed image bytes the case works
+ * on (compressed bytes for crc/update_crc over IDAT data).
+ *
+ * Inputs are the 16x16 sample image plus synthetic 1024-pixel wide RGBA
+ * images of 64K, 1M, 4M, 16M, ... of raw scanlines, up to MAX_MB (default 16).
+ * -s 512 adds the 64M, 256M and 512M images. -f only runs cases whose name
+ * contains FILTER. Synthetic PNGs are written to ./_tmp/bench.
+ *
+ * concatenate writes to /dev/null. concat_file and concat_par write a regular
+ * file in ./_tmp/bench, the first with the streaming writer and the second
+ * with THREADS deflate threads and pwrite() (default: online CPUs).
+ *
+ * The Makefile builds with -O0; for representative numbers build with
+ *   make clean bench CFLAGS="-Wall -O2 -std=c99"
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "crc.h"
+#include "zutil.h"
+#include "lab_png.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define SAMPLE_PNG   "starter/images/red-green-16x16.png"
+#define BENCH_DIR    "_tmp/bench"
+#define BENCH_WIDTH  1024          /* synthetic image width in pixels     */
+#define BENCH_STRIPS 50            /* inputs per concatenate case         */
+#define BENCH_OUT    BENCH_DIR "/out.png" /* concat_file/concat_par output */
+#define CRC_PIECE    4096          /* update_crc() piece size             */
+#define MAX_TRIALS   1000
+
+/******************************************************************************
+ * STRUCTURES and TYPEDEFS
+ *****************************************************************************/
+
+/* one input image the cases run over */
+typedef struct bench_input {
+    char name[32];     /* label printed in the report             */
+    U32 width;         /* pixels                                  */
+    U32 height;        /* pixels                                  */
+    U8 *raw;           /* filtered scanlines                      */
+    U64 raw_len;
+    U8 *def;           /* raw deflated with Z_DEFAULT_COMPRESSION */
+    U64 def_len;
+    U8 *inf;           /* mem_inf() output buffer                 */
+    U8 *def_out;       /* mem_def() output buffer                 */
+    char *files[BENCH_STRIPS]; /* strip PNGs for concatenate      */
+    int nfiles;
+    char single[64];   /* the whole image as one PNG              */
+} BENCH_INPUT;
+
+typedef void (*bench_fn)(BENCH_INPUT *in);
+
+/******************************************************************************
+ * GLOBALS
+ *****************************************************************************/
+static int g_trials = 11;
+static int g_warmup = 2;
+static const char *g_filter = NULL;
+static int g_null_fd = -1;
+static int g_threads = 1;
+
+/******************************************************************************
+ * FUNCTIONS
+ *****************************************************************************/
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief fill buf with scanlines that compress about as well as the lab
+ *        images do: a smooth gradient with some noise in the low bits.
+ */
+static void init_image(U8 *buf, U32 width, U32 height)
+{
+    U32 x, y;
+    U32 seed = 2463534242u;
+    U64 stride = (U64)width * 4 + 1;
+
+    for (y = 0; y < height; y++) {
+        U8 *row = buf + y * stride;
+        row[0] = 0; /* filter type None */
+        for (x = 0; x < width; x++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            row[1 + x * 4 + 0] = (x + y) + (seed & 0x7);
+            row[1 + x * 4 + 1] = (x * 2) + ((seed >> 3) & 0x7);
+            row[1 + x * 4 + 2] = (y * 3) + ((seed >> 6) & 0x3);
+            row[1 + x * 4 + 3] = 0xff;
+        }
+    }
+}
+
+/**
+ * @brief write rows [y0, y0+h) of an input as a PNG file with a single IDAT,
+ *        the layout get_idat_chunk() expects
+ */
+static int write_png(const char *path, BENCH_INPUT *in, U32 y0, U32 h)
+{
+    U64 stride = (U64)in->width * 4 + 1;
+    U8 ihdr_data[DATA_IHDR_SIZE] = { 0 };
+    struct chunk ihdr = { DATA_IHDR_SIZE, {'I', 'H', 'D', 'R'}, ihdr_data, 0 };
+    struct chunk idat = { 0, {'I', 'D', 'A', 'T'}, NULL, 0 };
+    struct chunk iend = { 0, {'I', 'E', 'N', 'D'}, NULL, 0 };
+    U64 def_len = 0;
+    FILE *fp;
+
+    ihdr_data[0] = in->width >> 24;
+    ihdr_data[1] = in->width >> 16;
+    ihdr_data[2] = in->width >> 8;
+    ihdr_data[3] = in->width;
+    ihdr_data[4] = h >> 24;
+    ihdr_data[5] = h >> 16;
+    ihdr_data[6] = h >> 8;
+    ihdr_data[7] = h;
+    ihdr_data[8] = 8;  /* bit depth           */
+    ihdr_data[9] = 6;  /* truecolor with alpha */
+
+    idat.p_data = malloc(compressBound(stride * h) + 1024);
+    if (idat.p_data == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    mem_def(idat.p_data, &def_len, in->raw + y0 * stride, stride * h, Z_DEFAULT_COMPRESSION);
+    idat.length = def_len;
+    update_chunk_crc(&ihdr);
+    update_chunk_crc(&idat);
+    update_chunk_crc(&iend);
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror(path);
+        free(idat.p_data);
+        return -1;
+    }
+    write_chunks_to_png_file(fp, &ihdr, &idat, &iend);
+    fclose(fp);
+    free(idat.p_data);
+    return 0;
+}
+
+/**
+ * @brief allocate the buffers of an input whose raw scanlines are set and
+ *        write out its PNG files
+ */
+static int prepare_input(BENCH_INPUT *in)
+{
+    U64 bound = compressBound(in->raw_len) + 1024;
+    U32 strip_h;
+    int i;
+
+    in->def = malloc(bound);
+    in->def_out = malloc(bound);
+    in->inf = malloc(in->raw_len);
+    if (in->def == NULL || in->def_out == NULL || in->inf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (mem_def(in->def, &in->def_len, in->raw, in->raw_len, Z_DEFAULT_COMPRESSION) != 0) {
+        return -1;
+    }
+
+    snprintf(in->single, sizeof(in->single), BENCH_DIR "/%s.png", in->name);
+    if (write_png(in->single, in, 0, in->height) != 0) {
+        return -1;
+    }
+
+    in->nfiles = in->height < BENCH_STRIPS ? in->height : BENCH_STRIPS;
+    strip_h = in->height / in->nfiles;
+    for (i = 0; i < in->nfiles; i++) {
+        U32 h = (i == in->nfiles - 1) ? in->height - strip_h * i : strip_h;
+        in->files[i] = malloc(64);
+        snprintf(in->files[i], 64, BENCH_DIR "/%s_%d.png", in->name, i);
+        if (write_png(in->files[i], in, strip_h * i, h) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_input(BENCH_INPUT *in)
+{
+    int i;
+    for (i = 0; i < in->nfiles; i++) {
+        unlink(in->files[i]);
+        free(in->files[i]);
+    }
+    unlink(in->single);
+    free(in->raw);
+    free(in->def);
+    free(in->def_out);
+    free(in->inf);
+}
+
+/* the cases ------------------------------------------------------------- */
+
+static volatile unsigned long g_sink; /* keeps results alive */
+
+static void bench_crc(BENCH_INPUT *in)
+{
+    g_sink += crc(in->def, in->def_len);
+}
+
+static void bench_update_crc(BENCH_INPUT *in)
+{
+    unsigned long c = 0xffffffffL;
+    U64 off;
+    for (off = 0; off < in->def_len; off += CRC_PIECE) {
+        U64 n = in->def_len - off < CRC_PIECE ? in->def_len - off : CRC_PIECE;
+        c = update_crc(c, in->def + off, n);
+    }
+    g_sink += c ^ 0xffffffffL;
+}
+
+static void bench_mem_def(BENCH_INPUT *in)
+{
+    U64 len = 0;
+    mem_def(in->def_out, &len, in->raw, in->raw_len, Z_DEFAULT_COMPRESSION);
+    g_sink += len;
+}
+
+static void bench_mem_inf(BENCH_INPUT *in)
+{
+    U64 len = 0;
+    mem_inf(in->inf, &len, in->def, in->def_len);
+    g_sink += len;
+}
+
+static void bench_get_idat(BENCH_INPUT *in)
+{
+    struct chunk idat;
+    FILE *fp = fopen(in->single, "rb");
+    get_idat_chunk(&idat, fp);
+    fclose(fp);
+    g_sink += idat.length;
+    free(idat.p_data);
+}
+
+static void bench_concatenate(BENCH_INPUT *in)
+{
+    lseek(g_null_fd, 0, SEEK_SET);
+    concatenate_pngs_fd(g_null_fd, in->files, in->nfiles, NULL, 1);
+}
+
+static void concat_to_file(BENCH_INPUT *in, int threads)
+{
+    int fd = open(BENCH_OUT, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(BENCH_OUT);
+        return;
+    }
+    concatenate_pngs_fd(fd, in->files, in->nfiles, NULL, threads);
+    close(fd);
+}
+
+static void bench_concat_file(BENCH_INPUT *in)
+{
+    concat_to_file(in, 1);
+}
+
+static void bench_concat_par(BENCH_INPUT *in)
+{
+    concat_to_file(in, g_threads);
+}
+
+/**
+ * @brief time one case and print a report line
+ * @param bytes the number of bytes one call of fn processes
+ */
+static void run_case(const char *name, bench_fn fn, BENCH_INPUT *in, U64 bytes)
+{
+    double t[MAX_TRIALS];
+    int trials = g_trials;
+    int i;
+
+    if (g_filter != NULL && strstr(name, g_filter) == NULL) {
+        return;
+    }
+    /* keep the very large inputs from taking forever */
+    if (bytes >= (64UL << 20) && trials > 5) {
+        trials = 5;
+    }
+
+    for (i = 0; i < g_warmup; i++) {
+        fn(in);
+    }
+    for (i = 0; i < trials; i++) {
+        double t0 = now_ns();
+        fn(in);
+        t[i] = now_ns() - t0;
+    }
+    qsort(t, trials, sizeof(double), cmp_double);
+
+    double tmin = t[0];
+    double tmed = t[trials / 2];
+    double tp99 = t[(int)((trials - 1) * 0.99 + 0.5)];
+
+    printf("%-14s %-10s %12lu %6d | %9.1f %9.1f %9.1f | %8.3f %8.3f %8.3f\n",
+           name, in->name, bytes, trials,
+           bytes / tmin * 1e3, bytes / tmed * 1e3, bytes / tp99 * 1e3,
+           tmin / bytes, tmed / bytes, tp99 / bytes);
+    fflush(stdout);
+}
+
+static void run_all(BENCH_INPUT *in)
+{
+    run_case("crc", bench_crc, in, in->def_len);
+    run_case("update_crc", bench_update_crc, in, in->def_len);
+    run_case("mem_def", bench_mem_def, in, in->raw_len);
+    run_case("mem_inf", bench_mem_inf, in, in->raw_len);
+    run_case("get_idat_chunk", bench_get_idat, in, in->def_len);
+    run_case("concatenate", bench_concatenate, in, in->raw_len);
+    run_case("concat_file", bench_concat_file, in, in->raw_len);
+    run_case("concat_par", bench_concat_par, in, in->raw_len);
+}
+
+/**
+ * @brief load the 16x16 sample image as an input
+ */
+static int load_sample(BENCH_INPUT *in)
+{
+    struct data_IHDR ihdr;
+    struct chunk idat;
+    FILE *fp = fopen(SAMPLE_PNG, "rb");
+
+    if (fp == NULL) {
+        perror(SAMPLE_PNG);
+        return -1;
+    }
+    get_png_data_IHDR(&ihdr, fp);
+    get_idat_chunk(&idat, fp);
+    fclose(fp);
+
+    memset(in, 0, sizeof(*in));
+    strcpy(in->name, "16x16");
+    in->width = ihdr.width;
+    in->height = ihdr.height;
+    in->raw_len = (U64)ihdr.height * (ihdr.width * 4 + 1);
+    in->raw = malloc(in->raw_len);
+    if (mem_inf(in->raw, &in->raw_len, idat.p_data, idat.length) != 0) {
+        free(idat.p_data);
+        return -1;
+    }
+    free(idat.p_data);
+    return prepare_input(in);
+}
+
+int main(int argc, char **argv)
+{
+    U64 max_mb = 16;
+    U64 mb;
+    int c;
+
+    g_threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    while ((c = getopt(argc, argv, "s:r:w:f:j:")) != -1) {
+        switch (c) {
+        case 's':
+            max_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            g_trials = atoi(optarg);
+            if (g_trials <= 0 || g_trials > MAX_TRIALS) {
+                fprintf(stderr, "%s: trials must be 1..%d -- 'r'\n", argv[0], MAX_TRIALS);
+                return 1;
+            }
+            break;
+        case 'w':
+            g_warmup = atoi(optarg);
+            break;
+        case 'f':
+            g_filter = optarg;
+            break;
+        case 'j':
+            g_threads = atoi(optarg);
+            if (g_threads <= 0) {
+                fprintf(stderr, "%s: option requires an argument > 0 -- 'j'\n", argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s MAX_MB] [-r TRIALS] [-w WARMUP] [-f FILTER] [-j THREADS]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    mkdir("_tmp", 0755);
+    mkdir(BENCH_DIR, 0755);
+    g_null_fd = open("/dev/null", O_WRONLY);
+    make_crc_table();
+
+    printf("%-14s %-10s %12s %6s | %9s %9s %9s | %8s %8s %8s\n",
+           "case", "input", "bytes", "trials",
+           "MB/s max", "MB/s med", "MB/s p99", "ns/B min", "ns/B med", "ns/B p99");
+
+    BENCH_INPUT in;
+    if (load_sample(&in) == 0) {
+        run_all(&in);
+    }
+    free_input(&in);
+
+    /* 64K, then x4 up to 16M, then 64M, 256M, 512M */
+    for (mb = 0; ; ) {
+        U64 raw_target = mb == 0 ? 65536 : mb << 20;
+        if (raw_target > (max_mb << 20)) {
+            break;
+        }
+
+        memset(&in, 0, sizeof(in));
+        in.width = BENCH_WIDTH;
+        in.height = raw_target / (BENCH_WIDTH * 4 + 1);
+        in.raw_len = (U64)in.height * (BENCH_WIDTH * 4 + 1);
+        if (raw_target < (1UL << 20)) {
+            snprintf(in.name, sizeof(in.name), "%luK", raw_target >> 10);
+        } else {
+            snprintf(in.name, sizeof(in.name), "%luM", raw_target >> 20);
+        }
+        in.raw = malloc(in.raw_len);
+        if (in.raw == NULL) {
+            perror("malloc");
+            break;
+        }
+        init_image(in.raw, in.width, in.height);
+        if (prepare_input(&in) == 0) {
+            run_all(&in);
+        }
+        free_input(&in);
+
+        mb = mb == 0 ? 1 : (mb < 256 ? mb * 4 : mb * 2);
+    }
+
+    close(g_null_fd);
+    return 0;
+}
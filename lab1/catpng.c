@@ -5,15 +5,34 @@ catpng CLT - concatenate PNG files into a single PNG file named all.png
 catpng - concatenate PNG images vertically to a new PNG named all.png
 
 @Usage
-catpng PNG_FILE1 PNG_FILE2 ... PNG_FILEN
+catpng [-o OUTPUT] [-c DIR] [-m MB] [-j THREADS] PNG_FILE1 PNG_FILE2 ... PNG_FILEN
 
 @Description
 Concatenate PNG FILE(s) vertically to all.png, a new PNG file.
 The concatenated image is output to a new PNG file with the name of all.png
+-o OUTPUT writes the image to OUTPUT instead, "-" means standard output.
+-c DIR keeps the inflated strips of the inputs in the cache directory DIR, so
+that fragments seen by an earlier run are not inflated again.
+-m MB caps the cache directory at MB megabytes (default 256), least recently
+used strips are evicted first.
+The image data are written as a series of 64K IDAT chunks while they are
+being compressed, so the output can be piped straight into another program.
+-j THREADS deflates the image on THREADS threads when the output is a regular
+file. Each thread writes its part straight to its place in the preallocated
+file, the header and IEND are filled in last. Pipes and stdout always use the
+single streaming writer.
+
+catpngc is built from this file with -DCATPNG_CLIENT. It takes the same
+arguments but hands the job to a running catpngd, see catpngd.c, and only
+falls back to doing the work itself when no daemon is listening. The daemon
+has its own cache and threads (catpngd -c, -m and -t), so -c, -m and -j
+only apply to that fallback.
 
 Examples:
 `catpng png_img/v1.png png_img/v2.png`
     Concatenate v1.png and v2.png vertically to all.png
+`catpng -o - png_img/v1.png png_img/v2.png | display`
+    Concatenate v1.png and v2.png and show the result without a temp file
 */
 #include <sys/types.h>  // for opendir(), readdir(), lstat()
 #include <dirent.h>     // for opendir(), readdir()
@@ -22,9 +41,17 @@ Examples:
 #include <stdio.h>      // for printf(), fprintf(), perror()
 #include <stdlib.h>     // for exit()
 #include <string.h>     // for strcmp(), strcat()
+#include <fcntl.h>      // for open()
+#include <getopt.h>     // for getopt()
+#include <arpa/inet.h>  // for htonl()
 #include "crc.h"
 #include "zutil.h"
 #include "lab_png.h"    // for is_png(), is_png_file_valid()
+#include "catpng.h"     // for CAT_CTX, png writer and strip cache
+#include "png_pwriter.h" // for the parallel output
+#ifdef CATPNG_CLIENT
+#include "catpngd.h"    // for catpngd_submit()
+#endif
 #include <assert.h>
 
 /**
@@ -36,14 +63,11 @@ Examples:
  * @param chunk A pointer to the chunk whose CRC needs to be updated.
  */
 void update_chunk_crc(chunk_p chunk) {
-    U8 crc_buf[CHUNK_TYPE_SIZE + chunk->length];
-    // make an array that has the combined [type + data ] values in the chunk
-    memcpy(crc_buf, chunk->type, CHUNK_TYPE_SIZE);
-    memcpy(crc_buf + CHUNK_TYPE_SIZE, chunk->p_data, chunk->length);
-    // the crc_buf now has the combined [type + data] values in the chunk
-    // TODO: consider using update_crc instead for performance
-    U32 new_crc = crc(crc_buf, CHUNK_TYPE_SIZE + chunk->length);
-    chunk->crc = new_crc;
+    // run the CRC over [type + data] in place instead of copying both into a
+    // stack buffer, which overflowed the stack for large IDAT chunks
+    unsigned long c = update_crc(0xffffffffL, chunk->type, CHUNK_TYPE_SIZE);
+    c = update_crc(c, chunk->p_data, chunk->length);
+    chunk->crc = c ^ 0xffffffffL;
 }
 
 /**
@@ -78,194 +102,602 @@ void write_chunks_to_png_file(FILE *png_file, struct chunk *p_IHDR, struct chunk
 }
 
 /**
- * @brief Concatenates multiple PNG files into a single PNG file.
- *
- * This function takes an array of file paths to PNG files, reads each file, and concatenates
- * them vertically to produce a single PNG file named "all.png". The function handles the
- * reading of IHDR, IDAT, and IEND chunks, adjusts the IHDR for the combined image dimensions,
- * concatenates the IDAT data after decompression and recompression, and writes out the new
- * PNG file with updated chunks.
+ * @brief Number of bytes in one filtered scanline, including the filter byte.
+ */
+static U64 png_row_bytes(const struct data_IHDR *ihdr) {
+    int channels;
+    switch (ihdr->color_type) {
+    case 2:  channels = 3; break; // Truecolor
+    case 4:  channels = 2; break; // Greyscale with alpha
+    case 6:  channels = 4; break; // Truecolor with alpha
+    default: channels = 1; break; // Grayscale or indexed-color
+    }
+    return ((U64)ihdr->width * channels * ihdr->bit_depth + 7) / 8 + 1;
+}
+
+/**
+ * @brief Make sure an arena holds at least need bytes.
+ * @return 0 on success, non-zero if out of memory
+ */
+static int arena_reserve(U8 **buf, U64 *size, U64 need) {
+    if (need <= *size) {
+        return 0;
+    }
+    U8 *q = realloc(*buf, need);
+    if (q == NULL) {
+        return 1;
+    }
+    *buf = q;
+    *size = need;
+    return 0;
+}
+
+/**
+ * @brief Read the IHDR and the first IDAT chunk of a PNG file, the IDAT data go
+ *        into the context's IDAT arena. Unlike get_idat_chunk() this reports a
+ *        malformed file instead of exiting, which a long-running daemon needs.
+ * @return 0 on success, non-zero on error with ctx->err set
+ */
+static int read_png_idat(CAT_CTX *ctx, const char *path, struct data_IHDR *ihdr, struct chunk *idat) {
+    U8 hdr[CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE];
+    FILE *png_file = fopen(path, "rb");
+
+    if (png_file == NULL) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "%s: cannot open", path);
+        return 1;
+    }
+    get_png_data_IHDR(ihdr, png_file);
+
+    // Skip the IHDR crc, then read the IDAT length and type
+    fseek(png_file, PNG_SIG_SIZE + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + DATA_IHDR_SIZE + CHUNK_CRC_SIZE, SEEK_SET);
+    if (fread(hdr, 1, sizeof(hdr), png_file) != sizeof(hdr) ||
+        memcmp(hdr + CHUNK_LEN_SIZE, "IDAT", CHUNK_TYPE_SIZE) != 0) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "%s: expected IDAT chunk after IHDR", path);
+        fclose(png_file);
+        return 1;
+    }
+    idat->length = (hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+    memcpy(idat->type, "IDAT", CHUNK_TYPE_SIZE);
+
+    if (arena_reserve(&ctx->idat, &ctx->idat_size, idat->length) != 0) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "%s: out of memory", path);
+        fclose(png_file);
+        return 1;
+    }
+    idat->p_data = ctx->idat;
+    if (fread(idat->p_data, 1, idat->length, png_file) != idat->length) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "%s: truncated IDAT chunk", path);
+        fclose(png_file);
+        return 1;
+    }
+    idat->crc = read_crc(png_file);
+    fclose(png_file);
+    return 0;
+}
+
+int cat_ctx_init(CAT_CTX *ctx, STRIP_CACHE *cache) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->cache = cache;
+    ctx->threads = 1;
+    if (inflateInit(&ctx->inf) != Z_OK) {
+        return 1;
+    }
+    if (png_writer_init(&ctx->writer, Z_DEFAULT_COMPRESSION, PNG_IDAT_CHUNK_SIZE) != 0) {
+        inflateEnd(&ctx->inf);
+        return 1;
+    }
+    return 0;
+}
+
+void cat_ctx_free(CAT_CTX *ctx) {
+    inflateEnd(&ctx->inf);
+    png_writer_free(&ctx->writer);
+    free(ctx->scratch);
+    free(ctx->idat);
+    ctx->scratch = ctx->idat = NULL;
+    ctx->scratch_size = ctx->idat_size = 0;
+}
+
+/**
+ * @brief Get the inflated scanlines of one input: mapped from the strip cache
+ *        when it has them, otherwise inflated into the scratch arena and added
+ *        to the cache.
+ * @param raw receives the scanlines, valid until the next call on ctx
+ * @param strip receives the cache mapping, release it with strip_release()
+ * @return 0 on success, non-zero on error with ctx->err set
+ */
+static int load_strip(CAT_CTX *ctx, const char *path, U8 **raw, U64 *len, STRIP *strip) {
+    struct data_IHDR png_IHDR_data;
+    struct chunk png_IDAT;
+    STRIP_CACHE *cache = ctx->cache;
+    U64 idat_hash = 0;
+    int ret;
+
+    memset(strip, 0, sizeof(*strip));
+    if (read_png_idat(ctx, path, &png_IHDR_data, &png_IDAT) != 0) {
+        return 1;
+    }
+
+    // grow the scratch arena only when a taller input shows up
+    U64 need = png_IHDR_data.height * png_row_bytes(&png_IHDR_data);
+
+    if (cache != NULL) {
+        idat_hash = strip_hash(png_IDAT.p_data, png_IDAT.length);
+        if (strip_cache_get(cache, &png_IDAT, idat_hash, strip) == 0) {
+            if (strip->len != need) {
+                snprintf(ctx->err, CAT_ERR_SIZE, "%s: cached strip has the wrong size", path);
+                strip_release(strip);
+                return 1;
+            }
+            *raw = strip->data;
+            *len = strip->len;
+            return 0;
+        }
+    }
+
+    if (arena_reserve(&ctx->scratch, &ctx->scratch_size, need) != 0) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "%s: out of memory", path);
+        return 1;
+    }
+
+    ret = mem_inf_strm(&ctx->inf, ctx->scratch, len, need, png_IDAT.p_data, png_IDAT.length);
+    if (ret != Z_OK) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "%s: invalid or incomplete deflate data (zlib %d)", path, ret);
+        return 1;
+    }
+    if (cache != NULL && *len == need) {
+        strip_cache_put(cache, &png_IDAT, idat_hash, ctx->scratch, *len);
+    }
+    *raw = ctx->scratch;
+    return 0;
+}
+
+/* state shared by the threads of one parallel concatenation */
+typedef struct cat_par {
+    PNG_PWRITER out;
+    char **files;
+    int nfiles;
+    int next;                  /* next segment to hand out                  */
+    int failed;
+    char err[CAT_ERR_SIZE];    /* first error, copied to the caller's ctx    */
+    pthread_mutex_t lock;
+} CAT_PAR;
+
+typedef struct cat_worker {
+    pthread_t tid;
+    CAT_CTX *ctx;              /* inflate state and arenas of this thread    */
+    CAT_CTX own;               /* for the threads other than the caller      */
+    STRIP_CACHE cache;         /* private copy so the hit counters are not shared */
+    PNG_SEGMENT seg;
+    CAT_PAR *par;
+} CAT_WORKER;
+
+static void cat_par_fail(CAT_PAR *par, const char *msg) {
+    pthread_mutex_lock(&par->lock);
+    if (!par->failed) {
+        snprintf(par->err, CAT_ERR_SIZE, "%s", msg);
+        par->failed = 1;
+    }
+    pthread_mutex_unlock(&par->lock);
+    png_pwriter_abort(&par->out);
+}
+
+/**
+ * @brief Take segments in increasing order until none are left. A segment is
+ *        a run of consecutive inputs, deflated here and written out at its
+ *        final offset by png_pwriter_commit().
+ */
+static void *cat_worker_main(void *arg) {
+    CAT_WORKER *wk = arg;
+    CAT_PAR *par = wk->par;
+    int nseg = par->out.nseg;
+
+    for (;;) {
+        int s;
+        int i;
+
+        pthread_mutex_lock(&par->lock);
+        s = par->failed ? nseg : par->next++;
+        pthread_mutex_unlock(&par->lock);
+        if (s >= nseg) {
+            break;
+        }
+
+        if (png_segment_start(&wk->seg, &par->out, s) != 0) {
+            cat_par_fail(par, "cannot start a deflate segment");
+            break;
+        }
+        int first = (U64)s * par->nfiles / nseg;
+        int end = (U64)(s + 1) * par->nfiles / nseg;
+        for (i = first; i < end; i++) {
+            STRIP strip;
+            U8 *raw;
+            U64 len;
+
+            if (load_strip(wk->ctx, par->files[i], &raw, &len, &strip) != 0) {
+                cat_par_fail(par, wk->ctx->err);
+                return NULL;
+            }
+            int ret = png_segment_feed(&wk->seg, raw, len);
+            strip_release(&strip);
+            if (ret != 0) {
+                cat_par_fail(par, "deflate error");
+                return NULL;
+            }
+        }
+        if (png_pwriter_commit(&par->out, &wk->seg) != 0) {
+            cat_par_fail(par, "write error");
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Pass 2 of concatenate_pngs_ctx() on ctx->threads threads, for a
+ *        regular output file.
  *
- * @param png_files An array of strings, each representing a file path to a PNG file.
- * @param num_png_files The number of PNG files in the array.
+ * The inputs are split into runs of consecutive files, CAT_SEGS_PER_THREAD per
+ * thread so a slow run does not hold up the others for long. Each thread
+ * inflates and deflates its runs on its own and pwrite()s the IDAT chunks of a
+ * run as soon as the runs before it have been sized, so there is no single
+ * writer at the end. The output is preallocated from the size of the inputs.
+ * The calling thread works as one of the threads, with ctx's own state.
+ */
+static int concatenate_pngs_par(CAT_CTX *ctx, int out_fd, char **png_files, int num_png_files,
+                                const struct data_IHDR *ihdr, U64 size_hint) {
+    int nthreads = ctx->threads < num_png_files ? ctx->threads : num_png_files;
+    int nseg = nthreads * CAT_SEGS_PER_THREAD < num_png_files ? nthreads * CAT_SEGS_PER_THREAD : num_png_files;
+    CAT_WORKER *workers;
+    CAT_PAR par;
+    U64 hits0 = ctx->cache != NULL ? ctx->cache->hits : 0;
+    U64 misses0 = ctx->cache != NULL ? ctx->cache->misses : 0;
+    int started = 0;
+    int ret = 0;
+    int i;
 
-Steps:
-    1. Make a buffer to store all of the IDAT chunks
-    2. For each PNG file, read the IDAT chunk, decompress it and append to buffer
-    3. Update the IDAT chunk with new length and crc
-    4. Write the buffer to the all.png file IDAT chunk
-    5. Write the new data_IHDR->height to all_png and compute the new crc
-*/
-void concatenate_pngs(char **png_files, int num_png_files) {
-    // Concatenate the PNG files vertically to all.png  
-    FILE *all_png = fopen("all.png", "wb");
-    simple_PNG_p all_png_p = (simple_PNG_p)malloc(sizeof(struct simple_PNG));
-    all_png_p->p_IHDR = (struct chunk *)malloc(sizeof(struct chunk));
-    all_png_p->p_IDAT = (struct chunk *)malloc(sizeof(struct chunk));
-    all_png_p->p_IEND = (struct chunk *)malloc(sizeof(struct chunk));
-
-    struct chunk *all_png_IHDR = all_png_p->p_IHDR;
-    struct chunk *all_png_IDAT = all_png_p->p_IDAT;
-    struct chunk *all_png_IEND = all_png_p->p_IEND;
-    struct data_IHDR all_png_IHDR_data_buf;
-    
-    // Fill in boilerplate IHDR chunk values
-    all_png_IHDR->length = DATA_IHDR_SIZE;
-    memcpy(all_png_IHDR->type, "IHDR", CHUNK_TYPE_SIZE);
-    all_png_IHDR->p_data = (U8*)malloc(DATA_IHDR_SIZE); // for now since it's uninitialized
-    all_png_IHDR->crc = 0;
-
-    // Initialize the IHDR data
-    all_png_IHDR_data_buf.width = 0;  // will be updated later
-    all_png_IHDR_data_buf.height = 0; // will be incremented later
-    all_png_IHDR_data_buf.bit_depth = 8;
-    all_png_IHDR_data_buf.color_type = 6;
-    all_png_IHDR_data_buf.compression = 0;
-    all_png_IHDR_data_buf.filter = 0;
-    all_png_IHDR_data_buf.interlace = 0;
-
-    // Fill in boilerplate IDAT 
-    all_png_IDAT->length = 0; // will be incremented later
-    memcpy(all_png_IDAT->type, "IDAT", CHUNK_TYPE_SIZE);
-    all_png_IDAT->p_data = NULL; // will be updated later
-    all_png_IDAT->crc = 0; // will be updated later
-
-    // Fill in boilerplate IEND
-    all_png_IEND->length = 0;
-    memcpy(all_png_IEND->type, "IEND", CHUNK_TYPE_SIZE);
-    all_png_IEND->p_data = NULL; // is zero bytes
-    update_chunk_crc(all_png_IEND);
-
-    if (all_png == NULL) {
-        perror("fopen");
-        exit(1);
+    workers = calloc(nthreads, sizeof(CAT_WORKER));
+    if (workers == NULL) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "out of memory");
+        return 1;
+    }
+    memset(&par, 0, sizeof(par));
+    par.files = png_files;
+    par.nfiles = num_png_files;
+    pthread_mutex_init(&par.lock, NULL);
+    if (png_pwriter_begin(&par.out, out_fd, ihdr, nseg, Z_DEFAULT_COMPRESSION, PNG_IDAT_CHUNK_SIZE, size_hint) != 0) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "cannot start the output file");
+        pthread_mutex_destroy(&par.lock);
+        free(workers);
+        return 1;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        CAT_WORKER *wk = &workers[i];
+        wk->par = &par;
+        if (i == 0) {
+            wk->ctx = ctx;
+        } else {
+            STRIP_CACHE *cache = NULL;
+            if (ctx->cache != NULL) {
+                wk->cache = *ctx->cache;
+                cache = &wk->cache;
+            }
+            // only the inflate state and the arenas are needed, not a writer
+            memset(&wk->own, 0, sizeof(wk->own));
+            wk->own.cache = cache;
+            if (inflateInit(&wk->own.inf) != Z_OK) {
+                break;
+            }
+            wk->ctx = &wk->own;
+        }
+        if (png_segment_init(&wk->seg, Z_DEFAULT_COMPRESSION) != 0) {
+            if (i > 0) {
+                cat_ctx_free(&wk->own);
+            }
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "cannot initialize zlib");
+        ret = 1;
+        goto out;
+    }
+
+    // update_crc() builds its table on first use, do that before the threads race to it
+    make_crc_table();
+
+    // the caller is worker 0, so one thread less is created
+    for (i = 1; i < started; i++) {
+        if (pthread_create(&workers[i].tid, NULL, cat_worker_main, &workers[i]) != 0) {
+            break;
+        }
+    }
+    int running = i;
+    cat_worker_main(&workers[0]);
+    for (i = 1; i < running; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    if (par.failed) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "%s", par.err);
+        ret = 1;
+    } else if (png_pwriter_finish(&par.out) != 0) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "write error");
+        ret = 1;
     }
 
+out:
+    for (i = 0; i < started; i++) {
+        png_segment_free(&workers[i].seg);
+        if (i > 0) {
+            if (ctx->cache != NULL) {
+                ctx->cache->hits += workers[i].cache.hits - hits0;
+                ctx->cache->misses += workers[i].cache.misses - misses0;
+            }
+            cat_ctx_free(&workers[i].own);
+        }
+    }
+    png_pwriter_free(&par.out);
+    pthread_mutex_destroy(&par.lock);
+    free(workers);
+    return ret;
+}
+
+/**
+ * @brief Concatenates multiple PNG files vertically and writes the result to out_fd.
+ *
+ * All IHDRs are read first so that the final image header is known, then each
+ * file's IDAT is inflated into a scratch arena and fed to a streaming PNG writer.
+ * Only one input is held decompressed at any time and the compressed output is
+ * written out in IDAT chunks as deflate produces it, so neither the combined
+ * inflated image nor the combined compressed image has to fit in memory.
+ *
+ * With a strip cache, an input whose IDAT is already in the cache is not inflated:
+ * the cached scanlines are mapped and fed to the writer directly. Misses are
+ * inflated as usual and then added to the cache.
+ *
+ * The zlib streams and the arenas belong to ctx and are reused by the next call.
+ */
+int concatenate_pngs_ctx(CAT_CTX *ctx, int out_fd, char **png_files, int num_png_files) {
+    struct data_IHDR all_png_IHDR_data_buf;
+    struct data_IHDR png_IHDR_data;
+    U64 in_bytes = 0;
+    int ret = 0;
     int i;
+
+    ctx->err[0] = '\0';
+
+    // Pass 1: validate the inputs and work out the combined IHDR
     for (i = 0; i < num_png_files; i++) {
-        FILE* png_file = fopen(png_files[i], "rb");
-        // check is_png
-        if (!is_png(png_files[i])) {
-            fprintf(stderr, "Error: %s is not a valid PNG file\n", png_files[i]);
-            exit(1);
+        FILE *png_file = fopen(png_files[i], "rb");
+        if (png_file == NULL) {
+            snprintf(ctx->err, CAT_ERR_SIZE, "%s: cannot open", png_files[i]);
+            return 1;
+        }
+        if (!is_png((U8 *)png_files[i])) {
+            snprintf(ctx->err, CAT_ERR_SIZE, "%s is not a valid PNG file", png_files[i]);
+            fclose(png_file);
+            return 1;
         }
-        // fetch the chunks from the file
-        struct data_IHDR png_IHDR_data;
-        struct chunk png_IDAT;
-
         get_png_data_IHDR(&png_IHDR_data, png_file);
-        get_idat_chunk(&png_IDAT, png_file);
-
-        // calculate the size of the buffers for the combined inflated png data
-        const int PNG_BUF_SIZE = png_IHDR_data.height*(png_IHDR_data.width * 4 + 1);
-        const int ALL_PNG_BUF_SIZE = all_png_IHDR_data_buf.height*(all_png_IHDR_data_buf.width * 4 + 1);
-        U8 combined_png_buf_def[ALL_PNG_BUF_SIZE+PNG_BUF_SIZE]; /* output buffer for mem_def() */
-        U8 combined_png_buf_inf[ALL_PNG_BUF_SIZE+PNG_BUF_SIZE]; /* output buffer for mem_inf() */
-        U64 comb_len_def = 0;              /* compressed data length   */
-        U64 comb_len_inf = 0;              /* uncompressed data length */
-        int ret;
-
-        // update the all_png_IHDR height and ensure width is the same
-        if (i == 0)
-            all_png_IHDR_data_buf.width = png_IHDR_data.width; // should always be the same
-        assert(all_png_IHDR_data_buf.width == png_IHDR_data.width);
-        
-        all_png_IHDR_data_buf.height += png_IHDR_data.height;
+        fclose(png_file);
 
-        // inflate (decompress) the png_IDAT data and all_png IDAT data into buffers (zlib) 
-        U64 second_len_inf = 0;
-        if (i > 0) {
-            ret = mem_inf(combined_png_buf_inf, &comb_len_inf, all_png_IDAT->p_data, all_png_IDAT->length);
-            assert(ret == Z_OK);
+        struct stat st;  // the inputs' size is a good guess of the output's
+        if (stat(png_files[i], &st) == 0) {
+            in_bytes += st.st_size;
         }
-        ret = mem_inf(combined_png_buf_inf+comb_len_inf, &second_len_inf, png_IDAT.p_data, png_IDAT.length);
-        assert(ret == Z_OK);
-        comb_len_inf += second_len_inf;
 
-        assert((ALL_PNG_BUF_SIZE+PNG_BUF_SIZE) == comb_len_inf);
+        if (i == 0) {
+            all_png_IHDR_data_buf = png_IHDR_data;
+            all_png_IHDR_data_buf.height = 0; // will be incremented below
+        } else if (png_IHDR_data.width != all_png_IHDR_data_buf.width) {
+            snprintf(ctx->err, CAT_ERR_SIZE, "%s is %u pixels wide, expected %u",
+                     png_files[i], png_IHDR_data.width, all_png_IHDR_data_buf.width);
+            return 1;
+        }
+        all_png_IHDR_data_buf.height += png_IHDR_data.height;
+    }
 
-        // compress the new all_png_IDAT data (zlib)
-        ret = mem_def(combined_png_buf_def, &comb_len_def, combined_png_buf_inf, comb_len_inf, Z_DEFAULT_COMPRESSION);
+    if (ctx->threads > 1 && num_png_files > 1 && png_pwriter_usable(out_fd)) {
+        return concatenate_pngs_par(ctx, out_fd, png_files, num_png_files, &all_png_IHDR_data_buf, in_bytes);
+    }
 
-        // realloc the all_png_IDAT->p_data to the new combined buffer
-        all_png_IDAT->p_data = (U8*)realloc(all_png_IDAT->p_data, comb_len_def);
-        memcpy(all_png_IDAT->p_data, combined_png_buf_def, comb_len_def);
+    // Pass 2: inflate each IDAT and stream it into the output
+    if (png_writer_begin(&ctx->writer, out_fd, &all_png_IHDR_data_buf) != 0) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "cannot start the output stream");
+        return 1;
+    }
 
-        // set the length of the all_png_IDAT chunk to be the return value of mem_def
-        all_png_IDAT->length = comb_len_def;
+    for (i = 0; i < num_png_files && ret == 0; i++) {
+        STRIP strip;
+        U8 *raw;
+        U64 len;
 
-        free(png_IDAT.p_data);
+        if (load_strip(ctx, png_files[i], &raw, &len, &strip) != 0) {
+            ret = 1;
+            break;
+        }
+        ret = png_writer_feed(&ctx->writer, raw, len);
+        strip_release(&strip);
     }
 
-    // Update the IHDR chunk with the new data ptr and CRC
-    U32 width_be = htonl(all_png_IHDR_data_buf.width); // ensure big-endian format for png
-    U32 height_be = htonl(all_png_IHDR_data_buf.height); // ensure big-endian format for png
-    memcpy(all_png_IHDR->p_data, &width_be, 4);
-    memcpy(all_png_IHDR->p_data + 4, &height_be, 4);
-    memcpy(all_png_IHDR->p_data + 8, &all_png_IHDR_data_buf.bit_depth, 1);
-    memcpy(all_png_IHDR->p_data + 9, &all_png_IHDR_data_buf.color_type, 1);
-    memcpy(all_png_IHDR->p_data + 10, &all_png_IHDR_data_buf.compression, 1);
-    memcpy(all_png_IHDR->p_data + 11, &all_png_IHDR_data_buf.filter, 1);
-    memcpy(all_png_IHDR->p_data + 12, &all_png_IHDR_data_buf.interlace, 1);
-    update_chunk_crc(all_png_IHDR);
+    if (png_writer_finish(&ctx->writer) != 0 && ret == 0) {
+        snprintf(ctx->err, CAT_ERR_SIZE, "write error");
+        ret = 1;
+    }
+    return ret;
+}
 
-    update_chunk_crc(all_png_IDAT);
+/**
+ * @brief Concatenates multiple PNG files vertically and writes the result to out_fd.
+ *
+ * One-shot wrapper around concatenate_pngs_ctx(), errors go to stderr.
+ *
+ * @param out_fd File descriptor to write the PNG to, a pipe or stdout works.
+ * @param png_files An array of strings, each representing a file path to a PNG file.
+ * @param num_png_files The number of PNG files in the array.
+ * @param cache Strip cache to consult, NULL to always inflate.
+ * @param threads Deflate threads to use when out_fd is a regular file.
+ * @return 0 on success, non-zero on error.
+ */
+int concatenate_pngs_fd(int out_fd, char **png_files, int num_png_files, STRIP_CACHE *cache, int threads) {
+    CAT_CTX ctx;
+    int ret;
 
-    // Writing to all.png directly
-    write_chunks_to_png_file(all_png, all_png_IHDR, all_png_IDAT, all_png_IEND);
+    if (cat_ctx_init(&ctx, cache) != 0) {
+        fprintf(stderr, "Error: cannot initialize zlib\n");
+        return 1;
+    }
+    ctx.threads = threads;
+    ret = concatenate_pngs_ctx(&ctx, out_fd, png_files, num_png_files);
+    if (ret != 0) {
+        fprintf(stderr, "Error: %s\n", ctx.err);
+    }
+    cat_ctx_free(&ctx);
+    return ret;
+}
 
-    // Close the all.png file
-    fclose(all_png);
+/**
+ * @brief Concatenates multiple PNG files into a single PNG file named "all.png".
+ *
+ * @param png_files An array of strings, each representing a file path to a PNG file.
+ * @param num_png_files The number of PNG files in the array.
+ */
+void concatenate_pngs(char **png_files, int num_png_files) {
+    int fd = open("all.png", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    if (concatenate_pngs_fd(fd, png_files, num_png_files, NULL, 1) != 0) {
+        close(fd);
+        exit(1);
+    }
+    close(fd);
+}
 
-    // Cleanup memory
-    free(all_png_IHDR->p_data);
-    free(all_png_IHDR);
-    free(all_png_IDAT->p_data);
-    free(all_png_IDAT);
-    free(all_png_IEND);
-    free(all_png_p);
+#ifndef CATPNG_NO_MAIN
+/**
+ * @brief Open the output named by -o, "-" is standard output.
+ */
+static int open_output(const char *path) {
+    if (strcmp(path, "-") == 0) {
+        return STDOUT_FILENO;
+    }
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 }
 
 int main(int argc, char *argv[]) {
+    const char *out_path = "all.png";
+    const char *cache_dir = NULL;
+    U64 cache_max = 0;
+    STRIP_CACHE cache;
+    int threads = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "o:c:m:j:")) != -1) {
+        switch (c) {
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'c':
+            cache_dir = optarg;
+            break;
+        case 'm':
+            cache_max = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            if (cache_max == 0) {
+                fprintf(stderr, "%s: cache size must be > 0 -- 'm'\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'j':
+            threads = strtol(optarg, NULL, 10);
+            if (threads <= 0) {
+                fprintf(stderr, "%s: option requires an argument > 0 -- 'j'\n", argv[0]);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-o OUTPUT] [-c CACHE_DIR] [-m CACHE_MB] [-j THREADS] PNG_FILE1 [PNG_FILE2 ... PNG_FILEN]\n", argv[0]);
+            exit(1);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s PNG_FILE1 [PNG_FILE2 ... PNG_FILEN]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-o OUTPUT] [-c CACHE_DIR] [-m CACHE_MB] [-j THREADS] PNG_FILE1 [PNG_FILE2 ... PNG_FILEN]\n", argv[0]);
+        exit(1);
+    }
+
+    int out_fd = open_output(out_path);
+    if (out_fd < 0) {
+        perror(out_path);
         exit(1);
     }
-    
-    else if (argc == 2) {
-        // There's only one PNG file so copy the contents of the first PNG file to all.png
+
+    if (argc == 2) {
+        // There's only one PNG file so copy the contents of the first PNG file to the output
         FILE *png_file = fopen(argv[1], "rb");
         if (png_file == NULL) {
             perror("fopen");
             exit(1);
         }
-        // Copy the file to a new file like "cp first_img.png all.png"
-        FILE *all_png = fopen("all.png", "wb");
-        if (all_png == NULL) {
-            perror("fopen");
-            exit(1);
-        }
+        // Copy the file to the output like "cp first_img.png all.png"
         char buffer[BUFSIZ];
         size_t n;
         while ((n = fread(buffer, 1, sizeof(buffer), png_file)) > 0) {
-            if (fwrite(buffer, 1, n, all_png) != n) {
-                perror("fwrite");
+            struct iovec iov = { buffer, n };
+            if (writev_all(out_fd, &iov, 1) != 0) {
+                perror("write");
                 fclose(png_file);
-                fclose(all_png);
+                close(out_fd);
                 exit(1);
             }
         }
         fclose(png_file);
-        fclose(all_png);
     }
 
     else {
-        // There are more than one PNG file so concatenate them vertically to all.png
+        // There are more than one PNG file so concatenate them vertically
         const int num_png_files = argc - 1;
         char **png_files = argv + 1;
-        concatenate_pngs(png_files, num_png_files);
+#ifdef CATPNG_CLIENT
+        // Let the daemon do it, it has warm threads and zlib state, and its
+        // own cache and thread count
+        char err[CAT_ERR_SIZE];
+        int sub = catpngd_submit(out_fd, png_files, num_png_files, err, sizeof(err));
+        if (sub > 0) {
+            fprintf(stderr, "Error: %s\n", err);
+            exit(1);
+        }
+        if (sub == 0) {
+            if (out_fd != STDOUT_FILENO) {
+                close(out_fd);
+            }
+            return 0;
+        }
+#endif
+        // No daemon, do it in this process
+        if (cache_dir != NULL && strip_cache_open(&cache, cache_dir, cache_max) != 0) {
+            close(out_fd);
+            exit(1);
+        }
+        int ret = concatenate_pngs_fd(out_fd, png_files, num_png_files, cache_dir ? &cache : NULL, threads);
+        if (cache_dir != NULL) {
+            strip_cache_close(&cache);
+        }
+        if (ret != 0) {
+            close(out_fd);
+            exit(1);
+        }
     }
 
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
     return 0;
 }
-
+#endif /* CATPNG_NO_MAIN */
@@ -0,0 +1,50 @@
+/**
+ * @file catpng.h
+ * @brief reusable concatenation context for programs that run many catpng
+ *        jobs in one process (catpngd), so each job does not pay for fresh
+ *        zlib state and cold allocations.
+ */
+
+#pragma once
+
+#include "zlib.h"
+#include "lab_png.h"
+#include "zutil.h"
+#include "png_writer.h"
+#include "strip_cache.h"
+
+#define CAT_ERR_SIZE 256
+#define CAT_SEGS_PER_THREAD 4  /* deflate segments per thread with -j */
+
+typedef struct cat_ctx {
+    z_stream inf;              /* pooled inflate state, reset per input     */
+    PNG_WRITER writer;         /* pooled deflate state and IDAT buffers     */
+    U8 *scratch;               /* inflate output arena, grows, never shrinks */
+    U64 scratch_size;
+    U8 *idat;                  /* IDAT read arena                           */
+    U64 idat_size;
+    STRIP_CACHE *cache;        /* strip cache, NULL if not used             */
+    int threads;               /* deflate threads for a regular output file */
+    char err[CAT_ERR_SIZE];    /* message describing the last failure       */
+} CAT_CTX;
+
+/**
+ * @brief Set up the pooled zlib streams of a context.
+ * @param cache strip cache used by the jobs, may be NULL
+ * @return 0 on success, non-zero on error
+ */
+int cat_ctx_init(CAT_CTX *ctx, STRIP_CACHE *cache);
+
+/**
+ * @brief Release everything owned by a context.
+ */
+void cat_ctx_free(CAT_CTX *ctx);
+
+/**
+ * @brief Concatenate PNG files vertically to out_fd using the pooled state
+ *        of ctx. Errors are not printed, they are described in ctx->err.
+ *        With ctx->threads > 1 and a regular output file the image data are
+ *        deflated and written in parallel, see png_pwriter.h.
+ * @return 0 on success, non-zero on error
+ */
+int concatenate_pngs_ctx(CAT_CTX *ctx, int out_fd, char **png_files, int num_png_files);
@@ -0,0 +1,384 @@
+/* catpngd.c
+catpngd - long-running catpng daemon
+
+@Synopsis
+catpngd - run catpng jobs sent by catpngc on a pool of warm worker threads
+
+@Usage
+catpngd [-s SOCKET] [-t THREADS] [-c CACHE_DIR] [-m CACHE_MB]
+
+@Description
+Listens on a Unix domain socket (default $CATPNGD_SOCKET or
+/tmp/catpngd-<uid>.sock) for jobs from catpngc, which takes the same
+arguments as catpng. Each worker thread keeps its own inflate/deflate state,
+IDAT buffers and scratch arena between jobs, and the CRC table is built once
+at startup, so a job costs only the time to concatenate.
+-t THREADS worker threads (default: number of online CPUs)
+-c CACHE_DIR, -m CACHE_MB strip cache shared by all jobs, as in catpng
+
+Examples:
+`catpngd -t 4 &`
+`catpngc -o all.png png_img/v1.png png_img/v2.png`
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "crc.h"
+#include "catpngd.h"
+
+#define QUEUE_SIZE      256  /* accepted connections waiting for a worker */
+#define EVICT_INTERVAL  64   /* jobs between strip cache size checks      */
+
+/* accepted connections waiting for a worker */
+typedef struct job_queue {
+    int fds[QUEUE_SIZE];
+    int head;
+    int count;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} JOB_QUEUE;
+
+/* per-thread state, everything a job needs is reused from here */
+typedef struct worker {
+    pthread_t tid;
+    CAT_CTX ctx;
+    STRIP_CACHE cache;      /* private copy so the hit counters are not shared */
+    char *paths;            /* paths arena                                   */
+    size_t paths_size;
+    char **argv;            /* argv arena pointing into paths                */
+    size_t argv_size;
+    unsigned long jobs;
+} WORKER;
+
+static JOB_QUEUE g_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+static volatile sig_atomic_t g_stop = 0;
+static const char *g_cache_dir = NULL;
+static U64 g_cache_max = 0;
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    g_stop = 1;
+}
+
+static void queue_push(JOB_QUEUE *q, int fd)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == QUEUE_SIZE && !q->stop) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    if (q->stop) {
+        pthread_mutex_unlock(&q->lock);
+        close(fd);
+        return;
+    }
+    q->fds[(q->head + q->count) % QUEUE_SIZE] = fd;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * @return the next connection, -1 once the daemon is shutting down
+ */
+static int queue_pop(JOB_QUEUE *q)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->stop) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->count > 0) {
+        fd = q->fds[q->head];
+        q->head = (q->head + 1) % QUEUE_SIZE;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return fd;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief receive the request header and the output fd that comes with it
+ * @return the output fd, -1 on a malformed request
+ */
+static int recv_req(int sock, CATPNGD_REQ *req)
+{
+    struct msghdr msg;
+    struct iovec iov = { req, sizeof(*req) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    struct cmsghdr *cmsg;
+    int fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(*req)) {
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (fd >= 0 && req->magic != CATPNGD_MAGIC) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief read, run and answer one job
+ */
+static void serve_job(WORKER *w, int sock)
+{
+    CATPNGD_REQ req;
+    CATPNGD_RESP resp;
+    int out_fd;
+    U32 i;
+
+    memset(&resp, 0, sizeof(resp));
+    out_fd = recv_req(sock, &req);
+    if (out_fd < 0) {
+        return;
+    }
+
+    if (req.nfiles == 0 || req.nfiles > CATPNGD_MAX_FILES || req.paths_len > CATPNGD_MAX_PATHS) {
+        resp.status = 1;
+        snprintf(resp.msg, sizeof(resp.msg), "bad request");
+        goto reply;
+    }
+
+    /* paths and argv come from per-thread arenas */
+    if (req.paths_len + 1 > w->paths_size) {
+        char *q = realloc(w->paths, req.paths_len + 1);
+        if (q == NULL) {
+            resp.status = 1;
+            snprintf(resp.msg, sizeof(resp.msg), "out of memory");
+            goto reply;
+        }
+        w->paths = q;
+        w->paths_size = req.paths_len + 1;
+    }
+    if (req.nfiles > w->argv_size) {
+        char **q = realloc(w->argv, req.nfiles * sizeof(char *));
+        if (q == NULL) {
+            resp.status = 1;
+            snprintf(resp.msg, sizeof(resp.msg), "out of memory");
+            goto reply;
+        }
+        w->argv = q;
+        w->argv_size = req.nfiles;
+    }
+    if (read_all(sock, w->paths, req.paths_len) != 0) {
+        close(out_fd);
+        return;
+    }
+    w->paths[req.paths_len] = '\0';
+
+    char *p = w->paths;
+    char *end = w->paths + req.paths_len;
+    for (i = 0; i < req.nfiles; i++) {
+        if (p >= end) {
+            resp.status = 1;
+            snprintf(resp.msg, sizeof(resp.msg), "bad request");
+            goto reply;
+        }
+        w->argv[i] = p;
+        p += strlen(p) + 1;
+    }
+
+    if (concatenate_pngs_ctx(&w->ctx, out_fd, w->argv, req.nfiles) != 0) {
+        resp.status = 1;
+        snprintf(resp.msg, sizeof(resp.msg), "%s", w->ctx.err);
+    }
+
+    if (g_cache_dir != NULL && ++w->jobs % EVICT_INTERVAL == 0) {
+        strip_cache_close(&w->cache);
+    }
+
+reply:
+    close(out_fd);
+    if (write(sock, &resp, sizeof(resp)) != sizeof(resp)) {
+        /* the client is gone, nothing to tell */
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    WORKER *w = arg;
+    int sock;
+
+    while ((sock = queue_pop(&g_queue)) >= 0) {
+        serve_job(w, sock);
+        close(sock);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    WORKER *workers;
+    int listen_fd;
+    int c;
+    long i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    catpngd_socket_path(addr.sun_path, sizeof(addr.sun_path));
+
+    while ((c = getopt(argc, argv, "s:t:c:m:")) != -1) {
+        switch (c) {
+        case 's':
+            snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", optarg);
+            break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            if (nthreads <= 0) {
+                fprintf(stderr, "%s: option requires an argument > 0 -- 't'\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            g_cache_dir = optarg;
+            break;
+        case 'm':
+            g_cache_max = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s SOCKET] [-t THREADS] [-c CACHE_DIR] [-m CACHE_MB]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads <= 0) {
+        nthreads = 1;
+    }
+
+    /* one-time init that every catpng process would otherwise pay for */
+    make_crc_table();
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal; /* no SA_RESTART, accept() must return */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(addr.sun_path);
+    mode_t old_mask = umask(077); /* only the owner may submit jobs */
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(addr.sun_path);
+        return 1;
+    }
+    umask(old_mask);
+    if (listen(listen_fd, 128) != 0) {
+        perror("listen");
+        return 1;
+    }
+
+    workers = calloc(nthreads, sizeof(WORKER));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (i = 0; i < nthreads; i++) {
+        STRIP_CACHE *cache = NULL;
+        if (g_cache_dir != NULL) {
+            if (strip_cache_open(&workers[i].cache, g_cache_dir, g_cache_max) != 0) {
+                return 1;
+            }
+            cache = &workers[i].cache;
+        }
+        if (cat_ctx_init(&workers[i].ctx, cache) != 0) {
+            fprintf(stderr, "catpngd: cannot initialize zlib\n");
+            return 1;
+        }
+        if (pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "catpngd: thread #%ld failed to create\n", i);
+            return 1;
+        }
+    }
+    fprintf(stderr, "catpngd: listening on %s with %ld workers\n", addr.sun_path, nthreads);
+
+    while (!g_stop) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        queue_push(&g_queue, fd);
+    }
+
+    /* drain: workers finish the queued jobs, then exit */
+    close(listen_fd);
+    unlink(addr.sun_path);
+    pthread_mutex_lock(&g_queue.lock);
+    g_queue.stop = 1;
+    pthread_cond_broadcast(&g_queue.not_empty);
+    pthread_cond_broadcast(&g_queue.not_full);
+    pthread_mutex_unlock(&g_queue.lock);
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        cat_ctx_free(&workers[i].ctx);
+        free(workers[i].paths);
+        free(workers[i].argv);
+        if (g_cache_dir != NULL) {
+            strip_cache_close(&workers[i].cache);
+        }
+    }
+    free(workers);
+    return 0;
+}
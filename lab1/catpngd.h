@@ -0,0 +1,46 @@
+/**
+ * @file catpngd.h
+ * @brief wire protocol between catpngc and the catpngd concat daemon.
+ *
+ * A job is one connection on the daemon's Unix domain socket:
+ *   client -> daemon  CATPNGD_REQ, with the output fd attached (SCM_RIGHTS)
+ *   client -> daemon  paths_len bytes: nfiles absolute, NUL terminated paths
+ *   daemon -> client  CATPNGD_RESP
+ * The client opens the output itself, so relative output paths, stdout and
+ * pipes behave exactly as with catpng.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "catpng.h"
+
+#define CATPNGD_MAGIC     0x43415450u       /* "CATP"                       */
+#define CATPNGD_ENV       "CATPNGD_SOCKET"  /* overrides the socket path    */
+#define CATPNGD_MAX_FILES 65536             /* inputs per job               */
+#define CATPNGD_MAX_PATHS (16*1024*1024)    /* bytes of paths per job       */
+
+typedef struct catpngd_req {
+    U32 magic;      /* CATPNGD_MAGIC                               */
+    U32 nfiles;     /* number of input paths                       */
+    U32 paths_len;  /* bytes of NUL terminated paths that follow    */
+} CATPNGD_REQ;
+
+typedef struct catpngd_resp {
+    int status;              /* 0 on success                       */
+    char msg[CAT_ERR_SIZE];  /* error message when status != 0     */
+} CATPNGD_RESP;
+
+/**
+ * @brief The daemon socket path: $CATPNGD_SOCKET, or /tmp/catpngd-<uid>.sock.
+ */
+void catpngd_socket_path(char *buf, size_t size);
+
+/**
+ * @brief Run a concat job on the daemon.
+ * @param out_fd output file descriptor, passed to the daemon
+ * @param err receives the daemon's error message when the job fails
+ * @return 0 on success, >0 if the job failed, <0 if no daemon is reachable
+ *         and the caller should do the job itself
+ */
+int catpngd_submit(int out_fd, char **png_files, int num_png_files, char *err, size_t err_len);
@@ -0,0 +1,167 @@
+/**
+ * @file catpngd_client.c
+ * @brief client side of the catpngd protocol, used by catpngc
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "catpngd.h"
+
+void catpngd_socket_path(char *buf, size_t size)
+{
+    const char *env = getenv(CATPNGD_ENV);
+
+    if (env != NULL && env[0] != '\0') {
+        snprintf(buf, size, "%s", env);
+    } else {
+        snprintf(buf, size, "/tmp/catpngd-%d.sock", (int)getuid());
+    }
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief send the request header with the output fd attached
+ */
+static int send_req(int sock, CATPNGD_REQ *req, int out_fd)
+{
+    struct msghdr msg;
+    struct iovec iov = { req, sizeof(*req) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctrl, 0, sizeof(ctrl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &out_fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(*req) ? 0 : -1;
+}
+
+int catpngd_submit(int out_fd, char **png_files, int num_png_files, char *err, size_t err_len)
+{
+    struct sockaddr_un addr;
+    CATPNGD_REQ req;
+    CATPNGD_RESP resp;
+    char *paths = NULL;
+    size_t paths_len = 0;
+    int sock;
+    int i;
+
+    if (num_png_files > CATPNGD_MAX_FILES) {
+        return -1;
+    }
+
+    /* the daemon has its own cwd, send absolute paths */
+    for (i = 0; i < num_png_files; i++) {
+        char *abs = realpath(png_files[i], NULL);
+        if (abs == NULL) {
+            snprintf(err, err_len, "%s: %s", png_files[i], strerror(errno));
+            free(paths);
+            return 1;
+        }
+        size_t n = strlen(abs) + 1;
+        char *q = realloc(paths, paths_len + n);
+        if (q == NULL) {
+            free(abs);
+            free(paths);
+            return -1;
+        }
+        paths = q;
+        memcpy(paths + paths_len, abs, n);
+        paths_len += n;
+        free(abs);
+    }
+    if (paths_len > CATPNGD_MAX_PATHS) {
+        free(paths);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    catpngd_socket_path(addr.sun_path, sizeof(addr.sun_path));
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        free(paths);
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        /* no daemon, the caller runs the job in process */
+        close(sock);
+        free(paths);
+        return -1;
+    }
+
+    req.magic = CATPNGD_MAGIC;
+    req.nfiles = num_png_files;
+    req.paths_len = paths_len;
+    if (send_req(sock, &req, out_fd) != 0 ||
+        write_all(sock, paths, paths_len) != 0 ||
+        read_all(sock, &resp, sizeof(resp)) != 0) {
+        /* the daemon may have written part of the output, do not retry */
+        snprintf(err, err_len, "lost connection to catpngd");
+        close(sock);
+        free(paths);
+        return 1;
+    }
+    close(sock);
+    free(paths);
+
+    if (resp.status != 0) {
+        resp.msg[CAT_ERR_SIZE - 1] = '\0';
+        snprintf(err, err_len, "%s", resp.msg);
+        return 1;
+    }
+    return 0;
+}
@@ -13,6 +13,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+struct strip_cache;
+
 /******************************************************************************
  * DEFINED MACROS 
  *****************************************************************************/
@@ -92,3 +94,45 @@ void get_idat_chunk(chunk_p idat_chunk, FILE *fp);
  * @return true if the file is valid, false otherwise.
  */
 bool is_png_file_valid(FILE *fp);
+
+/**
+ * @brief Recompute the CRC field of a chunk from its type and data.
+ *
+ * @param chunk The chunk whose CRC needs to be updated.
+ */
+void update_chunk_crc(chunk_p chunk);
+
+/**
+ * @brief Write a PNG signature followed by the given IHDR, IDAT and IEND chunks.
+ *
+ * @param png_file Output file.
+ * @param p_IHDR IHDR chunk, p_data holds the 13 data bytes in PNG byte order.
+ * @param p_IDAT IDAT chunk.
+ * @param p_IEND IEND chunk.
+ */
+void write_chunks_to_png_file(FILE *png_file, struct chunk *p_IHDR, struct chunk *p_IDAT, struct chunk *p_IEND);
+
+/**
+ * @brief Concatenates multiple PNG files vertically into a single PNG named "all.png".
+ *
+ * @param png_files An array of strings, each representing a file path to a PNG file.
+ * @param num_png_files The number of PNG files in the array.
+ */
+void concatenate_pngs(char **png_files, int num_png_files);
+
+/**
+ * @brief Concatenates multiple PNG files vertically and streams the result to out_fd.
+ *
+ * The image data are written as fixed-size IDAT chunks while they are being
+ * compressed, so out_fd may be a pipe or standard output. When out_fd is a
+ * regular file and threads > 1, the data are deflated on that many threads
+ * and each thread writes its part of the file with pwrite().
+ *
+ * @param out_fd File descriptor to write the PNG to.
+ * @param png_files An array of strings, each representing a file path to a PNG file.
+ * @param num_png_files The number of PNG files in the array.
+ * @param cache Cache of inflated strips to consult and fill, may be NULL.
+ * @param threads Number of deflate threads, 1 for the streaming writer.
+ * @return 0 on success, non-zero on error.
+ */
+int concatenate_pngs_fd(int out_fd, char **png_files, int num_png_files, struct strip_cache *cache, int threads);
@@ -0,0 +1,358 @@
+/**
+ * @file png_pwriter.c
+ * @brief parallel PNG writer. Segments are deflated independently and each
+ *        thread pwrite()s its own IDAT chunks, so there is no single writer
+ *        that every compressed byte has to pass through. Only the offsets
+ *        are handed from one segment to the next, under a mutex.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "crc.h"
+#include "png_pwriter.h"
+
+#define SEG_BATCH     64          /* IDAT chunks per pwritev() call          */
+#define SEG_MIN_SPACE (64*1024)   /* free bytes kept ahead of deflate        */
+#define ZLIB_CMF      0x78        /* deflate with a 32K window               */
+#define TRAILER_SIZE  (CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + 4 + CHUNK_CRC_SIZE)
+
+/**
+ * @brief pwritev() the whole iovec array at off, retrying on partial writes.
+ */
+static int pwritev_all(int fd, struct iovec *iov, int iovcnt, off_t off)
+{
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(fd, iov, iovcnt, off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        off += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief the two byte zlib header deflateInit() would have written
+ */
+static void zlib_header(U8 *p, int level)
+{
+    int flevel;
+    unsigned hdr;
+
+    if (level == Z_DEFAULT_COMPRESSION) {
+        level = 6;
+    }
+    flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    hdr = (ZLIB_CMF << 8) | (flevel << 6);
+    hdr += 31 - hdr % 31;
+    p[0] = hdr >> 8;
+    p[1] = hdr;
+}
+
+int png_pwriter_usable(int fd)
+{
+    struct stat st;
+    int flags = fcntl(fd, F_GETFL);
+
+    /* pwrite() on an O_APPEND file ignores the offset on Linux */
+    if (flags < 0 || (flags & O_APPEND)) {
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    return lseek(fd, 0, SEEK_CUR) >= 0;
+}
+
+int png_pwriter_begin(PNG_PWRITER *w, int fd, const struct data_IHDR *ihdr, int nseg,
+                      int level, size_t chunk_size, U64 size_hint)
+{
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->level = level;
+    w->chunk_size = chunk_size > 0 ? chunk_size : PNG_IDAT_CHUNK_SIZE;
+    w->ihdr = *ihdr;
+    w->nseg = nseg;
+    w->base = lseek(fd, 0, SEEK_CUR);
+    if (w->base < 0 || nseg <= 0) {
+        return -1;
+    }
+
+    w->seg_off = calloc(nseg + 1, sizeof(off_t));
+    w->seg_adler = calloc(nseg, sizeof(uLong));
+    w->seg_raw = calloc(nseg, sizeof(U64));
+    if (w->seg_off == NULL || w->seg_adler == NULL || w->seg_raw == NULL) {
+        perror("calloc");
+        png_pwriter_free(w);
+        return -1;
+    }
+    /* the signature and IHDR are written last, leave room for them */
+    w->seg_off[0] = PNG_HEAD_SIZE;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->sized, NULL);
+
+    /* reserve the space up front so the segments, which arrive out of
+       order, do not fragment the file; the size is trimmed by finish */
+    if (size_hint > 0) {
+        (void) fallocate(fd, 0, w->base, size_hint);
+    }
+    return 0;
+}
+
+void png_pwriter_abort(PNG_PWRITER *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->failed = 1;
+    pthread_cond_broadcast(&w->sized);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * @brief run deflate with the given flush mode until it has consumed all the
+ *        input, growing the segment buffer as needed.
+ */
+static int run_deflate(PNG_SEGMENT *s, int flush)
+{
+    int ret;
+
+    do {
+        if (s->cap - s->len < SEG_MIN_SPACE) {
+            size_t cap = s->cap * 2 > s->len + SEG_MIN_SPACE ? s->cap * 2 : s->len + SEG_MIN_SPACE;
+            U8 *q = realloc(s->buf, cap);
+            if (q == NULL) {
+                perror("realloc");
+                return -1;
+            }
+            s->buf = q;
+            s->cap = cap;
+        }
+        size_t room = s->cap - s->len;
+        s->strm.next_out = s->buf + s->len;
+        s->strm.avail_out = room > 0x40000000UL ? 0x40000000U : (uInt)room;
+        ret = deflate(&s->strm, flush);
+        if (ret == Z_STREAM_ERROR) {
+            return -1;
+        }
+        s->len = s->strm.next_out - s->buf;
+    } while (flush == Z_FINISH ? ret != Z_STREAM_END
+                               : (s->strm.avail_in > 0 || s->strm.avail_out == 0));
+    return 0;
+}
+
+/**
+ * @brief write the compressed bytes of a segment as IDAT chunks at off
+ */
+static int write_segment(PNG_PWRITER *w, PNG_SEGMENT *s, off_t off)
+{
+    U8 hdr[SEG_BATCH][CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE];
+    U8 crc_be[SEG_BATCH][CHUNK_CRC_SIZE];
+    struct iovec iov[3 * SEG_BATCH];
+    size_t pos = 0;
+
+    while (pos < s->len) {
+        size_t batch_bytes = 0;
+        int cnt = 0;
+        int i;
+
+        for (i = 0; i < SEG_BATCH && pos < s->len; i++) {
+            size_t n = s->len - pos < w->chunk_size ? s->len - pos : w->chunk_size;
+            U8 *data = s->buf + pos;
+
+            png_put_u32(hdr[i], n);
+            memcpy(hdr[i] + CHUNK_LEN_SIZE, "IDAT", CHUNK_TYPE_SIZE);
+            png_put_u32(crc_be[i], update_crc(update_crc(0xffffffffL, (U8 *)"IDAT", CHUNK_TYPE_SIZE),
+                                              data, n) ^ 0xffffffffL);
+            iov[cnt].iov_base = hdr[i];
+            iov[cnt++].iov_len = sizeof(hdr[i]);
+            iov[cnt].iov_base = data;
+            iov[cnt++].iov_len = n;
+            iov[cnt].iov_base = crc_be[i];
+            iov[cnt++].iov_len = CHUNK_CRC_SIZE;
+            batch_bytes += sizeof(hdr[i]) + n + CHUNK_CRC_SIZE;
+            pos += n;
+        }
+        if (pwritev_all(w->fd, iov, cnt, w->base + off) != 0) {
+            perror("pwritev");
+            return -1;
+        }
+        off += batch_bytes;
+    }
+    return 0;
+}
+
+int png_pwriter_commit(PNG_PWRITER *w, PNG_SEGMENT *s)
+{
+    size_t nchunks;
+    off_t framed;
+    off_t off;
+
+    s->strm.next_in = NULL;
+    s->strm.avail_in = 0;
+    if (run_deflate(s, s->last ? Z_FINISH : Z_SYNC_FLUSH) != 0) {
+        png_pwriter_abort(w);
+        return -1;
+    }
+    nchunks = (s->len + w->chunk_size - 1) / w->chunk_size;
+    framed = s->len + nchunks * (CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + CHUNK_CRC_SIZE);
+
+    /* the offset is known once every earlier segment has its size */
+    pthread_mutex_lock(&w->lock);
+    while (w->ready < s->index && !w->failed) {
+        pthread_cond_wait(&w->sized, &w->lock);
+    }
+    if (w->failed) {
+        pthread_mutex_unlock(&w->lock);
+        return -1;
+    }
+    off = w->seg_off[s->index];
+    w->seg_off[s->index + 1] = off + framed;
+    w->seg_adler[s->index] = s->adler;
+    w->seg_raw[s->index] = s->raw_len;
+    w->ready = s->index + 1;
+    pthread_cond_broadcast(&w->sized);
+    pthread_mutex_unlock(&w->lock);
+
+    if (write_segment(w, s, off) != 0) {
+        png_pwriter_abort(w);
+        return -1;
+    }
+    return 0;
+}
+
+int png_pwriter_finish(PNG_PWRITER *w)
+{
+    U8 head[PNG_HEAD_SIZE];
+    U8 tail[TRAILER_SIZE + PNG_IEND_SIZE];
+    uLong adler = adler32(0L, Z_NULL, 0);
+    off_t end;
+    int i;
+
+    if (w->failed || w->ready != w->nseg) {
+        return -1;
+    }
+    for (i = 0; i < w->nseg; i++) {
+        adler = adler32_combine(adler, w->seg_adler[i], (z_off_t)w->seg_raw[i]);
+    }
+
+    /* the zlib adler32 trailer in an IDAT chunk of its own, then IEND */
+    png_put_u32(tail, 4);
+    memcpy(tail + CHUNK_LEN_SIZE, "IDAT", CHUNK_TYPE_SIZE);
+    png_put_u32(tail + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE, adler);
+    png_put_u32(tail + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + 4,
+                crc(tail + CHUNK_LEN_SIZE, CHUNK_TYPE_SIZE + 4));
+    png_build_iend(tail + TRAILER_SIZE);
+    png_build_head(head, &w->ihdr);
+
+    struct iovec iov = { tail, sizeof(tail) };
+    struct iovec iov_head = { head, sizeof(head) };
+    if (pwritev_all(w->fd, &iov, 1, w->base + w->seg_off[w->nseg]) != 0 ||
+        pwritev_all(w->fd, &iov_head, 1, w->base) != 0) {
+        perror("pwritev");
+        return -1;
+    }
+
+    /* drop whatever the preallocation reserved past the image */
+    end = w->base + w->seg_off[w->nseg] + sizeof(tail);
+    if (ftruncate(w->fd, end) != 0) {
+        perror("ftruncate");
+        return -1;
+    }
+    lseek(w->fd, end, SEEK_SET);
+    return 0;
+}
+
+void png_pwriter_free(PNG_PWRITER *w)
+{
+    if (w->seg_off != NULL) {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->sized);
+    }
+    free(w->seg_off);
+    free(w->seg_adler);
+    free(w->seg_raw);
+    w->seg_off = NULL;
+    w->seg_adler = NULL;
+    w->seg_raw = NULL;
+}
+
+int png_segment_init(PNG_SEGMENT *s, int level)
+{
+    memset(s, 0, sizeof(*s));
+    /* raw deflate, the zlib header and trailer are written by the pwriter */
+    if (deflateInit2(&s->strm, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+int png_segment_start(PNG_SEGMENT *s, PNG_PWRITER *w, int index)
+{
+    if (deflateReset(&s->strm) != Z_OK) {
+        return -1;
+    }
+    s->index = index;
+    s->last = index == w->nseg - 1;
+    s->len = 0;
+    s->adler = adler32(0L, Z_NULL, 0);
+    s->raw_len = 0;
+    if (index == 0) {
+        if (s->cap < SEG_MIN_SPACE) {
+            U8 *q = realloc(s->buf, SEG_MIN_SPACE);
+            if (q == NULL) {
+                perror("realloc");
+                return -1;
+            }
+            s->buf = q;
+            s->cap = SEG_MIN_SPACE;
+        }
+        zlib_header(s->buf, w->level);
+        s->len = 2;
+    }
+    return 0;
+}
+
+int png_segment_feed(PNG_SEGMENT *s, U8 *raw, U64 len)
+{
+    /* avail_in and adler32() lengths are only 32 bits wide */
+    while (len > 0) {
+        uInt n = len > 0x40000000UL ? 0x40000000U : (uInt)len;
+        s->adler = adler32(s->adler, raw, n);
+        s->raw_len += n;
+        s->strm.next_in = raw;
+        s->strm.avail_in = n;
+        if (run_deflate(s, Z_NO_FLUSH) != 0) {
+            return -1;
+        }
+        raw += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void png_segment_free(PNG_SEGMENT *s)
+{
+    (void) deflateEnd(&s->strm);
+    free(s->buf);
+    s->buf = NULL;
+    s->len = s->cap = 0;
+}
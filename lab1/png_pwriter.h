@@ -0,0 +1,133 @@
+/**
+ * @file png_pwriter.h
+ * @brief parallel PNG writer. The image data are split into segments that
+ *        are deflated by different threads; each thread pwrite()s its
+ *        segment at its final offset in the output file as soon as the
+ *        segments before it have been sized.
+ *
+ * Every segment is an independent raw deflate stream ended with a sync flush
+ * (the last one with Z_FINISH), so the segments concatenate into one valid
+ * zlib stream. The zlib header is stored in front of segment 0, the adler32
+ * of the whole image is combined from the per-segment checksums and written
+ * in a 4 byte IDAT of its own by png_pwriter_finish(), which also writes the
+ * signature, IHDR and IEND last.
+ *
+ * Usage:
+ *   PNG_PWRITER w;                               // shared by all threads
+ *   png_pwriter_begin(&w, fd, &ihdr, nseg, level, 0, size_hint);
+ *   each thread:
+ *       PNG_SEGMENT s;
+ *       png_segment_init(&s, level);
+ *       for each segment i it takes, in increasing order:
+ *           png_segment_start(&s, &w, i);
+ *           png_segment_feed(&s, rows, rows_len); // as many times as needed
+ *           png_pwriter_commit(&w, &s);
+ *       png_segment_free(&s);
+ *   after joining the threads:
+ *   png_pwriter_finish(&w);
+ *   png_pwriter_free(&w);
+ *
+ * The output has to be a regular file, see png_pwriter_usable().
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "zlib.h"
+#include "lab_png.h"
+#include "png_writer.h"
+
+typedef struct png_pwriter {
+    int fd;                 /* output file, must be seekable                */
+    off_t base;             /* file offset the PNG starts at                */
+    int level;              /* zlib compression level                       */
+    size_t chunk_size;      /* data bytes per IDAT chunk                    */
+    struct data_IHDR ihdr;  /* header of the final image                    */
+    int nseg;               /* number of segments                           */
+    off_t *seg_off;         /* nseg + 1 offsets relative to base            */
+    uLong *seg_adler;       /* adler32 of each segment's raw data           */
+    U64 *seg_raw;           /* raw bytes of each segment                    */
+    int ready;              /* seg_off[0..ready] are known                  */
+    int failed;             /* set by png_pwriter_abort()                   */
+    pthread_mutex_t lock;
+    pthread_cond_t sized;   /* signalled whenever ready moves on            */
+} PNG_PWRITER;
+
+typedef struct png_segment {
+    z_stream strm;          /* raw deflate state, reset per segment         */
+    int index;              /* segment being compressed                     */
+    int last;               /* this is the final segment                    */
+    U8 *buf;                /* compressed bytes of the segment              */
+    size_t len;
+    size_t cap;
+    uLong adler;            /* adler32 of the raw bytes fed so far          */
+    U64 raw_len;            /* raw bytes fed so far                         */
+} PNG_SEGMENT;
+
+/**
+ * @brief Whether fd can be written with png_pwriter, i.e. it is a regular
+ *        file that supports positioned writes.
+ */
+int png_pwriter_usable(int fd);
+
+/**
+ * @brief Start a parallel PNG stream at the current offset of fd.
+ * @param ihdr image header of the final image, host byte order
+ * @param nseg number of segments the image data are split into
+ * @param level zlib compression level
+ * @param chunk_size IDAT data bytes per chunk, 0 selects PNG_IDAT_CHUNK_SIZE
+ * @param size_hint expected size of the output, preallocated with fallocate()
+ *        so the segments land in contiguous extents, 0 for none
+ * @return 0 on success, non-zero on error
+ */
+int png_pwriter_begin(PNG_PWRITER *w, int fd, const struct data_IHDR *ihdr, int nseg,
+                      int level, size_t chunk_size, U64 size_hint);
+
+/**
+ * @brief Finish compressing a segment, wait for the offset of the segments
+ *        before it, then write it in IDAT chunks at its final position.
+ * @return 0 on success, non-zero on error or if the stream was aborted
+ */
+int png_pwriter_commit(PNG_PWRITER *w, PNG_SEGMENT *s);
+
+/**
+ * @brief Fail the stream and wake every thread waiting in png_pwriter_commit().
+ */
+void png_pwriter_abort(PNG_PWRITER *w);
+
+/**
+ * @brief Write the signature, IHDR, adler32 trailer and IEND once all the
+ *        segments are committed, and trim the file to the image size. The
+ *        file offset of fd is left at the end of the image.
+ * @return 0 on success, non-zero on error
+ */
+int png_pwriter_finish(PNG_PWRITER *w);
+
+/**
+ * @brief Release the segment bookkeeping of a writer. The fd is not closed.
+ */
+void png_pwriter_free(PNG_PWRITER *w);
+
+/**
+ * @brief Set up the deflate state of a per-thread segment compressor.
+ * @return 0 on success, non-zero on error
+ */
+int png_segment_init(PNG_SEGMENT *s, int level);
+
+/**
+ * @brief Begin compressing segment index of w.
+ * @return 0 on success, non-zero on error
+ */
+int png_segment_start(PNG_SEGMENT *s, PNG_PWRITER *w, int index);
+
+/**
+ * @brief Deflate len bytes of filtered scanlines into the segment.
+ * @return 0 on success, non-zero on error
+ */
+int png_segment_feed(PNG_SEGMENT *s, U8 *raw, U64 len);
+
+/**
+ * @brief Release the deflate state and buffer of a segment compressor.
+ */
+void png_segment_free(PNG_SEGMENT *s);
@@ -0,0 +1,278 @@
+/**
+ * @file png_writer.c
+ * @brief streaming PNG writer. The deflate output goes straight into one of
+ *        PNG_WRITER_BATCH chunk buffers, the chunk CRC is updated as the
+ *        bytes come out of deflate, and full chunks are written together
+ *        with their length/type headers and CRCs in a single writev().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "crc.h"
+#include "png_writer.h"
+
+static const U8 png_sig[PNG_SIG_SIZE] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+
+/* CRC of the IEND chunk, it has no data so the value never changes */
+#define IEND_CRC 0xAE426082
+
+void png_put_u32(U8 *p, U32 v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        /* skip over what has been written, a pipe may take only part */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* the chunk currently being filled by deflate */
+static U8 *cur_buf(PNG_WRITER *w)
+{
+    return w->bufs + w->nfull * w->chunk_size;
+}
+
+/**
+ * @brief write out the signature/IHDR (first call only), the completed chunks
+ *        and, if given, trailing bytes such as the IEND chunk.
+ */
+static int flush_batch(PNG_WRITER *w, U8 *tail, size_t tail_len)
+{
+    struct iovec iov[1 + 3 * PNG_WRITER_BATCH + 1];
+    int cnt = 0;
+    size_t total = 0;
+
+    if (w->head_len > 0) {
+        iov[cnt].iov_base = w->head;
+        iov[cnt++].iov_len = w->head_len;
+        total += w->head_len;
+    }
+    for (int i = 0; i < w->nfull; i++) {
+        iov[cnt].iov_base = w->chunk_hdr[i];
+        iov[cnt++].iov_len = CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE;
+        iov[cnt].iov_base = w->bufs + i * w->chunk_size;
+        iov[cnt++].iov_len = w->chunk_len[i];
+        iov[cnt].iov_base = w->chunk_crc[i];
+        iov[cnt++].iov_len = CHUNK_CRC_SIZE;
+        total += CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + w->chunk_len[i] + CHUNK_CRC_SIZE;
+    }
+    if (tail_len > 0) {
+        iov[cnt].iov_base = tail;
+        iov[cnt++].iov_len = tail_len;
+        total += tail_len;
+    }
+
+    if (cnt > 0 && writev_all(w->fd, iov, cnt) != 0) {
+        perror("writev");
+        return -1;
+    }
+    w->bytes_out += total;
+    w->head_len = 0;
+    w->nfull = 0;
+    return 0;
+}
+
+/**
+ * @brief seal the chunk being filled, len bytes of data, and flush once the
+ *        batch is full.
+ */
+static int end_chunk(PNG_WRITER *w, size_t len)
+{
+    int i = w->nfull;
+
+    png_put_u32(w->chunk_hdr[i], len);
+    memcpy(w->chunk_hdr[i] + CHUNK_LEN_SIZE, "IDAT", CHUNK_TYPE_SIZE);
+    png_put_u32(w->chunk_crc[i], w->crc ^ 0xffffffffL);
+    w->chunk_len[i] = len;
+    w->nfull++;
+    w->crc = update_crc(0xffffffffL, (U8 *)"IDAT", CHUNK_TYPE_SIZE);
+
+    if (w->nfull == PNG_WRITER_BATCH) {
+        return flush_batch(w, NULL, 0);
+    }
+    return 0;
+}
+
+/**
+ * @brief run deflate with the given flush mode until it has consumed all the
+ *        input (Z_NO_FLUSH) or finished the stream (Z_FINISH).
+ */
+static int run_deflate(PNG_WRITER *w, int flush)
+{
+    int ret;
+
+    do {
+        if (w->strm.avail_out == 0) {
+            if (end_chunk(w, w->chunk_size) != 0) {
+                return -1;
+            }
+            w->strm.next_out = cur_buf(w);
+            w->strm.avail_out = w->chunk_size;
+        }
+        U8 *out = w->strm.next_out;
+        ret = deflate(&w->strm, flush);
+        if (ret == Z_STREAM_ERROR) {
+            return -1;
+        }
+        /* CRC the compressed bytes while they are still in cache */
+        w->crc = update_crc(w->crc, out, w->strm.next_out - out);
+    } while (flush == Z_FINISH ? ret != Z_STREAM_END
+                               : (w->strm.avail_in > 0 || w->strm.avail_out == 0));
+    return 0;
+}
+
+int png_writer_init(PNG_WRITER *w, int level, size_t chunk_size)
+{
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    w->chunk_size = chunk_size > 0 ? chunk_size : PNG_IDAT_CHUNK_SIZE;
+    w->bufs = malloc(w->chunk_size * PNG_WRITER_BATCH);
+    if (w->bufs == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (deflateInit(&w->strm, level) != Z_OK) {
+        free(w->bufs);
+        w->bufs = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void png_build_head(U8 *head, const struct data_IHDR *ihdr)
+{
+    U8 *p = head;
+
+    memcpy(p, png_sig, PNG_SIG_SIZE);
+    p += PNG_SIG_SIZE;
+    png_put_u32(p, DATA_IHDR_SIZE);
+    memcpy(p + CHUNK_LEN_SIZE, "IHDR", CHUNK_TYPE_SIZE);
+    p += CHUNK_LEN_SIZE;
+    png_put_u32(p + CHUNK_TYPE_SIZE, ihdr->width);
+    png_put_u32(p + CHUNK_TYPE_SIZE + 4, ihdr->height);
+    p[CHUNK_TYPE_SIZE + 8]  = ihdr->bit_depth;
+    p[CHUNK_TYPE_SIZE + 9]  = ihdr->color_type;
+    p[CHUNK_TYPE_SIZE + 10] = ihdr->compression;
+    p[CHUNK_TYPE_SIZE + 11] = ihdr->filter;
+    p[CHUNK_TYPE_SIZE + 12] = ihdr->interlace;
+    png_put_u32(p + CHUNK_TYPE_SIZE + DATA_IHDR_SIZE, crc(p, CHUNK_TYPE_SIZE + DATA_IHDR_SIZE));
+}
+
+void png_build_iend(U8 *iend)
+{
+    png_put_u32(iend, 0);
+    memcpy(iend + CHUNK_LEN_SIZE, "IEND", CHUNK_TYPE_SIZE);
+    png_put_u32(iend + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE, IEND_CRC);
+}
+
+int png_writer_begin(PNG_WRITER *w, int fd, const struct data_IHDR *ihdr)
+{
+    if (w->begun && deflateReset(&w->strm) != Z_OK) {
+        return -1;
+    }
+    w->begun = 1;
+    w->fd = fd;
+    w->nfull = 0;
+    w->bytes_out = 0;
+    w->strm.next_out = cur_buf(w);
+    w->strm.avail_out = w->chunk_size;
+    w->crc = update_crc(0xffffffffL, (U8 *)"IDAT", CHUNK_TYPE_SIZE);
+
+    /* signature followed by the IHDR chunk, sent with the first batch */
+    png_build_head(w->head, ihdr);
+    w->head_len = sizeof(w->head);
+
+    return 0;
+}
+
+int png_writer_open(PNG_WRITER *w, int fd, const struct data_IHDR *ihdr,
+                    int level, size_t chunk_size)
+{
+    if (png_writer_init(w, level, chunk_size) != 0) {
+        return -1;
+    }
+    if (png_writer_begin(w, fd, ihdr) != 0) {
+        png_writer_free(w);
+        return -1;
+    }
+    return 0;
+}
+
+int png_writer_feed(PNG_WRITER *w, U8 *raw, U64 len)
+{
+    int ret = 0;
+
+    /* avail_in is only 32 bits wide, feed very large buffers in pieces */
+    while (len > 0 && ret == 0) {
+        uInt n = len > 0x40000000UL ? 0x40000000U : (uInt)len;
+        w->strm.next_in = raw;
+        w->strm.avail_in = n;
+        ret = run_deflate(w, Z_NO_FLUSH);
+        raw += n;
+        len -= n;
+    }
+    return ret;
+}
+
+int png_writer_finish(PNG_WRITER *w)
+{
+    U8 iend[PNG_IEND_SIZE];
+    int ret;
+
+    w->strm.next_in = NULL;
+    w->strm.avail_in = 0;
+    ret = run_deflate(w, Z_FINISH);
+
+    if (ret == 0) {
+        size_t last = w->chunk_size - w->strm.avail_out;
+        if (last > 0) {
+            ret = end_chunk(w, last);
+        }
+    }
+    if (ret == 0) {
+        png_build_iend(iend);
+        ret = flush_batch(w, iend, sizeof(iend));
+    }
+    return ret;
+}
+
+void png_writer_free(PNG_WRITER *w)
+{
+    if (w->bufs != NULL) {
+        (void) deflateEnd(&w->strm);
+        free(w->bufs);
+        w->bufs = NULL;
+    }
+}
+
+int png_writer_close(PNG_WRITER *w)
+{
+    int ret = png_writer_finish(w);
+    png_writer_free(w);
+    return ret;
+}
@@ -0,0 +1,293 @@
+/**
+ * @file strip_cache.c
+ * @brief on-disk, mmap-backed cache of inflated PNG strips
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "strip_cache.h"
+
+#define STRIP_MAGIC "STRIPC1"
+#define STRIP_SUFFIX ".strip"
+#define STRIP_TMP_PREFIX ".tmp-"  /* entries being written, see strip_cache_put() */
+#define STRIP_TMP_STALE 60        /* seconds a temp file may sit unwritten         */
+
+/* header in front of the scanlines of every cache entry */
+typedef struct strip_hdr {
+    char magic[8];      /* STRIP_MAGIC                  */
+    U32 idat_len;       /* IDAT data length             */
+    U32 idat_crc;       /* IDAT chunk crc               */
+    U64 idat_hash;      /* strip_hash() of IDAT data    */
+    U64 raw_len;        /* length of the inflated data  */
+} STRIP_HDR;
+
+/* a cache file seen while enforcing the size cap */
+typedef struct strip_entry {
+    char name[NAME_MAX + 1];
+    off_t size;
+    struct timespec mtime;
+} STRIP_ENTRY;
+
+U64 strip_hash(const U8 *buf, U64 len)
+{
+    U64 h = 0xcbf29ce484222325UL;
+    U64 i;
+
+    for (i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 0x100000001b3UL;
+    }
+    return h;
+}
+
+static void entry_path(STRIP_CACHE *c, const struct chunk *idat, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%08x-%08x" STRIP_SUFFIX, c->dir, idat->crc, idat->length);
+}
+
+/**
+ * @brief remove temp files left behind by writers that died before their
+ *        rename(), which strip_cache_close() would never count or evict.
+ *        One not written to for STRIP_TMP_STALE seconds is taken as dead.
+ */
+static void remove_stale_temps(STRIP_CACHE *c)
+{
+    char path[STRIP_PATH_MAX + NAME_MAX + 2];
+    size_t prefix_len = strlen(STRIP_TMP_PREFIX);
+    time_t now = time(NULL);
+    struct dirent *de;
+    DIR *d = opendir(c->dir);
+
+    if (d == NULL) {
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+
+        if (strncmp(de->d_name, STRIP_TMP_PREFIX, prefix_len) != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", c->dir, de->d_name);
+        if (stat(path, &st) == 0 && now - st.st_mtime > STRIP_TMP_STALE) {
+            unlink(path);
+        }
+    }
+    closedir(d);
+}
+
+int strip_cache_open(STRIP_CACHE *c, const char *dir, U64 max_bytes)
+{
+    memset(c, 0, sizeof(*c));
+    if (strlen(dir) >= sizeof(c->dir) - 32) {
+        fprintf(stderr, "strip_cache: path too long: %s\n", dir);
+        return 1;
+    }
+    strcpy(c->dir, dir);
+    c->max_bytes = max_bytes > 0 ? max_bytes : STRIP_CACHE_MAX_DEFAULT;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+    remove_stale_temps(c);
+    return 0;
+}
+
+int strip_cache_get(STRIP_CACHE *c, const struct chunk *idat, U64 hash, STRIP *out)
+{
+    char path[STRIP_PATH_MAX + 32];
+    struct stat st;
+    STRIP_HDR *hdr;
+    void *map;
+    int fd;
+
+    entry_path(c, idat, path, sizeof(path));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        c->misses++;
+        return 1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(STRIP_HDR)) {
+        close(fd);
+        c->misses++;
+        return 1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        c->misses++;
+        return 1;
+    }
+
+    hdr = (STRIP_HDR *)map;
+    if (memcmp(hdr->magic, STRIP_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->idat_len != idat->length || hdr->idat_crc != idat->crc ||
+        hdr->idat_hash != hash ||
+        hdr->raw_len != (U64)st.st_size - sizeof(STRIP_HDR)) {
+        /* CRC collision or a stale entry, it gets replaced on put */
+        munmap(map, st.st_size);
+        close(fd);
+        c->misses++;
+        return 1;
+    }
+
+    /* bump mtime, it is the LRU clock used by strip_cache_close() */
+    futimens(fd, NULL);
+    close(fd);
+
+    out->map = map;
+    out->map_len = st.st_size;
+    out->data = (U8 *)map + sizeof(STRIP_HDR);
+    out->len = hdr->raw_len;
+    c->hits++;
+    return 0;
+}
+
+int strip_cache_put(STRIP_CACHE *c, const struct chunk *idat, U64 hash, const U8 *raw, U64 len)
+{
+    char path[STRIP_PATH_MAX + 32];
+    char tmp[STRIP_PATH_MAX + 64];
+    STRIP_HDR hdr;
+    int fd;
+
+    if (len + sizeof(hdr) > c->max_bytes) {
+        return 1; /* would be evicted straight away */
+    }
+
+    entry_path(c, idat, path, sizeof(path));
+    /* unique per call, threads of one process may put the same strip */
+    snprintf(tmp, sizeof(tmp), "%s/" STRIP_TMP_PREFIX "%08x-%08x.XXXXXX",
+             c->dir, idat->crc, idat->length);
+
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        perror(tmp);
+        return 1;
+    }
+    fchmod(fd, 0644);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, STRIP_MAGIC, sizeof(hdr.magic));
+    hdr.idat_len = idat->length;
+    hdr.idat_crc = idat->crc;
+    hdr.idat_hash = hash;
+    hdr.raw_len = len;
+
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        goto fail;
+    }
+    while (len > 0) {
+        ssize_t n = write(fd, raw, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto fail;
+        }
+        raw += n;
+        len -= n;
+    }
+    if (close(fd) != 0) {
+        unlink(tmp);
+        return 1;
+    }
+    if (rename(tmp, path) != 0) {
+        perror("rename");
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+
+fail:
+    perror("strip_cache_put");
+    close(fd);
+    unlink(tmp);
+    return 1;
+}
+
+void strip_release(STRIP *s)
+{
+    if (s->map != NULL) {
+        munmap(s->map, s->map_len);
+    }
+    memset(s, 0, sizeof(*s));
+}
+
+static int cmp_mtime(const void *a, const void *b)
+{
+    const STRIP_ENTRY *x = a;
+    const STRIP_ENTRY *y = b;
+
+    if (x->mtime.tv_sec != y->mtime.tv_sec) {
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    }
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec) {
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+void strip_cache_close(STRIP_CACHE *c)
+{
+    STRIP_ENTRY *entries = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    U64 total = 0;
+    struct dirent *de;
+    char path[STRIP_PATH_MAX + NAME_MAX + 2];
+    size_t suffix_len = strlen(STRIP_SUFFIX);
+    DIR *d = opendir(c->dir);
+
+    if (d == NULL) {
+        return;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        size_t n = strlen(de->d_name);
+        struct stat st;
+
+        if (n <= suffix_len || strcmp(de->d_name + n - suffix_len, STRIP_SUFFIX) != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", c->dir, de->d_name);
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            STRIP_ENTRY *q = realloc(entries, cap * sizeof(STRIP_ENTRY));
+            if (q == NULL) {
+                break;
+            }
+            entries = q;
+        }
+        strcpy(entries[count].name, de->d_name);
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    if (total > c->max_bytes) {
+        qsort(entries, count, sizeof(STRIP_ENTRY), cmp_mtime);
+        for (size_t i = 0; i < count && total > c->max_bytes; i++) {
+            snprintf(path, sizeof(path), "%s/%s", c->dir, entries[i].name);
+            if (unlink(path) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    free(entries);
+}
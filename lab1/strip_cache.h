@@ -0,0 +1,75 @@
+/**
+ * @file strip_cache.h
+ * @brief on-disk cache of inflated PNG strips, addressed by the IDAT chunk
+ *        CRC and length and verified with a 64-bit hash of the IDAT data.
+ *
+ * Each entry is one file in the cache directory named <crc>-<len>.strip,
+ * holding a small header followed by the inflated scanlines. Hits are
+ * mmap()ed read-only so the scanlines can be handed to deflate without a
+ * copy. The directory is kept under a size cap by evicting the least
+ * recently used entries; a hit refreshes the entry's mtime. An entry is
+ * written to a .tmp-* file and renamed into place; temp files left behind
+ * by a writer that died are removed by the next strip_cache_open().
+ */
+
+#pragma once
+
+#include "lab_png.h"
+#include "zutil.h"
+
+#define STRIP_CACHE_MAX_DEFAULT (256UL*1024*1024) /* default size cap, 256M */
+#define STRIP_PATH_MAX 4096                        /* longest cache dir path  */
+
+typedef struct strip_cache {
+    char dir[STRIP_PATH_MAX]; /* cache directory                          */
+    U64 max_bytes;            /* size cap enforced by strip_cache_close() */
+    U64 hits;                 /* lookups served from the cache            */
+    U64 misses;               /* lookups that had to inflate              */
+} STRIP_CACHE;
+
+typedef struct strip {
+    U8 *data;           /* inflated scanlines                       */
+    U64 len;            /* length of data in bytes                  */
+    void *map;          /* mapping backing data                     */
+    size_t map_len;     /* length of the mapping                    */
+} STRIP;
+
+/**
+ * @brief 64-bit FNV-1a hash, used to verify that a cache entry really was
+ *        produced from the same IDAT data and not just one with the same CRC.
+ */
+U64 strip_hash(const U8 *buf, U64 len);
+
+/**
+ * @brief Open (and create if needed) a cache directory.
+ * @param max_bytes size cap, 0 selects STRIP_CACHE_MAX_DEFAULT
+ * @return 0 on success, non-zero on error
+ */
+int strip_cache_open(STRIP_CACHE *c, const char *dir, U64 max_bytes);
+
+/**
+ * @brief Look up the inflated strip for an IDAT chunk.
+ * @param idat the IDAT chunk, length, data and crc must be filled in
+ * @param hash strip_hash() of the IDAT data
+ * @param out mapped strip on a hit, release with strip_release()
+ * @return 0 on a hit, 1 on a miss
+ */
+int strip_cache_get(STRIP_CACHE *c, const struct chunk *idat, U64 hash, STRIP *out);
+
+/**
+ * @brief Store the inflated strip of an IDAT chunk. Entries are written to a
+ *        temporary file and renamed into place, so concurrent runs sharing
+ *        the directory never see a partial entry.
+ * @return 0 on success, non-zero on error
+ */
+int strip_cache_put(STRIP_CACHE *c, const struct chunk *idat, U64 hash, const U8 *raw, U64 len);
+
+/**
+ * @brief Unmap a strip returned by strip_cache_get().
+ */
+void strip_release(STRIP *s);
+
+/**
+ * @brief Enforce the size cap, evicting least recently used entries first.
+ */
+void strip_cache_close(STRIP_CACHE *c);
@@ -10,6 +10,7 @@
  */
 
 #include <stdio.h>
+#include <limits.h>
 #include "zutil.h"
 
 /**
@@ -137,6 +138,64 @@ int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
     return (ret == Z_STREAM_END) ? Z_OK : Z_DATA_ERROR;
 }
 
+/**
+ * @brief: inflate in memory data from source to dest with a caller owned
+ *         inflate stream. The stream must have been set up with inflateInit();
+ *         it is reset here, so one stream can be reused for any number of
+ *         calls without paying for inflateInit()/inflateEnd() each time.
+ *         Unlike mem_inf() the data are inflated straight into dest.
+ * @param: strm z_stream* inflate stream owned by the caller
+ * @param: dest U8* output buffer
+ * @param: dest_len, U64* output parameter, length of inflated data
+ * @param: dest_cap U64 capacity of dest in bytes
+ * @param: source U8* source buffer, contains zlib data to be inflated
+ * @param: source_len U64 length of source data
+ *
+ * @return =0  on success
+ *         <>0 error, Z_BUF_ERROR if the data do not fit in dest
+ */
+int mem_inf_strm(z_stream *strm, U8 *dest, U64 *dest_len, U64 dest_cap,
+                 U8 *source, U64 source_len)
+{
+    int ret = inflateReset(strm);
+    if (ret != Z_OK) {
+        return ret;
+    }
+
+    /* avail_in and avail_out are only 32 bits wide, hand over very large
+       buffers in pieces */
+    U64 in_left = source_len;
+    U64 out_left = dest_cap;
+    strm->next_in = source;
+    strm->avail_in = 0;
+    strm->next_out = dest;
+    strm->avail_out = 0;
+    do {
+        if (strm->avail_in == 0 && in_left > 0) {
+            strm->avail_in = in_left > UINT_MAX ? UINT_MAX : (uInt)in_left;
+            in_left -= strm->avail_in;
+        }
+        if (strm->avail_out == 0 && out_left > 0) {
+            strm->avail_out = out_left > UINT_MAX ? UINT_MAX : (uInt)out_left;
+            out_left -= strm->avail_out;
+        }
+        ret = inflate(strm, Z_NO_FLUSH);
+    } while (ret == Z_OK && strm->avail_out + out_left > 0 &&
+             strm->avail_in + in_left > 0);
+    *dest_len = dest_cap - out_left - strm->avail_out;
+
+    switch (ret) {
+    case Z_STREAM_END:
+        return Z_OK;
+    case Z_NEED_DICT:
+        return Z_DATA_ERROR;
+    case Z_OK:          /* ran out of output space, or of data */
+        return Z_BUF_ERROR;
+    default:
+        return ret;
+    }
+}
+
 /* report a zlib or i/o error */
 void zerr(int ret)
 {
@@ -0,0 +1,406 @@
+/**
+ * @file checkpoint.c
+ * @brief on disk journal of the fragments fetched so far, see checkpoint.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+
+#define PATH_LEN 256
+#define ROOT_LEN (PATH_LEN - 32) /* leaves room for "/objects/" and a hash */
+#define RECORD_LEN 64
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char root[ROOT_LEN];
+static int journal_fd = -1;
+static int sync_every;
+static int pending;                /* records appended since the last fsync */
+
+/*
+ * What the journal says is kept, by image number - 1 and sequence number,
+ * for the split it last gave the image, 0 if none. The tables grow with the
+ * highest sequence number seen.
+ */
+typedef struct index {
+    unsigned long long *hashes;
+    unsigned char *kept;
+    int size;
+    int fragments;
+} INDEX;
+
+static INDEX index_of[CHECKPOINT_IMAGES];
+
+/**
+ * @brief 64 bit FNV-1a of len bytes at buf, names the object holding them
+ */
+static unsigned long long fnv1a(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int valid(int img, int seq)
+{
+    return img >= 1 && img <= CHECKPOINT_IMAGES && seq >= 0 && seq < CHECKPOINT_FRAGMENTS;
+}
+
+static int is_kept(int img, int seq)
+{
+    INDEX *ix = &index_of[img - 1];
+    return seq < ix->size && ix->kept[seq];
+}
+
+/**
+ * @brief Note that fragment seq of img is kept with the given hash, growing
+ *        the tables of img to hold it. Called with the lock held, or before
+ *        any thread can get at the tables.
+ * @return 0 on success, -1 if out of memory
+ */
+static int set_kept(int img, int seq, unsigned long long hash)
+{
+    INDEX *ix = &index_of[img - 1];
+
+    if (seq >= ix->size) {
+        int size = ix->size > 0 ? ix->size : 64;
+        unsigned long long *h;
+        unsigned char *k;
+
+        while (size <= seq) {
+            size *= 2;
+        }
+        h = realloc(ix->hashes, size * sizeof(*h));
+        if (h == NULL) {
+            return -1;
+        }
+        ix->hashes = h;
+        k = realloc(ix->kept, size);
+        if (k == NULL) {
+            return -1;
+        }
+        memset(k + ix->size, 0, size - ix->size);
+        ix->kept = k;
+        ix->size = size;
+    }
+    ix->hashes[seq] = hash;
+    ix->kept[seq] = 1;
+    return 0;
+}
+
+/**
+ * @brief Forget what is kept of img and note its new split. Called with the
+ *        lock held, or before any thread can get at the tables.
+ */
+static void set_split(int img, int fragments)
+{
+    INDEX *ix = &index_of[img - 1];
+
+    if (ix->kept != NULL) {
+        memset(ix->kept, 0, ix->size);
+    }
+    ix->fragments = fragments;
+}
+
+static void index_free(void)
+{
+    for (int i = 0; i < CHECKPOINT_IMAGES; i++) {
+        free(index_of[i].hashes);
+        free(index_of[i].kept);
+        memset(&index_of[i], 0, sizeof(INDEX));
+    }
+}
+
+static void object_path(char *path, unsigned long long hash)
+{
+    snprintf(path, PATH_LEN, "%s/objects/%016llx", root, hash);
+}
+
+/**
+ * @brief write all len bytes, a regular file may still take them in parts
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Index the records of the journal. A record cut short by a crash is
+ *        the last line and has no newline, it is skipped.
+ * @return 1 if the journal ends in such a record, 0 if not, -1 on error
+ */
+static int read_journal(const char *path)
+{
+    char line[RECORD_LEN];
+    int torn = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        int img, seq;
+        unsigned long long hash;
+        char nl;
+
+        torn = strchr(line, '\n') == NULL;
+        if (sscanf(line, "%d fragments %d%c", &img, &seq, &nl) == 3 && nl == '\n') {
+            if (valid(img, 0) && seq >= 1 && seq <= CHECKPOINT_FRAGMENTS) {
+                set_split(img, seq);
+            }
+            continue;
+        }
+        if (sscanf(line, "%d %d %16llx%c", &img, &seq, &hash, &nl) == 4 && nl == '\n' &&
+            valid(img, seq) && !is_kept(img, seq) && set_kept(img, seq, hash) != 0) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return torn;
+}
+
+int checkpoint_open(const char *dir, int every)
+{
+    char path[PATH_LEN];
+    int torn;
+
+    if (strlen(dir) >= ROOT_LEN) {
+        fprintf(stderr, "checkpoint_open: %s: path too long\n", dir);
+        return -1;
+    }
+    snprintf(root, sizeof(root), "%s", dir);
+    snprintf(path, sizeof(path), "%s/objects", root);
+    if ((mkdir(root, 0755) != 0 && errno != EEXIST) ||
+        (mkdir(path, 0755) != 0 && errno != EEXIST)) {
+        perror("mkdir");
+        return -1;
+    }
+
+    index_free();
+    snprintf(path, sizeof(path), "%s/journal", root);
+    torn = read_journal(path);
+    if (torn < 0) {
+        perror("fopen");
+        return -1;
+    }
+    journal_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (journal_fd < 0) {
+        perror("open");
+        return -1;
+    }
+    /* end the torn record, or the next one would be glued onto it */
+    if (torn && write_all(journal_fd, "\n", 1) != 0) {
+        perror("write");
+    }
+    sync_every = every;
+    pending = 0;
+    return 0;
+}
+
+int checkpoint_load(int img, int seq, char **buf, size_t *len)
+{
+    char path[PATH_LEN];
+    struct stat st;
+    char *p;
+    int fd;
+
+    pthread_mutex_lock(&lock);
+    int found = journal_fd >= 0 && valid(img, seq) && is_kept(img, seq);
+    unsigned long long hash = found ? index_of[img - 1].hashes[seq] : 0;
+    pthread_mutex_unlock(&lock);
+    if (!found) {
+        return -1;
+    }
+
+    object_path(path, hash);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        goto damaged;
+    }
+    if (fstat(fd, &st) != 0 || (p = malloc(st.st_size + 1)) == NULL) {
+        close(fd);
+        goto damaged;
+    }
+    for (off_t got = 0; got < st.st_size; ) {
+        ssize_t n = read(fd, p + got, st.st_size - got);
+        if (n <= 0) {
+            st.st_size = got; /* shorter than it said, the hash tells */
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    /* an object that never reached the disk whole does not match its name */
+    if (fnv1a(p, st.st_size) != hash) {
+        free(p);
+        unlink(path);
+        goto damaged;
+    }
+    p[st.st_size] = 0;
+    *buf = p;
+    *len = st.st_size;
+    return 0;
+
+damaged:
+    pthread_mutex_lock(&lock);
+    index_of[img - 1].kept[seq] = 0;
+    pthread_mutex_unlock(&lock);
+    return -1;
+}
+
+int checkpoint_split(int img, int fragments)
+{
+    char record[RECORD_LEN];
+    int n;
+
+    if (journal_fd < 0 || !valid(img, 0) || fragments < 1 || fragments > CHECKPOINT_FRAGMENTS) {
+        return -1;
+    }
+    pthread_mutex_lock(&lock);
+    int same = index_of[img - 1].fragments == fragments;
+    if (!same) {
+        set_split(img, fragments);
+    }
+    pthread_mutex_unlock(&lock);
+    if (same) {
+        return 0;
+    }
+
+    n = snprintf(record, sizeof(record), "%d fragments %d\n", img, fragments);
+    if (write_all(journal_fd, record, n) != 0) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+int checkpoint_add(int img, int seq, const void *buf, size_t len)
+{
+    char path[PATH_LEN];
+    char record[RECORD_LEN];
+    unsigned long long hash = fnv1a(buf, len);
+    int sync = 0;
+    int n;
+    int fd;
+
+    if (journal_fd < 0 || !valid(img, seq)) {
+        return -1;
+    }
+
+    /* the same content is stored once, whoever got there first wrote it */
+    object_path(path, hash);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) {
+        int err = write_all(fd, buf, len);
+        close(fd);
+        if (err != 0) {
+            perror("write");
+            unlink(path);
+            return -1;
+        }
+    } else if (errno != EEXIST) {
+        perror("open");
+        return -1;
+    }
+
+    /* one write() per record keeps records of other processes whole */
+    n = snprintf(record, sizeof(record), "%d %d %016llx\n", img, seq, hash);
+    if (write_all(journal_fd, record, n) != 0) {
+        perror("write");
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (set_kept(img, seq, hash) != 0) {
+        /* it is in the journal, a later run still finds it */
+        perror("realloc");
+    }
+    pending++;
+    sync = sync_every > 0 && pending >= sync_every;
+    pthread_mutex_unlock(&lock);
+    return sync ? checkpoint_sync() : 0;
+}
+
+int checkpoint_sync(void)
+{
+    pthread_mutex_lock(&lock);
+    int n = pending;
+    pending = 0;
+    pthread_mutex_unlock(&lock);
+
+    /* outside the lock, checkpoint_add() does not wait on the disk */
+    if (n > 0 && journal_fd >= 0 && fsync(journal_fd) != 0) {
+        perror("fsync");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief delete the objects, the journal and the directories
+ */
+static void remove_checkpoint(void)
+{
+    char path[PATH_LEN];
+    DIR *d;
+    struct dirent *e;
+
+    snprintf(path, sizeof(path), "%s/objects", root);
+    d = opendir(path);
+    if (d != NULL) {
+        while ((e = readdir(d)) != NULL) {
+            if (e->d_name[0] != '.' &&
+                snprintf(path, sizeof(path), "%s/objects/%s", root, e->d_name) < PATH_LEN) {
+                unlink(path);
+            }
+        }
+        closedir(d);
+    }
+    snprintf(path, sizeof(path), "%s/objects", root);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/journal", root);
+    unlink(path);
+    rmdir(root);
+}
+
+void checkpoint_close(int remove)
+{
+    if (journal_fd < 0) {
+        return;
+    }
+    checkpoint_sync();
+    close(journal_fd);
+    journal_fd = -1;
+    index_free();
+    if (remove) {
+        remove_checkpoint();
+    }
+}
@@ -0,0 +1,84 @@
+/**
+ * @file checkpoint.h
+ * @brief fragments kept on disk so that a run that is killed, or loses its
+ *        mirrors near the end, can be restarted without fetching them again.
+ *
+ * A checkpoint is a directory holding
+ *
+ *     objects/HASH   each fragment once, named by the 64 bit FNV-1a hash of
+ *                    its bytes
+ *     journal        one "IMG SEQ HASH" line per fragment kept, appended,
+ *                    after an "IMG fragments N" line saying how many
+ *                    fragments image IMG was split into
+ *
+ * Fragments cut for one split are of no use for another, so the records of
+ * an image count only if they come after a split record that matches the
+ * run reading them, see checkpoint_split().
+ *
+ * The journal is only ever appended to, and a record is written after the
+ * object it names. It is fsync()ed in batches rather than per fragment, so a
+ * crash loses at most the last batch of records, never what came before.
+ * Objects are not synced at all: checkpoint_load() checks every object
+ * against its name and drops the ones that did not make it to disk, which
+ * are then fetched again like any missing fragment.
+ *
+ * Several processes may append to the same checkpoint, each record is a
+ * single write() on an O_APPEND descriptor. Within a process the functions
+ * are thread safe.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#define CHECKPOINT_IMAGES    3     /* image numbers 1 to CHECKPOINT_IMAGES  */
+#define CHECKPOINT_FRAGMENTS 65536 /* sequence numbers 0 to this - 1        */
+#define CHECKPOINT_SYNC_EVERY 16   /* records per fsync() of the journal    */
+
+/**
+ * @brief Open the checkpoint in dir, creating it if need be, and read its
+ *        journal. Until it is opened every other function does nothing.
+ * @param dir directory of the checkpoint
+ * @param sync_every fsync() the journal after this many records, 0 if the
+ *        caller runs checkpoint_sync() itself, off its fetching threads
+ * @return 0 on success, -1 on error
+ */
+int checkpoint_open(const char *dir, int sync_every);
+
+/**
+ * @brief Read fragment seq of image img back from the checkpoint.
+ * @param buf receives a malloc()ed copy of the fragment, to be freed
+ * @param len receives its size in bytes
+ * @return 0 on success, -1 if it is not in the checkpoint or its object is
+ *         damaged, in which case the object is removed
+ */
+int checkpoint_load(int img, int seq, char **buf, size_t *len);
+
+/**
+ * @brief Say that image img is split into the given number of fragments.
+ *        If the journal has it split otherwise, or does not say, the
+ *        records of img are dropped and the new split is appended, so the
+ *        fragments are fetched again. Call it before loading fragments.
+ * @return 0 on success, -1 on error
+ */
+int checkpoint_split(int img, int fragments);
+
+/**
+ * @brief Keep fragment seq of image img: store its bytes unless an object
+ *        with the same content is there already, then append its record.
+ * @return 0 on success, -1 on error
+ */
+int checkpoint_add(int img, int seq, const void *buf, size_t len);
+
+/**
+ * @brief fsync() the journal if records were appended since the last time.
+ * @return 0 on success, -1 on error
+ */
+int checkpoint_sync(void);
+
+/**
+ * @brief Sync and close the checkpoint.
+ * @param remove delete the checkpoint as well, once the images it was kept
+ *        for are written
+ */
+void checkpoint_close(int remove);
@@ -0,0 +1,156 @@
+/**
+ * @file coord.c
+ * @brief message framing for the coordinator and workers, see coord.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "coord.h"
+
+#define COORD_READ_SIZE 65536 /* room made for each read */
+
+/* fixed fields of each message type */
+static int num_fields(U32 type)
+{
+    switch (type) {
+    case COORD_HELLO:  return 1;
+    case COORD_JOB:    return 3;
+    case COORD_CANCEL: return 1;
+    case COORD_RESULT: return 3;
+    default:           return -1;
+    }
+}
+
+int coord_send(int fd, U32 type, const U32 *words, int num_words,
+               const void *rest, size_t rest_len)
+{
+    U32 head[2 + 3];
+    struct iovec iov[2];
+    struct msghdr mh;
+    size_t left;
+
+    head[0] = htonl(type);
+    head[1] = htonl((U32)(num_words * sizeof(U32) + rest_len));
+    for (int i = 0; i < num_words; i++) {
+        head[2 + i] = htonl(words[i]);
+    }
+    iov[0].iov_base = head;
+    iov[0].iov_len = (2 + num_words) * sizeof(U32);
+    iov[1].iov_base = (void *)rest;
+    iov[1].iov_len = rest_len;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = rest_len > 0 ? 2 : 1;
+    left = iov[0].iov_len + rest_len;
+
+    while (left > 0) {
+        ssize_t n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* a non-blocking socket with a full buffer, wait for room */
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                int r = poll(&pfd, 1, COORD_SEND_TIMEOUT_MS);
+                if (r > 0 || (r < 0 && errno == EINTR)) {
+                    continue;
+                }
+            }
+            return -1;
+        }
+        left -= n;
+        /* step over what went out, a short write can end inside either part */
+        while (n > 0) {
+            size_t step = (size_t)n < mh.msg_iov->iov_len ? (size_t)n : mh.msg_iov->iov_len;
+            mh.msg_iov->iov_base = (U8 *)mh.msg_iov->iov_base + step;
+            mh.msg_iov->iov_len -= step;
+            n -= step;
+            if (mh.msg_iov->iov_len == 0 && mh.msg_iovlen > 1) {
+                mh.msg_iov++;
+                mh.msg_iovlen--;
+            }
+        }
+    }
+    return 0;
+}
+
+int coord_read(int fd, COORD_BUF *b)
+{
+    // What was parsed before is not needed any more
+    if (b->start > 0) {
+        memmove(b->data, b->data + b->start, b->len - b->start);
+        b->len -= b->start;
+        b->start = 0;
+    }
+    while (1) {
+        if (b->cap - b->len < COORD_READ_SIZE) {
+            size_t cap = b->cap > 0 ? 2 * b->cap : 2 * COORD_READ_SIZE;
+            U8 *p = realloc(b->data, cap);
+            if (p == NULL) {
+                perror("realloc");
+                return -1;
+            }
+            b->data = p;
+            b->cap = cap;
+        }
+        ssize_t n = recv(fd, b->data + b->len, b->cap - b->len, MSG_DONTWAIT);
+        if (n > 0) {
+            b->len += n;
+            continue;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+}
+
+int coord_next(COORD_BUF *b, COORD_MSG *msg)
+{
+    U32 head[2];
+    size_t avail = b->len - b->start;
+    int fields;
+
+    if (avail < sizeof(head)) {
+        return 0;
+    }
+    memcpy(head, b->data + b->start, sizeof(head));
+    msg->type = ntohl(head[0]);
+    U32 len = ntohl(head[1]);
+    fields = num_fields(msg->type);
+    if (fields < 0 || len > COORD_MAX_MSG || len < fields * sizeof(U32)) {
+        return -1;
+    }
+    if (avail < sizeof(head) + len) {
+        return 0;
+    }
+
+    const U8 *p = b->data + b->start + sizeof(head);
+    for (int i = 0; i < fields; i++) {
+        U32 w;
+        memcpy(&w, p + i * sizeof(U32), sizeof(U32));
+        msg->words[i] = ntohl(w);
+    }
+    msg->rest = p + fields * sizeof(U32);
+    msg->rest_len = len - fields * sizeof(U32);
+    b->start += sizeof(head) + len;
+    return 1;
+}
+
+void coord_buf_free(COORD_BUF *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
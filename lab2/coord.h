@@ -0,0 +1,103 @@
+/**
+ * @file coord.h
+ * @brief wire protocol between a paster coordinator (-W PORT) and its
+ *        workers (-w HOST:PORT).
+ *
+ * Workers connect to the coordinator over TCP, from this host or any other.
+ * Every message is a header of two 32 bit words in network byte order, the
+ * type and the length of what follows, then that many bytes:
+ *
+ *   HELLO   worker -> coordinator  slots
+ *           the worker runs up to slots jobs at once
+ *   JOB     coordinator -> worker  id, image, part, URL
+ *           fetch the URL, which strategy_next() built, and answer with a
+ *           RESULT of the same id. image and part are only echoed.
+ *   CANCEL  coordinator -> worker  id
+ *           another worker brought the fragment of job id first, drop it.
+ *           A RESULT for it may still cross on the wire and is ignored.
+ *   RESULT  worker -> coordinator  id, seq, micros, fragment
+ *           the X-Ece252-Fragment the server sent, -1 if the transfer
+ *           failed, how long it took in microseconds, and the PNG strip as
+ *           the server sent it, still compressed
+ *
+ * The coordinator keeps every worker at its slots outstanding jobs, so a
+ * worker that is twice as fast gets twice the work. It closes the
+ * connections once every image is in, which ends the workers.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include "lab_png.h"
+
+#define COORD_HELLO  1
+#define COORD_JOB    2
+#define COORD_CANCEL 3
+#define COORD_RESULT 4
+
+#define COORD_MAX_MSG (16 * 1024 * 1024) /* longest message accepted */
+#define COORD_MAX_WORKERS 64             /* connected at once        */
+#define COORD_SEND_TIMEOUT_MS 10000      /* longest wait for room    */
+
+/* bytes read from a connection and not yet parsed */
+typedef struct coord_buf {
+    U8 *data;
+    size_t start; /* first byte not parsed */
+    size_t len;   /* bytes in data         */
+    size_t cap;
+} COORD_BUF;
+
+/* one message parsed out of a COORD_BUF, valid until the next coord_read() */
+typedef struct coord_msg {
+    U32 type;
+    U32 words[3];     /* the fixed fields, in host byte order */
+    const U8 *rest;   /* the URL or the fragment              */
+    size_t rest_len;
+} COORD_MSG;
+
+/**
+ * @brief Send a message of num_words fixed fields and then rest_len bytes
+ *        at rest, blocking until it is all written, on a non-blocking fd
+ *        too, where it waits for room in the socket buffer.
+ * @return 0 on success, -1 if the connection is gone or the peer has taken
+ *         nothing for COORD_SEND_TIMEOUT_MS
+ */
+int coord_send(int fd, U32 type, const U32 *words, int num_words,
+               const void *rest, size_t rest_len);
+
+/**
+ * @brief Read whatever fd has for b without blocking.
+ * @return 0 if the connection is still open, -1 on end of file or error
+ */
+int coord_read(int fd, COORD_BUF *b);
+
+/**
+ * @brief Take the next whole message out of b.
+ * @return 1 with msg filled in, 0 if there is no whole message yet, -1 if
+ *         the peer sent something that is not this protocol
+ */
+int coord_next(COORD_BUF *b, COORD_MSG *msg);
+
+void coord_buf_free(COORD_BUF *b);
+
+/**
+ * @brief Coordinate the workers that connect on port until every image of
+ *        the batch is in. Takes the place of the fetch engines, see
+ *        paster_coord.c.
+ * @return 0 on success, -1 on error
+ */
+int fetch_fragments_coord(int port);
+
+/**
+ * @brief Print the jobs every worker ran and what they were good for.
+ */
+void coord_report(FILE *fp);
+
+/**
+ * @brief Work for the coordinator at host:port with up to slots transfers,
+ *        or tune_limit() of them with -t auto, until it hangs up. See
+ *        paster_worker.c.
+ * @return 0 once the coordinator is done, -1 on error
+ */
+int paster_worker(const char *host, const char *port, int slots);
@@ -0,0 +1,48 @@
+/**
+ * @file deadline.c
+ * @brief transfer timeouts and the run deadline of paster, see deadline.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+#include "deadline.h"
+
+static long request_ms = DEADLINE_REQUEST_MS;
+static double run_end;       /* seconds, monotonic, 0 for no deadline */
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void deadline_init(int ms, double run_sec)
+{
+    request_ms = ms;
+    run_end = run_sec > 0 ? now_sec() + run_sec : 0.0;
+}
+
+void deadline_apply(CURL *easy)
+{
+    long total = request_ms;
+
+    if (run_end > 0) {
+        long left = (long)((run_end - now_sec()) * 1000.0);
+        if (left < total) {
+            total = left > 1 ? left : 1; /* 0 would mean no timeout at all */
+        }
+    }
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS,
+                     total < DEADLINE_CONNECT_MS ? total : (long)DEADLINE_CONNECT_MS);
+    curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, (long)DEADLINE_LOW_SPEED);
+    curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, (long)DEADLINE_LOW_SPEED_SEC);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, total);
+}
+
+int deadline_passed(void)
+{
+    return run_end > 0 && now_sec() >= run_end;
+}
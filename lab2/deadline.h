@@ -0,0 +1,50 @@
+/**
+ * @file deadline.h
+ * @brief how long paster waits on one transfer, and on the whole run.
+ *
+ * Without limits a mirror that accepts a connection and never answers
+ * holds the transfer, and with the threads engine its thread, for good.
+ * Every transfer gets
+ *
+ *   a connect timeout   DEADLINE_CONNECT_MS
+ *   a low speed limit   less than DEADLINE_LOW_SPEED bytes/s for
+ *                       DEADLINE_LOW_SPEED_SEC seconds counts as a stall
+ *   a total timeout     -T MS (default DEADLINE_REQUEST_MS)
+ *
+ * and a transfer that runs into one fails like any other, so the mirror's
+ * circuit breaker (mirror.h) and the retry backoff (strategy.h) take it
+ * from there.
+ *
+ * The run as a whole may be given -D SEC. The transfers still running then
+ * are cut short, nothing more is requested, and paster exits with the
+ * fragments it has in the checkpoint, to resume from.
+ *
+ * Set once before the transfers start, read only after that.
+ */
+
+#pragma once
+
+#include <curl/curl.h>
+
+#define DEADLINE_CONNECT_MS 2000
+#define DEADLINE_LOW_SPEED 1024     /* bytes/s                          */
+#define DEADLINE_LOW_SPEED_SEC 3
+#define DEADLINE_REQUEST_MS 5000    /* -T default                       */
+
+/**
+ * @brief Set the limits, the run deadline counting from now.
+ * @param request_ms total timeout of a transfer
+ * @param run_sec seconds the run may take, 0 for no limit
+ */
+void deadline_init(int request_ms, double run_sec);
+
+/**
+ * @brief Set the timeouts of easy for the transfer about to start, the
+ *        total one cut to what is left of the run.
+ */
+void deadline_apply(CURL *easy);
+
+/**
+ * @brief Whether the -D deadline has passed.
+ */
+int deadline_passed(void);
@@ -0,0 +1,862 @@
+/* fragsrv.c
+fragsrv - local stand-in for the ece252 fragment servers
+
+@Usage
+fragsrv [-d IMG_DIR] [-f FRAGMENTS] [-p PORT] [-P PART_PORT] [MIRROR...]
+
+@Description
+Serves the images IMG_DIR/1.png to IMG_DIR/3.png (default starter/img, the
+ones that are missing answer 404) split into FRAGMENTS horizontal strips
+(default 50), the way the ece252 servers do:
+   GET /image?img=N          on PORT (default 2520) a random strip of image N
+   GET /image?img=N&part=K   on PART_PORT (default 2530) strip K, a random
+                             one if &part is left out
+Every response carries the strip number in an X-Ece252-Fragment header, and
+the number of strips in X-Ece252-Fragments, which the ece252 servers do not
+send. Connections are kept alive. Each strip is deflated once at startup
+and sent with sendfile() from a single epoll loop, so the server costs a
+client far less than the network it stands in for.
+
+Each MIRROR is a local address with its own faults, as ADDR[,OPTION...]
+(default 127.0.0.1):
+   delay=MS       every response waits MS milliseconds first
+   jitter=MS      and up to MS more, uniformly distributed
+   tail=P:MS      with probability P it waits MS milliseconds more again
+   rate=BYTES     each connection gets at most BYTES of body per second
+   err=P          with probability P the answer is 503 with no body
+   conns=N        at most N open connections, further ones are closed
+                  as soon as they are accepted
+   nopart         PART_PORT ignores &part, like a lab2 era server
+Any address in 127.0.0.0/8 works on Linux without configuration. paster
+takes the mirrors with -m; paster2 and the timing harnesses use the ece252
+host names, which /etc/hosts can point at the mirrors.
+
+On SIGINT or SIGTERM the requests, faults and bytes of every mirror are
+printed and the server exits.
+
+Example:
+`fragsrv 127.0.0.1,delay=50 127.0.0.2,delay=50,tail=0.05:1000 127.0.0.3,err=0.1 &`
+`paster -t 6 -m 127.0.0.1,127.0.0.2,127.0.0.3`
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "framebuf.h"
+#include "png_writer.h"
+
+#define FRAGSRV_IMAGES   3      /* img=1 to img=3                            */
+#define MAX_STRIPS       65536  /* most FRAGMENTS an image can be split into */
+#define MAX_MIRRORS      16
+#define MAX_EVENTS       256    /* epoll events handled per wakeup           */
+#define LISTEN_BACKLOG   1024
+#define IN_BUF_SIZE      4096   /* longest request head                      */
+#define HEAD_BUF_SIZE    256    /* longest response head                     */
+#define PACE_SLICE       0.01   /* seconds of a rate= allowance per send     */
+
+/* one pre-split strip, a PNG of its own in the file of its image */
+typedef struct strip {
+    off_t off;
+    off_t size;
+} STRIP;
+
+/* the strips of an image one after the other in an unlinked file */
+typedef struct image {
+    int fd;
+    int num_strips;             /* 0 if the image was not found              */
+    STRIP *strips;
+} IMAGE;
+
+/* a virtual mirror: one address, both ports, its own faults */
+typedef struct vmirror {
+    char addr[INET_ADDRSTRLEN];
+    double delay;               /* seconds                                   */
+    double jitter;              /* seconds, uniform on top of delay          */
+    double tail_p;              /* probability of the tail delay             */
+    double tail;                /* seconds, on top of the others             */
+    double rate;                /* body bytes per second and connection      */
+    double err;                 /* probability of a 503                      */
+    int max_conns;              /* 0 for no limit                            */
+    int part;                   /* PART_PORT honours &part=K                 */
+    int open;                   /* connections open now                      */
+    unsigned long accepted;
+    unsigned long refused;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long long bytes;
+} VMIRROR;
+
+/* what an epoll event points at, the kind comes first in both */
+enum { EP_LISTENER, EP_CONN };
+
+typedef struct listener {
+    int kind;
+    int fd;
+    VMIRROR *m;
+    int part_port;
+} LISTENER;
+
+/* where a connection is with its current request */
+enum {
+    ST_READ,                    /* waiting for a whole request head          */
+    ST_WAIT,                    /* sleeping off the injected latency         */
+    ST_SEND,                    /* sending the head and body                 */
+    ST_PACE,                    /* sleeping off the rate= limit              */
+};
+
+typedef struct conn {
+    int kind;
+    int fd;
+    VMIRROR *m;
+    int part_port;
+    int state;
+    int events;                 /* epoll interest currently registered       */
+    int keep_alive;
+    size_t req_len;             /* bytes of in taken by the request          */
+    size_t in_len;
+    char in[IN_BUF_SIZE];
+    char head[HEAD_BUF_SIZE];
+    size_t head_len;
+    size_t head_off;
+    int body_fd;                /* -1 for a response without a body          */
+    off_t body_off;
+    off_t body_end;
+    double due;                 /* when ST_WAIT or ST_PACE is over           */
+    int heap_pos;               /* index in the timer heap, -1 if not in it  */
+} CONN;
+
+static IMAGE images[FRAGSRV_IMAGES + 1];
+static VMIRROR mirrors[MAX_MIRRORS];
+static int num_mirrors;
+static int epfd;
+static volatile sig_atomic_t g_stop = 0;
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* connections sleeping in ST_WAIT or ST_PACE, earliest due first */
+static CONN **heap;
+static int heap_len;
+static int heap_cap;
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    g_stop = 1;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief uniform on [0, 1), xorshift64*
+ */
+static double rand01(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void heap_swap(int i, int j)
+{
+    CONN *t = heap[i];
+    heap[i] = heap[j];
+    heap[j] = t;
+    heap[i]->heap_pos = i;
+    heap[j]->heap_pos = j;
+}
+
+static void heap_fix(int i)
+{
+    while (i > 0 && heap[(i - 1) / 2]->due > heap[i]->due) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int l = 2 * i + 1;
+        int min = i;
+        if (l < heap_len && heap[l]->due < heap[min]->due) {
+            min = l;
+        }
+        if (l + 1 < heap_len && heap[l + 1]->due < heap[min]->due) {
+            min = l + 1;
+        }
+        if (min == i) {
+            break;
+        }
+        heap_swap(i, min);
+        i = min;
+    }
+}
+
+static int heap_push(CONN *c)
+{
+    if (heap_len == heap_cap) {
+        int cap = heap_cap > 0 ? 2 * heap_cap : 256;
+        CONN **q = realloc(heap, cap * sizeof(CONN *));
+        if (q == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        heap = q;
+        heap_cap = cap;
+    }
+    heap[heap_len] = c;
+    c->heap_pos = heap_len++;
+    heap_fix(c->heap_pos);
+    return 0;
+}
+
+static void heap_remove(CONN *c)
+{
+    int i = c->heap_pos;
+
+    if (i < 0) {
+        return;
+    }
+    c->heap_pos = -1;
+    if (i != --heap_len) {
+        heap[i] = heap[heap_len];
+        heap[i]->heap_pos = i;
+        heap_fix(i);
+    }
+}
+
+static void conn_close(CONN *c)
+{
+    heap_remove(c);
+    close(c->fd); /* also takes it out of the epoll set */
+    c->m->open--;
+    free(c);
+}
+
+/**
+ * @brief register interest in events, only when it changes
+ */
+static int set_events(CONN *c, int events)
+{
+    struct epoll_event ev;
+
+    if (c->events == events) {
+        return 0;
+    }
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+/**
+ * @brief sleep until due without holding up the loop
+ */
+static int sleep_until(CONN *c, int state, double due)
+{
+    c->state = state;
+    c->due = due;
+    if (set_events(c, 0) != 0) {
+        return -1;
+    }
+    return heap_push(c);
+}
+
+/**
+ * @brief value of key=NUMBER in the query string, -1 if it is not there
+ */
+static int query_int(const char *query, const char *key)
+{
+    size_t n = strlen(key);
+
+    for (const char *p = query; p != NULL && *p != '\0'; p = strchr(p, '&')) {
+        if (*p == '&') {
+            p++;
+        }
+        if (strncmp(p, key, n) == 0 && p[n] == '=') {
+            return atoi(p + n + 1);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Decide the answer to the request head in c->in and build its head.
+ */
+static void prepare_response(CONN *c, const char *target, int minor)
+{
+    const char *query = strchr(target, '?');
+    int img = query != NULL ? query_int(query + 1, "img") : -1;
+    int part = query != NULL ? query_int(query + 1, "part") : -1;
+    IMAGE *im = img >= 1 && img <= FRAGSRV_IMAGES ? &images[img] : NULL;
+    int k = -1;
+
+    c->body_fd = -1;
+    c->body_off = c->body_end = 0;
+    c->m->requests++;
+
+    if (strncmp(target, "/image", 6) != 0 || (target[6] != '?' && target[6] != '\0') ||
+        im == NULL || im->num_strips == 0) {
+        c->head_len = snprintf(c->head, sizeof(c->head),
+                               "HTTP/1.%d 404 Not Found\r\nContent-Length: 0\r\n\r\n", minor);
+        return;
+    }
+    if (c->part_port && c->m->part && part >= 0) {
+        if (part >= im->num_strips) {
+            c->head_len = snprintf(c->head, sizeof(c->head),
+                                   "HTTP/1.%d 404 Not Found\r\nContent-Length: 0\r\n\r\n", minor);
+            return;
+        }
+        k = part;
+    } else {
+        k = (int)(rand01() * im->num_strips);
+    }
+    if (c->m->err > 0 && rand01() < c->m->err) {
+        c->m->errors++;
+        c->head_len = snprintf(c->head, sizeof(c->head),
+                               "HTTP/1.%d 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n", minor);
+        return;
+    }
+
+    c->body_fd = im->fd;
+    c->body_off = im->strips[k].off;
+    c->body_end = im->strips[k].off + im->strips[k].size;
+    c->head_len = snprintf(c->head, sizeof(c->head),
+                           "HTTP/1.%d 200 OK\r\nContent-Type: image/png\r\n"
+                           "Content-Length: %lld\r\nX-Ece252-Fragment: %d\r\n"
+                           "X-Ece252-Fragments: %d\r\n\r\n",
+                           minor, (long long)im->strips[k].size, k, im->num_strips);
+}
+
+static int conn_send(CONN *c);
+
+/**
+ * @brief Take the next request head out of c->in if a whole one is there,
+ *        and start answering it after the mirror's latency.
+ * @return 0 to go on, -1 if the connection has to be closed
+ */
+static int conn_request(CONN *c)
+{
+    char method[8];
+    char target[256];
+    int minor = 1;
+    char *end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+    double d;
+
+    if (end == NULL) {
+        /* a head this long is not a client of ours */
+        return c->in_len == sizeof(c->in) ? -1 : set_events(c, EPOLLIN);
+    }
+    *end = '\0';
+    c->req_len = end + 4 - c->in;
+    if (sscanf(c->in, "%7s %255s HTTP/1.%d", method, target, &minor) != 3 ||
+        strcmp(method, "GET") != 0) {
+        return -1;
+    }
+    c->keep_alive = minor >= 1 ? strcasestr(c->in, "\nConnection: close") == NULL
+                               : strcasestr(c->in, "\nConnection: keep-alive") != NULL;
+    prepare_response(c, target, minor);
+    c->head_off = 0;
+
+    d = c->m->delay + c->m->jitter * rand01();
+    if (c->m->tail_p > 0 && rand01() < c->m->tail_p) {
+        d += c->m->tail;
+    }
+    if (d > 0) {
+        return sleep_until(c, ST_WAIT, now_sec() + d);
+    }
+    c->state = ST_SEND;
+    return conn_send(c);
+}
+
+/**
+ * @brief Send as much of the response as the socket and the mirror's rate
+ *        take, and move on to the next request when it is all out.
+ * @return 0 to go on, -1 if the connection has to be closed
+ */
+static int conn_send(CONN *c)
+{
+    while (c->head_off < c->head_len) {
+        int more = c->body_fd >= 0 ? MSG_MORE : 0; /* one segment with the body */
+        ssize_t n = send(c->fd, c->head + c->head_off, c->head_len - c->head_off,
+                         MSG_NOSIGNAL | more);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return errno == EAGAIN ? set_events(c, EPOLLOUT) : 0;
+            }
+            return -1;
+        }
+        c->head_off += n;
+        c->m->bytes += n;
+    }
+    while (c->body_off < c->body_end) {
+        size_t chunk = c->body_end - c->body_off;
+        ssize_t n;
+
+        if (c->m->rate > 0) {
+            size_t allowance = c->m->rate * PACE_SLICE;
+            if (allowance < 1460) {
+                allowance = 1460; /* at least a segment per wakeup */
+            }
+            if (chunk > allowance) {
+                chunk = allowance;
+            }
+        }
+        n = sendfile(c->fd, c->body_fd, &c->body_off, chunk);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                return set_events(c, EPOLLOUT);
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        c->m->bytes += n;
+        if (c->m->rate > 0 && c->body_off < c->body_end) {
+            return sleep_until(c, ST_PACE, now_sec() + n / c->m->rate);
+        }
+    }
+
+    /* done, a pipelined request may be waiting behind this one */
+    if (!c->keep_alive) {
+        return -1;
+    }
+    c->in_len -= c->req_len;
+    memmove(c->in, c->in + c->req_len, c->in_len);
+    c->req_len = 0;
+    c->state = ST_READ;
+    return conn_request(c);
+}
+
+static int conn_read(CONN *c)
+{
+    while (c->in_len < sizeof(c->in)) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        c->in_len += n;
+    }
+    return conn_request(c);
+}
+
+static void conn_event(CONN *c, int events)
+{
+    int ret = 0;
+
+    if (c->state == ST_READ && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        ret = conn_read(c);
+    } else if (c->state == ST_SEND && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+        ret = conn_send(c);
+    }
+    if (ret != 0) {
+        conn_close(c);
+    }
+}
+
+static void accept_all(LISTENER *l)
+{
+    while (1) {
+        struct epoll_event ev;
+        int one = 1;
+        CONN *c;
+        int fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            return;
+        }
+        if (l->m->max_conns > 0 && l->m->open >= l->m->max_conns) {
+            l->m->refused++;
+            close(fd);
+            continue;
+        }
+        c = calloc(1, sizeof(CONN));
+        if (c == NULL) {
+            perror("calloc");
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->kind = EP_CONN;
+        c->fd = fd;
+        c->m = l->m;
+        c->part_port = l->part_port;
+        c->state = ST_READ;
+        c->events = EPOLLIN;
+        c->heap_pos = -1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            perror("epoll_ctl");
+            close(fd);
+            free(c);
+            continue;
+        }
+        l->m->open++;
+        l->m->accepted++;
+    }
+}
+
+/**
+ * @brief wake the connections whose sleep is over
+ */
+static void run_timers(void)
+{
+    double now = now_sec();
+
+    while (heap_len > 0 && heap[0]->due <= now) {
+        CONN *c = heap[0];
+        heap_remove(c);
+        c->state = ST_SEND;
+        if (conn_send(c) != 0) {
+            conn_close(c);
+        }
+    }
+}
+
+/**
+ * @brief read a whole file into memory
+ * @return the malloc()ed contents, NULL if it cannot be read
+ */
+static U8 *read_file(const char *path, size_t *len)
+{
+    struct stat st;
+    U8 *buf;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        return NULL;
+    }
+    if (fstat(fileno(fp), &st) != 0 || (buf = malloc(st.st_size)) == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+    if (fread(buf, 1, st.st_size, fp) != (size_t)st.st_size) {
+        free(buf);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    *len = st.st_size;
+    return buf;
+}
+
+/**
+ * @brief Split dir/img.png into num_strips PNGs of consecutive rows, one
+ *        after the other in an unlinked file under tmp. The last strip takes
+ *        the rows left over.
+ * @return 0 on success, 1 if there is no such image, -1 on error
+ */
+static int load_image(const char *dir, const char *tmp, int img, int num_strips, PNG_WRITER *w)
+{
+    IMAGE *im = &images[img];
+    char path[512];
+    struct data_IHDR ihdr;
+    U8 *rows;
+    U64 row_bytes;
+    size_t len;
+    U8 *png;
+    U32 per;
+
+    snprintf(path, sizeof(path), "%s/%d.png", dir, img);
+    png = read_file(path, &len);
+    if (png == NULL) {
+        return 1;
+    }
+    if (framebuf_decode_png(png, len, &ihdr, &rows, &row_bytes) != 0) {
+        fprintf(stderr, "fragsrv: %s is not a PNG it can split\n", path);
+        free(png);
+        return -1;
+    }
+    free(png);
+    if (ihdr.height < (U32)num_strips) {
+        fprintf(stderr, "fragsrv: %s has fewer rows than %d strips\n", path, num_strips);
+        free(rows);
+        return -1;
+    }
+
+    im->strips = calloc(num_strips, sizeof(STRIP));
+    if (im->strips == NULL) {
+        perror("calloc");
+        free(rows);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%d.png", tmp, img);
+    im->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (im->fd < 0) {
+        perror("open");
+        free(rows);
+        return -1;
+    }
+    unlink(path); /* the fd keeps it */
+
+    per = ihdr.height / num_strips;
+    for (int k = 0; k < num_strips; k++) {
+        struct data_IHDR strip = ihdr;
+        off_t end;
+
+        strip.height = k < num_strips - 1 ? per : ihdr.height - per * (num_strips - 1);
+        if (png_writer_begin(w, im->fd, &strip) != 0 ||
+            png_writer_feed(w, rows + (U64)k * per * row_bytes, strip.height * row_bytes) != 0 ||
+            png_writer_finish(w) != 0 || (end = lseek(im->fd, 0, SEEK_CUR)) < 0) {
+            perror("write");
+            free(rows);
+            return -1;
+        }
+        im->strips[k].off = k > 0 ? im->strips[k - 1].off + im->strips[k - 1].size : 0;
+        im->strips[k].size = end - im->strips[k].off;
+    }
+    im->num_strips = num_strips;
+    free(rows);
+    return 0;
+}
+
+/**
+ * @brief Parse ADDR[,OPTION...] into the next mirror.
+ * @return 0 on success, -1 on a bad address or option
+ */
+static int parse_mirror(char *spec)
+{
+    char *save = NULL;
+    char *tok = strtok_r(spec, ",", &save);
+    VMIRROR *m;
+    struct in_addr a;
+
+    if (num_mirrors == MAX_MIRRORS || tok == NULL || inet_pton(AF_INET, tok, &a) != 1) {
+        return -1;
+    }
+    m = &mirrors[num_mirrors];
+    memset(m, 0, sizeof(*m));
+    snprintf(m->addr, sizeof(m->addr), "%s", tok);
+    m->part = 1;
+    while ((tok = strtok_r(NULL, ",", &save)) != NULL) {
+        double ms;
+        if (sscanf(tok, "delay=%lf", &ms) == 1) {
+            m->delay = ms / 1000.0;
+        } else if (sscanf(tok, "jitter=%lf", &ms) == 1) {
+            m->jitter = ms / 1000.0;
+        } else if (sscanf(tok, "tail=%lf:%lf", &m->tail_p, &ms) == 2) {
+            m->tail = ms / 1000.0;
+        } else if (sscanf(tok, "rate=%lf", &m->rate) == 1) {
+        } else if (sscanf(tok, "err=%lf", &m->err) == 1) {
+        } else if (sscanf(tok, "conns=%d", &m->max_conns) == 1) {
+        } else if (strcmp(tok, "nopart") == 0) {
+            m->part = 0;
+        } else {
+            return -1;
+        }
+    }
+    num_mirrors++;
+    return 0;
+}
+
+static int listen_on(VMIRROR *m, int port, int part_port)
+{
+    struct sockaddr_in sa;
+    struct epoll_event ev;
+    LISTENER *l;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    inet_pton(AF_INET, m->addr, &sa.sin_addr);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, LISTEN_BACKLOG) != 0) {
+        fprintf(stderr, "fragsrv: %s:%d: %s\n", m->addr, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    l = malloc(sizeof(LISTENER));
+    if (l == NULL) {
+        perror("malloc");
+        close(fd);
+        return -1;
+    }
+    l->kind = EP_LISTENER;
+    l->fd = fd;
+    l->m = m;
+    l->part_port = part_port;
+    ev.events = EPOLLIN;
+    ev.data.ptr = l;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("epoll_ctl");
+        close(fd);
+        free(l);
+        return -1;
+    }
+    return 0;
+}
+
+static void report(FILE *fp)
+{
+    for (int i = 0; i < num_mirrors; i++) {
+        VMIRROR *m = &mirrors[i];
+        fprintf(fp, "Mirror %s: %lu requests, %lu errors injected, %lu connections, "
+                    "%lu refused, %llu bytes sent\n",
+                m->addr, m->requests, m->errors, m->accepted, m->refused, m->bytes);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "starter/img";
+    int num_strips = NUM_FRAGMENTS;
+    int port = 2520;
+    int part_port = 2530;
+    char tmp[] = "/tmp/fragsrv.XXXXXX";
+    struct epoll_event events[MAX_EVENTS];
+    struct sigaction sa;
+    PNG_WRITER w;
+    int loaded = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:f:p:P:")) != -1) {
+        switch (c) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'f':
+            num_strips = atoi(optarg);
+            if (num_strips < 1 || num_strips > MAX_STRIPS) {
+                fprintf(stderr, "%s: option requires an argument 1 to %d -- 'f'\n", argv[0], MAX_STRIPS);
+                return 1;
+            }
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'P':
+            part_port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d IMG_DIR] [-f FRAGMENTS] [-p PORT] [-P PART_PORT] "
+                            "[ADDR[,OPTION...]...]\n", argv[0]);
+            return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (parse_mirror(argv[i]) != 0) {
+            fprintf(stderr, "%s: bad mirror %s\n", argv[0], argv[i]);
+            return 1;
+        }
+    }
+    if (num_mirrors == 0) {
+        char spec[] = "127.0.0.1";
+        parse_mirror(spec);
+    }
+
+    /* split every image once, the strips are only ever sent from now on */
+    if (mkdtemp(tmp) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    if (png_writer_init(&w, Z_DEFAULT_COMPRESSION, 0) != 0) {
+        rmdir(tmp);
+        return 1;
+    }
+    for (int img = 1; img <= FRAGSRV_IMAGES; img++) {
+        int ret = load_image(dir, tmp, img, num_strips, &w);
+        if (ret < 0) {
+            png_writer_free(&w);
+            rmdir(tmp);
+            return 1;
+        }
+        loaded += ret == 0;
+    }
+    png_writer_free(&w);
+    rmdir(tmp);
+    if (loaded == 0) {
+        fprintf(stderr, "%s: no images in %s\n", argv[0], dir);
+        return 1;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    for (int i = 0; i < num_mirrors; i++) {
+        if (listen_on(&mirrors[i], port, 0) != 0 || listen_on(&mirrors[i], part_port, 1) != 0) {
+            return 1;
+        }
+    }
+    rng_state ^= (unsigned long long)time(NULL) << 20 ^ getpid();
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal; /* no SA_RESTART, epoll_wait() must return */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN); /* sendfile() to a closed client */
+    fprintf(stderr, "fragsrv: %d images of %d strips, %d mirrors on :%d and :%d\n",
+            loaded, num_strips, num_mirrors, port, part_port);
+
+    while (!g_stop) {
+        int timeout = -1;
+        int n;
+
+        if (heap_len > 0) {
+            double wait = heap[0]->due - now_sec();
+            timeout = wait > 0 ? (int)(wait * 1000.0) + 1 : 0;
+        }
+        n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int *kind = events[i].data.ptr;
+            if (*kind == EP_LISTENER) {
+                accept_all(events[i].data.ptr);
+            } else {
+                conn_event(events[i].data.ptr, events[i].events);
+            }
+        }
+        run_timers();
+    }
+
+    report(stdout);
+    return 0;
+}
@@ -0,0 +1,258 @@
+/**
+ * @file framebuf.c
+ * @brief decode-on-arrival image buffer for paster, see framebuf.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "framebuf.h"
+#include "png_writer.h"
+
+static const U8 png_sig[PNG_SIG_SIZE] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+
+static U32 get_u32(const U8 *p)
+{
+    return (U32)p[0] << 24 | (U32)p[1] << 16 | (U32)p[2] << 8 | p[3];
+}
+
+/**
+ * @brief Number of bytes in one filtered scanline, including the filter byte.
+ */
+static U64 png_row_bytes(const struct data_IHDR *ihdr)
+{
+    int channels;
+    switch (ihdr->color_type) {
+    case 2:  channels = 3; break; // Truecolor
+    case 4:  channels = 2; break; // Greyscale with alpha
+    case 6:  channels = 4; break; // Truecolor with alpha
+    default: channels = 1; break; // Grayscale or indexed-color
+    }
+    return ((U64)ihdr->width * channels * ihdr->bit_depth + 7) / 8 + 1;
+}
+
+/**
+ * @brief Check the signature and read the IHDR of a PNG in memory.
+ * @return offset of the chunk after IHDR, 0 if png is not a PNG
+ */
+static size_t parse_head(const U8 *png, size_t len, struct data_IHDR *ihdr)
+{
+    const U8 *p = png + PNG_SIG_SIZE + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE;
+    size_t head = PNG_SIG_SIZE + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + DATA_IHDR_SIZE + CHUNK_CRC_SIZE;
+
+    if (len < head || memcmp(png, png_sig, PNG_SIG_SIZE) != 0 ||
+        get_u32(png + PNG_SIG_SIZE) != DATA_IHDR_SIZE ||
+        memcmp(png + PNG_SIG_SIZE + CHUNK_LEN_SIZE, "IHDR", CHUNK_TYPE_SIZE) != 0) {
+        return 0;
+    }
+    ihdr->width       = get_u32(p);
+    ihdr->height      = get_u32(p + 4);
+    ihdr->bit_depth   = p[8];
+    ihdr->color_type  = p[9];
+    ihdr->compression = p[10];
+    ihdr->filter      = p[11];
+    ihdr->interlace   = p[12];
+    if (ihdr->width == 0 || ihdr->height == 0 || ihdr->interlace != 0) {
+        return 0;
+    }
+    return head;
+}
+
+/**
+ * @brief Inflate the IDAT chunks of a PNG in memory into out, which must
+ *        end up exactly full.
+ * @param pos offset of the first chunk after IHDR
+ * @return 0 on success, -1 on a damaged or short image
+ */
+static int inflate_idats(const U8 *png, size_t len, size_t pos, U8 *out, U64 out_len)
+{
+    z_stream strm;
+    int ret = Z_OK;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit(&strm) != Z_OK) {
+        return -1;
+    }
+    strm.next_out = out;
+    strm.avail_out = out_len;
+
+    while (ret == Z_OK && pos + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE <= len) {
+        U32 length = get_u32(png + pos);
+        const U8 *type = png + pos + CHUNK_LEN_SIZE;
+        const U8 *data = type + CHUNK_TYPE_SIZE;
+
+        if (length > len - pos - CHUNK_LEN_SIZE - CHUNK_TYPE_SIZE - CHUNK_CRC_SIZE) {
+            break; /* truncated */
+        }
+        if (memcmp(type, "IEND", CHUNK_TYPE_SIZE) == 0) {
+            break;
+        }
+        if (memcmp(type, "IDAT", CHUNK_TYPE_SIZE) == 0) {
+            strm.next_in = (U8 *)data;
+            strm.avail_in = length;
+            ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret == Z_OK && strm.avail_out == 0 && strm.avail_in > 0) {
+                ret = Z_DATA_ERROR; /* more rows than the header says */
+            }
+        }
+        pos += CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + length + CHUNK_CRC_SIZE;
+    }
+    (void) inflateEnd(&strm);
+    return ret == Z_STREAM_END && strm.avail_out == 0 ? 0 : -1;
+}
+
+int framebuf_decode_png(const U8 *png, size_t len, struct data_IHDR *ihdr,
+                        U8 **rows, U64 *row_bytes)
+{
+    size_t pos = parse_head(png, len, ihdr);
+    U8 *p;
+
+    if (pos == 0) {
+        return -1;
+    }
+    *row_bytes = png_row_bytes(ihdr);
+    p = malloc(*row_bytes * ihdr->height);
+    if (p == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (inflate_idats(png, len, pos, p, *row_bytes * ihdr->height) != 0) {
+        free(p);
+        return -1;
+    }
+    *rows = p;
+    return 0;
+}
+
+int framebuf_init(FRAMEBUF *fb, int num_slots)
+{
+    memset(fb, 0, sizeof(*fb));
+    fb->slots = calloc(num_slots, sizeof(U8 *));
+    fb->heights = calloc(num_slots, sizeof(U32));
+    if (fb->slots == NULL || fb->heights == NULL) {
+        perror("calloc");
+        free(fb->slots);
+        free(fb->heights);
+        return -1;
+    }
+    fb->num_slots = num_slots;
+    if (pthread_mutex_init(&fb->lock, NULL) != 0) {
+        free(fb->slots);
+        free(fb->heights);
+        return -1;
+    }
+    return 0;
+}
+
+int framebuf_put(FRAMEBUF *fb, int seq, const U8 *png, size_t len)
+{
+    struct data_IHDR ihdr;
+    size_t pos;
+    U8 *slot;
+
+    if (seq < 0 || seq >= fb->num_slots) {
+        return -1;
+    }
+    pos = parse_head(png, len, &ihdr);
+    if (pos == 0) {
+        fprintf(stderr, "\nfragment %d is not a PNG\n", seq);
+        return -1;
+    }
+
+    /* the first fragment sets the geometry the others have to match */
+    pthread_mutex_lock(&fb->lock);
+    if (!fb->ready) {
+        fb->ihdr = ihdr;
+        fb->row_bytes = png_row_bytes(&ihdr);
+        fb->ready = 1;
+    }
+    int fits = ihdr.width == fb->ihdr.width && ihdr.bit_depth == fb->ihdr.bit_depth &&
+               ihdr.color_type == fb->ihdr.color_type;
+    pthread_mutex_unlock(&fb->lock);
+
+    if (!fits) {
+        fprintf(stderr, "\nfragment %d does not match the others\n", seq);
+        return -1;
+    }
+    slot = malloc(ihdr.height * fb->row_bytes);
+    if (slot == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (inflate_idats(png, len, pos, slot, ihdr.height * fb->row_bytes) != 0) {
+        fprintf(stderr, "\nfragment %d has damaged image data\n", seq);
+        free(slot);
+        return -1;
+    }
+
+    pthread_mutex_lock(&fb->lock);
+    fb->slots[seq] = slot;
+    fb->heights[seq] = ihdr.height;
+    pthread_mutex_unlock(&fb->lock);
+    return 0;
+}
+
+int framebuf_write_png(FRAMEBUF *fb, const char *path)
+{
+    struct data_IHDR ihdr;
+    PNG_WRITER w;
+    int fd;
+    int ret = 0;
+
+    pthread_mutex_lock(&fb->lock);
+    if (!fb->ready) {
+        pthread_mutex_unlock(&fb->lock);
+        fprintf(stderr, "framebuf_write_png: no fragments\n");
+        return -1;
+    }
+    ihdr = fb->ihdr;
+    ihdr.height = 0;
+    for (int i = 0; i < fb->num_slots; i++) {
+        ihdr.height += fb->heights[i];
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        pthread_mutex_unlock(&fb->lock);
+        return -1;
+    }
+    if (png_writer_open(&w, fd, &ihdr, Z_DEFAULT_COMPRESSION, 0) != 0) {
+        ret = -1;
+    }
+    for (int i = 0; i < fb->num_slots && ret == 0; i++) {
+        if (fb->heights[i] > 0) {
+            ret = png_writer_feed(&w, fb->slots[i], fb->heights[i] * fb->row_bytes);
+        }
+    }
+    if (ret == 0) {
+        ret = png_writer_close(&w);
+    } else if (w.bufs != NULL) {
+        png_writer_free(&w);
+    }
+    if (ret != 0) {
+        perror("write");
+    }
+    if (close(fd) != 0 && ret == 0) {
+        perror("close");
+        ret = -1;
+    }
+    pthread_mutex_unlock(&fb->lock);
+    return ret;
+}
+
+void framebuf_free(FRAMEBUF *fb)
+{
+    for (int i = 0; i < fb->num_slots; i++) {
+        free(fb->slots[i]);
+    }
+    free(fb->slots);
+    free(fb->heights);
+    fb->slots = NULL;
+    fb->heights = NULL;
+    fb->num_slots = 0;
+    fb->ready = 0;
+    pthread_mutex_destroy(&fb->lock);
+}
@@ -0,0 +1,73 @@
+/**
+ * @file framebuf.h
+ * @brief the final image held in memory while its fragments arrive.
+ *
+ * Each fragment is inflated straight from the receive buffer into its own
+ * slot of filtered scanlines, so a fragment is neither written to disk nor
+ * read a second time. A slot is allocated for the rows of its fragment when
+ * it arrives, so the fragments need not be of the same height and an image
+ * of thousands of fragments costs no more than its pixels. Fragments land
+ * in disjoint slots and can be decoded by several threads at once; only the
+ * first one, which sets the geometry, takes the lock for longer than a few
+ * instructions.
+ *
+ * Once every fragment is in, framebuf_write_png() deflates the slots in
+ * order into all.png.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include "lab_png.h"
+#include "zutil.h"
+#include "paster.h"
+
+typedef struct framebuf {
+    pthread_mutex_t lock;
+    int ready;                   /* geometry known                           */
+    struct data_IHDR ihdr;       /* of the first fragment, host byte order   */
+    U64 row_bytes;               /* one filtered scanline with filter byte   */
+    int num_slots;               /* one per fragment                         */
+    U8 **slots;                  /* rows of each fragment, NULL if none      */
+    U32 *heights;                /* rows decoded into each slot, 0 if none   */
+} FRAMEBUF;
+
+/**
+ * @brief Initialize an empty frame buffer of num_slots fragments. The rows
+ *        of a slot are allocated when its fragment arrives.
+ * @return 0 on success, non-zero on error
+ */
+int framebuf_init(FRAMEBUF *fb, int num_slots);
+
+/**
+ * @brief Inflate a PNG fragment held in memory into slot seq. Fragments must
+ *        match the first one in width and pixel format, their heights may
+ *        differ. Different slots may be filled concurrently; the caller
+ *        makes sure a slot is filled only once.
+ * @param seq fragment number, 0 to num_slots - 1
+ * @param png the fragment as received
+ * @param len bytes in png
+ * @return 0 on success, -1 if the fragment is not a usable PNG
+ */
+int framebuf_put(FRAMEBUF *fb, int seq, const U8 *png, size_t len);
+
+/**
+ * @brief Write the slots in order as one PNG to path.
+ * @return 0 on success, non-zero on error
+ */
+int framebuf_write_png(FRAMEBUF *fb, const char *path);
+
+/**
+ * @brief Release the slots of a frame buffer.
+ */
+void framebuf_free(FRAMEBUF *fb);
+
+/**
+ * @brief Inflate a whole PNG held in memory into its filtered scanlines.
+ * @param ihdr receives the image header, host byte order
+ * @param rows receives a malloc()ed buffer of ihdr->height rows, to be freed
+ * @param row_bytes receives the size of one row, filter byte included
+ * @return 0 on success, -1 if png is not a PNG or its image data is damaged
+ */
+int framebuf_decode_png(const U8 *png, size_t len, struct data_IHDR *ihdr,
+                        U8 **rows, U64 *row_bytes);
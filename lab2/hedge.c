@@ -0,0 +1,141 @@
+/**
+ * @file hedge.c
+ * @brief request latency percentiles and hedging budget, see hedge.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hedge.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int pctl;
+static int budget;
+
+static double window[HEDGE_WINDOW];  /* ring of the latest latencies       */
+static int window_len;
+static int window_pos;
+static double delay = -1.0;          /* hedge delay for the current window */
+
+static double *samples;              /* every latency, for the report      */
+static int num_samples;
+static int max_samples;
+
+static int num_hedges;
+static int num_won;
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief nearest-rank percentile p of n values, sorted in place
+ */
+static double percentile(double *v, int n, double p)
+{
+    int rank;
+
+    qsort(v, n, sizeof(double), cmp_double);
+    rank = (int)(p / 100.0 * n + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return v[rank > n ? n - 1 : rank - 1];
+}
+
+void hedge_init(int p, int b)
+{
+    pthread_mutex_lock(&lock);
+    pctl = p;
+    budget = b;
+    window_len = window_pos = 0;
+    delay = -1.0;
+    num_samples = 0;
+    num_hedges = num_won = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+void hedge_record(double seconds)
+{
+    pthread_mutex_lock(&lock);
+    if (num_samples == max_samples) {
+        int n = max_samples > 0 ? 2 * max_samples : 256;
+        double *q = realloc(samples, n * sizeof(double));
+        if (q != NULL) {
+            samples = q;
+            max_samples = n;
+        }
+    }
+    if (num_samples < max_samples) {
+        samples[num_samples++] = seconds;
+    }
+
+    window[window_pos] = seconds;
+    window_pos = (window_pos + 1) % HEDGE_WINDOW;
+    if (window_len < HEDGE_WINDOW) {
+        window_len++;
+    }
+    if (pctl > 0 && window_len >= HEDGE_MIN_SAMPLES) {
+        double sorted[HEDGE_WINDOW];
+        memcpy(sorted, window, window_len * sizeof(double));
+        delay = percentile(sorted, window_len, pctl);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+double hedge_delay(void)
+{
+    pthread_mutex_lock(&lock);
+    double d = delay;
+    pthread_mutex_unlock(&lock);
+    return d;
+}
+
+int hedge_room(int requests)
+{
+    int ok;
+
+    pthread_mutex_lock(&lock);
+    ok = (num_hedges + 1) * 100 <= budget * requests;
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+void hedge_sent(void)
+{
+    pthread_mutex_lock(&lock);
+    num_hedges++;
+    pthread_mutex_unlock(&lock);
+}
+
+void hedge_won(void)
+{
+    pthread_mutex_lock(&lock);
+    num_won++;
+    pthread_mutex_unlock(&lock);
+}
+
+void hedge_report(FILE *fp)
+{
+    pthread_mutex_lock(&lock);
+    if (num_samples > 0) {
+        double *v = malloc(num_samples * sizeof(double));
+        if (v != NULL) {
+            memcpy(v, samples, num_samples * sizeof(double));
+            fprintf(fp, "Request latency over %d requests: p50 %.1f ms, p99 %.1f ms, p99.9 %.1f ms\n",
+                    num_samples, percentile(v, num_samples, 50.0) * 1000.0,
+                    percentile(v, num_samples, 99.0) * 1000.0,
+                    percentile(v, num_samples, 99.9) * 1000.0);
+            free(v);
+        }
+    }
+    if (pctl > 0) {
+        fprintf(fp, "Hedging after p%d: %d hedges sent, %d answered first\n", pctl, num_hedges, num_won);
+    } else {
+        fprintf(fp, "Hedging off\n");
+    }
+    pthread_mutex_unlock(&lock);
+}
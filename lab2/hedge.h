@@ -0,0 +1,69 @@
+/**
+ * @file hedge.h
+ * @brief request latency bookkeeping and the hedging policy of paster.
+ *
+ * A few slow responses decide when the last fragment comes in. Once a
+ * targeted request has been outstanding for longer than the -p percentile
+ * of recently observed latencies, the multi engine sends the same request
+ * to a different mirror, keeps whichever answer arrives first and cancels
+ * the other. Hedges are capped at -b percent of the requests issued, so a
+ * mirror that is slow across the board does not double the load.
+ *
+ * Every completed request's latency is kept for the p50/p99/p99.9 report.
+ * A hedged request counts once, from when the first copy was sent.
+ *
+ * All functions are thread safe.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+#define HEDGE_WINDOW      100 /* recent latencies the delay is taken from  */
+#define HEDGE_MIN_SAMPLES 10  /* no hedging before this many are in        */
+#define HEDGE_PCTL_DEFAULT 95
+#define HEDGE_BUDGET_DEFAULT 10
+
+/**
+ * @brief Set the policy and forget all samples.
+ * @param pctl percentile of recent latency after which a request is
+ *        hedged, 0 disables hedging
+ * @param budget hedges allowed per 100 requests issued
+ */
+void hedge_init(int pctl, int budget);
+
+/**
+ * @brief Record the latency of a completed request, in seconds.
+ */
+void hedge_record(double seconds);
+
+/**
+ * @brief Seconds a request may be outstanding before it is hedged.
+ * @return the delay, or a negative value while hedging is off or there are
+ *         too few samples to tell
+ */
+double hedge_delay(void);
+
+/**
+ * @brief Tell whether the budget has room for one more hedge.
+ * @param requests requests issued so far, hedges included
+ * @return 1 if a hedge may be sent, 0 if the budget is used up
+ */
+int hedge_room(int requests);
+
+/**
+ * @brief Count a hedge that was sent against the budget. Only call it once
+ *        the hedge is on its way, a hedge that could not be made costs
+ *        nothing.
+ */
+void hedge_sent(void);
+
+/**
+ * @brief Count a hedge that answered before the request it duplicated.
+ */
+void hedge_won(void);
+
+/**
+ * @brief Print the p50, p99 and p99.9 request latency and the hedges sent.
+ */
+void hedge_report(FILE *fp);
@@ -0,0 +1,371 @@
+/**
+ * @file metrics.c
+ * @brief per-thread transfer counters and latency histograms, see metrics.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "mirror.h"
+#include "metrics.h"
+
+#define HALF_BUCKETS (METRICS_SUB_BUCKETS / 2)
+#define HIST_BUCKETS (HALF_BUCKETS * 21) /* 128 exact, then 64 per power of two to 2^26 */
+
+enum { T_DNS, T_CONNECT, T_TTFB, T_TOTAL, NUM_TIMES };
+
+static const char *time_names[NUM_TIMES] = { "dns", "connect", "ttfb", "total" };
+static const char *outcome_names[] = { "new", "dup", "failed", "cancelled" };
+
+typedef struct histogram {
+    atomic_uint buckets[HIST_BUCKETS];
+    atomic_ullong n;
+    atomic_llong max;       /* us */
+} HISTOGRAM;
+
+typedef struct mirror_metrics {
+    atomic_ullong requests;
+    atomic_ullong outcomes[METRICS_CANCELLED + 1];
+    atomic_ullong bytes;    /* headers and body */
+    atomic_int in_flight;
+    HISTOGRAM times[NUM_TIMES];
+} MIRROR_METRICS;
+
+struct metrics_shard {
+    struct metrics_shard *next;
+    MIRROR_METRICS mirrors[]; /* num_mirrors of them */
+};
+
+/* a histogram summed over the shards, by the reader */
+typedef struct summed {
+    unsigned long long buckets[HIST_BUCKETS];
+    unsigned long long n;
+    long long max;
+} SUMMED;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static METRICS_SHARD *shards;  /* under lock, only ever prepended to */
+static int num_mirrors;
+static FILE *out;
+static int interval_ms;
+static struct timespec start_ts;
+static double last_dump;
+static SUMMED scratch[NUM_TIMES]; /* under lock */
+
+static double since_start(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - start_ts.tv_sec) + (ts.tv_nsec - start_ts.tv_nsec) / 1e9;
+}
+
+/**
+ * @brief bucket of a value in us
+ */
+static int bucket_of(long long us)
+{
+    int shift;
+
+    if (us < METRICS_SUB_BUCKETS) {
+        return us < 0 ? 0 : (int)us;
+    }
+    if (us >= METRICS_MAX_US) {
+        us = METRICS_MAX_US - 1;
+    }
+    /* the top 7 bits of us pick the bucket, 64 to 127 after the shift */
+    shift = 63 - __builtin_clzll((unsigned long long)us) - 6;
+    return HALF_BUCKETS * shift + (int)(us >> shift);
+}
+
+/**
+ * @brief middle of the values counted in bucket b, in us
+ */
+static double bucket_value(int b)
+{
+    int shift;
+
+    if (b < METRICS_SUB_BUCKETS) {
+        return b;
+    }
+    shift = b / HALF_BUCKETS - 1;
+    return (double)((long long)(b - HALF_BUCKETS * shift) << shift) + ((1LL << shift) - 1) / 2.0;
+}
+
+static void record(HISTOGRAM *h, long long us)
+{
+    /* only the owning thread writes, relaxed is enough for the reader */
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->n, 1, memory_order_relaxed);
+    if (us > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, us, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief smallest bucket value with at least p percent of the samples at
+ *        or below it
+ */
+static double percentile(const SUMMED *h, double p)
+{
+    unsigned long long rank = (unsigned long long)(p / 100.0 * h->n + 0.999999);
+    unsigned long long seen = 0;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            double v = bucket_value(b);
+            return v < h->max ? v : h->max; /* never above what was seen */
+        }
+    }
+    return h->max;
+}
+
+void metrics_init(FILE *fp, int interval)
+{
+    pthread_mutex_lock(&lock);
+    num_mirrors = mirror_count();
+    out = fp;
+    interval_ms = interval;
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+    last_dump = 0.0;
+    pthread_mutex_unlock(&lock);
+}
+
+METRICS_SHARD *metrics_shard(void)
+{
+    METRICS_SHARD *s = calloc(1, sizeof(METRICS_SHARD) + num_mirrors * sizeof(MIRROR_METRICS));
+
+    if (s == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    pthread_mutex_lock(&lock);
+    s->next = shards;
+    shards = s;
+    pthread_mutex_unlock(&lock);
+    return s;
+}
+
+void metrics_start(METRICS_SHARD *s, int m)
+{
+    if (s == NULL || m < 0 || m >= num_mirrors) {
+        return;
+    }
+    atomic_fetch_add_explicit(&s->mirrors[m].requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->mirrors[m].in_flight, 1, memory_order_relaxed);
+}
+
+void metrics_end(METRICS_SHARD *s, int m, CURL *easy, METRICS_OUTCOME outcome)
+{
+    MIRROR_METRICS *mm;
+
+    if (s == NULL || m < 0 || m >= num_mirrors) {
+        return;
+    }
+    mm = &s->mirrors[m];
+    atomic_fetch_sub_explicit(&mm->in_flight, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mm->outcomes[outcome], 1, memory_order_relaxed);
+    if (easy == NULL) {
+        return;
+    }
+
+    curl_off_t body = 0;
+    long head = 0;
+    curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &body);
+    curl_easy_getinfo(easy, CURLINFO_HEADER_SIZE, &head);
+    atomic_fetch_add_explicit(&mm->bytes, (unsigned long long)body + head, memory_order_relaxed);
+
+    // How long a transfer that was cut short took says nothing about the mirror
+    if (outcome == METRICS_CANCELLED) {
+        return;
+    }
+    curl_off_t dns = 0, connect = 0, ttfb = 0, total = 0;
+    long opened = 0;
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &opened);
+    curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+    curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total);
+    if (opened > 0) {
+        record(&mm->times[T_DNS], dns);
+        record(&mm->times[T_CONNECT], connect);
+    }
+    if (ttfb > 0) {
+        record(&mm->times[T_TTFB], ttfb);
+    }
+    record(&mm->times[T_TOTAL], total);
+}
+
+void metrics_remote(METRICS_SHARD *s, int m, METRICS_OUTCOME outcome, size_t bytes, long long micros)
+{
+    MIRROR_METRICS *mm;
+
+    if (s == NULL || m < 0 || m >= num_mirrors) {
+        return;
+    }
+    mm = &s->mirrors[m];
+    atomic_fetch_sub_explicit(&mm->in_flight, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mm->outcomes[outcome], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mm->bytes, bytes, memory_order_relaxed);
+    if (outcome != METRICS_CANCELLED) {
+        record(&mm->times[T_TOTAL], micros);
+    }
+}
+
+/**
+ * @brief sum histogram t of mirror m over the shards into scratch[t].
+ *        Called with the lock held.
+ */
+static void sum_times(int m, int t)
+{
+    SUMMED *h = &scratch[t];
+
+    memset(h, 0, sizeof(*h));
+    for (METRICS_SHARD *s = shards; s != NULL; s = s->next) {
+        const HISTOGRAM *src = &s->mirrors[m].times[t];
+        long long max = atomic_load_explicit(&src->max, memory_order_relaxed);
+        if (atomic_load_explicit(&src->n, memory_order_relaxed) == 0) {
+            continue;
+        }
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            h->buckets[b] += atomic_load_explicit(&src->buckets[b], memory_order_relaxed);
+        }
+        if (max > h->max) {
+            h->max = max;
+        }
+    }
+    // The total of the buckets read, which a concurrent record() may be ahead of
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        h->n += h->buckets[b];
+    }
+}
+
+/**
+ * @brief sum counter field, at offset off in MIRROR_METRICS, of mirror m
+ *        over the shards. Called with the lock held.
+ */
+static unsigned long long sum_counter(int m, size_t off)
+{
+    unsigned long long v = 0;
+
+    for (METRICS_SHARD *s = shards; s != NULL; s = s->next) {
+        v += atomic_load_explicit((atomic_ullong *)((char *)&s->mirrors[m] + off), memory_order_relaxed);
+    }
+    return v;
+}
+
+static int sum_in_flight(int m)
+{
+    int v = 0;
+
+    for (METRICS_SHARD *s = shards; s != NULL; s = s->next) {
+        v += atomic_load_explicit(&s->mirrors[m].in_flight, memory_order_relaxed);
+    }
+    return v;
+}
+
+/**
+ * @brief write one JSON line of everything so far. Called with the lock held.
+ */
+static void dump(int final)
+{
+    fprintf(out, "{\"t\":%.3f,%s\"mirrors\":[", since_start(), final ? "\"final\":true," : "");
+    for (int m = 0; m < num_mirrors; m++) {
+        fprintf(out, "%s{\"host\":\"%s\",\"requests\":%llu", m > 0 ? "," : "", mirror_host(m),
+                sum_counter(m, offsetof(MIRROR_METRICS, requests)));
+        for (int o = 0; o <= METRICS_CANCELLED; o++) {
+            fprintf(out, ",\"%s\":%llu", outcome_names[o],
+                    sum_counter(m, offsetof(MIRROR_METRICS, outcomes) + o * sizeof(atomic_ullong)));
+        }
+        fprintf(out, ",\"in_flight\":%d,\"bytes\":%llu", sum_in_flight(m),
+                sum_counter(m, offsetof(MIRROR_METRICS, bytes)));
+        for (int t = 0; t < NUM_TIMES; t++) {
+            SUMMED *h = &scratch[t];
+            sum_times(m, t);
+            fprintf(out, ",\"%s_ms\":{\"n\":%llu", time_names[t], h->n);
+            if (h->n > 0) {
+                fprintf(out, ",\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f",
+                        percentile(h, 50.0) / 1000.0, percentile(h, 90.0) / 1000.0,
+                        percentile(h, 99.0) / 1000.0, h->max / 1000.0);
+            }
+            fputc('}', out);
+        }
+        fputc('}', out);
+    }
+    fputs("]}\n", out);
+    fflush(out);
+}
+
+void metrics_tick(void)
+{
+    pthread_mutex_lock(&lock);
+    if (out != NULL) {
+        double now = since_start();
+        if ((now - last_dump) * 1000.0 >= interval_ms) {
+            dump(0);
+            last_dump = now;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void metrics_dump(void)
+{
+    pthread_mutex_lock(&lock);
+    if (out != NULL) {
+        dump(1);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void metrics_report(FILE *fp)
+{
+    pthread_mutex_lock(&lock);
+    for (int m = 0; m < num_mirrors; m++) {
+        unsigned long long requests = sum_counter(m, offsetof(MIRROR_METRICS, requests));
+        if (requests == 0) {
+            continue;
+        }
+        fprintf(fp, "Metrics %s: %llu requests, %llu new, %llu dup, %llu failed, %llu cancelled, %llu bytes\n",
+                mirror_host(m), requests,
+                sum_counter(m, offsetof(MIRROR_METRICS, outcomes) + METRICS_NEW * sizeof(atomic_ullong)),
+                sum_counter(m, offsetof(MIRROR_METRICS, outcomes) + METRICS_DUP * sizeof(atomic_ullong)),
+                sum_counter(m, offsetof(MIRROR_METRICS, outcomes) + METRICS_FAILED * sizeof(atomic_ullong)),
+                sum_counter(m, offsetof(MIRROR_METRICS, outcomes) + METRICS_CANCELLED * sizeof(atomic_ullong)),
+                sum_counter(m, offsetof(MIRROR_METRICS, bytes)));
+        fprintf(fp, "  ");
+        for (int t = 0; t < NUM_TIMES; t++) {
+            SUMMED *h = &scratch[t];
+            sum_times(m, t);
+            if (h->n == 0) {
+                fprintf(fp, "%s%s -", t > 0 ? ", " : "", time_names[t]);
+                continue;
+            }
+            fprintf(fp, "%s%s p50 %.1f p99 %.1f ms", t > 0 ? ", " : "", time_names[t],
+                    percentile(h, 50.0) / 1000.0, percentile(h, 99.0) / 1000.0);
+        }
+        fputc('\n', fp);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void metrics_cleanup(void)
+{
+    pthread_mutex_lock(&lock);
+    while (shards != NULL) {
+        METRICS_SHARD *s = shards;
+        shards = s->next;
+        free(s);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,99 @@
+/**
+ * @file metrics.h
+ * @brief live per-mirror metrics of a paster run.
+ *
+ * Every thread that runs transfers owns a shard: per mirror, counters of
+ * the requests it sent, how they ended, the bytes they brought in and how
+ * many are in flight, and HDR style histograms of the DNS, connect, time
+ * to first byte and total time curl reports for each transfer. A shard is
+ * only written by its thread, with relaxed atomics, so recording takes no
+ * lock and shares no cache line with another thread.
+ *
+ * The histograms are log-linear: exact below METRICS_SUB_BUCKETS us, then
+ * METRICS_SUB_BUCKETS / 2 buckets per power of two, so any value is known
+ * to within 1/64 of itself up to METRICS_MAX_US.
+ *
+ * metrics_dump() sums the shards into one JSON line, everything counted
+ * since the start:
+ *
+ *     {"t":1.503,"mirrors":[{"host":"ece252-1.uwaterloo.ca","requests":40,
+ *      "new":35,"dup":3,"failed":2,"cancelled":0,"in_flight":2,
+ *      "bytes":297145,"dns_ms":{"n":4,"p50":0.1,"p90":0.1,"p99":0.1,
+ *      "max":0.1},"connect_ms":{...},"ttfb_ms":{...},"total_ms":{...}},...]}
+ *
+ * DNS and connect are only sampled by transfers that opened a connection.
+ * Like curl's, the times run from the start of the transfer, so connect
+ * includes DNS and time to first byte includes both.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <curl/curl.h>
+
+#define METRICS_SUB_BUCKETS 128   /* exact values below this, in us           */
+#define METRICS_MAX_US (1LL << 26) /* about 67 s, longer times are counted here */
+#define METRICS_INTERVAL_MS 1000  /* default for -i                           */
+
+typedef enum metrics_outcome {
+    METRICS_NEW,       /* brought a fragment we did not have       */
+    METRICS_DUP,       /* a fragment we had, perhaps cut at the header */
+    METRICS_FAILED,    /* an error, or nothing usable              */
+    METRICS_CANCELLED, /* not needed any more, see mirror_cancel() */
+} METRICS_OUTCOME;
+
+typedef struct metrics_shard METRICS_SHARD;
+
+/**
+ * @brief Size the metrics for the mirrors of mirror_count(), and have
+ *        metrics_tick() write a line to fp every interval_ms.
+ * @param fp where the JSON lines go, NULL for none
+ */
+void metrics_init(FILE *fp, int interval_ms);
+
+/**
+ * @brief A new shard for the calling thread, kept until metrics_cleanup().
+ * @return the shard, NULL if out of memory
+ */
+METRICS_SHARD *metrics_shard(void);
+
+/**
+ * @brief Count a request sent to mirror m as in flight. NULL shards are
+ *        ignored by this and metrics_end().
+ */
+void metrics_start(METRICS_SHARD *s, int m);
+
+/**
+ * @brief Count how the request to mirror m ended, and sample its times and
+ *        size from easy, which may be NULL for a cancelled one.
+ */
+void metrics_end(METRICS_SHARD *s, int m, CURL *easy, METRICS_OUTCOME outcome);
+
+/**
+ * @brief metrics_end() for a request a worker ran, see coord.h, which
+ *        only reports the size of the fragment and the total time.
+ */
+void metrics_remote(METRICS_SHARD *s, int m, METRICS_OUTCOME outcome, size_t bytes, long long micros);
+
+/**
+ * @brief Write one JSON line to the file of metrics_init(), if the
+ *        interval has passed since the last one. Called by the progress
+ *        thread.
+ */
+void metrics_tick(void);
+
+/**
+ * @brief Write the closing JSON line, with "final":true, to the file of
+ *        metrics_init().
+ */
+void metrics_dump(void);
+
+/**
+ * @brief Print the counts and the p50/p99 of each time, per mirror.
+ */
+void metrics_report(FILE *fp);
+
+/**
+ * @brief Free every shard.
+ */
+void metrics_cleanup(void);
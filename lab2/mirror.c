@@ -0,0 +1,302 @@
+/**
+ * @file mirror.c
+ * @brief latency aware mirror selection for paster, see mirror.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mirror.h"
+
+#define EWMA_ALPHA  0.3    /* weight of the newest sample                  */
+#define LATENCY_MIN 0.001  /* seconds, floor for mirrors not measured yet  */
+#define SUCCESS_MIN 0.01   /* keeps the score finite at 100% errors        */
+#define FAILURE_SEC 1.0    /* latency a failed transfer counts as, at least */
+
+enum { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+typedef struct mirror {
+    char host[MIRROR_HOST_LEN];
+    double latency;      /* EWMA of transfer time, seconds               */
+    double error_rate;   /* EWMA of failures, 0 to 1                     */
+    int outstanding;     /* requests sent and not finished               */
+    double sent_sum;     /* when they were sent, summed                  */
+    int requests;
+    int failures;
+    int streak;          /* failures in a row                            */
+    int breaker;         /* BREAKER_CLOSED, _OPEN or _HALF_OPEN          */
+    double reopen;       /* when an open breaker goes half open          */
+    int trial;           /* the half open trial request is out           */
+    int tripped;         /* trips since the breaker was last closed      */
+    int trips;
+} MIRROR;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static MIRROR mirrors[MIRROR_MAX];
+static int num_mirrors;
+static unsigned int seed;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief a uniformly distributed number in [0, 1). Called with the lock held.
+ */
+static double rand01(void)
+{
+    if (seed == 0) {
+        seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    }
+    return rand_r(&seed) / ((double)RAND_MAX + 1.0);
+}
+
+int mirror_parse(const char *list)
+{
+    MIRROR parsed[MIRROR_MAX];
+    int n = 0;
+    const char *p = list;
+
+    memset(parsed, 0, sizeof(parsed));
+    while (1) {
+        size_t len = strcspn(p, ",");
+        if (len == 0 || len >= MIRROR_HOST_LEN || n == MIRROR_MAX) {
+            return -1;
+        }
+        memcpy(parsed[n].host, p, len);
+        n++;
+        if (p[len] == '\0') {
+            break;
+        }
+        p += len + 1;
+    }
+
+    pthread_mutex_lock(&lock);
+    memcpy(mirrors, parsed, sizeof(parsed));
+    num_mirrors = n;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int mirror_count(void)
+{
+    pthread_mutex_lock(&lock);
+    int n = num_mirrors;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+const char *mirror_host(int m)
+{
+    /* the list does not change while requests are running */
+    return mirrors[m].host;
+}
+
+/**
+ * @brief expected wait for one more request at mirror m, lower is better
+ */
+static double score(const MIRROR *m, double now)
+{
+    double latency = m->latency > LATENCY_MIN ? m->latency : LATENCY_MIN;
+    double success = 1.0 - m->error_rate;
+
+    // Requests that have been out longer than it takes say it takes longer
+    if (m->outstanding > 0 && now - m->sent_sum / m->outstanding > latency) {
+        latency = now - m->sent_sum / m->outstanding;
+    }
+
+    if (success < SUCCESS_MIN) {
+        success = SUCCESS_MIN;
+    }
+    return latency * (m->outstanding + 1) / success;
+}
+
+/**
+ * @brief whether m may be sent a request now, moving an open breaker whose
+ *        cooldown is over to half open. Called with the lock held.
+ */
+static int available(MIRROR *m, double now)
+{
+    if (m->breaker == BREAKER_OPEN && now >= m->reopen) {
+        m->breaker = BREAKER_HALF_OPEN;
+        m->trial = 0;
+    }
+    return m->breaker == BREAKER_CLOSED || (m->breaker == BREAKER_HALF_OPEN && !m->trial);
+}
+
+/**
+ * @brief open the breaker of m for a jittered cooldown, twice as long as
+ *        the last one if it never closed in between. Called with the lock held.
+ */
+static void trip(MIRROR *m)
+{
+    double cooldown = BREAKER_COOLDOWN;
+
+    for (int i = 0; i < m->tripped && cooldown < BREAKER_COOLDOWN_MAX; i++) {
+        cooldown *= 2;
+    }
+    if (cooldown > BREAKER_COOLDOWN_MAX) {
+        cooldown = BREAKER_COOLDOWN_MAX;
+    }
+    m->breaker = BREAKER_OPEN;
+    m->reopen = now_sec() + cooldown * (0.5 + 0.5 * rand01());
+    m->trial = 0;
+    m->tripped++;
+    m->trips++;
+}
+
+/**
+ * @brief one request sent seconds ago to m is no longer outstanding.
+ *        Called with the lock held.
+ */
+static void finish(MIRROR *m, double seconds)
+{
+    if (--m->outstanding <= 0) {
+        m->outstanding = 0;
+        m->sent_sum = 0.0; /* no rounding left over */
+    } else {
+        m->sent_sum -= now_sec() - seconds;
+    }
+}
+
+/**
+ * @brief power of two choices among the mirrors other than exclude whose
+ *        breakers let a request through, and count the request there.
+ *        Called with the lock held.
+ * @return index of the mirror, -1 if there is none
+ */
+static int pick(int exclude)
+{
+    int candidates[MIRROR_MAX];
+    double now = now_sec();
+    int n = 0;
+    int a, b;
+
+    for (int i = 0; i < num_mirrors; i++) {
+        if (i != exclude && available(&mirrors[i], now)) {
+            candidates[n++] = i;
+        }
+    }
+    if (n < 1) {
+        return -1;
+    }
+    a = (int)(rand01() * n);
+    if (n > 1) {
+        b = (int)(rand01() * (n - 1));
+        if (b >= a) {
+            b++; /* two different mirrors */
+        }
+        if (score(&mirrors[candidates[b]], now) < score(&mirrors[candidates[a]], now)) {
+            a = b;
+        }
+    }
+    a = candidates[a];
+    if (mirrors[a].breaker == BREAKER_HALF_OPEN) {
+        mirrors[a].trial = 1; /* the only one until it is answered */
+    }
+    mirrors[a].outstanding++;
+    mirrors[a].sent_sum += now;
+    mirrors[a].requests++;
+    return a;
+}
+
+int mirror_pick(void)
+{
+    pthread_mutex_lock(&lock);
+    int m = pick(-1);
+    pthread_mutex_unlock(&lock);
+    return m;
+}
+
+int mirror_pick_other(int exclude)
+{
+    pthread_mutex_lock(&lock);
+    int m = pick(exclude);
+    pthread_mutex_unlock(&lock);
+    return m;
+}
+
+double mirror_ready_in(void)
+{
+    double now = now_sec();
+    double next = -1.0;
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < num_mirrors; i++) {
+        if (mirrors[i].breaker == BREAKER_OPEN) {
+            double due = mirrors[i].reopen > now ? mirrors[i].reopen - now : 0.0;
+            if (next < 0 || due < next) {
+                next = due;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return next;
+}
+
+void mirror_done(int m, int ok, double seconds)
+{
+    pthread_mutex_lock(&lock);
+    MIRROR *p = &mirrors[m];
+    finish(p, seconds);
+    if (!ok) {
+        /* a refused connection fails fast, but it cost a request that has to
+           be made again, so it must not make the mirror look quick */
+        if (seconds < FAILURE_SEC) {
+            seconds = FAILURE_SEC;
+        }
+        p->failures++;
+    }
+    /* the first sample replaces the optimistic start value */
+    p->latency = p->latency == 0.0 ? seconds
+                                   : EWMA_ALPHA * seconds + (1.0 - EWMA_ALPHA) * p->latency;
+    p->error_rate = EWMA_ALPHA * (ok ? 0.0 : 1.0) + (1.0 - EWMA_ALPHA) * p->error_rate;
+
+    // Any answer closes the breaker, a failure in half open is the trial's
+    if (ok) {
+        p->streak = 0;
+        p->breaker = BREAKER_CLOSED;
+        p->tripped = 0;
+    } else if (++p->streak >= BREAKER_FAILURES && p->breaker == BREAKER_CLOSED) {
+        trip(p);
+    } else if (p->breaker == BREAKER_HALF_OPEN) {
+        trip(p);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void mirror_cancel(int m, double seconds)
+{
+    pthread_mutex_lock(&lock);
+    MIRROR *p = &mirrors[m];
+    finish(p, seconds);
+    /* it would have taken at least this long, which only tells us
+       something if that is more than expected */
+    if (seconds > p->latency) {
+        p->latency = EWMA_ALPHA * seconds + (1.0 - EWMA_ALPHA) * p->latency;
+    }
+    if (p->breaker == BREAKER_HALF_OPEN) {
+        p->trial = 0; /* nothing learned, another request may try */
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void mirror_report(FILE *fp)
+{
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < num_mirrors; i++) {
+        fprintf(fp, "Mirror %s: %d requests, %d failed, latency %.1f ms, error rate %.0f%%, "
+                "breaker tripped %d times\n", mirrors[i].host, mirrors[i].requests,
+                mirrors[i].failures, mirrors[i].latency * 1000.0,
+                mirrors[i].error_rate * 100.0, mirrors[i].trips);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,99 @@
+/**
+ * @file mirror.h
+ * @brief picks which mirror each request goes to.
+ *
+ * Every mirror keeps an exponentially weighted moving average (EWMA) of the
+ * latency of its transfers and of its error rate, and a count of the
+ * requests it has outstanding. A request goes to the better of two mirrors
+ * drawn at random (power of two choices), scored as
+ *
+ *     latency * (outstanding + 1) / (1 - error rate)
+ *
+ * where the latency is never less than the mean age of the requests still
+ * outstanding there, so a mirror that stops answering looks slower with
+ * every moment instead of keeping the estimate of its last answer. A slow
+ * or failing mirror gets few requests while one that has not been
+ * measured yet is tried right away. Requests stay spread over the fast
+ * mirrors instead of all piling onto the fastest one.
+ *
+ * A mirror that is down would still get the odd request that way, and each
+ * one costs up to a transfer timeout (deadline.h). So every mirror also has
+ * a circuit breaker: BREAKER_FAILURES failures in a row open it, and an
+ * open mirror gets no requests at all for a cooldown that doubles with
+ * every trip in a row, up to BREAKER_COOLDOWN_MAX, and is jittered so that
+ * mirrors that failed together do not come back together. Then a single
+ * trial request goes out (half open); if it succeeds the breaker closes,
+ * if not it opens again.
+ *
+ * All functions are thread safe.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+#define MIRROR_MAX 16       /* mirrors that can be given with -m          */
+#define MIRROR_HOST_LEN 128 /* longest host name                          */
+#define BREAKER_FAILURES 3        /* failures in a row that open a breaker */
+#define BREAKER_COOLDOWN 0.5      /* seconds open after a first trip       */
+#define BREAKER_COOLDOWN_MAX 8.0
+#define MIRROR_DEFAULT "ece252-1.uwaterloo.ca,ece252-2.uwaterloo.ca,ece252-3.uwaterloo.ca"
+
+/**
+ * @brief Replace the mirror list with the comma separated host names in list.
+ * @return 0 on success, -1 if the list is empty, too long or has an empty
+ *         or overlong name
+ */
+int mirror_parse(const char *list);
+
+/**
+ * @brief Number of mirrors in the list.
+ */
+int mirror_count(void);
+
+/**
+ * @brief Host name of mirror m.
+ */
+const char *mirror_host(int m);
+
+/**
+ * @brief Choose the mirror for a new request and count it as outstanding
+ *        there until mirror_done().
+ * @return index of the mirror, -1 while the breaker of every mirror is open
+ */
+int mirror_pick(void);
+
+/**
+ * @brief mirror_pick() among all mirrors but exclude, for a second copy of
+ *        a request that mirror is slow to answer or a retry of one it
+ *        failed.
+ * @return index of the mirror, -1 if there is only the one or the breakers
+ *         of all the others are open
+ */
+int mirror_pick_other(int exclude);
+
+/**
+ * @brief Seconds until the breaker of a mirror that is open lets a trial
+ *        request through.
+ * @return the wait, a negative value if no breaker is open
+ */
+double mirror_ready_in(void);
+
+/**
+ * @brief Report how a request to mirror m went.
+ * @param ok the mirror sent a usable fragment
+ * @param seconds how long the transfer took
+ */
+void mirror_done(int m, int ok, double seconds);
+
+/**
+ * @brief Report that a request to mirror m was cancelled after seconds
+ *        because another copy of it answered first.
+ */
+void mirror_cancel(int m, double seconds);
+
+/**
+ * @brief Print the requests, latency, error rate and breaker trips of
+ *        every mirror.
+ */
+void mirror_report(FILE *fp);
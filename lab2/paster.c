@@ -1,47 +1,177 @@
+/* paster.c
+paster - fetch the fragments of an image from the ece252 servers and paste
+them into all.png
+
+@Usage
+paster [-t NUM|auto] [-n IMG[,IMG...]] [-e multi|threads] [-s random|part|auto] [-m HOSTS]
+       [-p PCTL] [-b PCT] [-c DIR] [-f NUM] [-M FILE] [-i MS] [-T MS] [-D SEC] [-W PORT]
+paster -w HOST:PORT [-t NUM|auto] [-T MS]
+
+@Description
+-t NUM number of concurrent transfers (default 1)
+-t auto start with a few transfers and add more while the fragments come in
+   faster for it, and the latency holds, up to 64. The number settled on is
+   printed at the end, see tune.h.
+-n IMG image to fetch, 1, 2 or 3 (default 1). A comma separated list such
+   as 1,2,3 fetches the images as one batch over the same transfers and
+   connections, and writes each to all_IMG.png as soon as it is complete.
+   The image closest to completion is asked for first.
+-e ENGINE how the transfers are run:
+   multi    one thread drives all NUM transfers from a curl_multi event loop,
+            reusing its easy handles and buffers (default)
+   threads  NUM threads, each looping on a blocking curl_easy_perform()
+-s STRATEGY which fragments are asked for, see strategy.h:
+   random   the :2520 endpoint, which sends a random fragment
+   part     the :2530 endpoint with &part=K for exactly the missing ones
+   auto     part if the server honours it, else random with targeted
+            requests for the last few missing fragments (default)
+-m HOSTS comma separated mirror host names
+   (default ece252-1.uwaterloo.ca,ece252-2.uwaterloo.ca,ece252-3.uwaterloo.ca).
+   Each request goes to the better of two mirrors picked at random, judged
+   by their recent latency, error rate and requests outstanding, see mirror.h.
+   A mirror that fails 3 requests in a row gets none for a while, then one
+   to see whether it is back. A targeted request that failed is retried on
+   another mirror after a backoff, see strategy.h.
+-p PCTL with the multi engine, send a second copy of a targeted request to
+   another mirror once it has been outstanding longer than the PCTL
+   percentile of recent request latency, and cancel whichever copy loses
+   (default 95, 0 turns hedging off), see hedge.h
+-b PCT at most PCT hedges per 100 requests (default 10)
+-c DIR keep each fragment fetched in the checkpoint DIR (default .paster_ckpt)
+   until the images are written, so that a run that is killed or cannot
+   reach the mirrors resumes with only the missing fragments, see
+   checkpoint.h
+-f NUM each image is split into NUM fragments, 1 to 65536. Without it the
+   first fragment is fetched on its own and the X-Ece252-Fragments header of
+   the answer says, as fragsrv sends it; a server that does not send one
+   has the usual 50. The fragments may be of any height.
+-M FILE write live metrics to FILE as one JSON line every -i ms, - for
+   stderr: per mirror the requests sent, new, duplicate, failed and
+   cancelled, bytes and requests in flight, and the p50/p90/p99/max of DNS,
+   connect, time to first byte and total time, see metrics.h. A line with
+   "final":true closes the run. A summary is printed at the end either way.
+-i MS interval between the lines of -M (default 1000)
+-T MS a transfer that takes longer than MS milliseconds fails (default
+   5000), as does one that cannot connect within 2 s or stalls, see
+   deadline.h
+-D SEC give up after SEC seconds (default never): the images that are not
+   complete by then are not written, paster exits with an error and the
+   fragments fetched are kept in the checkpoint for the next run
+-W PORT coordinate instead of fetching: workers connect on PORT, from this
+   host or others, and each request the strategy makes is handed to one of
+   them with a free slot. They send the fragments back still compressed and
+   they are decoded and kept here, so -n, -s, -m, -p, -b, -c and -f work as
+   usual; a targeted request a worker is slow with is hedged on another.
+   The fragment count is probed from here unless -f is given. See coord.h.
+-w HOST:PORT work for the coordinator at HOST:PORT with -t transfers, until
+   it has every image. Any number of workers may join or leave at any time.
+The number of requests issued against the useful fragments they brought in
+is printed at the end. Each fragment is inflated into the image in memory as
+soon as it arrives, and kept as received in the checkpoint directory (-c,
+.paster_ckpt by default) until the images are written; nothing else but the
+images goes to disk.
+*/
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <curl/curl.h>
 #include <getopt.h>
 #include <stdatomic.h>
-#include <semaphore.h>
 #include "lab_png.h"
 #include "crc.h"
 #include "zutil.h"
+#include "paster.h"
+#include "strategy.h"
+#include "framebuf.h"
+#include "mirror.h"
+#include "hedge.h"
+#include "checkpoint.h"
+#include "metrics.h"
+#include "tune.h"
+#include "coord.h"
+#include "deadline.h"
 #include "assert.h"
 
-#define ECE252_HEADER "X-Ece252-Fragment: "
-#define URL_LENGTH 256
-#define BUF_SIZE 1048576  /* 1024*1024 = 1M */
-#define BUF_INC  524288   /* 1024*512  = 0.5M */
-#define max(a, b) \
-   ({ __typeof__ (a) _a = (a); \
-       __typeof__ (b) _b = (b); \
-     _a > _b ? _a : _b; })
-
 atomic_int fragment_counter = 0; // Counts the number of fragments completed
-volatile int fragment_numbers[50]; // Stores the fragment numbers
+int num_fragments = NUM_FRAGMENTS; // Fragments per image, from -f or the server
+
+/*
+ * One image of the batch. Bit k of claimed is set once a transfer has
+ * claimed fragment k for decoding. Claiming is a single fetch-or on the
+ * word holding it, so no lock is taken per fragment.
+ */
+typedef struct image {
+    int img;                /* image number on the server            */
+    char path[32];          /* where it is written                   */
+    atomic_ullong *claimed; /* FRAGMENT_WORDS(num_fragments) words   */
+    atomic_int count;       /* fragments decoded                     */
+    FRAMEBUF framebuf;      /* each fragment is inflated into it     */
+    int written;            /* written out, by the progress thread   */
+    double done;            /* seconds from start to written         */
+    int failed;             /* writing it out failed                 */
+} IMAGE;
+
+static IMAGE images[MAX_IMAGES];
+static int num_images;
+static struct timespec start_ts;
+
+/*
+ * Set by main to stop the progress reporter, which waits on progress_cond
+ * between redraws so that a completed image is written out at once.
+ */
+static atomic_int progress_stop;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static int images_ready; // Completed images signalled, under progress_lock
+
+/*
+ * Each fetch thread runs its transfer on its own multi handle, listed here
+ * so that the thread completing the image can wake the others at once.
+ */
+static pthread_mutex_t waiters_lock = PTHREAD_MUTEX_INITIALIZER;
+static CURLM **waiters;
+static int num_waiters;
+
+/*
+ * Shared by the easy handles of the fetch threads: DNS cache, connection
+ * cache and TLS sessions, each behind its own lock.
+ */
+static CURLSH *share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
 
 /*
- * Use semaphore to handle the synchronization issue.
+ * Transfers that opened a connection, and connections opened, over all engines.
  */
-sem_t sem;
-
-typedef struct recv_buf2 {
-    char *buf;       /* Memory to hold a copy of received data */
-    size_t size;     /* Size of valid data in buf in bytes */
-    size_t max_size; /* Max capacity of buf in bytes */
-    int seq;         /* >=0 sequence number extracted from HTTP header */
-                     /* <0 indicates an invalid seq number */
-} RECV_BUF;
-
-size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
-size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
-int recv_buf_init(RECV_BUF *ptr, size_t max_size);
-int recv_buf_cleanup(RECV_BUF *ptr);
-int write_file(const char *path, const void *in, size_t len);
+static atomic_int transfers_total;
+static atomic_int transfers_reused;
+static atomic_int connections_opened;
+
+/**
+ * @brief Whether fragment seq of the image-th image has been claimed by
+ *        save_fragment() already.
+ */
+static int have_fragment(int image, int seq) {
+    if (image < 0 || image >= num_images || seq < 0 || seq >= num_fragments) {
+        return 0;
+    }
+    return (atomic_load(&images[image].claimed[FRAGMENT_WORD(seq)]) & FRAGMENT_BIT(seq)) != 0;
+}
+
+/**
+ * @brief Seconds since main started.
+ */
+static double elapsed(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - start_ts.tv_sec) + (ts.tv_nsec - start_ts.tv_nsec) / 1e9;
+}
 
 /**
  * @brief cURL header callback function to extract image sequence number from
@@ -55,6 +185,10 @@ int write_file(const char *path, const void *in, size_t len);
  * @details This routine will be invoked multiple times by libcurl until the full
  *          header data are received. We are only interested in the ECE252_HEADER line
  *          received so that we can extract the image sequence number from it.
+ *          If that fragment is already in, the transfer is aborted here, before
+ *          the body is downloaded, and p->dup is set so the engines can tell
+ *          this abort from a failed transfer. A server that says how many
+ *          fragments there are has that kept in p->total.
  */
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata) {
     int realsize = size * nmemb;
@@ -64,6 +198,13 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata) {
         strncmp(p_recv, ECE252_HEADER, strlen(ECE252_HEADER)) == 0) {
         /* Extract image sequence number */
         p->seq = atoi(p_recv + strlen(ECE252_HEADER));
+        if (have_fragment(p->image, p->seq)) {
+            p->dup = 1;
+            return 0; /* anything but realsize makes libcurl abort */
+        }
+    } else if (realsize > (int)strlen(ECE252_COUNT_HEADER) &&
+               strncmp(p_recv, ECE252_COUNT_HEADER, strlen(ECE252_COUNT_HEADER)) == 0) {
+        p->total = atoi(p_recv + strlen(ECE252_COUNT_HEADER));
     }
     return realsize;
 }
@@ -127,9 +268,23 @@ int recv_buf_init(RECV_BUF *ptr, size_t max_size) {
     ptr->size = 0;
     ptr->max_size = max_size;
     ptr->seq = -1; /* Valid seq should be non-negative */
+    ptr->dup = 0;
+    ptr->image = 0;
+    ptr->total = 0;
     return 0;
 }
 
+/**
+ * @brief Empty the receive buffer for the next transfer, keeping its memory.
+ * @param ptr Pointer to the receive buffer structure
+ */
+void recv_buf_reset(RECV_BUF *ptr) {
+    ptr->size = 0;
+    ptr->seq = -1;
+    ptr->dup = 0;
+    ptr->total = 0;
+}
+
 /**
  * @brief Clean up the receive buffer.
  * @param ptr Pointer to the receive buffer structure
@@ -146,129 +301,516 @@ int recv_buf_cleanup(RECV_BUF *ptr) {
     return 0;
 }
 
+static void share_lock_cb(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    (void) handle;
+    (void) access;
+    (void) userptr;
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock_cb(CURL *handle, curl_lock_data data, void *userptr) {
+    (void) handle;
+    (void) userptr;
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
 /**
- * @brief Output data in memory to a file.
- * @param path Output file path
- * @param in Input data to be written to the file
- * @param len Length of the input data in bytes
- * @return 0 on success, negative value on error
+ * @brief Create the share object the fetch threads' easy handles use.
+ * @return 0 on success, -1 on error
  */
-int write_file(const char *path, const void *in, size_t len) {
-    FILE *fp = NULL;
+static int share_init(void) {
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&share_locks[i], NULL);
+    }
+    share = curl_share_init();
+    if (share == NULL) {
+        fprintf(stderr, "curl_share_init: returned NULL\n");
+        return -1;
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    return 0;
+}
+
+void count_connection(CURL *easy) {
+    long opened = 0;
+
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &opened);
+    atomic_fetch_add(&transfers_total, 1);
+    if (opened > 0) {
+        atomic_fetch_add(&connections_opened, (int)opened);
+    } else {
+        atomic_fetch_add(&transfers_reused, 1);
+    }
+}
 
-    if (path == NULL) {
-        fprintf(stderr, "write_file: file name is null!\n");
+/**
+ * @brief Interrupt every fetch thread waiting on a transfer, so that its
+ *        xferinfo callback runs and sees whether its image is complete.
+ */
+static void wake_waiters(void) {
+    pthread_mutex_lock(&waiters_lock);
+    for (int i = 0; i < num_waiters; i++) {
+        if (waiters[i] != NULL) {
+            curl_multi_wakeup(waiters[i]);
+        }
+    }
+    pthread_mutex_unlock(&waiters_lock);
+}
+
+int fetch_complete(void) {
+    return atomic_load(&fragment_counter) >= num_fragments * num_images || deadline_passed();
+}
+
+/**
+ * @brief Deflate every completed image not written yet into its file and let
+ *        go of its frame buffer. Called by the progress thread, so neither
+ *        engine stops fetching the rest of the batch meanwhile, and by main
+ *        once that thread is gone.
+ * @return number of images written out so far
+ */
+static int write_images(void) {
+    int written = 0;
+
+    for (int i = 0; i < num_images; i++) {
+        IMAGE *im = &images[i];
+        if (!im->written && atomic_load(&im->count) == num_fragments) {
+            if (framebuf_write_png(&im->framebuf, im->path) != 0) {
+                im->failed = 1;
+            }
+            framebuf_free(&im->framebuf);
+            im->done = elapsed();
+            im->written = 1;
+        }
+        written += im->written;
+    }
+    return written;
+}
+
+/**
+ * @brief Claim fragment seq of the image-th image and inflate len bytes at
+ *        buf into it, see save_fragment().
+ * @return 1 if the fragment was new, 0 if it was a duplicate, -1 if it could
+ *         not be decoded
+ */
+static int put_fragment(int image, int seq, const char *buf, size_t len) {
+    IMAGE *im = &images[image];
+    atomic_ullong *word = &im->claimed[FRAGMENT_WORD(seq)];
+
+    // Claim the sequence number so no other transfer decodes it as well
+    if (atomic_fetch_or(word, FRAGMENT_BIT(seq)) & FRAGMENT_BIT(seq)) {
+        return 0;
+    }
+
+    // Inflate it into its rows of the image
+    if (framebuf_put(&im->framebuf, seq, (U8 *)buf, len) != 0) {
+        atomic_fetch_and(word, ~FRAGMENT_BIT(seq)); // Let a later copy try again
         return -1;
     }
 
-    if (in == NULL) {
-        fprintf(stderr, "write_file: input data is null!\n");
+    // Every other fragment was decoded before it was counted, the image is whole
+    atomic_fetch_add(&fragment_counter, 1);
+    if (atomic_fetch_add(&im->count, 1) + 1 == num_fragments) {
+        pthread_mutex_lock(&progress_lock);
+        images_ready++;
+        pthread_cond_signal(&progress_cond); // Have it written out
+        pthread_mutex_unlock(&progress_lock);
+        wake_waiters(); // Transfers still waiting on this image can stop
+    }
+    return 1;
+}
+
+int save_fragment(RECV_BUF *recv_buf) {
+    int seq = recv_buf->seq;
+    int image = recv_buf->image;
+    int saved;
+
+    if (seq < 0 || seq >= num_fragments || image < 0 || image >= num_images) {
         return -1;
     }
+    saved = put_fragment(image, seq, recv_buf->buf, recv_buf->size);
 
-    fp = fopen(path, "wb");
-    if (fp == NULL) {
-        perror("fopen");
-        return -2;
+    // Keep it on disk too, the journal is synced by the progress thread
+    if (saved > 0) {
+        checkpoint_add(images[image].img, seq, recv_buf->buf, recv_buf->size);
     }
+    return saved;
+}
 
-    if (fwrite(in, 1, len, fp) != len) {
-        fprintf(stderr, "write_file: incomplete write!\n");
-        return -3;
+/**
+ * @brief Decode the fragments a previous run left in the checkpoint, so that
+ *        only the missing ones are fetched.
+ * @return number of fragments restored
+ */
+static int restore_fragments(void) {
+    int restored = 0;
+
+    for (int i = 0; i < num_images; i++) {
+        // Fragments cut for another -f do not fit these, they are dropped
+        checkpoint_split(images[i].img, num_fragments);
+        for (int seq = 0; seq < num_fragments; seq++) {
+            char *buf;
+            size_t len;
+            if (checkpoint_load(images[i].img, seq, &buf, &len) != 0) {
+                continue;
+            }
+            if (put_fragment(i, seq, buf, len) > 0) {
+                strategy_restore(i, seq);
+                restored++;
+            }
+            free(buf);
+        }
     }
-    return fclose(fp);
+    return restored;
+}
+
+int xferinfo_cb_curl(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                     curl_off_t ultotal, curl_off_t ulnow) {
+    RECV_BUF *p = (RECV_BUF *)clientp;
+    (void) dltotal;
+    (void) dlnow;
+    (void) ultotal;
+    (void) ulnow;
+
+    // Non-zero aborts the transfer, nothing it brings is needed any more
+    return fetch_complete() ||
+           (p->image >= 0 && p->image < num_images &&
+            atomic_load(&images[p->image].count) >= num_fragments);
+}
+
+/**
+ * @brief Draw the progress bar for count of the total fragments.
+ */
+static void draw_progress(int count, int total) {
+    int progress = (int)((long long)count * 100 / total); // Calculate progress percentage
+    int filled = count * PROGRESS_WIDTH / total;
+    char loading_bar[PROGRESS_WIDTH+1];
+    memset(loading_bar, ' ', PROGRESS_WIDTH);
+    loading_bar[PROGRESS_WIDTH] = '\0';
+    for (int i = 0; i < filled && i < PROGRESS_WIDTH; i++) {
+        loading_bar[i] = '=';
+    }
+    if (filled < PROGRESS_WIDTH) {
+        loading_bar[filled] = '>';
+    }
+    printf("\rDownloading img strips: [%-*s] %d%%", PROGRESS_WIDTH, loading_bar, progress);
+    fflush(stdout);
+}
+
+/**
+ * @brief Progress reporter thread. Redraws the bar at most every
+ *        PROGRESS_INTERVAL_MS, and only when the count has changed, so the
+ *        fetch threads never wait on the terminal. It also writes out each
+ *        image as soon as save_fragment() signals it is complete.
+ * @param arg unused
+ * @return NULL
+ */
+static void *progress_main(void *arg) {
+    int shown = -1;
+    int seen = 0;
+    (void) arg;
+
+    while (1) {
+        struct timespec ts;
+        int count = atomic_load(&fragment_counter);
+        int stop = atomic_load(&progress_stop);
+        if (count != shown) {
+            draw_progress(count, num_fragments * num_images);
+            shown = count;
+        }
+        if (write_images() == num_images || stop) {
+            break;
+        }
+        checkpoint_sync(); // One fsync per tick for whatever came in
+        metrics_tick();    // A JSON line every -i ms, with -M
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&progress_lock);
+        if (images_ready == seen) {
+            pthread_cond_timedwait(&progress_cond, &progress_lock, &ts);
+        }
+        seen = images_ready;
+        pthread_mutex_unlock(&progress_lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief curl_easy_perform() on the calling thread's own multi handle, so
+ *        that wake_waiters() can cut a wait short.
+ * @return the result of the transfer
+ */
+static CURLcode perform_transfer(CURLM *cm, CURL *easy) {
+    CURLcode res = CURLE_OK;
+    CURLMsg *msg;
+    int running = 1;
+    int msgs_left;
+
+    if (curl_multi_add_handle(cm, easy) != CURLM_OK) {
+        return CURLE_FAILED_INIT;
+    }
+    while (running) {
+        if (curl_multi_perform(cm, &running) != CURLM_OK) {
+            res = CURLE_FAILED_INIT;
+            break;
+        }
+        if (running && curl_multi_poll(cm, NULL, 0, 1000, NULL) != CURLM_OK) {
+            res = CURLE_FAILED_INIT;
+            break;
+        }
+    }
+    while ((msg = curl_multi_info_read(cm, &msgs_left)) != NULL) {
+        if (msg->msg == CURLMSG_DONE) {
+            res = msg->data.result;
+        }
+    }
+    curl_multi_remove_handle(cm, easy);
+    return res;
 }
 
 /**
  * @brief Function to create a thread.
- *        Uses cURL to get the fragment numbers and file data to store in files.
- *        Creates a file for a specific fragment of the image.
- * @param thread_input Input data for the thread
+ *        Uses cURL to get fragments and decodes each new one into the frame buffer.
+ * @param thread_input index of the thread, as an intptr_t
  * @return NULL
  */
 void* get_fragment(void* thread_input) {
-    int server_num = 1;
-    char **server_urls = (char**) thread_input;
+    int id = (int)(intptr_t)thread_input;
+    CURLM *cm = curl_multi_init();
+
+    CURL *curl_handle = NULL;
+    RECV_BUF recv_buf;
+    METRICS_SHARD *shard = metrics_shard();
+
+    if (cm == NULL) {
+        fprintf(stderr, "curl_multi_init: returned NULL\n");
+        return NULL;
+    }
+    pthread_mutex_lock(&waiters_lock);
+    waiters[id] = cm;
+    pthread_mutex_unlock(&waiters_lock);
+
+    // The connection cache is shared, room for one connection per thread and mirror
+    curl_multi_setopt(cm, CURLMOPT_MAXCONNECTS, (long)num_waiters * mirror_count());
+
+    // One buffer and one curl session for all transfers of this thread
+    if (recv_buf_init(&recv_buf, BUF_SIZE) != 0) {
+        fprintf(stderr, "recv_buf_init failed\n");
+        goto out;
+    }
+    curl_handle = curl_easy_init();
+    if (curl_handle == NULL) {
+        fprintf(stderr, "curl_easy_init: returned NULL\n");
+        recv_buf_cleanup(&recv_buf);
+        goto out;
+    }
+
+    // Register write callback function to process received data
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl3);
+    // User-defined data structure passed to the callback function
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&recv_buf);
+    // Register header callback function to process received header data
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl);
+    // User-defined data structure passed to the callback function
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&recv_buf);
+    // Some servers require a user-agent field
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    // Stop as soon as another thread completes the image
+    curl_easy_setopt(curl_handle, CURLOPT_XFERINFOFUNCTION, xferinfo_cb_curl);
+    curl_easy_setopt(curl_handle, CURLOPT_XFERINFODATA, (void *)&recv_buf);
+    curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 0L);
+    // DNS answers, open connections and TLS sessions are shared by all threads
+    curl_easy_setopt(curl_handle, CURLOPT_SHARE, share);
 
-    while (fragment_counter < 50) {
-        CURL *curl_handle;
+    while (!fetch_complete()) {
         CURLcode res;
-        RECV_BUF recv_buf;
-        char fname[URL_LENGTH];
+        FETCH_REQ req;
 
-        // Initialize buffer
-        if (recv_buf_init(&recv_buf, BUF_SIZE) != 0) {
-            fprintf(stderr, "recv_buf_init failed\n");
-            continue;
+        // With -t auto only the first tune_limit() threads fetch
+        tune_wait(id);
+        if (fetch_complete()) {
+            break;
         }
 
-        // Init a curl session
-        curl_handle = curl_easy_init();
-        if (curl_handle == NULL) {
-            fprintf(stderr, "curl_easy_init: returned NULL\n");
-            recv_buf_cleanup(&recv_buf);
+        // Ask the strategy what to fetch, it may have nothing until a request in flight ends
+        int next = strategy_next(&req);
+        if (next < 0) {
+            break;
+        }
+        if (next > 0) {
+            tune_starved();
+            strategy_wait();
             continue;
         }
 
-        // Specify URL to get
-        curl_easy_setopt(curl_handle, CURLOPT_URL, server_urls[server_num - 1]);
-        // Register write callback function to process received data
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl3);
-        // User-defined data structure passed to the callback function
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&recv_buf);
-        // Register header callback function to process received header data
-        curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl);
-        // User-defined data structure passed to the callback function
-        curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&recv_buf);
-        // Some servers require a user-agent field
-        curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-
-        // Get it!
-        res = curl_easy_perform(curl_handle);
-        if (res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        }
-
-        // Check whether the sequence number already exists
-        sem_wait(&sem);
-        if (recv_buf.seq >= 0 && recv_buf.seq < 50 && fragment_numbers[recv_buf.seq] == -1) {
-            fragment_numbers[recv_buf.seq] = recv_buf.seq;
-            sprintf(fname, "./_tmp/%d.png", recv_buf.seq + 1);
-            write_file(fname, recv_buf.buf, recv_buf.size);
-            fragment_counter += 1;
-
-            // (Optional) LOADING bar
-            int progress = (fragment_counter) * 100 / 50; // Calculate progress percentage
-            char loading_bar[50+1];
-            memset(loading_bar, ' ', 50);
-            loading_bar[50] = '\0';
-            int filled_length = fragment_counter; // Calculate filled length for the loading bar
-            for (int i = 0; i < filled_length && i < 50; i++) {
-                loading_bar[i] = '=';
+        // Specify URL to get, on a rewound buffer
+        recv_buf_reset(&recv_buf);
+        recv_buf.image = req.image;
+        curl_easy_setopt(curl_handle, CURLOPT_URL, req.url);
+        deadline_apply(curl_handle);
+
+        // Get it! A duplicate is aborted as soon as its header shows up
+        metrics_start(shard, req.mirror);
+        res = perform_transfer(cm, curl_handle);
+        double seconds = 0.0;
+        curl_easy_getinfo(curl_handle, CURLINFO_TOTAL_TIME, &seconds);
+        count_connection(curl_handle);
+
+        if (res == CURLE_ABORTED_BY_CALLBACK || (res != CURLE_OK && deadline_passed())) {
+            // Not needed any more or cut short by -D, which says nothing about the mirror
+            metrics_end(shard, req.mirror, curl_handle, METRICS_CANCELLED);
+            strategy_cancel(&req);
+            mirror_cancel(req.mirror, seconds);
+        } else {
+            if (res != CURLE_OK && !recv_buf.dup) {
+                fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
             }
-            if (filled_length < 50) {
-                loading_bar[filled_length] = '>';
+
+            int saved = recv_buf.dup ? 0 : res == CURLE_OK ? save_fragment(&recv_buf) : -1;
+            metrics_end(shard, req.mirror, curl_handle,
+                        saved > 0 ? METRICS_NEW : saved == 0 ? METRICS_DUP : METRICS_FAILED);
+            strategy_done(&req, saved >= 0, recv_buf.seq, saved > 0);
+
+            // Let the mirror scheduler know how fast and reliable this mirror was
+            mirror_done(req.mirror, saved >= 0, seconds);
+            tune_done(saved >= 0, seconds);
+            if (saved >= 0) {
+                hedge_record(seconds);
             }
-            printf("\rDownloading img strips: [%-50s] %d%%", loading_bar, progress);
-            fflush(stdout);
         }
-        sem_post(&sem);
+    }
+    tune_stop(); // The threads still parked have nothing left to do either
 
-        // Cleaning up
-        curl_easy_cleanup(curl_handle);
-        recv_buf_cleanup(&recv_buf);
+    // Cleaning up
+    curl_easy_cleanup(curl_handle);
+    recv_buf_cleanup(&recv_buf);
 
-        // For using different server
-        server_num += 1;
-        if (server_num == 4) {
-            server_num = 1;
+out:
+    pthread_mutex_lock(&waiters_lock);
+    waiters[id] = NULL;
+    pthread_mutex_unlock(&waiters_lock);
+    curl_multi_cleanup(cm);
+    return NULL;
+}
+
+/**
+ * @brief Fetch one random fragment of image img to learn how many fragments
+ *        the images are split into, from the ECE252_COUNT_HEADER of the
+ *        answer. The fragment is left in recv_buf to be kept like any other.
+ * @param avoid mirror a probe failed on before, -1 for none
+ * @param mirror receives the mirror asked
+ * @return the count the server sent, 0 if it sent none, -1 if it did not answer
+ */
+static int probe_once(int img, int avoid, RECV_BUF *recv_buf, int *mirror) {
+    FETCH_REQ req;
+    CURLcode res;
+    double seconds = 0.0;
+    CURL *easy;
+    METRICS_SHARD *shard = metrics_shard();
+
+    if (strategy_probe(img, avoid, &req) != 0) {
+        return -1;
+    }
+    *mirror = req.mirror;
+    easy = curl_easy_init();
+    if (easy == NULL) {
+        fprintf(stderr, "curl_easy_init: returned NULL\n");
+        mirror_cancel(req.mirror, 0.0);
+        return -1;
+    }
+    recv_buf_reset(recv_buf);
+    curl_easy_setopt(easy, CURLOPT_URL, req.url);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_cb_curl3);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, (void *)recv_buf);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, header_cb_curl);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, (void *)recv_buf);
+    curl_easy_setopt(easy, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    deadline_apply(easy);
+
+    metrics_start(shard, req.mirror);
+    res = curl_easy_perform(easy);
+    curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &seconds);
+    count_connection(easy);
+    metrics_end(shard, req.mirror, easy, res == CURLE_OK ? METRICS_NEW : METRICS_FAILED);
+    mirror_done(req.mirror, res == CURLE_OK, seconds);
+    curl_easy_cleanup(easy);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "probing %s failed: %s\n", req.url, curl_easy_strerror(res));
+        recv_buf->seq = -1;
+        return -1;
+    }
+    return recv_buf->total;
+}
+
+/**
+ * @brief probe_once() until a mirror answers, each retry on another mirror
+ *        after a jittered backoff like that of strategy.h, at most once per
+ *        mirror and not past the -D deadline.
+ * @return the count the server sent, 0 if it sent none or none answered
+ */
+static int probe_fragments(int img, RECV_BUF *recv_buf) {
+    unsigned int seed = (unsigned int)time(NULL);
+    double ms = RETRY_BASE_MS;
+    int mirror = -1;
+
+    for (int i = 0; i < mirror_count() && !deadline_passed(); i++) {
+        if (i > 0) {
+            double wait = ms * (0.5 + 0.5 * (rand_r(&seed) / ((double)RAND_MAX + 1.0)));
+            struct timespec ts = { (time_t)(wait / 1000), (long)(wait * 1e6) % 1000000000L };
+            nanosleep(&ts, NULL);
+            ms = ms * 2 < RETRY_MAX_MS ? ms * 2 : RETRY_MAX_MS;
+        }
+        int total = probe_once(img, mirror, recv_buf, &mirror);
+        if (total >= 0) {
+            return total;
         }
     }
-    return NULL;
+    return 0;
+}
+
+/**
+ * @brief Parse the comma separated image numbers of -n.
+ * @param list e.g. "1" or "1,2,3"
+ * @param imgs receives up to MAX_IMAGES image numbers
+ * @return how many there are, -1 if one is not 1 to 3 or is given twice
+ */
+static int parse_images(const char *list, int *imgs) {
+    int n = 0;
+    const char *p = list;
+
+    while (1) {
+        char *end;
+        long img = strtol(p, &end, 10);
+        if (end == p || img < 1 || img > 3 || n == MAX_IMAGES) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (imgs[i] == img) {
+                return -1;
+            }
+        }
+        imgs[n++] = (int)img;
+        if (*end == '\0') {
+            break;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        p = end + 1;
+    }
+    return n;
 }
 
 /**
- * @brief Handle inputs, modify URLs based on user inputs, create threads to get data, and concatenate PNGs.
+ * @brief Handle inputs, fetch and decode the fragments, and write the images.
  * @param argc Argument count
  * @param argv Argument vector
  * @return 0 on success, negative value on error
@@ -276,25 +818,146 @@ void* get_fragment(void* thread_input) {
 int main(int argc, char **argv) {
     int c;
     int t = 1;   // Number of threads
-    int n = 1;   // Image number
+    int auto_t = 0; // -t auto, t is then the most that may be used
+    int imgs[MAX_IMAGES] = { 1 }; // Image numbers
+    int n = 1;   // How many images
+    int use_threads = 0; // Fetch engine, curl_multi loop unless -e threads
+    STRATEGY strategy = STRATEGY_AUTO; // What to request, see strategy.h
+    int hedge_pctl = HEDGE_PCTL_DEFAULT;     // Hedge requests slower than this percentile
+    int hedge_budget = HEDGE_BUDGET_DEFAULT; // Hedges allowed per 100 requests
+    const char *checkpoint_dir = CHECKPOINT_DIR_DEFAULT; // Where fetched fragments are kept
+    int fragments_given = 0; // -f was given, nothing to learn from the server
+    RECV_BUF probe;          // The fragment that told how many there are
+    const char *metrics_path = NULL;              // -M, JSON lines of metrics
+    int metrics_interval = METRICS_INTERVAL_MS;   // -i
+    FILE *metrics_fp = NULL;
+    int coord_port = 0;             // -W, coordinate workers instead of fetching
+    char *coordinator = NULL;       // -w, HOST:PORT to work for
+    int request_ms = DEADLINE_REQUEST_MS; // -T, timeout of one transfer
+    double run_sec = 0.0;                 // -D, of the whole run, 0 for none
     char *str = "option requires an argument";
-    memset(&fragment_numbers, -1, sizeof(fragment_numbers));
+
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+
+    // The ece252 mirrors unless -m says otherwise
+    if (mirror_parse(MIRROR_DEFAULT) != 0) {
+        return -1;
+    }
 
     // Handle inputs
-    while ((c = getopt(argc, argv, "t:n:")) != -1) {
+    while ((c = getopt(argc, argv, "t:n:e:s:m:p:b:c:f:M:i:T:D:W:w:")) != -1) {
         switch (c) {
         case 't':
-            t = strtoul(optarg, NULL, 10);
+            auto_t = strcmp(optarg, "auto") == 0;
+            t = auto_t ? TUNE_MAX : (int)strtoul(optarg, NULL, 10);
             if (t <= 0) {
-                fprintf(stderr, "%s: %s > 0 -- 't'\n", argv[0], str);
+                fprintf(stderr, "%s: %s > 0 or auto -- 't'\n", argv[0], str);
                 return -1;
             }
             break;
 
         case 'n':
-            n = strtoul(optarg, NULL, 10);
-            if (n <= 0 || n > 3) {
-                fprintf(stderr, "%s: %s 1, 2, or 3 -- 'n'\n", argv[0], str);
+            n = parse_images(optarg, imgs);
+            if (n <= 0) {
+                fprintf(stderr, "%s: %s 1, 2, or 3, or a list of them such as 1,2,3 -- 'n'\n", argv[0], str);
+                return -1;
+            }
+            break;
+
+        case 'e':
+            if (strcmp(optarg, "threads") == 0) {
+                use_threads = 1;
+            } else if (strcmp(optarg, "multi") == 0) {
+                use_threads = 0;
+            } else {
+                fprintf(stderr, "%s: %s multi or threads -- 'e'\n", argv[0], str);
+                return -1;
+            }
+            break;
+
+        case 's':
+            if (strategy_parse(optarg, &strategy) != 0) {
+                fprintf(stderr, "%s: %s random, part or auto -- 's'\n", argv[0], str);
+                return -1;
+            }
+            break;
+
+        case 'm':
+            if (mirror_parse(optarg) != 0) {
+                fprintf(stderr, "%s: %s HOST[,HOST...], at most %d -- 'm'\n", argv[0], str, MIRROR_MAX);
+                return -1;
+            }
+            break;
+
+        case 'p':
+            hedge_pctl = strtoul(optarg, NULL, 10);
+            if (hedge_pctl < 0 || hedge_pctl > 99) {
+                fprintf(stderr, "%s: %s 0 to 99 -- 'p'\n", argv[0], str);
+                return -1;
+            }
+            break;
+
+        case 'b':
+            hedge_budget = strtoul(optarg, NULL, 10);
+            if (hedge_budget < 0 || hedge_budget > 100) {
+                fprintf(stderr, "%s: %s 0 to 100 -- 'b'\n", argv[0], str);
+                return -1;
+            }
+            break;
+
+        case 'c':
+            checkpoint_dir = optarg;
+            break;
+
+        case 'f':
+            num_fragments = strtoul(optarg, NULL, 10);
+            if (num_fragments < 1 || num_fragments > MAX_FRAGMENTS) {
+                fprintf(stderr, "%s: %s 1 to %d -- 'f'\n", argv[0], str, MAX_FRAGMENTS);
+                return -1;
+            }
+            fragments_given = 1;
+            break;
+
+        case 'M':
+            metrics_path = optarg;
+            break;
+
+        case 'i':
+            metrics_interval = strtoul(optarg, NULL, 10);
+            if (metrics_interval <= 0) {
+                fprintf(stderr, "%s: %s > 0 -- 'i'\n", argv[0], str);
+                return -1;
+            }
+            break;
+
+        case 'T':
+            request_ms = strtoul(optarg, NULL, 10);
+            if (request_ms <= 0) {
+                fprintf(stderr, "%s: %s > 0 -- 'T'\n", argv[0], str);
+                return -1;
+            }
+            break;
+
+        case 'D':
+            run_sec = strtod(optarg, NULL);
+            if (run_sec <= 0) {
+                fprintf(stderr, "%s: %s > 0 -- 'D'\n", argv[0], str);
+                return -1;
+            }
+            break;
+
+        case 'W':
+            coord_port = strtoul(optarg, NULL, 10);
+            if (coord_port <= 0 || coord_port > 65535) {
+                fprintf(stderr, "%s: %s 1 to 65535 -- 'W'\n", argv[0], str);
+                return -1;
+            }
+            break;
+
+        case 'w':
+            coordinator = optarg;
+            if (strrchr(coordinator, ':') == NULL) {
+                fprintf(stderr, "%s: %s HOST:PORT -- 'w'\n", argv[0], str);
                 return -1;
             }
             break;
@@ -304,91 +967,202 @@ int main(int argc, char **argv) {
         }
     }
 
-    // Allocate memory for modified URLs
-    char **modified_url = malloc(3 * sizeof(char*));
-    if (modified_url == NULL) {
-        fprintf(stderr, "malloc failed for modified_url\n");
-        return -1;
+    // A worker only fetches what the coordinator sends it
+    if (coordinator != NULL) {
+        char *colon = strrchr(coordinator, ':');
+        *colon = '\0';
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        tune_init(auto_t ? TUNE_START : t, t);
+        deadline_init(request_ms, 0.0); // the coordinator keeps the -D deadline
+        int ret = paster_worker(coordinator, colon + 1, t);
+        curl_global_cleanup();
+        return ret;
     }
-    for (int i = 0; i < 3; i++) {
-        modified_url[i] = malloc(URL_LENGTH * sizeof(char));
-        if (modified_url[i] == NULL) {
-            fprintf(stderr, "malloc failed for modified_url[%d]\n", i);
+
+    // Every transfer from here on is counted, the mirror list is final
+    if (metrics_path != NULL) {
+        metrics_fp = strcmp(metrics_path, "-") == 0 ? stderr : fopen(metrics_path, "w");
+        if (metrics_fp == NULL) {
+            perror(metrics_path);
             return -1;
         }
     }
+    metrics_init(metrics_fp, metrics_interval);
 
-    // Modify URLs
-    sprintf(modified_url[0], "http://ece252-1.uwaterloo.ca:2520/image?img=%d", n);
-    sprintf(modified_url[1], "http://ece252-2.uwaterloo.ca:2520/image?img=%d", n);
-    sprintf(modified_url[2], "http://ece252-3.uwaterloo.ca:2520/image?img=%d", n);
-
-    // Initialize semaphore
-    sem_init(&sem, 0, 1);
+    // Initialize libcurl before any transfer, the -D deadline counts from here
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    deadline_init(request_ms, run_sec);
 
-    // Initialize threads
-    const int thread_num = t;
-    pthread_t tid[thread_num];
+    // Without -f, the answer to one request says how many fragments there
+    // are, a server that does not say has the usual NUM_FRAGMENTS
+    if (recv_buf_init(&probe, BUF_SIZE) != 0) {
+        fprintf(stderr, "recv_buf_init failed\n");
+        return -1;
+    }
+    if (!fragments_given) {
+        int total = probe_fragments(imgs[0], &probe);
+        if (total >= 1 && total <= MAX_FRAGMENTS) {
+            num_fragments = total;
+        }
+    }
 
-    // Initialize libcurl before any thread
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+    // The strategy builds the URLs of the images
+    if (strategy_init(strategy, imgs, n, num_fragments) != 0) {
+        return -1;
+    }
+    // -t auto works up from a few transfers, otherwise t is all there is
+    tune_init(auto_t ? TUNE_START : t, t);
+    // Hedging needs the multi engine, the threads engine only measures
+    hedge_init(use_threads ? 0 : hedge_pctl, hedge_budget);
 
-    // Create threads
-    int current_thread_num = t;
-    for (int i = 0; i < t; i++) {
-        if (pthread_create(&tid[i], NULL, get_fragment, modified_url) != 0) {
-            current_thread_num = i;
-            // Thread num should be from 0 to t-1
-            printf("Thread #%d failed to create!\n", i);
-            // This issue could be mainly a capacity issue because the number of threads we can generate is limited by the ECEubuntu server.
-            // We need to stop generating new threads.
-            break;
+    // Initialize the images the fragments are decoded into, a single one is all.png
+    for (int i = 0; i < n; i++) {
+        images[i].img = imgs[i];
+        if (n == 1) {
+            snprintf(images[i].path, sizeof(images[i].path), "all.png");
+        } else {
+            snprintf(images[i].path, sizeof(images[i].path), "all_%d.png", imgs[i]);
+        }
+        images[i].claimed = calloc(FRAGMENT_WORDS(num_fragments), sizeof(atomic_ullong));
+        if (images[i].claimed == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        if (framebuf_init(&images[i].framebuf, num_fragments) != 0) {
+            fprintf(stderr, "framebuf_init failed\n");
+            return -1;
         }
     }
+    num_images = n;
 
-    // Join threads based on how many threads we generated.
-    for (int i = 0; i < current_thread_num; i++) {
-        pthread_join(tid[i], NULL);
+    // Pick up where a run that did not finish left off, the fetching threads
+    // only append to the journal, it is synced by the progress thread
+    if (checkpoint_open(checkpoint_dir, 0) == 0) {
+        int restored = restore_fragments();
+        if (restored > 0) {
+            printf("Resumed %d fragments from %s\n", restored, checkpoint_dir);
+        }
+    } else {
+        fprintf(stderr, "%s: no checkpoint in %s, fetching everything\n", argv[0], checkpoint_dir);
     }
-   printf("\nJoined all threads...\n");
 
-    // Store 50 fragment file names
-    char **fragment_files = malloc(fragment_counter * sizeof(char*));
-    if (fragment_files == NULL) {
-        fprintf(stderr, "malloc failed for fragment_files\n");
-        return -1;
+    // The probe fragment is the first one of the first image
+    if (probe.seq >= 0 && save_fragment(&probe) > 0) {
+        strategy_restore(0, probe.seq);
     }
-    for (int i = 0; i < fragment_counter; i++) {
-        fragment_files[i] = malloc(256 * sizeof(char));
-        if (fragment_files[i] == NULL) {
-            fprintf(stderr, "malloc failed for fragment_files[%d]\n", i);
+    recv_buf_cleanup(&probe);
+
+    // The progress bar is drawn by its own thread, away from the fetching
+    pthread_t progress_tid;
+    int progress_started = pthread_create(&progress_tid, NULL, progress_main, NULL) == 0;
+
+    if (coord_port > 0) {
+        // The workers fetch, this only hands out the requests and decodes
+        if (fetch_fragments_coord(coord_port) != 0) {
+            fprintf(stderr, "\ncoordinating the workers failed\n");
+            checkpoint_close(0);
             return -1;
         }
-        sprintf(fragment_files[i], "./_tmp/%d.png", i + 1);
-    }
+    } else if (!use_threads) {
+        // One thread, t transfers in flight on a curl_multi handle
+        if (fetch_fragments_multi(t) != 0) {
+            fprintf(stderr, "\nfetching the fragments failed\n");
+            checkpoint_close(0);
+            return -1;
+        }
+    } else {
+        // Initialize threads
+        const int thread_num = t;
+        pthread_t tid[thread_num];
 
-   printf("Concatenating PNG segments into a single PNG file...\n");
-    // Concatenate PNG segments into a single PNG file
-    concatenate_pngs(fragment_files, fragment_counter);
+        // Room for the multi handle of every thread
+        waiters = calloc(t, sizeof(CURLM *));
+        if (waiters == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        num_waiters = t;
+
+        // Connections and DNS answers are kept across transfers and threads
+        if (share_init() != 0) {
+            return -1;
+        }
+
+        // Create threads
+        int current_thread_num = t;
+        for (int i = 0; i < t; i++) {
+            if (pthread_create(&tid[i], NULL, get_fragment, (void *)(intptr_t)i) != 0) {
+                current_thread_num = i;
+                // Thread num should be from 0 to t-1
+                printf("Thread #%d failed to create!\n", i);
+                // This issue could be mainly a capacity issue because the number of threads we can generate is limited by the ECEubuntu server.
+                // We need to stop generating new threads.
+                break;
+            }
+        }
 
-   printf("Cleaning up...\n");
-    // Deallocate and remove helper files
-    for (int i = 0; i < fragment_counter; i++) {
-        remove(fragment_files[i]);
-        free(fragment_files[i]);
+        // Join threads based on how many threads we generated.
+        for (int i = 0; i < current_thread_num; i++) {
+            pthread_join(tid[i], NULL);
+        }
+        free(waiters);
+        waiters = NULL;
+        num_waiters = 0;
+        curl_share_cleanup(share);
+        share = NULL;
+    }
+    atomic_store(&progress_stop, 1);
+    if (progress_started) {
+        pthread_join(progress_tid, NULL);
+    }
+    if (atomic_load(&fragment_counter) >= num_fragments * num_images) {
+        printf("\nFetched all fragments...\n");
+    } else {
+        printf("\nThe deadline of %g s passed with %d of %d fragments in...\n",
+               run_sec, atomic_load(&fragment_counter), num_fragments * num_images);
+    }
+    strategy_report(stdout);
+    mirror_report(stdout);
+    hedge_report(stdout);
+    tune_report(stdout);
+    if (coord_port > 0) {
+        coord_report(stdout);
     }
-    free(fragment_files);
+    metrics_report(stdout);
+    metrics_dump();
+    if (metrics_fp != NULL && metrics_fp != stderr) {
+        fclose(metrics_fp);
+    }
+    metrics_cleanup();
+    printf("Connections: %d opened, %d of %d transfers reused one\n",
+           atomic_load(&connections_opened), atomic_load(&transfers_reused),
+           atomic_load(&transfers_total));
 
-    // Deallocate URLs
-    for (int i = 0; i < 3; i++) {
-        free(modified_url[i]);
+    // Each image was written as soon as its last fragment came in, but for
+    // one the progress thread was stopped before getting to
+    write_images();
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        if (images[i].failed) {
+            fprintf(stderr, "writing %s failed\n", images[i].path);
+            failed = 1;
+        } else if (!images[i].written) {
+            fprintf(stderr, "%s: %d of %d fragments in, run again to fetch the rest\n",
+                    images[i].path, atomic_load(&images[i].count), num_fragments);
+            failed = 1;
+        } else {
+            printf("Wrote %s after %.2f s\n", images[i].path, images[i].done);
+        }
+    }
+    // The checkpoint is only needed until every image is written
+    checkpoint_close(!failed);
+    if (failed) {
+        return -1;
     }
-    free(modified_url);
 
-    // Destroy semaphore and cleanup libcurl
-    sem_destroy(&sem);
+    // Cleanup libcurl
     curl_global_cleanup();
-    printf("Done! You can now view the image by typing 'display ./all.png' in the terminal.\n");
+    printf("Done! You can now view the image by typing 'display ./%s' in the terminal.\n", images[0].path);
     pthread_exit(0);
 
 }
@@ -0,0 +1,96 @@
+/**
+ * @file paster.h
+ * @brief state and helpers shared by the paster fetch engines.
+ *
+ * The threads engine (paster.c) runs -t threads that each loop on a blocking
+ * curl_easy_perform(). The multi engine (paster_multi.c) drives -t transfers
+ * from one curl_multi event loop on the main thread.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <curl/curl.h>
+
+#define ECE252_HEADER "X-Ece252-Fragment: "
+#define ECE252_COUNT_HEADER "X-Ece252-Fragments: " /* sent by fragsrv, not ece252 */
+#define URL_LENGTH 256
+#define NUM_FRAGMENTS 50  /* fragments per image, unless -f or the server says otherwise */
+#define MAX_FRAGMENTS 65536 /* most fragments an image may be split into */
+#define MAX_IMAGES 3      /* images fetched in one batch, see -n */
+#define BUF_SIZE 1048576  /* 1024*1024 = 1M */
+#define BUF_INC  524288   /* 1024*512  = 0.5M */
+#define PROGRESS_INTERVAL_MS 100 /* fastest the progress bar is redrawn */
+#define PROGRESS_WIDTH 50        /* characters in the progress bar */
+#define CHECKPOINT_DIR_DEFAULT ".paster_ckpt" /* see checkpoint.h, -c */
+#define FRAGMENT_WORDS(n) (((n) + 63) / 64) /* 64 bit words in a bitmap of n */
+#define FRAGMENT_WORD(seq) ((seq) / 64)
+#define FRAGMENT_BIT(seq) (1ULL << ((seq) % 64))
+#define max(a, b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a > _b ? _a : _b; })
+
+typedef struct recv_buf2 {
+    char *buf;       /* Memory to hold a copy of received data */
+    size_t size;     /* Size of valid data in buf in bytes */
+    size_t max_size; /* Max capacity of buf in bytes */
+    int seq;         /* >=0 sequence number extracted from HTTP header */
+                     /* <0 indicates an invalid seq number */
+    int dup;         /* transfer aborted at the header, seq is one we have */
+    int image;       /* index in the batch of the image being fetched */
+    int total;       /* fragments per image from ECE252_COUNT_HEADER, 0 if none */
+} RECV_BUF;
+
+extern atomic_int fragment_counter; /* over all images of the batch */
+extern int num_fragments;           /* per image, fixed before the fetching starts */
+
+size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
+size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
+int recv_buf_init(RECV_BUF *ptr, size_t max_size);
+void recv_buf_reset(RECV_BUF *ptr);
+
+/**
+ * @brief libcurl transfer info callback that aborts the transfer once every
+ *        fragment of its image is in, so no thread waits on a transfer whose
+ *        answer is no longer needed. The clientp is the transfer's RECV_BUF.
+ * @return 0 to continue, non-zero to abort
+ */
+int xferinfo_cb_curl(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                     curl_off_t ultotal, curl_off_t ulnow);
+int recv_buf_cleanup(RECV_BUF *ptr);
+
+/**
+ * @brief Count whether a finished transfer opened a connection or reused
+ *        one, for the report at the end. Thread safe.
+ */
+void count_connection(CURL *easy);
+
+/**
+ * @brief Whether fetching is over: every fragment of every image of the
+ *        batch is in, or the -D deadline has passed, see deadline.h.
+ */
+int fetch_complete(void);
+
+/**
+ * @brief Keep a received fragment if it is one we do not have yet: claim it
+ *        in the fragment bitmap of recv_buf->image and inflate it into its
+ *        rows of that image's frame buffer. Lock free, fragments are decoded
+ *        concurrently. The fragment that completes an image has the image
+ *        written out right away.
+ * @return 1 if the fragment was new, 0 if it was a duplicate, -1 if it has
+ *         no valid sequence number or could not be decoded
+ */
+int save_fragment(RECV_BUF *recv_buf);
+
+/**
+ * @brief Fetch fragments with up to max_conn concurrent transfers driven by
+ *        a single curl_multi loop, until every image of the batch is saved.
+ *        Easy handles and receive buffers are created once and reused.
+ *        What each transfer asks for, and from which mirror, comes from
+ *        strategy_next().
+ * @param max_conn number of transfers kept in flight
+ * @return 0 on success, non-zero on error
+ */
+int fetch_fragments_multi(int max_conn);
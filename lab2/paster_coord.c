@@ -0,0 +1,536 @@
+/**
+ * @file paster_coord.c
+ * @brief coordinator engine: instead of fetching, hand each request
+ *        strategy_next() makes to a worker process and keep the fragments
+ *        the workers send back, see coord.h.
+ *
+ *        Every worker is kept at the number of jobs it said it can run, so
+ *        work goes wherever it is done fastest. A targeted job outstanding
+ *        for longer than the hedge delay is sent to a second worker, on a
+ *        second mirror, and whichever copy loses is cancelled, so a slow or
+ *        stuck worker does not hold back the last fragments. A worker that
+ *        has sent nothing for STALL_HEDGES hedge delays while it has jobs is
+ *        taken to be stuck: its jobs are cancelled and go back to the
+ *        strategy, as they do when a worker hangs up, and it gets one job
+ *        at a time until it is heard from again. A cancelled job is not
+ *        answered, so without that one it would never be.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "paster.h"
+#include "strategy.h"
+#include "mirror.h"
+#include "hedge.h"
+#include "metrics.h"
+#include "coord.h"
+
+#define POLL_TIMEOUT_MS 1000
+#define MAX_SLOTS 1024        /* most jobs one worker may ask for */
+#define STALL_HEDGES 4        /* hedge delays of silence that make a worker stuck */
+#define STALL_MIN 0.1         /* seconds, and never less than this        */
+#define STALL_DEFAULT 1.0     /* seconds, before there is a hedge delay   */
+
+/* a request handed to a worker */
+typedef struct job {
+    U32 id;
+    FETCH_REQ req;
+    int busy;                 /* sent and not answered or cancelled      */
+    double start;             /* when it was sent                        */
+    double origin;            /* when the request it serves was first sent */
+    struct job *twin;         /* other copy of a hedged request          */
+    int hedged;               /* a hedge has been sent for this job      */
+    int is_hedge;             /* this job is the second copy             */
+    struct worker *owner;
+} JOB;
+
+/* one worker connection, kept for the report after it hangs up */
+typedef struct worker {
+    int fd;                   /* -1 once gone                            */
+    char name[64];            /* address:port it connected from          */
+    int slots;                /* jobs it runs at once, 0 before HELLO    */
+    int outstanding;
+    JOB *jobs;                /* slots of them                           */
+    COORD_BUF in;
+    double heard;             /* last message, or first job outstanding  */
+    int stalled;              /* stuck, see STALL_HEDGES                 */
+    int stalls;
+    int sent;
+    int useful;
+    int dup;
+    int failed;
+    int cancelled;
+} WORKER;
+
+static WORKER workers[COORD_MAX_WORKERS];
+static int num_workers;       /* connections so far, live or gone        */
+static U32 next_id = 1;
+static int requests;          /* jobs sent, hedges included              */
+static METRICS_SHARD *shard;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int listen_on(int port)
+{
+    struct sockaddr_in sa;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, COORD_MAX_WORKERS) != 0) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void accept_workers(int lfd)
+{
+    while (1) {
+        struct sockaddr_in sa;
+        socklen_t len = sizeof(sa);
+        int one = 1;
+        int fd = accept4(lfd, (struct sockaddr *)&sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+        if (num_workers == COORD_MAX_WORKERS) {
+            fprintf(stderr, "\nno room for another worker, at most %d\n", COORD_MAX_WORKERS);
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        WORKER *w = &workers[num_workers++];
+        memset(w, 0, sizeof(*w));
+        w->fd = fd;
+        snprintf(w->name, sizeof(w->name), "%s:%d", inet_ntoa(sa.sin_addr), ntohs(sa.sin_port));
+    }
+}
+
+/**
+ * @brief job j ends without an answer: cancelled, or its worker is gone
+ */
+static void job_release(JOB *j)
+{
+    if (j->twin != NULL) {
+        j->twin->twin = NULL;
+        j->twin = NULL;
+    }
+    metrics_end(shard, j->req.mirror, NULL, METRICS_CANCELLED);
+    mirror_cancel(j->req.mirror, now_sec() - j->start);
+    strategy_cancel(&j->req);
+    j->busy = 0;
+    j->owner->outstanding--;
+    j->owner->cancelled++;
+}
+
+/**
+ * @brief hand the jobs of w back to the strategy and close it
+ */
+static void worker_drop(WORKER *w)
+{
+    for (int i = 0; i < w->slots; i++) {
+        if (w->jobs[i].busy) {
+            job_release(&w->jobs[i]);
+        }
+    }
+    close(w->fd);
+    w->fd = -1;
+    free(w->jobs);
+    w->jobs = NULL;
+    w->slots = 0;
+    coord_buf_free(&w->in);
+}
+
+static JOB *free_job(WORKER *w)
+{
+    for (int i = 0; i < w->slots; i++) {
+        if (!w->jobs[i].busy) {
+            return &w->jobs[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief send j->req to its worker
+ * @return 0 on success, -1 if the worker is gone
+ */
+static int job_send(WORKER *w, JOB *j)
+{
+    U32 words[3];
+
+    j->id = next_id++;
+    j->owner = w;
+    j->start = j->origin = now_sec();
+    j->twin = NULL;
+    j->hedged = j->is_hedge = 0;
+    words[0] = j->id;
+    words[1] = (U32)j->req.image;
+    words[2] = (U32)j->req.part;
+    if (coord_send(w->fd, COORD_JOB, words, 3, j->req.url, strlen(j->req.url)) != 0) {
+        mirror_cancel(j->req.mirror, 0.0);
+        strategy_cancel(&j->req);
+        return -1;
+    }
+    metrics_start(shard, j->req.mirror);
+    j->busy = 1;
+    if (w->outstanding++ == 0) {
+        w->heard = j->start; /* the silence before it had nothing to answer */
+    }
+    w->sent++;
+    requests++;
+    return 0;
+}
+
+/**
+ * @brief give w as many jobs as it has room for and the strategy has
+ * @return 0 on success, -1 if the worker is gone
+ */
+static int worker_fill(WORKER *w)
+{
+    int room = w->stalled ? 1 : w->slots; /* a stuck one gets a probe */
+
+    while (w->outstanding < room && !fetch_complete()) {
+        JOB *j = free_job(w);
+        if (j == NULL || strategy_next(&j->req) != 0) {
+            break;
+        }
+        if (job_send(w, j) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void on_result(WORKER *w, const COORD_MSG *msg)
+{
+    JOB *j = NULL;
+    int seq = (int)msg->words[1];
+    double seconds = msg->words[2] / 1e6;
+    int saved = -1;
+
+    for (int i = 0; i < w->slots && j == NULL; i++) {
+        if (w->jobs[i].busy && w->jobs[i].id == msg->words[0]) {
+            j = &w->jobs[i];
+        }
+    }
+    if (j == NULL) {
+        return; /* cancelled, its twin brought the fragment */
+    }
+
+    if (seq >= 0) {
+        RECV_BUF rb;
+        memset(&rb, 0, sizeof(rb));
+        rb.buf = (char *)msg->rest;
+        rb.size = msg->rest_len;
+        rb.seq = seq;
+        rb.image = j->req.image;
+        saved = save_fragment(&rb);
+    }
+    if (j->twin != NULL) {
+        /* the first usable answer wins, a failed copy leaves the other running */
+        if (saved >= 0) {
+            JOB *twin = j->twin;
+            U32 id = twin->id;
+            if (j->is_hedge) {
+                hedge_won();
+            }
+            job_release(twin);
+            // The twin is always on another worker, see send_hedges(). A
+            // CANCEL cut short would leave its stream out of step
+            if (coord_send(twin->owner->fd, COORD_CANCEL, &id, 1, NULL, 0) != 0) {
+                worker_drop(twin->owner);
+            }
+        } else {
+            j->twin->twin = NULL;
+            j->twin = NULL;
+        }
+    }
+    if (saved >= 0) {
+        hedge_record(now_sec() - j->origin);
+    }
+    metrics_remote(shard, j->req.mirror,
+                   saved > 0 ? METRICS_NEW : saved == 0 ? METRICS_DUP : METRICS_FAILED,
+                   msg->rest_len, msg->words[2]);
+    mirror_done(j->req.mirror, saved >= 0, seconds);
+    strategy_done(&j->req, saved >= 0, seq, saved > 0);
+    if (saved > 0) {
+        w->useful++;
+    } else if (saved == 0) {
+        w->dup++;
+    } else {
+        w->failed++;
+    }
+    j->busy = 0;
+    w->outstanding--;
+}
+
+/**
+ * @brief read and act on what w sent
+ * @return 0 on success, -1 if w hung up or broke the protocol
+ */
+static int worker_read(WORKER *w)
+{
+    COORD_MSG msg;
+    int open = coord_read(w->fd, &w->in) == 0;
+    int r;
+
+    // Whatever came in before a hang up is still good
+    while ((r = coord_next(&w->in, &msg)) == 1) {
+        w->heard = now_sec();
+        w->stalled = 0;
+        if (msg.type == COORD_HELLO && w->slots == 0) {
+            int slots = msg.words[0] < MAX_SLOTS ? (int)msg.words[0] : MAX_SLOTS;
+            if (slots == 0) {
+                fprintf(stderr, "Worker %s: offered no transfers\n", w->name);
+                return -1;
+            }
+            w->jobs = calloc(slots, sizeof(JOB));
+            if (w->jobs == NULL) {
+                perror("calloc");
+                return -1;
+            }
+            w->slots = slots;
+        } else if (msg.type == COORD_RESULT) {
+            on_result(w, &msg);
+        }
+    }
+    return r < 0 || !open ? -1 : 0;
+}
+
+/**
+ * @brief the live worker other than exclude with the most free slots
+ */
+static WORKER *idlest(const WORKER *exclude)
+{
+    WORKER *best = NULL;
+
+    for (int i = 0; i < num_workers; i++) {
+        WORKER *w = &workers[i];
+        if (w == exclude || w->fd < 0 || w->stalled || w->outstanding >= w->slots) {
+            continue;
+        }
+        if (best == NULL || w->slots - w->outstanding > best->slots - best->outstanding) {
+            best = w;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Send a second copy of every targeted job outstanding for longer
+ *        than the hedge delay to another worker, while one has a free slot
+ *        and there is budget.
+ * @return seconds until the next job becomes due for a hedge, a negative
+ *         value if none will
+ */
+static double send_hedges(void)
+{
+    double delay = hedge_delay();
+    double now = now_sec();
+    double next = -1.0;
+
+    if (delay < 0) {
+        return -1.0;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        WORKER *w = &workers[i];
+        for (int k = 0; k < w->slots; k++) {
+            JOB *j = &w->jobs[k];
+            if (!j->busy || j->hedged || j->req.part < 0) {
+                continue;
+            }
+            double due = j->start + delay - now;
+            if (due > 0) {
+                if (next < 0 || due < next) {
+                    next = due;
+                }
+                continue;
+            }
+            WORKER *other = idlest(w);
+            if (other == NULL || !hedge_room(requests + 1)) {
+                return next;
+            }
+            JOB *h = free_job(other);
+            if (strategy_hedge(&j->req, &h->req) != 0) {
+                continue; /* no other mirror now, try again on a later pass */
+            }
+            if (job_send(other, h) != 0) {
+                worker_drop(other);
+                continue;
+            }
+            hedge_sent();
+            j->hedged = 1;
+            h->origin = j->start;
+            h->hedged = h->is_hedge = 1;
+            h->twin = j;
+            j->twin = h;
+        }
+    }
+    return next;
+}
+
+/**
+ * @brief Take the jobs back from every worker that has been silent for too
+ *        long with jobs outstanding, see STALL_HEDGES. The CANCELs go out
+ *        ahead of any new job, so the worker frees their slots first.
+ * @return seconds until the next worker would count as stuck, a negative
+ *         value if none will
+ */
+static double check_stalls(void)
+{
+    double delay = hedge_delay();
+    double after = delay > 0 ? STALL_HEDGES * delay : STALL_DEFAULT;
+    double now = now_sec();
+    double next = -1.0;
+
+    if (after < STALL_MIN) {
+        after = STALL_MIN;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        WORKER *w = &workers[i];
+        if (w->fd < 0 || w->stalled || w->outstanding == 0) {
+            continue;
+        }
+        double due = w->heard + after - now;
+        if (due > 0) {
+            if (next < 0 || due < next) {
+                next = due;
+            }
+            continue;
+        }
+        w->stalled = 1;
+        w->stalls++;
+        for (int k = 0; k < w->slots; k++) {
+            JOB *j = &w->jobs[k];
+            if (j->busy) {
+                U32 id = j->id;
+                job_release(j);
+                if (coord_send(w->fd, COORD_CANCEL, &id, 1, NULL, 0) != 0) {
+                    worker_drop(w);
+                    break;
+                }
+            }
+        }
+    }
+    return next;
+}
+
+int fetch_fragments_coord(int port)
+{
+    struct pollfd fds[1 + COORD_MAX_WORKERS];
+    WORKER *polled[1 + COORD_MAX_WORKERS];
+    int lfd = listen_on(port);
+    int ret = 0;
+
+    if (lfd < 0) {
+        return -1;
+    }
+    shard = metrics_shard();
+    fprintf(stderr, "Coordinating on port %d, start workers with -w HOST:%d\n", port, port);
+
+    while (!fetch_complete()) {
+        int nfds = 1;
+        int timeout_ms = POLL_TIMEOUT_MS;
+        double next;
+
+        fds[0].fd = lfd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < num_workers; i++) {
+            if (workers[i].fd >= 0) {
+                fds[nfds].fd = workers[i].fd;
+                fds[nfds].events = POLLIN;
+                polled[nfds++] = &workers[i];
+            }
+        }
+
+        /* wake up in time for the next job that may need a hedge, and the
+           next worker that may be stuck */
+        next = send_hedges();
+        if (next >= 0 && next * 1000 < timeout_ms) {
+            timeout_ms = (int)(next * 1000) + 1;
+        }
+        next = check_stalls();
+        if (next >= 0 && next * 1000 < timeout_ms) {
+            timeout_ms = (int)(next * 1000) + 1;
+        }
+        next = strategy_ready_in();
+        if (next >= 0 && next * 1000 < timeout_ms) {
+            timeout_ms = (int)(next * 1000) + 1;
+        }
+        if (poll(fds, nfds, timeout_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            ret = -1;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            accept_workers(lfd);
+        }
+        for (int i = 1; i < nfds; i++) {
+            /* one may have been dropped over a CANCEL to it meanwhile */
+            if (polled[i]->fd >= 0 && fds[i].revents != 0 && worker_read(polled[i]) != 0) {
+                worker_drop(polled[i]);
+            }
+        }
+        /* workers that answered, and new ones, get more */
+        for (int i = 0; i < num_workers && !fetch_complete(); i++) {
+            if (workers[i].fd >= 0 && worker_fill(&workers[i]) != 0) {
+                worker_drop(&workers[i]);
+            }
+        }
+    }
+
+    /* hanging up is what tells the workers the batch is done */
+    for (int i = 0; i < num_workers; i++) {
+        if (workers[i].fd >= 0) {
+            worker_drop(&workers[i]);
+        }
+    }
+    close(lfd);
+    return ret;
+}
+
+void coord_report(FILE *fp)
+{
+    for (int i = 0; i < num_workers; i++) {
+        WORKER *w = &workers[i];
+        fprintf(fp, "Worker %s: %d jobs, %d useful, %d duplicate, %d failed, %d cancelled, "
+                "stuck %d times\n", w->name, w->sent, w->useful, w->dup, w->failed,
+                w->cancelled, w->stalls);
+    }
+}
@@ -0,0 +1,335 @@
+/**
+ * @file paster_multi.c
+ * @brief event driven fetch engine: one thread keeps max_conn transfers in
+ *        flight on a curl_multi handle. Each transfer slot owns an easy handle
+ *        and a receive buffer for the whole run, so a finished transfer is
+ *        re-armed with a new URL instead of being torn down, and its
+ *        connection stays open in the multi handle's pool.
+ *
+ *        A second set of max_conn slots runs hedges: when a targeted request
+ *        is slower than the hedge delay, the same fragment is requested from
+ *        another mirror and whichever copy answers second is cancelled.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <curl/curl.h>
+#include "paster.h"
+#include "strategy.h"
+#include "mirror.h"
+#include "hedge.h"
+#include "metrics.h"
+#include "tune.h"
+#include "deadline.h"
+
+#define SLOT_BUF_SIZE (64*1024) /* a fragment is a few KB, grows if needed */
+#define POLL_TIMEOUT_MS 1000
+
+/* one transfer kept in flight */
+typedef struct transfer_slot {
+    CURL *easy;
+    RECV_BUF recv_buf;
+    FETCH_REQ req;       /* what the running transfer asked for         */
+    int busy;            /* the easy handle is in the multi handle      */
+    double start;        /* when this transfer was started              */
+    double origin;       /* when the request it serves was first sent   */
+    struct transfer_slot *twin; /* other copy of a hedged request       */
+    int hedged;          /* a hedge has been sent for this transfer     */
+} TRANSFER_SLOT;
+
+static METRICS_SHARD *shard; /* of the thread running the loop */
+
+/* seconds on a monotonic clock */
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief start the request in slot->req on the slot's handle
+ */
+static void slot_start(CURLM *cm, TRANSFER_SLOT *slot)
+{
+    recv_buf_reset(&slot->recv_buf);
+    slot->recv_buf.image = slot->req.image;
+    slot->start = slot->origin = now_sec();
+    slot->twin = NULL;
+    slot->hedged = 0;
+    curl_easy_setopt(slot->easy, CURLOPT_URL, slot->req.url);
+    deadline_apply(slot->easy);
+    curl_multi_add_handle(cm, slot->easy);
+    metrics_start(shard, slot->req.mirror);
+    slot->busy = 1;
+}
+
+/**
+ * @brief rewind the slot's buffer, ask the strategy for the next request and
+ *        start it. A slot the strategy has nothing for stays idle.
+ */
+static int slot_arm(CURLM *cm, TRANSFER_SLOT *slot)
+{
+    if (strategy_next(&slot->req) != 0) {
+        tune_starved();
+        return 0;
+    }
+    slot_start(cm, slot);
+    return 1;
+}
+
+/**
+ * @brief Start a hedge for every targeted transfer outstanding for longer
+ *        than the hedge delay, while there are free hedge slots and budget.
+ * @return seconds until the next transfer becomes due for a hedge, a
+ *         negative value if none will
+ */
+static double send_hedges(CURLM *cm, TRANSFER_SLOT *slots, TRANSFER_SLOT *hedges,
+                          int max_conn, int *requests)
+{
+    double delay = hedge_delay();
+    double now = now_sec();
+    double next = -1.0;
+    int h = 0;
+
+    if (delay < 0 || mirror_count() < 2) {
+        return -1.0;
+    }
+    for (int i = 0; i < max_conn; i++) {
+        TRANSFER_SLOT *slot = &slots[i];
+        double due;
+
+        if (!slot->busy || slot->hedged || slot->req.part < 0) {
+            continue;
+        }
+        due = slot->start + delay - now;
+        if (due > 0) {
+            if (next < 0 || due < next) {
+                next = due;
+            }
+            continue;
+        }
+        while (h < max_conn && hedges[h].busy) {
+            h++;
+        }
+        if (h == max_conn) {
+            break;
+        }
+        if (!hedge_room(*requests + 1)) {
+            break; /* no budget until more requests have been issued */
+        }
+        if (strategy_hedge(&slot->req, &hedges[h].req) != 0) {
+            continue; /* no other mirror now, try again on a later pass */
+        }
+        slot_start(cm, &hedges[h]);
+        hedge_sent();
+        slot->hedged = 1;
+        hedges[h].origin = slot->start;
+        hedges[h].hedged = 1;
+        hedges[h].twin = slot;
+        slot->twin = &hedges[h];
+        (*requests)++;
+    }
+    return next;
+}
+
+/**
+ * @brief the other copy of a hedged request lost the race, stop it
+ */
+static void slot_cancel(CURLM *cm, TRANSFER_SLOT *slot)
+{
+    curl_multi_remove_handle(cm, slot->easy);
+    metrics_end(shard, slot->req.mirror, slot->easy, METRICS_CANCELLED);
+    mirror_cancel(slot->req.mirror, now_sec() - slot->start);
+    strategy_cancel(&slot->req);
+    slot->busy = 0;
+    slot->twin = NULL;
+}
+
+static int slot_init(TRANSFER_SLOT *slot)
+{
+    memset(slot, 0, sizeof(*slot));
+    if (recv_buf_init(&slot->recv_buf, SLOT_BUF_SIZE) != 0) {
+        fprintf(stderr, "recv_buf_init failed\n");
+        return -1;
+    }
+    slot->easy = curl_easy_init();
+    if (slot->easy == NULL) {
+        fprintf(stderr, "curl_easy_init: returned NULL\n");
+        recv_buf_cleanup(&slot->recv_buf);
+        return -1;
+    }
+
+    curl_easy_setopt(slot->easy, CURLOPT_WRITEFUNCTION, write_cb_curl3);
+    curl_easy_setopt(slot->easy, CURLOPT_WRITEDATA, (void *)&slot->recv_buf);
+    curl_easy_setopt(slot->easy, CURLOPT_HEADERFUNCTION, header_cb_curl);
+    curl_easy_setopt(slot->easy, CURLOPT_HEADERDATA, (void *)&slot->recv_buf);
+    curl_easy_setopt(slot->easy, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    curl_easy_setopt(slot->easy, CURLOPT_PRIVATE, (void *)slot);
+    return 0;
+}
+
+static void slot_cleanup(TRANSFER_SLOT *slot)
+{
+    if (slot->easy != NULL) {
+        curl_easy_cleanup(slot->easy);
+        recv_buf_cleanup(&slot->recv_buf);
+        slot->easy = NULL;
+    }
+}
+
+int fetch_fragments_multi(int max_conn)
+{
+    TRANSFER_SLOT *slots;
+    TRANSFER_SLOT *hedges;
+    CURLM *cm;
+    int requests = 0;
+    int running = 0;
+    int ret = 0;
+    int i;
+
+    cm = curl_multi_init();
+    if (cm == NULL) {
+        fprintf(stderr, "curl_multi_init: returned NULL\n");
+        return -1;
+    }
+    shard = metrics_shard(); /* without one the run is just not measured */
+    /* one connection per transfer, spread over the mirrors, and room for
+       the hedges so they do not queue behind the requests they hedge */
+    curl_multi_setopt(cm, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)(2 * max_conn));
+    curl_multi_setopt(cm, CURLMOPT_MAXCONNECTS, (long)(2 * max_conn));
+
+    slots = calloc(2 * max_conn, sizeof(TRANSFER_SLOT));
+    if (slots == NULL) {
+        perror("calloc");
+        curl_multi_cleanup(cm);
+        return -1;
+    }
+    hedges = slots + max_conn;
+    for (i = 0; i < 2 * max_conn; i++) {
+        if (slot_init(&slots[i]) != 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+    for (i = 0; i < tune_limit(); i++) {
+        requests += slot_arm(cm, &slots[i]);
+    }
+
+    while (!fetch_complete()) {
+        CURLMcode mc = curl_multi_perform(cm, &running);
+        CURLMsg *msg;
+        int msgs_left;
+        int timeout_ms = POLL_TIMEOUT_MS;
+        double next;
+
+        if (mc != CURLM_OK) {
+            fprintf(stderr, "curl_multi_perform failed: %s\n", curl_multi_strerror(mc));
+            ret = -1;
+            break;
+        }
+
+        /* collect the finished transfers before sleeping, otherwise the
+           poll below would wait on a loop with nothing left to run */
+        while ((msg = curl_multi_info_read(cm, &msgs_left)) != NULL) {
+            TRANSFER_SLOT *slot;
+            double seconds = 0.0;
+
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&slot);
+            if (msg->data.result != CURLE_OK && deadline_passed()) {
+                /* cut short by -D, which says nothing about the mirror */
+                if (slot->twin != NULL) {
+                    slot->twin->twin = NULL;
+                }
+                slot_cancel(cm, slot);
+                continue;
+            }
+            int saved = -1;
+            if (slot->recv_buf.dup) {
+                saved = 0; /* aborted at the header, we have that one */
+            } else if (msg->data.result != CURLE_OK) {
+                fprintf(stderr, "transfer failed: %s\n", curl_easy_strerror(msg->data.result));
+            } else {
+                saved = save_fragment(&slot->recv_buf);
+            }
+            if (slot->twin != NULL) {
+                /* the first usable answer wins, a failed copy leaves the
+                   other one running */
+                if (saved >= 0) {
+                    if (slot >= hedges) {
+                        hedge_won();
+                    }
+                    slot_cancel(cm, slot->twin);
+                } else {
+                    slot->twin->twin = NULL;
+                }
+                slot->twin = NULL;
+            }
+            if (saved >= 0) {
+                hedge_record(now_sec() - slot->origin);
+            }
+            curl_easy_getinfo(slot->easy, CURLINFO_TOTAL_TIME, &seconds);
+            count_connection(slot->easy);
+            metrics_end(shard, slot->req.mirror, slot->easy,
+                        saved > 0 ? METRICS_NEW : saved == 0 ? METRICS_DUP : METRICS_FAILED);
+            mirror_done(slot->req.mirror, saved >= 0, seconds);
+            tune_done(saved >= 0, seconds);
+            strategy_done(&slot->req, saved >= 0, slot->recv_buf.seq, saved > 0);
+
+            /* re-arm the same handle, its connection is kept by cm; hedge
+               slots only run when send_hedges() starts them, and slots
+               past the -t auto limit wait until it grows */
+            curl_multi_remove_handle(cm, slot->easy);
+            slot->busy = 0;
+            if (slot - slots < tune_limit() && !fetch_complete()) {
+                requests += slot_arm(cm, slot);
+            }
+        }
+        /* idle slots get another chance whenever a transfer has ended */
+        for (i = 0; i < tune_limit() && !fetch_complete(); i++) {
+            if (!slots[i].busy) {
+                requests += slot_arm(cm, &slots[i]);
+            }
+        }
+        if (fetch_complete()) {
+            break;
+        }
+
+        /* wake up in time for the next transfer that may need a hedge, and
+           the next request held back by a backoff or breaker */
+        next = send_hedges(cm, slots, hedges, max_conn, &requests);
+        if (next >= 0 && next * 1000 < timeout_ms) {
+            timeout_ms = (int)(next * 1000) + 1;
+        }
+        next = strategy_ready_in();
+        if (next >= 0 && next * 1000 < timeout_ms) {
+            timeout_ms = (int)(next * 1000) + 1;
+        }
+
+        mc = curl_multi_poll(cm, NULL, 0, timeout_ms, NULL);
+        if (mc != CURLM_OK) {
+            fprintf(stderr, "curl_multi_poll failed: %s\n", curl_multi_strerror(mc));
+            ret = -1;
+            break;
+        }
+    }
+
+out:
+    for (i = 0; i < 2 * max_conn; i++) {
+        if (slots[i].busy) {
+            curl_multi_remove_handle(cm, slots[i].easy);
+        }
+        slot_cleanup(&slots[i]);
+    }
+    free(slots);
+    curl_multi_cleanup(cm);
+    return ret;
+}
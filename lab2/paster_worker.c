@@ -0,0 +1,299 @@
+/**
+ * @file paster_worker.c
+ * @brief worker side of a distributed paster, see coord.h: fetch the URLs
+ *        the coordinator sends on a curl_multi handle and send back what the
+ *        server answered, without decoding it.
+ *
+ *        Each job the coordinator may have outstanding has a task with its
+ *        own easy handle and buffer, kept for the whole run like the slots
+ *        of the multi engine. With -t auto only tune_limit() tasks run at
+ *        once and the rest wait their turn in order.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <curl/curl.h>
+#include "paster.h"
+#include "tune.h"
+#include "coord.h"
+#include "deadline.h"
+
+#define TASK_BUF_SIZE (64*1024) /* a fragment is a few KB, grows if needed */
+#define POLL_TIMEOUT_MS 1000
+
+enum { TASK_FREE, TASK_QUEUED, TASK_RUNNING };
+
+/* one job of the coordinator */
+typedef struct task {
+    CURL *easy;
+    RECV_BUF recv_buf;
+    char url[URL_LENGTH];
+    U32 id;
+    int state;
+} TASK;
+
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    int fd = -1;
+    int one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        perror("connect");
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int task_init(TASK *t)
+{
+    memset(t, 0, sizeof(*t));
+    if (recv_buf_init(&t->recv_buf, TASK_BUF_SIZE) != 0) {
+        fprintf(stderr, "recv_buf_init failed\n");
+        return -1;
+    }
+    t->easy = curl_easy_init();
+    if (t->easy == NULL) {
+        fprintf(stderr, "curl_easy_init: returned NULL\n");
+        recv_buf_cleanup(&t->recv_buf);
+        return -1;
+    }
+    curl_easy_setopt(t->easy, CURLOPT_WRITEFUNCTION, write_cb_curl3);
+    curl_easy_setopt(t->easy, CURLOPT_WRITEDATA, (void *)&t->recv_buf);
+    curl_easy_setopt(t->easy, CURLOPT_HEADERFUNCTION, header_cb_curl);
+    curl_easy_setopt(t->easy, CURLOPT_HEADERDATA, (void *)&t->recv_buf);
+    curl_easy_setopt(t->easy, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    curl_easy_setopt(t->easy, CURLOPT_PRIVATE, (void *)t);
+    /* the URLs come off the network, never let one read a file:// or such */
+#if LIBCURL_VERSION_NUM >= 0x075500
+    curl_easy_setopt(t->easy, CURLOPT_PROTOCOLS_STR, "http,https");
+#else
+    curl_easy_setopt(t->easy, CURLOPT_PROTOCOLS, (long)(CURLPROTO_HTTP | CURLPROTO_HTTPS));
+#endif
+    return 0;
+}
+
+/**
+ * @brief the queued task the coordinator sent first, NULL if none is queued
+ */
+static TASK *first_queued(TASK *tasks, int slots)
+{
+    TASK *first = NULL;
+
+    for (int i = 0; i < slots; i++) {
+        if (tasks[i].state == TASK_QUEUED && (first == NULL || tasks[i].id < first->id)) {
+            first = &tasks[i];
+        }
+    }
+    return first;
+}
+
+static TASK *find_task(TASK *tasks, int slots, U32 id)
+{
+    for (int i = 0; i < slots; i++) {
+        if (tasks[i].state != TASK_FREE && tasks[i].id == id) {
+            return &tasks[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief act on one message of the coordinator
+ * @return 0 on success, -1 if it broke the protocol
+ */
+static int on_message(CURLM *cm, TASK *tasks, int slots, int *running, const COORD_MSG *msg)
+{
+    TASK *t;
+
+    if (msg->type == COORD_JOB) {
+        t = NULL;
+        for (int i = 0; i < slots && t == NULL; i++) {
+            if (tasks[i].state == TASK_FREE) {
+                t = &tasks[i];
+            }
+        }
+        if (t == NULL || msg->rest_len >= URL_LENGTH) {
+            fprintf(stderr, "coordinator sent more jobs than slots\n");
+            return -1;
+        }
+        memcpy(t->url, msg->rest, msg->rest_len);
+        t->url[msg->rest_len] = '\0';
+        t->id = msg->words[0];
+        t->state = TASK_QUEUED;
+    } else if (msg->type == COORD_CANCEL) {
+        t = find_task(tasks, slots, msg->words[0]);
+        if (t != NULL) {
+            if (t->state == TASK_RUNNING) {
+                curl_multi_remove_handle(cm, t->easy);
+                (*running)--;
+            }
+            t->state = TASK_FREE;
+        }
+    }
+    return 0;
+}
+
+int paster_worker(const char *host, const char *port, int slots)
+{
+    TASK *tasks;
+    CURLM *cm;
+    COORD_BUF in;
+    U32 hello = (U32)slots;
+    int fd;
+    int running = 0;
+    int jobs = 0;
+    int failed = 0;
+    int ret = 0;
+    int i;
+
+    memset(&in, 0, sizeof(in));
+    fd = connect_to(host, port);
+    if (fd < 0) {
+        return -1;
+    }
+    cm = curl_multi_init();
+    tasks = calloc(slots, sizeof(TASK));
+    if (cm == NULL || tasks == NULL) {
+        fprintf(stderr, "out of memory\n");
+        close(fd);
+        return -1;
+    }
+    curl_multi_setopt(cm, CURLMOPT_MAXCONNECTS, (long)slots);
+    for (i = 0; i < slots; i++) {
+        if (task_init(&tasks[i]) != 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+    if (coord_send(fd, COORD_HELLO, &hello, 1, NULL, 0) != 0) {
+        perror("send");
+        ret = -1;
+        goto out;
+    }
+
+    while (1) {
+        struct curl_waitfd wfd;
+        CURLMsg *msg;
+        COORD_MSG cmsg;
+        int msgs_left;
+        int open;
+        int r;
+
+        /* start what the coordinator sent, in order, as far as the limit allows */
+        TASK *t;
+        while (running < tune_limit() && (t = first_queued(tasks, slots)) != NULL) {
+            recv_buf_reset(&t->recv_buf);
+            curl_easy_setopt(t->easy, CURLOPT_URL, t->url);
+            deadline_apply(t->easy);
+            curl_multi_add_handle(cm, t->easy);
+            t->state = TASK_RUNNING;
+            running++;
+        }
+        if (running < tune_limit()) {
+            tune_starved();
+        }
+
+        if (curl_multi_perform(cm, &r) != CURLM_OK) {
+            fprintf(stderr, "curl_multi_perform failed\n");
+            ret = -1;
+            break;
+        }
+        while ((msg = curl_multi_info_read(cm, &msgs_left)) != NULL) {
+            curl_off_t micros = 0;
+            U32 words[3];
+
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+            curl_easy_getinfo(t->easy, CURLINFO_TOTAL_TIME_T, &micros);
+            int seq = msg->data.result == CURLE_OK ? t->recv_buf.seq : -1;
+            words[0] = t->id;
+            words[1] = (U32)seq;
+            words[2] = (U32)micros;
+            curl_multi_remove_handle(cm, t->easy);
+            t->state = TASK_FREE;
+            running--;
+            jobs++;
+            failed += seq < 0;
+            tune_done(seq >= 0, micros / 1e6);
+
+            // The strip goes back as the server sent it, the coordinator decodes it
+            if (coord_send(fd, COORD_RESULT, words, 3, t->recv_buf.buf,
+                           seq >= 0 ? t->recv_buf.size : 0) != 0) {
+                goto out; /* the coordinator is gone, which means done */
+            }
+        }
+
+        wfd.fd = fd;
+        wfd.events = CURL_WAIT_POLLIN;
+        wfd.revents = 0;
+        if (curl_multi_poll(cm, &wfd, 1, POLL_TIMEOUT_MS, NULL) != CURLM_OK) {
+            fprintf(stderr, "curl_multi_poll failed\n");
+            ret = -1;
+            break;
+        }
+        if (wfd.revents == 0) {
+            continue;
+        }
+        open = coord_read(fd, &in) == 0;
+        while ((r = coord_next(&in, &cmsg)) == 1) {
+            if (on_message(cm, tasks, slots, &running, &cmsg) != 0) {
+                r = -1;
+                break;
+            }
+        }
+        if (r < 0) {
+            fprintf(stderr, "coordinator broke the protocol\n");
+            ret = -1;
+            break;
+        }
+        if (!open) {
+            break; /* every image is in */
+        }
+    }
+
+out:
+    printf("Worker: %d jobs, %d failed\n", jobs, failed);
+    for (i = 0; i < slots; i++) {
+        if (tasks[i].easy != NULL) {
+            if (tasks[i].state == TASK_RUNNING) {
+                curl_multi_remove_handle(cm, tasks[i].easy);
+            }
+            curl_easy_cleanup(tasks[i].easy);
+            recv_buf_cleanup(&tasks[i].recv_buf);
+        }
+    }
+    free(tasks);
+    coord_buf_free(&in);
+    curl_multi_cleanup(cm);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,127 @@
+/**
+ * @file png_writer.h
+ * @brief streaming PNG writer, emits the deflated image data as a sequence
+ *        of fixed-size IDAT chunks while deflate produces them.
+ *
+ * Usage:
+ *   PNG_WRITER w;
+ *   png_writer_open(&w, fd, &ihdr, Z_DEFAULT_COMPRESSION, PNG_IDAT_CHUNK_SIZE);
+ *   png_writer_feed(&w, rows, rows_len);    // as many times as needed
+ *   png_writer_close(&w);                   // writes the tail and IEND
+ *
+ * The output fd does not have to be seekable, so stdout or a pipe works.
+ *
+ * A writer that produces many images should keep its deflate state and
+ * chunk buffers instead of allocating them per image:
+ *   png_writer_init(&w, level, 0);
+ *   for each image:
+ *       png_writer_begin(&w, fd, &ihdr);
+ *       png_writer_feed(...);
+ *       png_writer_finish(&w);
+ *   png_writer_free(&w);
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "zlib.h"
+#include "lab_png.h"
+#include "zutil.h"
+
+#define PNG_IDAT_CHUNK_SIZE (64*1024) /* compressed bytes per IDAT chunk     */
+#define PNG_WRITER_BATCH    4         /* full IDAT chunks per writev() call  */
+
+/* signature plus IHDR chunk, and the IEND chunk */
+#define PNG_HEAD_SIZE (PNG_SIG_SIZE + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + DATA_IHDR_SIZE + CHUNK_CRC_SIZE)
+#define PNG_IEND_SIZE (CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + CHUNK_CRC_SIZE)
+
+typedef struct png_writer {
+    int fd;                 /* output file descriptor, may be a pipe        */
+    z_stream strm;          /* deflate state                                */
+    size_t chunk_size;      /* data bytes per IDAT chunk                    */
+    U8 *bufs;               /* PNG_WRITER_BATCH chunk data buffers          */
+    int nfull;              /* completed chunks waiting in bufs             */
+    U32 crc;                /* running crc of the chunk being filled        */
+    U8 head[PNG_HEAD_SIZE]; /* signature and IHDR                           */
+    size_t head_len;        /* bytes of head not yet written                */
+    U8 chunk_hdr[PNG_WRITER_BATCH][CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE];
+    U8 chunk_crc[PNG_WRITER_BATCH][CHUNK_CRC_SIZE];
+    U32 chunk_len[PNG_WRITER_BATCH];
+    U64 bytes_out;          /* total bytes written to fd                    */
+    int begun;              /* deflate has been used since the last reset   */
+} PNG_WRITER;
+
+/**
+ * @brief Allocate the chunk buffers and the deflate state of a writer.
+ * @param level zlib compression level
+ * @param chunk_size IDAT data bytes per chunk, 0 selects PNG_IDAT_CHUNK_SIZE
+ * @return 0 on success, non-zero on error
+ */
+int png_writer_init(PNG_WRITER *w, int level, size_t chunk_size);
+
+/**
+ * @brief Start a new PNG stream on an initialized writer, resetting the
+ *        deflate state, and queue the signature and IHDR for the first write.
+ * @return 0 on success, non-zero on error
+ */
+int png_writer_begin(PNG_WRITER *w, int fd, const struct data_IHDR *ihdr);
+
+/**
+ * @brief Finish the deflate stream, write the last IDAT chunk and IEND.
+ *        The writer stays initialized and can begin another image.
+ * @return 0 on success, non-zero on error
+ */
+int png_writer_finish(PNG_WRITER *w);
+
+/**
+ * @brief Release the deflate state and buffers of a writer.
+ */
+void png_writer_free(PNG_WRITER *w);
+
+/**
+ * @brief Start a PNG stream: png_writer_init() followed by png_writer_begin().
+ * @param w writer to initialize
+ * @param fd output file descriptor
+ * @param ihdr image header of the final image, host byte order
+ * @param level zlib compression level
+ * @param chunk_size IDAT data bytes per chunk, 0 selects PNG_IDAT_CHUNK_SIZE
+ * @return 0 on success, non-zero on error
+ */
+int png_writer_open(PNG_WRITER *w, int fd, const struct data_IHDR *ihdr,
+                    int level, size_t chunk_size);
+
+/**
+ * @brief Deflate len bytes of filtered scanlines, writing out every IDAT
+ *        chunk that fills up on the way.
+ * @return 0 on success, non-zero on error
+ */
+int png_writer_feed(PNG_WRITER *w, U8 *raw, U64 len);
+
+/**
+ * @brief png_writer_finish() followed by png_writer_free(). The fd is not closed.
+ * @return 0 on success, non-zero on error
+ */
+int png_writer_close(PNG_WRITER *w);
+
+/**
+ * @brief write() the whole iovec array, retrying on partial writes.
+ * @return 0 on success, -1 on error with errno set
+ */
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Store v at p in network byte order.
+ */
+void png_put_u32(U8 *p, U32 v);
+
+/**
+ * @brief Build the PNG signature and the IHDR chunk, PNG_HEAD_SIZE bytes.
+ * @param ihdr image header, host byte order
+ */
+void png_build_head(U8 *head, const struct data_IHDR *ihdr);
+
+/**
+ * @brief Build the IEND chunk, PNG_IEND_SIZE bytes.
+ */
+void png_build_iend(U8 *iend);
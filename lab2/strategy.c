@@ -0,0 +1,516 @@
+/**
+ * @file strategy.c
+ * @brief request planning for paster, see strategy.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "strategy.h"
+#include "mirror.h"
+
+#define RANDOM_URL "http://%s:2520/image?img=%d"
+#define PART_URL   "http://%s:2530/image?img=%d&part=%d"
+#define WAIT_MS    100  /* strategy_wait() re-checks at least this often */
+
+/* whether the part endpoint does what it says, as far as auto knows */
+enum { PART_UNKNOWN, PART_YES, PART_NO };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+/*
+ * What is known about one image of the batch. Bit k of have is set once
+ * fragment k is in, bit k of open while it is missing, no targeted request
+ * for it is running and it is not backing off after a failed one, so a part
+ * to ask for is found a word at a time.
+ */
+typedef struct plan {
+    int img;                          /* image number on the server        */
+    unsigned long long *have;
+    unsigned long long *open;
+    int *in_flight;                   /* targeted requests for it running  */
+    unsigned char *fails;             /* targeted requests for it failed   */
+    signed char *avoid;               /* mirror that failed it last, or -1 */
+    unsigned char *backoff;           /* it is in the retry list           */
+    int num_have;
+    int num_open;
+    int cursor;                       /* word the search for a part starts at */
+} PLAN;
+
+/* a fragment backing off after a failed request */
+typedef struct retry {
+    int image;
+    int part;
+    double due;                       /* seconds, monotonic                */
+} RETRY;
+
+static STRATEGY strategy = STRATEGY_AUTO;
+static PLAN plans[MAX_IMAGES];
+static int num_plans;
+static int num_parts;                 /* fragments per image               */
+static int num_complete;              /* plans with every fragment in      */
+static int part_state;
+static int probing;                   /* a probe request is in flight      */
+static int tail_probed;               /* auto already probed for the tail  */
+static int probe_failures;            /* part probes that got no answer    */
+static RETRY *retries;                /* unordered, a few at a time        */
+static int num_retries;
+static int max_retries;
+static unsigned int seed;
+
+/* what the requests were good for */
+static int num_issued;
+static int num_useful;
+static int num_dup;
+static int num_failed;
+static int num_targeted;
+static int num_backoffs;
+
+int strategy_parse(const char *name, STRATEGY *s)
+{
+    if (strcmp(name, "random") == 0) {
+        *s = STRATEGY_RANDOM;
+    } else if (strcmp(name, "part") == 0) {
+        *s = STRATEGY_PART;
+    } else if (strcmp(name, "auto") == 0) {
+        *s = STRATEGY_AUTO;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int strategy_probe(int img, int avoid, FETCH_REQ *req)
+{
+    req->part = -1;
+    req->image = 0;
+    req->mirror = avoid >= 0 ? mirror_pick_other(avoid) : -1;
+    if (req->mirror < 0) {
+        req->mirror = mirror_pick();
+    }
+    if (req->mirror < 0) {
+        return -1;
+    }
+    snprintf(req->url, sizeof(req->url), RANDOM_URL, mirror_host(req->mirror), img);
+    return 0;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int has(const unsigned long long *bits, int k)
+{
+    return (bits[FRAGMENT_WORD(k)] & FRAGMENT_BIT(k)) != 0;
+}
+
+/**
+ * @brief set or clear the open bit of fragment k to match have and in_flight
+ */
+static void update_open(PLAN *p, int k)
+{
+    int open = !has(p->have, k) && p->in_flight[k] == 0 && !p->backoff[k];
+
+    if (open != has(p->open, k)) {
+        p->open[FRAGMENT_WORD(k)] ^= FRAGMENT_BIT(k);
+        p->num_open += open ? 1 : -1;
+    }
+}
+
+/**
+ * @brief fragment k of p is in
+ */
+static void set_have(PLAN *p, int k)
+{
+    p->have[FRAGMENT_WORD(k)] |= FRAGMENT_BIT(k);
+    update_open(p, k);
+    if (++p->num_have == num_parts) {
+        num_complete++;
+    }
+}
+
+static void plan_free(PLAN *p)
+{
+    free(p->have);
+    free(p->open);
+    free(p->in_flight);
+    free(p->fails);
+    free(p->avoid);
+    free(p->backoff);
+    memset(p, 0, sizeof(*p));
+}
+
+/**
+ * @brief hold fragment part of the image-th plan back after a failed
+ *        request for it, for RETRY_BASE_MS doubled per failure up to
+ *        RETRY_MAX_MS, of which a random half is waited. Called with the
+ *        lock held.
+ */
+static void back_off(int image, int part)
+{
+    PLAN *p = &plans[image];
+    double ms = RETRY_BASE_MS;
+
+    if (p->backoff[part] || has(p->have, part)) {
+        return;
+    }
+    if (num_retries == max_retries) {
+        int n = max_retries > 0 ? 2 * max_retries : 16;
+        RETRY *r = realloc(retries, n * sizeof(RETRY));
+        if (r == NULL) {
+            return; /* it is simply asked for again right away */
+        }
+        retries = r;
+        max_retries = n;
+    }
+    for (int i = 1; i < p->fails[part] && ms < RETRY_MAX_MS; i++) {
+        ms *= 2;
+    }
+    if (ms > RETRY_MAX_MS) {
+        ms = RETRY_MAX_MS;
+    }
+    if (seed == 0) {
+        seed = (unsigned int)time(NULL) ^ (unsigned int)(image * 65536 + part);
+    }
+    ms *= 0.5 + 0.5 * (rand_r(&seed) / ((double)RAND_MAX + 1.0));
+    retries[num_retries].image = image;
+    retries[num_retries].part = part;
+    retries[num_retries].due = now_sec() + ms / 1000.0;
+    num_retries++;
+    p->backoff[part] = 1;
+    update_open(p, part);
+    num_backoffs++;
+}
+
+/**
+ * @brief open the fragments whose backoff is over. Called with the lock held.
+ */
+static void release_retries(void)
+{
+    double now = now_sec();
+
+    for (int i = 0; i < num_retries; ) {
+        if (retries[i].due > now) {
+            i++;
+            continue;
+        }
+        PLAN *p = &plans[retries[i].image];
+        p->backoff[retries[i].part] = 0;
+        update_open(p, retries[i].part);
+        retries[i] = retries[--num_retries];
+    }
+}
+
+int strategy_init(STRATEGY s, const int *imgs, int num_imgs, int num_fragments)
+{
+    int words = FRAGMENT_WORDS(num_fragments);
+    int ret = 0;
+
+    pthread_mutex_lock(&lock);
+    strategy = s;
+    for (int i = 0; i < num_plans; i++) {
+        plan_free(&plans[i]);
+    }
+    num_plans = num_imgs < MAX_IMAGES ? num_imgs : MAX_IMAGES;
+    num_parts = num_fragments;
+    for (int i = 0; i < num_plans; i++) {
+        PLAN *p = &plans[i];
+        p->img = imgs[i];
+        p->have = calloc(words, sizeof(unsigned long long));
+        p->open = calloc(words, sizeof(unsigned long long));
+        p->in_flight = calloc(num_fragments, sizeof(int));
+        p->fails = calloc(num_fragments, 1);
+        p->avoid = malloc(num_fragments);
+        p->backoff = calloc(num_fragments, 1);
+        if (p->have == NULL || p->open == NULL || p->in_flight == NULL ||
+            p->fails == NULL || p->avoid == NULL || p->backoff == NULL) {
+            perror("calloc");
+            ret = -1;
+            continue;
+        }
+        memset(p->avoid, -1, num_fragments);
+        /* every fragment is missing, none is being fetched */
+        memset(p->open, 0xff, words * sizeof(unsigned long long));
+        if (num_fragments % 64 != 0) {
+            p->open[words - 1] = FRAGMENT_BIT(num_fragments) - 1;
+        }
+        p->num_open = num_fragments;
+    }
+    num_complete = 0;
+    part_state = s == STRATEGY_PART ? PART_YES : PART_UNKNOWN;
+    probing = 0;
+    tail_probed = 0;
+    probe_failures = 0;
+    num_retries = 0;
+    num_issued = num_useful = num_dup = num_failed = num_targeted = num_backoffs = 0;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+void strategy_restore(int image, int seq)
+{
+    pthread_mutex_lock(&lock);
+    if (image >= 0 && image < num_plans && seq >= 0 && seq < num_parts &&
+        !has(plans[image].have, seq)) {
+        set_have(&plans[image], seq);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief a missing fragment of p nobody is fetching yet, -1 if there is none.
+ *        The search goes on from where the last one ended, so asking for
+ *        every fragment once costs a pass over the bitmap, not one per part.
+ */
+static int pick_part(PLAN *p)
+{
+    int words = FRAGMENT_WORDS(num_parts);
+
+    if (p->num_open == 0) {
+        return -1;
+    }
+    for (int i = 0; i <= words; i++) {
+        int w = (p->cursor + i) % words;
+        if (p->open[w] != 0) {
+            p->cursor = w;
+            return w * 64 + __builtin_ctzll(p->open[w]);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief the unfinished plans, closest to completion first
+ * @return how many there are
+ */
+static int by_progress(int *order)
+{
+    int n = 0;
+
+    for (int i = 0; i < num_plans; i++) {
+        int j = n;
+        if (plans[i].num_have == num_parts) {
+            continue;
+        }
+        while (j > 0 && plans[order[j - 1]].num_have < plans[i].num_have) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+        n++;
+    }
+    return n;
+}
+
+int strategy_next(FETCH_REQ *req)
+{
+    int order[MAX_IMAGES];
+    int n;
+    int image = -1;
+    int part = -1;
+
+    pthread_mutex_lock(&lock);
+    n = by_progress(order);
+    if (n == 0) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    release_retries();
+
+    if (strategy == STRATEGY_AUTO && part_state == PART_NO &&
+        !tail_probed && num_parts - plans[order[0]].num_have <= STRATEGY_TAIL) {
+        /* random fetching is at its worst now, see if parts work after all */
+        part_state = PART_UNKNOWN;
+        tail_probed = 1;
+    }
+
+    if (strategy == STRATEGY_PART || (strategy == STRATEGY_AUTO && part_state == PART_YES)) {
+        /* the most complete image with a fragment nobody is fetching */
+        for (int i = 0; i < n && part < 0; i++) {
+            part = pick_part(&plans[order[i]]);
+            image = order[i];
+        }
+        if (part < 0) {
+            image = -1; /* every missing fragment is already on its way */
+        }
+    } else {
+        image = order[0];
+        if (strategy == STRATEGY_AUTO && part_state == PART_UNKNOWN && !probing) {
+            part = pick_part(&plans[image]);
+            probing = part >= 0;
+        }
+    }
+
+    if (image >= 0) {
+        PLAN *p = &plans[image];
+
+        // A retry goes elsewhere than the mirror that failed it, if it can
+        req->mirror = -1;
+        if (part >= 0 && p->avoid[part] >= 0) {
+            req->mirror = mirror_pick_other(p->avoid[part]);
+        }
+        if (req->mirror < 0) {
+            req->mirror = mirror_pick();
+        }
+        if (req->mirror < 0) {
+            /* every breaker is open, wait for one to let a trial through */
+            if (part >= 0 && strategy == STRATEGY_AUTO && part_state == PART_UNKNOWN) {
+                probing = 0;
+            }
+            image = -1;
+        }
+    }
+
+    if (image >= 0) {
+        PLAN *p = &plans[image];
+        const char *host = mirror_host(req->mirror);
+
+        req->part = part;
+        req->image = image;
+        if (part >= 0) {
+            p->in_flight[part]++;
+            update_open(p, part);
+            num_targeted++;
+            snprintf(req->url, sizeof(req->url), PART_URL, host, p->img, part);
+        } else {
+            snprintf(req->url, sizeof(req->url), RANDOM_URL, host, p->img);
+        }
+        num_issued++;
+    }
+    pthread_mutex_unlock(&lock);
+    return image >= 0 ? 0 : 1;
+}
+
+void strategy_done(const FETCH_REQ *req, int ok, int seq, int useful)
+{
+    int valid = ok && seq >= 0 && seq < num_parts;
+
+    PLAN *p = &plans[req->image];
+
+    pthread_mutex_lock(&lock);
+    if (req->part >= 0) {
+        p->in_flight[req->part]--;
+        if (!ok) {
+            if (p->fails[req->part] < 255) {
+                p->fails[req->part]++;
+            }
+            p->avoid[req->part] = (signed char)req->mirror;
+            back_off(req->image, req->part);
+        }
+        update_open(p, req->part);
+        if (strategy == STRATEGY_AUTO && part_state == PART_UNKNOWN) {
+            /* a server without &part=K sends a random fragment instead, one
+               that does not answer at all gets a few more tries */
+            if (valid) {
+                part_state = seq == req->part ? PART_YES : PART_NO;
+            } else if (++probe_failures >= STRATEGY_PROBE_TRIES) {
+                part_state = PART_NO;
+            }
+            probing = 0;
+        }
+    }
+    if (valid && !has(p->have, seq)) {
+        set_have(p, seq);
+    }
+    if (!valid) {
+        num_failed++;
+    } else if (useful) {
+        num_useful++;
+    } else {
+        num_dup++;
+    }
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+int strategy_hedge(const FETCH_REQ *req, FETCH_REQ *hedge)
+{
+    PLAN *p = &plans[req->image];
+    int ret = -1;
+
+    pthread_mutex_lock(&lock);
+    if (req->part >= 0 && !has(p->have, req->part)) {
+        hedge->part = req->part;
+        hedge->image = req->image;
+        hedge->mirror = mirror_pick_other(req->mirror);
+        if (hedge->mirror >= 0) {
+            snprintf(hedge->url, sizeof(hedge->url), PART_URL,
+                     mirror_host(hedge->mirror), p->img, hedge->part);
+            p->in_flight[hedge->part]++;
+            update_open(p, hedge->part);
+            num_issued++;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+void strategy_cancel(const FETCH_REQ *req)
+{
+    pthread_mutex_lock(&lock);
+    if (req->part >= 0) {
+        plans[req->image].in_flight[req->part]--;
+        update_open(&plans[req->image], req->part);
+        if (strategy == STRATEGY_AUTO && part_state == PART_UNKNOWN) {
+            /* the other copy settles what auto makes of the part endpoint */
+            probing = 0;
+        }
+    }
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+double strategy_ready_in(void)
+{
+    double next = mirror_ready_in();
+    double now = now_sec();
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < num_retries; i++) {
+        double due = retries[i].due > now ? retries[i].due - now : 0.0;
+        if (next < 0 || due < next) {
+            next = due;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return next;
+}
+
+void strategy_wait(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += WAIT_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&lock);
+    if (num_complete < num_plans) {
+        pthread_cond_timedwait(&changed, &lock, &ts);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void strategy_report(FILE *fp)
+{
+    static const char *names[] = { "random", "part", "auto" };
+
+    pthread_mutex_lock(&lock);
+    fprintf(fp, "Requests (%s): %d issued, %d useful, %d duplicate, %d failed, "
+                "%d targeted, %.2f requests per fragment, %d retries backed off\n",
+            names[strategy], num_issued, num_useful, num_dup, num_failed, num_targeted,
+            num_useful > 0 ? (double)num_issued / num_useful : 0.0, num_backoffs);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,136 @@
+/**
+ * @file strategy.h
+ * @brief decides what the fetch engines request next.
+ *
+ * The :2520 endpoint (image?img=N) returns a random fragment, so collecting
+ * all n of them is a coupon collector problem: about n ln n requests, 225
+ * on average for the usual 50, most of them duplicates. The lab3 endpoint on :2530
+ * also takes &part=K and returns exactly fragment K.
+ *
+ *   random  every request goes to the random endpoint
+ *   part    every request asks the part endpoint for a missing fragment
+ *   auto    probe the part endpoint once; if it answers with the part that
+ *           was asked for, work like part. Otherwise fetch at random and
+ *           probe again for the last STRATEGY_TAIL missing fragments, which
+ *           are the ones random fetching wastes most requests on. A probe
+ *           that gets no answer at all says nothing about the endpoint and
+ *           is retried, up to STRATEGY_PROBE_TRIES times.
+ *
+ * A batch of up to MAX_IMAGES images is planned together. Each request goes
+ * to the unfinished image with the most fragments in that still has one
+ * worth asking for, so the first image completes as early as it would on
+ * its own and the others soak up the transfers it has no use for.
+ *
+ * A targeted request that fails is not asked for again right away: its
+ * fragment waits out an exponential backoff with jitter, RETRY_BASE_MS
+ * doubled for every failure of it up to RETRY_MAX_MS, and the retry goes
+ * to another mirror than the one that failed it if there is one. With the
+ * circuit breakers of mirror.h this keeps a dead mirror from soaking up
+ * the requests for the fragments it failed.
+ *
+ * All functions are thread safe.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include "paster.h"
+
+#define STRATEGY_TAIL 5  /* missing fragments at which auto probes again */
+#define STRATEGY_PROBE_TRIES 3 /* failed part probes before auto gives up on it */
+#define RETRY_BASE_MS 50 /* backoff of a fragment after its first failure */
+#define RETRY_MAX_MS 2000
+
+typedef enum {
+    STRATEGY_RANDOM,
+    STRATEGY_PART,
+    STRATEGY_AUTO,
+} STRATEGY;
+
+/* one request handed to an engine */
+typedef struct fetch_req {
+    char url[URL_LENGTH];
+    int part;      /* fragment asked for, -1 for a random one */
+    int mirror;    /* mirror the request goes to, see mirror.h */
+    int image;     /* index of the image in the batch */
+} FETCH_REQ;
+
+/**
+ * @brief Parse "random", "part" or "auto".
+ * @return 0 on success, -1 if name is not a strategy
+ */
+int strategy_parse(const char *name, STRATEGY *s);
+
+/**
+ * @brief A request for a random fragment of image img, sent on its own
+ *        before a batch is planned to learn from its answer how many
+ *        fragments the images are split into.
+ * @param avoid mirror a probe failed on before, -1 for none
+ * @return 0 with req filled in, -1 if no mirror may be sent a request
+ */
+int strategy_probe(int img, int avoid, FETCH_REQ *req);
+
+/**
+ * @brief Start a new batch of images.
+ * @param imgs image numbers, 1 to 3
+ * @param num_imgs how many, at most MAX_IMAGES
+ * @param num_fragments fragments per image, 1 to MAX_FRAGMENTS
+ * @return 0 on success, -1 if out of memory
+ */
+int strategy_init(STRATEGY s, const int *imgs, int num_imgs, int num_fragments);
+
+/**
+ * @brief Mark fragment seq of the image-th image as in without a request,
+ *        for a fragment restored from a checkpoint or brought in by the
+ *        probe.
+ */
+void strategy_restore(int image, int seq);
+
+/**
+ * @brief Pick the next request and the mirror it goes to. The engine reports
+ *        the transfer to mirror_done() as well as to strategy_done().
+ * @return 0 with req filled in, 1 if there is nothing worth requesting until
+ *         a request in flight finishes or strategy_ready_in() has passed,
+ *         -1 once every fragment of every image is in
+ */
+int strategy_next(FETCH_REQ *req);
+
+/**
+ * @brief Seconds until a fragment is through its retry backoff or a mirror
+ *        breaker lets a request through again, for engines that sleep when
+ *        strategy_next() has nothing.
+ * @return the wait, a negative value if nothing is held back
+ */
+double strategy_ready_in(void);
+
+/**
+ * @brief Report how a request went.
+ * @param ok the transfer completed
+ * @param seq fragment the server sent, -1 if none
+ * @param useful the fragment was new
+ */
+void strategy_done(const FETCH_REQ *req, int ok, int seq, int useful);
+
+/**
+ * @brief Make a second copy of a targeted request, for a different mirror.
+ * @return 0 with hedge filled in, -1 if req is not targeted, its fragment
+ *         is already in or there is no other mirror
+ */
+int strategy_hedge(const FETCH_REQ *req, FETCH_REQ *hedge);
+
+/**
+ * @brief Report that a request was cancelled because its other copy
+ *        answered first. It counts as issued, not as failed.
+ */
+void strategy_cancel(const FETCH_REQ *req);
+
+/**
+ * @brief Block until strategy_next() may have something again, for engines
+ *        that got 1 from it.
+ */
+void strategy_wait(void);
+
+/**
+ * @brief Print requests issued against useful fragments, and the retries.
+ */
+void strategy_report(FILE *fp);
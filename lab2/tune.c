@@ -0,0 +1,224 @@
+/**
+ * @file tune.c
+ * @brief hill climbing on the number of transfers in flight, see tune.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "tune.h"
+
+#define TUNE_HISTORY 32 /* limits remembered for the report */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int limit = 1;
+static int max_limit = 1;
+static int tuning;
+static int stopped;
+
+static double epoch_start;   /* seconds, monotonic                      */
+static int epoch_answers;
+static double epoch_seconds; /* latency summed over the epoch's answers */
+static int epoch_starved;    /* tune_starved() was called               */
+
+static int ramping;          /* still doubling                          */
+static int probing;          /* +1 up, -1 down, 0 holding best_limit    */
+static int last_probe;       /* direction of the last probe             */
+static int held;             /* epochs at best_limit since the last probe */
+static int best_limit;
+static double best_rate;
+static double best_latency;
+static double base_latency;  /* lowest epoch latency                    */
+
+static int history[TUNE_HISTORY];
+static int num_history;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief move to limit n, waking threads it lets run. Called with the lock held.
+ */
+static void set_limit(int n)
+{
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > max_limit) {
+        n = max_limit;
+    }
+    if (n == limit) {
+        return;
+    }
+    if (n > limit) {
+        pthread_cond_broadcast(&cond);
+    }
+    limit = n;
+    if (num_history < TUNE_HISTORY) {
+        history[num_history++] = n;
+    }
+}
+
+static int step(int n)
+{
+    return n / 4 > 1 ? n / 4 : 1;
+}
+
+/**
+ * @brief judge the epoch that just ended at the current limit. Called with
+ *        the lock held.
+ */
+static void end_epoch(double rate, double latency)
+{
+    int inflated;
+
+    if (base_latency == 0.0 || latency < base_latency) {
+        base_latency = latency;
+    }
+    inflated = latency > TUNE_INFLATE * base_latency;
+
+    if (ramping) {
+        if (rate >= best_rate * (1.0 + TUNE_GAIN)) {
+            best_rate = rate;
+            best_latency = latency;
+            best_limit = limit;
+            if (!inflated && limit < max_limit) {
+                set_limit(2 * limit);
+                return;
+            }
+        }
+        ramping = 0;
+        set_limit(best_limit);
+        return;
+    }
+
+    if (probing != 0) {
+        int better = probing > 0 ? rate >= best_rate * (1.0 + TUNE_GAIN) && !inflated
+                                 : rate >= best_rate * (1.0 - TUNE_GAIN / 2);
+        if (better) {
+            best_rate = rate;
+            best_latency = latency;
+            best_limit = limit;
+        } else {
+            set_limit(best_limit);
+        }
+        probing = 0;
+        held = 0;
+        return;
+    }
+
+    // Holding, what the best limit gets now is what a probe has to beat
+    best_rate = rate;
+    best_latency = latency;
+    if (++held >= TUNE_PROBE_EPOCHS) {
+        int up = last_probe <= 0;
+        if ((up && limit < max_limit) || (!up && limit > 1)) {
+            probing = last_probe = up ? 1 : -1;
+            set_limit(up ? limit + step(limit) : limit - step(limit));
+        } else {
+            last_probe = up ? 1 : -1; /* at the edge, try the other way next */
+        }
+        held = 0;
+    }
+}
+
+void tune_init(int start, int max)
+{
+    pthread_mutex_lock(&lock);
+    max_limit = max > start ? max : start;
+    limit = start < 1 ? 1 : start;
+    tuning = max > start;
+    stopped = 0;
+    ramping = tuning;
+    probing = last_probe = held = 0;
+    best_limit = limit;
+    best_rate = best_latency = base_latency = 0.0;
+    epoch_start = now_sec();
+    epoch_answers = 0;
+    epoch_seconds = 0.0;
+    epoch_starved = 0;
+    num_history = 0;
+    history[num_history++] = limit;
+    pthread_mutex_unlock(&lock);
+}
+
+int tune_limit(void)
+{
+    pthread_mutex_lock(&lock);
+    int n = limit;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+void tune_done(int ok, double seconds)
+{
+    pthread_mutex_lock(&lock);
+    if (!tuning || !ok) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    epoch_answers++;
+    epoch_seconds += seconds;
+
+    double now = now_sec();
+    double span = now - epoch_start;
+    int needed = 2 * limit > TUNE_EPOCH_MIN ? 2 * limit : TUNE_EPOCH_MIN;
+    if (span * 1000.0 >= TUNE_EPOCH_MS && epoch_answers >= needed) {
+        // The limit was not what held the transfers back if some were idle
+        if (!epoch_starved) {
+            end_epoch(epoch_answers / span, epoch_seconds / epoch_answers);
+        }
+        epoch_start = now;
+        epoch_answers = 0;
+        epoch_seconds = 0.0;
+        epoch_starved = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void tune_starved(void)
+{
+    pthread_mutex_lock(&lock);
+    epoch_starved = 1;
+    pthread_mutex_unlock(&lock);
+}
+
+void tune_wait(int id)
+{
+    pthread_mutex_lock(&lock);
+    while (id >= limit && !stopped) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void tune_stop(void)
+{
+    pthread_mutex_lock(&lock);
+    stopped = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+void tune_report(FILE *fp)
+{
+    pthread_mutex_lock(&lock);
+    if (tuning) {
+        fprintf(fp, "Concurrency auto: settled on %d transfers, %.0f answers/s at %.1f ms, "
+                "%.1f in flight by Little's law; tried", best_limit, best_rate,
+                best_latency * 1000.0, best_rate * best_latency);
+        for (int i = 0; i < num_history; i++) {
+            fprintf(fp, " %d", history[i]);
+        }
+        fputc('\n', fp);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,74 @@
+/**
+ * @file tune.h
+ * @brief picks how many transfers paster keeps in flight, for -t auto.
+ *
+ * The best -t depends on how far away the mirrors are: at 1 ms a few
+ * transfers keep them busy, at 20 ms it takes dozens. With -t auto the
+ * limit starts at TUNE_START and the answers that come in are counted in
+ * epochs of at least TUNE_EPOCH_MS and TUNE_EPOCH_MIN answers. Each epoch
+ * gives a throughput X (answers per second) and a mean latency W.
+ *
+ * The limit doubles while X grows by TUNE_GAIN or more. Once it does not,
+ * or W has grown past TUNE_INFLATE times the lowest W seen, the limit goes
+ * back to the best one and is held there. Every TUNE_PROBE_EPOCHS epochs a
+ * step of a quarter is tried, alternately up and down: up is kept if X
+ * grows by TUNE_GAIN, down if X drops by less than half of that, since the
+ * same throughput over fewer connections is better for everyone.
+ *
+ * An epoch in which the strategy had nothing to ask for while the limit
+ * left room, as near the end of a part fetch, says nothing about the limit
+ * and is skipped. By Little's law X * W is the number of transfers actually
+ * waiting on the mirrors, which is reported next to the limit.
+ *
+ * All functions are thread safe.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+#define TUNE_START 2          /* transfers in flight to begin with          */
+#define TUNE_MAX 64           /* most -t auto ever uses                     */
+#define TUNE_EPOCH_MS 50      /* shortest epoch                             */
+#define TUNE_EPOCH_MIN 16     /* fewest answers in an epoch, and 2 per transfer */
+#define TUNE_GAIN 0.10        /* throughput gain worth more transfers       */
+#define TUNE_INFLATE 2.0      /* latency growth that stops the ramp         */
+#define TUNE_PROBE_EPOCHS 5   /* epochs held between two probes             */
+
+/**
+ * @brief Fix the limit at start, or with max > start tune it between 1 and
+ *        max starting from start.
+ */
+void tune_init(int start, int max);
+
+/**
+ * @brief Transfers that may be in flight right now.
+ */
+int tune_limit(void);
+
+/**
+ * @brief Count an answer, ok if it was usable, that took seconds.
+ */
+void tune_done(int ok, double seconds);
+
+/**
+ * @brief Note that a transfer could have started but the strategy had
+ *        nothing for it.
+ */
+void tune_starved(void);
+
+/**
+ * @brief Block the id-th fetch thread, from 0, for as long as id is not
+ *        below the limit, until tune_stop().
+ */
+void tune_wait(int id);
+
+/**
+ * @brief Release every thread in tune_wait(), the fetching is over.
+ */
+void tune_stop(void);
+
+/**
+ * @brief With -t auto, print the limit settled on and the ones tried.
+ */
+void tune_report(FILE *fp);
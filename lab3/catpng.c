@@ -36,14 +36,13 @@ Examples:
  * @param chunk A pointer to the chunk whose CRC needs to be updated.
  */
 void update_chunk_crc(chunk_p chunk) {
-    U8 crc_buf[CHUNK_TYPE_SIZE + chunk->length];
-    // make an array that has the combined [type + data ] values in the chunk
-    memcpy(crc_buf, chunk->type, CHUNK_TYPE_SIZE);
-    memcpy(crc_buf + CHUNK_TYPE_SIZE, chunk->p_data, chunk->length);
-    // the crc_buf now has the combined [type + data] values in the chunk
-    // TODO: consider using update_crc instead for performance
-    U32 new_crc = crc(crc_buf, CHUNK_TYPE_SIZE + chunk->length);
-    chunk->crc = new_crc;
+    // the crc of the combined [type + data] values in the chunk, without
+    // copying the data next to the type first
+    U32 new_crc = update_crc(0xffffffffL, chunk->type, CHUNK_TYPE_SIZE);
+    if (chunk->length > 0) {
+        new_crc = update_crc(new_crc, chunk->p_data, chunk->length);
+    }
+    chunk->crc = new_crc ^ 0xffffffffL;
 }
 
 /**
@@ -141,11 +140,16 @@ void concatenate_pngs(char **png_files, int num_png_files) {
         exit(1);
     }
 
+    // The rows of every file are inflated once into one buffer, which grows
+    // by doubling, and deflated once at the end
+    U8 *all_png_buf_inf = NULL; /* filtered rows of the files so far */
+    U64 all_len_inf = 0;        /* bytes of them                     */
+    U64 all_cap_inf = 0;        /* bytes allocated for them          */
     int i;
     for (i = 0; i < num_png_files; i++) {
         FILE* png_file = fopen(png_files[i], "rb");
         // check is_png
-        if (!is_png(png_files[i])) {
+        if (png_file == NULL || !is_png(png_files[i])) {
             fprintf(stderr, "Error: %s is not a valid PNG file\n", png_files[i]);
             exit(1);
         }
@@ -155,14 +159,11 @@ void concatenate_pngs(char **png_files, int num_png_files) {
 
         get_png_data_IHDR(&png_IHDR_data, png_file);
         get_idat_chunk(&png_IDAT, png_file);
+        fclose(png_file);
 
-        // calculate the size of the buffers for the combined inflated png data
-        const int PNG_BUF_SIZE = png_IHDR_data.height*(png_IHDR_data.width * 4 + 1);
-        const int ALL_PNG_BUF_SIZE = all_png_IHDR_data_buf.height*(all_png_IHDR_data_buf.width * 4 + 1);
-        U8 combined_png_buf_def[ALL_PNG_BUF_SIZE+PNG_BUF_SIZE]; /* output buffer for mem_def() */
-        U8 combined_png_buf_inf[ALL_PNG_BUF_SIZE+PNG_BUF_SIZE]; /* output buffer for mem_inf() */
-        U64 comb_len_def = 0;              /* compressed data length   */
-        U64 comb_len_inf = 0;              /* uncompressed data length */
+        // size of the inflated png data of this file
+        const U64 PNG_BUF_SIZE = (U64)png_IHDR_data.height*(png_IHDR_data.width * 4 + 1);
+        U64 second_len_inf = 0;
         int ret;
 
         // update the all_png_IHDR height and ensure width is the same
@@ -172,31 +173,44 @@ void concatenate_pngs(char **png_files, int num_png_files) {
         
         all_png_IHDR_data_buf.height += png_IHDR_data.height;
 
-        // inflate (decompress) the png_IDAT data and all_png IDAT data into buffers (zlib) 
-        U64 second_len_inf = 0;
-        if (i > 0) {
-            ret = mem_inf(combined_png_buf_inf, &comb_len_inf, all_png_IDAT->p_data, all_png_IDAT->length);
-            assert(ret == Z_OK);
+        // make room for its rows after the ones before
+        if (all_len_inf + PNG_BUF_SIZE > all_cap_inf) {
+            U64 cap = all_cap_inf > 0 ? all_cap_inf : PNG_BUF_SIZE;
+            while (cap < all_len_inf + PNG_BUF_SIZE) {
+                cap *= 2;
+            }
+            U8 *q = (U8*)realloc(all_png_buf_inf, cap);
+            if (q == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            all_png_buf_inf = q;
+            all_cap_inf = cap;
         }
-        ret = mem_inf(combined_png_buf_inf+comb_len_inf, &second_len_inf, png_IDAT.p_data, png_IDAT.length);
-        assert(ret == Z_OK);
-        comb_len_inf += second_len_inf;
-
-        assert((ALL_PNG_BUF_SIZE+PNG_BUF_SIZE) == comb_len_inf);
-
-        // compress the new all_png_IDAT data (zlib)
-        ret = mem_def(combined_png_buf_def, &comb_len_def, combined_png_buf_inf, comb_len_inf, Z_DEFAULT_COMPRESSION);
-
-        // realloc the all_png_IDAT->p_data to the new combined buffer
-        all_png_IDAT->p_data = (U8*)realloc(all_png_IDAT->p_data, comb_len_def);
-        memcpy(all_png_IDAT->p_data, combined_png_buf_def, comb_len_def);
 
-        // set the length of the all_png_IDAT chunk to be the return value of mem_def
-        all_png_IDAT->length = comb_len_def;
+        // inflate (decompress) the png_IDAT data behind the rows so far (zlib)
+        ret = mem_inf(all_png_buf_inf + all_len_inf, &second_len_inf, png_IDAT.p_data, png_IDAT.length);
+        assert(ret == Z_OK);
+        assert(second_len_inf == PNG_BUF_SIZE);
+        all_len_inf += second_len_inf;
 
         free(png_IDAT.p_data);
     }
 
+    // compress the all_png_IDAT data (zlib), once for all the files
+    U64 comb_len_def = 0;
+    all_png_IDAT->p_data = (U8*)malloc(compressBound(all_len_inf));
+    if (all_png_IDAT->p_data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (mem_def(all_png_IDAT->p_data, &comb_len_def, all_png_buf_inf, all_len_inf, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        fprintf(stderr, "Error: cannot deflate all.png\n");
+        exit(1);
+    }
+    all_png_IDAT->length = comb_len_def;
+    free(all_png_buf_inf);
+
     // Update the IHDR chunk with the new data ptr and CRC
     U32 width_be = htonl(all_png_IHDR_data_buf.width); // ensure big-endian format for png
     U32 height_be = htonl(all_png_IHDR_data_buf.height); // ensure big-endian format for png
@@ -113,3 +113,13 @@ Steps:
     5. Write the new data_IHDR->height to all_png and compute the new crc
 */
 void concatenate_pngs(char **png_files, int num_png_files);
+
+/**
+ * @brief Set the crc of a chunk from its type and data.
+ */
+void update_chunk_crc(chunk_p chunk);
+
+/**
+ * @brief Write a png of the three chunks, whose crcs are set, to png_file.
+ */
+void write_chunks_to_png_file(FILE *png_file, struct chunk *p_IHDR, struct chunk *p_IDAT, struct chunk *p_IEND);
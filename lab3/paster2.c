@@ -1,6 +1,9 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdatomic.h>
@@ -16,22 +19,64 @@
 #include "lab_png.h"
 #include "crc.h"
 #include "zutil.h"
-#include "shm_stack.h"
+#include "shm_ring.h"
+#include "shm_slab.h"
+#include "shm_frame.h"
+#include "checkpoint.h"
 
 #define ECE252_HEADER "X-Ece252-Fragment: "
+#define ECE252_COUNT_HEADER "X-Ece252-Fragments: " /* sent by fragsrv, not ece252 */
+#define LENGTH_HEADER "Content-Length: "
 #define URL_LENGTH 256
 #define BUF_SIZE 10240  /* 10K */
 #define BUF_INC  524288   /* 1024*512  = 0.5M */
-#define MAX_FRAGMENTS 50
-#define NUM_SEMS 5
+#define NUM_FRAGMENTS 50  /* fragments per image, unless the server says otherwise */
+#define MAX_FRAGMENTS CHECKPOINT_FRAGMENTS
+#define NUM_SEMS 2
 #define SHARED_SEM 1
+#define CHECKPOINT_DIR ".paster2_ckpt" /* default for the optional 6th argument */
+#define NUM_SERVERS 3
+#define CONNECT_TIMEOUT_MS 2000
+#define LOW_SPEED_LIMIT 1024    /* bytes/s, slower than this ...             */
+#define LOW_SPEED_TIME 3        /* ... for this many seconds is a stall      */
+#define REQUEST_TIMEOUT_MS 5000
+#define FETCH_TRIES 6           /* requests for one fragment before giving up */
+#define RETRY_BASE_MS 50        /* backoff after the first failure, doubled   */
+#define RETRY_MAX_MS 2000       /* for every failure after that up to this    */
+#define BREAKER_FAILURES 3      /* failures in a row that open a breaker      */
+#define BREAKER_COOLDOWN 0.5    /* seconds a breaker stays open, doubled for  */
+#define BREAKER_COOLDOWN_MAX 8.0 /* every trip in a row up to this            */
 #define max(a, b) \
    ({ __typeof__ (a) _a = (a); \
        __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
 
 atomic_int fragment_counter = 0; // Counts the number of fragments completed
-volatile int fragment_numbers[50]; // Stores the fragment numbers
+double run_deadline = 0; // Seconds since the epoch the run must end by, 0 for never
+
+/*
+ * Circuit breaker of a server: one that failed BREAKER_FAILURES requests in
+ * a row, or timed out, which is a failure that costs seconds, is skipped
+ * until open_until. Then a single trial request goes to it; if that fails
+ * too it is skipped for twice as long.
+ */
+typedef struct breaker {
+    int streak;        /* failures in a row           */
+    int tripped;       /* trips since the last answer */
+    double open_until; /* seconds since the epoch     */
+} BREAKER;
+
+/*
+ * The breakers of all servers, in shared memory so that what one producer
+ * learns about a server spares the others.
+ */
+typedef struct breakers {
+    sem_t lock;
+    BREAKER b[NUM_SERVERS];
+} BREAKERS;
+
+static BREAKERS *breakers;      // attached by main, inherited by the children
+static int shmid_breakers = -1;
 
 /*
  * Use semaphore to handle the synchronization issue.
@@ -44,14 +89,20 @@ typedef struct recv_buf_flat {
     size_t max_size; /* Max capacity of buf in bytes */
     int seq;         /* >=0 sequence number extracted from HTTP header */
                      /* <0 indicates an invalid seq number */
+    int total;       /* fragments per image from ECE252_COUNT_HEADER, 0 if none */
+    SHM_SLAB *slab;  /* slab buf is a block of, NULL if buf is malloc()ed */
+    SLAB_HANDLE block; /* that block */
 } RECV_BUF;
 
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
 int recv_buf_init(RECV_BUF *ptr, size_t max_size);
+int recv_buf_init_shm(RECV_BUF *ptr, SHM_SLAB *slab, size_t max_size);
+int recv_buf_grow(RECV_BUF *p, size_t need);
 int recv_buf_cleanup(RECV_BUF *ptr);
 int write_file(const char *path, const void *in, size_t len);
 int perform_curl_request(const char *url, RECV_BUF *recv_buf);
+int fetch_fragment(int N, int part, int *server, RECV_BUF *recv_buf);
 
 /**
  * @brief cURL header callback function to extract image sequence number from
@@ -65,6 +116,9 @@ int perform_curl_request(const char *url, RECV_BUF *recv_buf);
  * @details This routine will be invoked multiple times by libcurl until the full
  *          header data are received. We are only interested in the ECE252_HEADER line
  *          received so that we can extract the image sequence number from it.
+ *          A server that says how many fragments there are has that kept in
+ *          p->total, and one that says how long the fragment is has room
+ *          made for it before it arrives.
  */
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata) {
     int realsize = size * nmemb;
@@ -74,6 +128,13 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata) {
         strncmp(p_recv, ECE252_HEADER, strlen(ECE252_HEADER)) == 0) {
         /* Extract image sequence number */
         p->seq = atoi(p_recv + strlen(ECE252_HEADER));
+    } else if (realsize > (int)strlen(ECE252_COUNT_HEADER) &&
+               strncmp(p_recv, ECE252_COUNT_HEADER, strlen(ECE252_COUNT_HEADER)) == 0) {
+        p->total = atoi(p_recv + strlen(ECE252_COUNT_HEADER));
+    } else if (realsize > (int)strlen(LENGTH_HEADER) &&
+               strncasecmp(p_recv, LENGTH_HEADER, strlen(LENGTH_HEADER)) == 0) {
+        /* Failing here is noticed by the write callback */
+        recv_buf_grow(p, strtoul(p_recv + strlen(LENGTH_HEADER), NULL, 10));
     }
     return realsize;
 }
@@ -96,16 +157,8 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
     size_t realsize = size * nmemb;
     RECV_BUF *p = (RECV_BUF *)p_userdata;
 
-    if (p->size + realsize + 1 > p->max_size) { /* Hope this rarely happens */
-        /* Received data is not 0 terminated, add one byte for terminating 0 */
-        size_t new_size = p->max_size + max(BUF_INC, realsize + 1);
-        char *q = (char*) realloc(p->buf, new_size);
-        if (q == NULL) {
-            perror("realloc"); /* Out of memory */
-            return -1;
-        }
-        p->buf = q;
-        p->max_size = new_size;
+    if (recv_buf_grow(p, p->size + realsize) != 0) {
+        return -1;
     }
 
     memcpy(p->buf + p->size, p_recv, realsize); /* Copy data from libcurl */
@@ -137,6 +190,80 @@ int recv_buf_init(RECV_BUF *ptr, size_t max_size) {
     ptr->size = 0;
     ptr->max_size = max_size;
     ptr->seq = -1; /* Valid seq should be non-negative */
+    ptr->total = 0;
+    ptr->slab = NULL;
+    ptr->block = 0;
+    return 0;
+}
+
+/**
+ * @brief Initialize the receive buffer with a block of slab, so that the
+ *        fragment is received straight into shared memory.
+ * @param ptr Pointer to the receive buffer structure
+ * @param slab The slab
+ * @param max_size Size of the block to start with
+ * @return 0 on success, 1 if ptr is NULL, 2 if the slab has no block
+ */
+int recv_buf_init_shm(RECV_BUF *ptr, SHM_SLAB *slab, size_t max_size) {
+    if (ptr == NULL) {
+        return 1;
+    }
+
+    ptr->block = slab_alloc(slab, max_size);
+    if (ptr->block == 0) {
+        return 2;
+    }
+
+    ptr->slab = slab;
+    ptr->buf = slab_ptr(slab, ptr->block);
+    ptr->size = 0;
+    ptr->max_size = slab_size(ptr->block);
+    ptr->seq = -1;
+    ptr->total = 0;
+    return 0;
+}
+
+/**
+ * @brief Make room in the receive buffer for need bytes and a terminating 0.
+ *        A malloc()ed buffer is realloc()ed, a block of a slab swapped for a
+ *        larger one; either copies what was received so far, which with a
+ *        Content-Length is nothing.
+ * @param p Pointer to the receive buffer structure
+ * @param need Bytes the buffer is to hold
+ * @return 0 on success, -1 if there is no memory or no block that large
+ */
+int recv_buf_grow(RECV_BUF *p, size_t need) {
+    if (need + 1 <= p->max_size) {
+        return 0;
+    }
+
+    if (p->slab != NULL) {
+        if (need + 1 > SHM_SLAB_MAX_BLOCK) {
+            fprintf(stderr, "Fragment larger than %d bytes\n", SHM_SLAB_MAX_BLOCK - 1);
+            return -1;
+        }
+        SLAB_HANDLE block = slab_alloc(p->slab, need + 1);
+        if (block == 0) {
+            fprintf(stderr, "No room left in the shared slab for a %zu byte fragment\n", need);
+            return -1;
+        }
+        memcpy(slab_ptr(p->slab, block), p->buf, p->size);
+        slab_free(p->slab, p->block);
+        p->block = block;
+        p->buf = slab_ptr(p->slab, block);
+        p->max_size = slab_size(block);
+        return 0;
+    }
+
+    /* Received data is not 0 terminated, add one byte for terminating 0 */
+    size_t new_size = p->max_size + max(BUF_INC, need + 1 - p->max_size);
+    char *q = (char*) realloc(p->buf, new_size);
+    if (q == NULL) {
+        perror("realloc"); /* Out of memory */
+        return -1;
+    }
+    p->buf = q;
+    p->max_size = new_size;
     return 0;
 }
 
@@ -150,7 +277,13 @@ int recv_buf_cleanup(RECV_BUF *ptr) {
         return 1;
     }
 
-    free(ptr->buf);
+    if (ptr->slab != NULL) {
+        slab_free(ptr->slab, ptr->block);
+        ptr->block = 0;
+    } else {
+        free(ptr->buf);
+    }
+    ptr->buf = NULL;
     ptr->size = 0;
     ptr->max_size = 0;
     return 0;
@@ -190,10 +323,24 @@ int write_file(const char *path, const void *in, size_t len) {
 }
 
 /**
- * @brief Helper function to perform a cURL request.
+ * @brief Seconds since the epoch.
+ */
+static double now_sec(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/**
+ * @brief Helper function to perform a cURL request. The request fails if
+ *        it cannot connect within CONNECT_TIMEOUT_MS, stalls for
+ *        LOW_SPEED_TIME seconds or takes longer than REQUEST_TIMEOUT_MS, or
+ *        what is left until run_deadline.
  * @param url The URL to fetch from
  * @param recv_buf Pointer to the receive buffer structure
- * @return 0 on success, negative value on error
+ * @return 0 on success, -3 if it ran into a timeout, other negative values
+ *         on other errors
  */
 int perform_curl_request(const char *url, RECV_BUF *recv_buf) {
     CURL *curl_handle;
@@ -221,19 +368,169 @@ int perform_curl_request(const char *url, RECV_BUF *recv_buf) {
     /* some servers requires a user-agent field */
     curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
 
+    /* a server that hangs must not hold the producer forever */
+    long timeout_ms = REQUEST_TIMEOUT_MS;
+    if (run_deadline > 0) {
+        long left = (long)((run_deadline - now_sec()) * 1000);
+        if (left < timeout_ms) {
+            timeout_ms = left > 1 ? left : 1; /* 0 would mean no timeout */
+        }
+    }
+    curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS,
+                     timeout_ms < CONNECT_TIMEOUT_MS ? timeout_ms : (long)CONNECT_TIMEOUT_MS);
+    curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_LIMIT, (long)LOW_SPEED_LIMIT);
+    curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_TIME, (long)LOW_SPEED_TIME);
+    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT_MS, timeout_ms);
+
     /* get it! */
     res = curl_easy_perform(curl_handle);
 
     if (res != CURLE_OK) {
         fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
         curl_easy_cleanup(curl_handle);
-        return -2;
+        return res == CURLE_OPERATION_TIMEDOUT ? -3 : -2;
     }
 
     curl_easy_cleanup(curl_handle);
     return 0;
 }
 
+/**
+ * @brief Create the shared breakers, all closed.
+ * @return 0 on success, -1 on error
+ */
+static int breakers_open(void) {
+    shmid_breakers = shmget(IPC_PRIVATE, sizeof(BREAKERS), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    if (shmid_breakers < 0) {
+        perror("shmget");
+        return -1;
+    }
+    breakers = (BREAKERS *)shmat(shmid_breakers, NULL, 0);
+    if (breakers == (void *)-1) {
+        perror("shmat");
+        shmctl(shmid_breakers, IPC_RMID, NULL);
+        return -1;
+    }
+    memset(breakers, 0, sizeof(BREAKERS));
+    if (sem_init(&breakers->lock, SHARED_SEM, 1) != 0) {
+        perror("sem_init");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Remove the shared breakers, once the children are done with them.
+ */
+static void breakers_close(void) {
+    sem_destroy(&breakers->lock);
+    shmdt(breakers);
+    shmctl(shmid_breakers, IPC_RMID, NULL);
+}
+
+/**
+ * @brief The first server from server on (0 based) whose breaker lets a
+ *        request through, server itself if none does. A server let through
+ *        for a trial is held for the trial until breaker_done().
+ */
+static int breaker_pick(int server) {
+    double now = now_sec();
+    int s = server;
+
+    sem_wait(&breakers->lock);
+    for (int i = 0; i < NUM_SERVERS; i++) {
+        BREAKER *b = &breakers->b[(server + i) % NUM_SERVERS];
+        if (b->open_until <= now) {
+            s = (server + i) % NUM_SERVERS;
+            if (b->tripped > 0) {
+                b->open_until = now + REQUEST_TIMEOUT_MS / 1000.; // no other trial meanwhile
+            }
+            break;
+        }
+    }
+    sem_post(&breakers->lock);
+    return s;
+}
+
+/**
+ * @brief Count a request to server (0 based) against its breaker.
+ * @param ok The server sent a fragment
+ * @param timed_out It did not, and took a timeout to say so
+ */
+static void breaker_done(int server, int ok, int timed_out) {
+    BREAKER *b = &breakers->b[server];
+
+    sem_wait(&breakers->lock);
+    if (ok) {
+        b->streak = 0;
+        b->tripped = 0;
+        b->open_until = 0;
+        sem_post(&breakers->lock);
+        return;
+    }
+    // A failure after the cooldown is the trial request's, it opens again at once
+    if (++b->streak >= BREAKER_FAILURES || b->tripped > 0 || timed_out) {
+        double cooldown = BREAKER_COOLDOWN;
+        for (int i = 0; i < b->tripped && cooldown < BREAKER_COOLDOWN_MAX; i++) {
+            cooldown *= 2;
+        }
+        if (cooldown > BREAKER_COOLDOWN_MAX) {
+            cooldown = BREAKER_COOLDOWN_MAX;
+        }
+        // Jittered so that servers that failed together do not come back together
+        b->open_until = now_sec() + cooldown * (0.5 + 0.5 * rand() / ((double)RAND_MAX + 1));
+        b->tripped++;
+    }
+    sem_post(&breakers->lock);
+}
+
+/**
+ * @brief Fetch fragment part of image N, or a random one if part < 0, into
+ *        recv_buf. A failed request is tried again on the next server whose
+ *        breaker is closed, after a backoff of RETRY_BASE_MS doubled per
+ *        failure up to RETRY_MAX_MS of which a random half is waited, up to
+ *        FETCH_TRIES requests and not past run_deadline.
+ * @param N The image number
+ * @param part The fragment, -1 for whichever the server sends
+ * @param server In: the server (0 based) to try first, out: the next one
+ * @param recv_buf Initialized receive buffer, holds the fragment on success
+ * @return 0 on success, -1 if every request failed
+ */
+int fetch_fragment(int N, int part, int *server, RECV_BUF *recv_buf) {
+    char url[URL_LENGTH];
+    double backoff_ms = RETRY_BASE_MS;
+
+    for (int tries = 0; tries < FETCH_TRIES; tries++) {
+        if (run_deadline > 0 && now_sec() >= run_deadline) {
+            break;
+        }
+        // The next server that is not shedding load, the first one if all are
+        int s = breaker_pick(*server);
+        *server = (s + 1) % NUM_SERVERS;
+
+        if (part >= 0) {
+            sprintf(url, "http://ece252-%d.uwaterloo.ca:2530/image?img=%d&part=%d", s + 1, N, part);
+        } else {
+            sprintf(url, "http://ece252-%d.uwaterloo.ca:2520/image?img=%d", s + 1, N);
+        }
+        recv_buf->size = 0;
+        recv_buf->seq = -1;
+        recv_buf->total = 0;
+        int res = perform_curl_request(url, recv_buf);
+        int ok = res == 0 && recv_buf->seq >= 0 && (part < 0 || recv_buf->seq == part);
+        breaker_done(s, ok, res == -3);
+        if (ok) {
+            return 0;
+        }
+        if (tries + 1 < FETCH_TRIES) {
+            usleep((useconds_t)(backoff_ms * (0.5 + 0.5 * rand() / ((double)RAND_MAX + 1)) * 1000));
+            backoff_ms = backoff_ms * 2 < RETRY_MAX_MS ? backoff_ms * 2 : RETRY_MAX_MS;
+        }
+    }
+    recv_buf->seq = -1;
+    return -1;
+}
+
 
 /**
  * @brief Cleans up all shared resources used by the program.
@@ -243,27 +540,31 @@ int perform_curl_request(const char *url, RECV_BUF *recv_buf) {
  * @param num_produced Pointer to the shared counter for produced items
  * @param num_consumed Pointer to the shared counter for consumed items
  * @param sems Pointer to the array of semaphores
- * @param queue Pointer to the shared queue
+ * @param queue Pointer to the shared ring
+ * @param slab Pointer to the shared slab the fragments are kept in
  * @param shmid_num_produced Shared memory ID for num_produced
  * @param shmid_num_consumed Shared memory ID for num_consumed
  * @param shmid_sems Shared memory ID for semaphores
- * @param shmid_stack Shared memory ID for the queue
+ * @param shmid_ring Shared memory ID for the ring
+ * @param shmid_slab Shared memory ID for the slab
  */
-void cleanup_resources(int *num_produced, int *num_consumed, sem_t *sems, struct int_stack *queue, int shmid_num_produced, int shmid_num_consumed, int shmid_sems, int shmid_stack) {
+void cleanup_resources(int *num_produced, int *num_consumed, sem_t *sems, SHM_RING *queue, SHM_SLAB *slab, int shmid_num_produced, int shmid_num_consumed, int shmid_sems, int shmid_ring, int shmid_slab) {
     // Detach shared memory segments
     shmdt(num_produced);
     shmdt(num_consumed);
     shmdt(sems);
     shmdt(queue);
+    shmdt(slab);
 
     // Remove shared memory segments
     shmctl(shmid_num_produced, IPC_RMID, NULL);
     shmctl(shmid_num_consumed, IPC_RMID, NULL);
     shmctl(shmid_sems, IPC_RMID, NULL);
-    shmctl(shmid_stack, IPC_RMID, NULL);
+    shmctl(shmid_ring, IPC_RMID, NULL);
+    shmctl(shmid_slab, IPC_RMID, NULL);
 
     // Destroy semaphores
-    for (int i = 0; i < 5; i++) {
+    for (int i = 0; i < NUM_SEMS; i++) {
         sem_destroy(&sems[i]);
     }
 }
@@ -271,76 +572,64 @@ void cleanup_resources(int *num_produced, int *num_consumed, sem_t *sems, struct
 /**
  * @brief Producer function that fetches image fragments from servers.
  * 
- * This function runs in a loop, fetching image fragments until all 50 fragments
- * have been produced. It uses semaphores for synchronization with consumers.
+ * This function runs in a loop, fetching image fragments until all missing
+ * fragments have been produced. Each is received straight into a block of
+ * the slab, which is then pushed into the ring, blocking while it is full,
+ * and is the consumer's from there on. A fragment that could not be fetched, see fetch_fragment(), is still
+ * pushed, with no sequence number, so that the consumers' count comes out;
+ * it is not kept in the checkpoint and is fetched again the next run.
  * 
  * @param N The image number to fetch
+ * @param missing Fragment numbers not in the checkpoint yet
+ * @param num_missing Number of them
  * @param num_produced Pointer to the shared counter for produced items
- * @param queue Pointer to the shared queue for storing fragments
+ * @param queue Pointer to the shared ring for storing fragments
+ * @param slab Pointer to the shared slab the fragments are kept in
  * @param sems Pointer to the array of semaphores
  */
-void producer(int N, int *num_produced, struct int_stack *queue, sem_t *sems) {
+void producer(int N, const int *missing, int num_missing, int *num_produced, SHM_RING *queue, SHM_SLAB *slab, sem_t *sems) {
     // Assign semaphores to more descriptive names
     sem_t* num_produced_mutex = &sems[0];
-    sem_t* num_free_spaces_sem = &sems[1];
-    sem_t* num_items_sem = &sems[2];
-    sem_t* buffer_mutex = &sems[3];
 
-    int server_num = 1;
+    // Start on a different server in every producer
+    int server = getpid() % NUM_SERVERS;
+    srand(getpid());
     
     // Initialize cURL
     curl_global_init(CURL_GLOBAL_DEFAULT);
 
-    char url[256];
-
     while (true) {
         // Lock update to num_produced with a mutex so that only
         // one producer will fetch a certain fragment number (unique url)
         sem_wait(num_produced_mutex);
         
-        // Check if all fragments have been produced
-        if (*num_produced >= 50) {
+        // Check if all missing fragments have been produced
+        if (*num_produced >= num_missing) {
             sem_post(num_produced_mutex);
             break;
         }
 
-        // Prepare URL for the next fragment
-        memset(url, '\0', sizeof(url));
+        // Take the next fragment
         RECV_BUF recv_buf;
-        sprintf(url, "http://ece252-%d.uwaterloo.ca:2530/image?img=%d&part=%d", server_num, N, *num_produced);
+        int part = missing[*num_produced];
         
         // Increment the number of produced items
         *num_produced += 1;
         sem_post(num_produced_mutex);
 
-        // Initialize buffer for receiving data
-        recv_buf_init(&recv_buf, BUF_SIZE);
-
-        // Perform the cURL request
-        if (perform_curl_request(url, &recv_buf) != 0) {
-            fprintf(stderr, "Failed to perform cURL request\n");
+        // Reserve a block of the slab to receive it in, then fetch it,
+        // from another server if one fails
+        if (recv_buf_init_shm(&recv_buf, slab, BUF_SIZE) != 0) {
+            fprintf(stderr, "No shared memory for fragment %d\n", part);
+            ring_push(queue, -1, 0, 0);
+        } else if (fetch_fragment(N, part, &server, &recv_buf) != 0) {
+            fprintf(stderr, "Giving up on fragment %d\n", part);
+            recv_buf_cleanup(&recv_buf);
+            ring_push(queue, -1, 0, 0);
+        } else {
+            // Publish the block, waiting for a free slot
+            ring_push(queue, recv_buf.seq, recv_buf.block, recv_buf.size);
         }
-
-        // Wait for a free space in the buffer
-        sem_wait(num_free_spaces_sem);
-        
-        // Lock the buffer for writing
-        sem_wait(buffer_mutex);
-        
-        // Add the received fragment to the queue
-        push(queue, recv_buf);
-        
-        // Release the buffer lock
-        sem_post(buffer_mutex);
-        
-        // Signal that a new item is available
-        sem_post(num_items_sem);
-
-        // Clean up the receive buffer
-        recv_buf_cleanup(&recv_buf);
-        
-        // Cycle through servers
-        server_num = (server_num % 3) + 1;
     }
 }
 
@@ -348,28 +637,30 @@ void producer(int N, int *num_produced, struct int_stack *queue, sem_t *sems) {
  * @brief Consumer function that processes image fragments.
  * 
  * This function runs in a loop, consuming image fragments from the shared queue
- * until all 50 fragments have been consumed. It uses semaphores for synchronization
- * with producers.
+ * until all missing fragments have been consumed, and keeps each one in the
+ * checkpoint. Popping blocks while the ring is empty. With a frame, each
+ * fragment is also inflated into its rows of it.
  * 
+ * @param N The image number being fetched
+ * @param num_missing Number of fragments the producers fetch
  * @param sleep_time Time to sleep after processing each fragment (in microseconds)
- * @param queue Pointer to the shared queue for storing fragments
+ * @param queue Pointer to the shared ring for storing fragments
+ * @param slab Pointer to the shared slab the fragments are kept in
+ * @param frame Pointer to the shared frame to assemble the image in, or NULL
  * @param sems Pointer to the array of semaphores
  * @param num_consumed Pointer to the shared counter for consumed items
  */
-void consumer(int sleep_time, struct int_stack* queue, sem_t* sems, int* num_consumed)
+void consumer(int N, int num_missing, int sleep_time, SHM_RING* queue, SHM_SLAB* slab, SHM_FRAME* frame, sem_t* sems, int* num_consumed)
 {
     // Assign semaphores to more descriptive names
-    sem_t* num_consumed_mutex = &sems[4];
-    sem_t* num_free_spaces_sem = &sems[1];
-    sem_t* num_items_sem = &sems[2];
-    sem_t* buffer_mutex = &sems[3];
+    sem_t* num_consumed_mutex = &sems[1];
 
     while (true) {
         // Lock update to num_consumed with a mutex
         sem_wait(num_consumed_mutex);
         
-        // Check if all fragments have been consumed
-        if (*num_consumed >= 50) {
+        // Check if all missing fragments have been consumed
+        if (*num_consumed >= num_missing) {
             sem_post(num_consumed_mutex);
             break;
         }
@@ -378,37 +669,180 @@ void consumer(int sleep_time, struct int_stack* queue, sem_t* sems, int* num_con
         *num_consumed += 1;
         sem_post(num_consumed_mutex);
 
-        char fname[256];
-        RECV_BUF pop_buf;
-        recv_buf_init(&pop_buf, BUF_SIZE);
-
-        // Wait for an item to be available in the buffer
-        sem_wait(num_items_sem);
-
-        // Lock the buffer for reading
-        sem_wait(buffer_mutex);
-        
-        // Remove a fragment from the queue
-        pop(queue, &pop_buf);
-        
-        // Release the buffer lock
-        sem_post(buffer_mutex);
+        // Take the oldest fragment, waiting for one to arrive
+        int seq;
+        SLAB_HANDLE block;
+        size_t size;
+        ring_pop(queue, &seq, &block, &size);
 
         // Simulate processing time
         usleep(sleep_time);
         
-        // Save the fragment to a file
-        sprintf(fname, "./_tmp/%d.png", pop_buf.seq+1);
-        write_file(fname, pop_buf.buf, pop_buf.size);
-        
-        // Clean up the receive buffer
-        recv_buf_cleanup(&pop_buf);
+        // Keep the fragment in the checkpoint, a failed fetch has no seq and is fetched next run
+        if (seq >= 0 && size > 0) {
+            checkpoint_add(N, seq, slab_ptr(slab, block), size);
+            // One that does not fit the frame is left to main()
+            if (frame != NULL) {
+                frame_place(frame, seq, slab_ptr(slab, block), size);
+            }
+        }
+        slab_free(slab, block);
+    }
+}
+
+
+/**
+ * @brief Fetch a random fragment of image N to learn how many fragments the
+ *        image is split into, and keep the fragment in the checkpoint.
+ * @param N The image number
+ * @param num_fragments Fragments the image is split into, 0 to take the
+ *        count the server sends, or NUM_FRAGMENTS if it sends none
+ * @return The count the server sent, 0 if it sent none or did not answer
+ */
+int probe_fragments(int N, int num_fragments) {
+    RECV_BUF recv_buf;
+    int server = 0;
+    int total = 0;
+
+    if (recv_buf_init(&recv_buf, BUF_SIZE) != 0) {
+        return 0;
+    }
+    if (fetch_fragment(N, -1, &server, &recv_buf) == 0) {
+        total = recv_buf.total;
+        if (num_fragments == 0) {
+            num_fragments = total >= 1 && total <= MAX_FRAGMENTS ? total : NUM_FRAGMENTS;
+        }
+        if (recv_buf.seq >= 0 && recv_buf.size > 0 &&
+            checkpoint_split(N, num_fragments) == 0) {
+            checkpoint_add(N, recv_buf.seq, recv_buf.buf, recv_buf.size);
+        }
+    }
+    recv_buf_cleanup(&recv_buf);
+    return total;
+}
+
+/**
+ * @brief Find the fragments of image N the checkpoint does not hold yet.
+ * @param N The image number
+ * @param num_fragments Fragments the image is split into
+ * @param missing Receives the missing fragment numbers
+ * @return Number of missing fragments
+ */
+int find_missing(int N, int num_fragments, int *missing) {
+    int num_missing = 0;
+
+    for (int seq = 0; seq < num_fragments; seq++) {
+        char *buf;
+        size_t len;
+        if (checkpoint_load(N, seq, &buf, &len) == 0) {
+            free(buf);
+        } else {
+            missing[num_missing++] = seq;
+        }
+    }
+    return num_missing;
+}
+
+/**
+ * @brief Write every fragment of image N from the checkpoint to ./_tmp/SEQ.png
+ *        for concatenate_pngs().
+ * @param N The image number
+ * @param num_fragments Fragments the image is split into
+ * @return Number of fragments that are not in the checkpoint
+ */
+int extract_fragments(int N, int num_fragments) {
+    int num_missing = 0;
+
+    for (int seq = 0; seq < num_fragments; seq++) {
+        char fname[256];
+        char *buf;
+        size_t len;
+        if (checkpoint_load(N, seq, &buf, &len) != 0) {
+            num_missing++;
+            continue;
+        }
+        sprintf(fname, "./_tmp/%d.png", seq+1);
+        if (write_file(fname, buf, len) != 0) {
+            num_missing++;
+        }
+        free(buf);
+    }
+    return num_missing;
+}
+
+/**
+ * @brief Create the frame image N is assembled in, in shared memory, laid out
+ *        from the first fragment of it in the checkpoint.
+ * @param N The image number
+ * @param num_fragments Fragments the image is split into
+ * @return The frame, NULL if the checkpoint has no fragment of the image or
+ *         the frame does not take it
+ */
+SHM_FRAME *frame_open(int N, int num_fragments) {
+    U32 width = 0;
+    U32 rows = 0;
+    int shaped = -1;
+
+    for (int seq = 0; seq < num_fragments; seq++) {
+        char *buf;
+        size_t len;
+        if (checkpoint_load(N, seq, &buf, &len) == 0) {
+            shaped = frame_shape((U8 *)buf, len, &width, &rows);
+            free(buf);
+            break;
+        }
+    }
+    size_t size = shaped == 0 ? sizeof_shm_frame(width, rows, num_fragments) : 0;
+    if (size == 0) {
+        return NULL;
+    }
 
-        // Signal that a new space is available in the buffer
-        sem_post(num_free_spaces_sem);
+    int shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    if (shmid < 0) {
+        perror("shmget");
+        return NULL;
     }
+    SHM_FRAME *frame = (SHM_FRAME *)shmat(shmid, NULL, 0);
+    // Gone once the last process detaches, the children inherit it
+    shmctl(shmid, IPC_RMID, NULL);
+    if (frame == (void *)-1) {
+        perror("shmat");
+        return NULL;
+    }
+    init_shm_frame(frame, width, rows, num_fragments);
+    return frame;
 }
 
+/**
+ * @brief Inflate the fragments of image N the consumers did not place, the
+ *        ones resumed from the checkpoint, into the frame.
+ * @param N The image number
+ * @param num_fragments Fragments the image is split into
+ * @param frame The frame
+ * @return Number of fragments that are not in the checkpoint, -1 if one
+ *         does not fit the frame
+ */
+int place_fragments(int N, int num_fragments, SHM_FRAME *frame) {
+    int num_missing = 0;
+
+    for (int seq = 0; seq < num_fragments; seq++) {
+        char *buf;
+        size_t len;
+        if (frame_placed(frame, seq)) {
+            continue;
+        }
+        if (checkpoint_load(N, seq, &buf, &len) != 0) {
+            num_missing++;
+            continue;
+        }
+        int placed = frame_place(frame, seq, (U8 *)buf, len);
+        free(buf);
+        if (placed != 0) {
+            return -1;
+        }
+    }
+    return num_missing;
+}
 
 /**
  * @brief Main function to handle inputs, create processes, and manage the producer-consumer problem.
@@ -416,6 +850,28 @@ void consumer(int sleep_time, struct int_stack* queue, sem_t* sems, int* num_con
  * This function parses command-line arguments, sets up shared memory and semaphores,
  * creates producer and consumer processes, waits for their completion, and then
  * concatenates the gathered image fragments.
+ *
+ * The consumers keep every fragment in a checkpoint (the optional 6th argument,
+ * .paster2_ckpt by default, see checkpoint.h), which is only removed once
+ * all.png is written. A run that was killed or lost its servers is restarted
+ * with the same arguments and fetches only the fragments that are missing.
+ *
+ * The optional 7th argument is the number of fragments the image is split
+ * into. Without it one fragment is fetched before the children start, and
+ * the X-Ece252-Fragments header of the answer says, as fragsrv sends it; a
+ * server that does not send one has the usual NUM_FRAGMENTS. 0 does the same.
+ *
+ * The optional 8th argument is a deadline in seconds for the whole run.
+ * Requests still running then are cut short and no more are made; the
+ * fragments that are in stay in the checkpoint for the next run. Every
+ * request has its own timeouts either way, see perform_curl_request(), and
+ * a failed one is retried on another server, see fetch_fragment().
+ *
+ * With the optional 9th argument 1 the image is assembled in shared memory
+ * instead (see shm_frame.h): the consumers inflate every fragment into its
+ * rows as they take it, and all that is left after them is deflating and
+ * writing all.png. If a fragment turns out not to fit, the fragments are
+ * concatenated as without it.
  * 
  * @param argc Argument count
  * @param argv Argument vector
@@ -426,7 +882,7 @@ int main(int argc, char **argv) {
 
     // Check for correct number of arguments
     if ( argc < 6 ) {
-        fprintf(stderr, "Usage: %s B P C X N\n", argv[0]);
+        fprintf(stderr, "Usage: %s B P C X N [CHECKPOINT_DIR [FRAGMENTS [DEADLINE [FRAMEBUFFER]]]]\n", argv[0]);
         exit(1);
     }
 
@@ -436,6 +892,18 @@ int main(int argc, char **argv) {
     int C = atoi(argv[3]);  // num consumers
     int X = atoi(argv[4]);  // consumer sleep time in ms
     int N = atoi(argv[5]);  // image number
+    const char *checkpoint_dir = argc > 6 ? argv[6] : CHECKPOINT_DIR;
+    int num_fragments = argc > 7 ? atoi(argv[7]) : 0; // 0 until the server says
+    if (num_fragments < 0 || num_fragments > MAX_FRAGMENTS) {
+        fprintf(stderr, "%s: FRAGMENTS must be 0 to %d\n", argv[0], MAX_FRAGMENTS);
+        exit(1);
+    }
+    double deadline = argc > 8 ? atof(argv[8]) : 0; // seconds, 0 for none
+    if (deadline < 0) {
+        fprintf(stderr, "%s: DEADLINE must be 0 or more seconds\n", argv[0]);
+        exit(1);
+    }
+    int use_frame = argc > 9 ? atoi(argv[9]) : 0; // assemble in shared memory
 
     const int NUM_CHILDREN = P + C;
     pid_t pid;
@@ -450,39 +918,105 @@ int main(int argc, char **argv) {
          abort();
     }
     times[0] = (tv.tv_sec) + tv.tv_usec/1000000.;
+    if (deadline > 0) {
+        run_deadline = times[0] + deadline; // inherited by the children
+    }
+
+    // The consumers keep the fragments in the checkpoint, its journal is
+    // synced every CHECKPOINT_SYNC_EVERY fragments, away from the producers
+    if (checkpoint_open(checkpoint_dir, CHECKPOINT_SYNC_EVERY) != 0) {
+        fprintf(stderr, "%s: cannot open the checkpoint in %s\n", argv[0], checkpoint_dir);
+        exit(1);
+    }
+    if (breakers_open() != 0) {
+        exit(1);
+    }
+    int probed = num_fragments == 0; // the probe fragment was not resumed
+    if (probed) {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        num_fragments = probe_fragments(N, 0);
+        curl_global_cleanup();
+        if (num_fragments < 1 || num_fragments > MAX_FRAGMENTS) {
+            num_fragments = NUM_FRAGMENTS;
+        }
+    }
+    // Fragments cut for another count do not fit these, they are dropped
+    if (checkpoint_split(N, num_fragments) != 0) {
+        breakers_close();
+        exit(1);
+    }
+    // The frame is laid out from a fragment, fetch one if none was resumed
+    SHM_FRAME *frame = NULL;
+    if (use_frame) {
+        frame = frame_open(N, num_fragments);
+        if (frame == NULL && !probed) {
+            curl_global_init(CURL_GLOBAL_DEFAULT);
+            probe_fragments(N, num_fragments);
+            curl_global_cleanup();
+            probed = 1;
+            frame = frame_open(N, num_fragments);
+        }
+        if (frame == NULL) {
+            fprintf(stderr, "%s: no frame for the fragments, concatenating them\n", argv[0]);
+        }
+    }
+    int *missing = malloc(num_fragments * sizeof(int));
+    if (missing == NULL) {
+        perror("malloc");
+        breakers_close();
+        exit(1);
+    }
+    int num_missing = find_missing(N, num_fragments, missing);
+    if (num_fragments - num_missing > probed) {
+        printf("Resumed %d fragments from %s\n", num_fragments - num_missing - probed, checkpoint_dir);
+        fflush(stdout); // or every child prints it again when it exits
+    }
 
     // Declare shared memory pointers
     int* num_produced;      // shared num produced counter
     int* num_consumed;      // shared num consumed counter
     sem_t* sems;            // all the semaphores
-    struct int_stack *queue;// storing B numbers of fragments
-    int shm_stack_size = sizeof_shm_stack(B); // size of the stack
+    SHM_RING *queue;        // storing B numbers of fragments
+    SHM_SLAB *slab;         // their bytes
+    size_t shm_ring_size = sizeof_shm_ring(B); // size of the ring
+    // A fragment is in a block from the producer that fetched it to the
+    // consumer that keeps it, and a producer growing its block holds two
+    // for a moment, so at most B + 2P + C blocks are in use. Those of
+    // BUF_SIZE always fit, larger fragments share the overflow area
+    size_t shm_slab_size = sizeof_shm_slab(B + 2 * P + C, BUF_SIZE);
+    if (shm_slab_size == 0) {
+        fprintf(stderr, "%s: B + 2P + C too large\n", argv[0]);
+        breakers_close();
+        exit(1);
+    }
 
     // Allocate shared memory
     int shmid_num_produced = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
     int shmid_num_consumed = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
     int shmid_sems = shmget(IPC_PRIVATE, sizeof(sem_t) * NUM_SEMS, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    int shmid_stack = shmget(IPC_PRIVATE, shm_stack_size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    int shmid_ring = shmget(IPC_PRIVATE, shm_ring_size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    int shmid_slab = shmget(IPC_PRIVATE, shm_slab_size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
 
     // Link shared memory regions to pointers
     num_produced = (int*)shmat(shmid_num_produced, NULL, 0);
     num_consumed = (int*)shmat(shmid_num_consumed, NULL, 0);
     sems = (sem_t*)shmat(shmid_sems, NULL, 0);
-    queue = (struct int_stack*)shmat(shmid_stack, NULL, 0);
+    queue = (SHM_RING*)shmat(shmid_ring, NULL, 0);
+    slab = (SHM_SLAB*)shmat(shmid_slab, NULL, 0);
 
     // Initialize shared memory segments
     *num_produced = 0;
     *num_consumed = 0;
-    if (init_shm_stack(queue, B) > 0) {
-        printf("Unable to initialize stack\n");
+    if (init_shm_ring(queue, B) > 0) {
+        printf("Unable to initialize ring\n");
+    }
+    if (init_shm_slab(slab, B + 2 * P + C, BUF_SIZE) > 0) {
+        printf("Unable to initialize slab\n");
     }
 
     // Initialize semaphores
     status  = sem_init(&sems[0], SHARED_SEM, 1); // num_produced mutex
-    status += sem_init(&sems[4], SHARED_SEM, 1); // num_consumed mutex
-    status += sem_init(&sems[1], SHARED_SEM, B); // does buffer have space semaphore
-    status += sem_init(&sems[2], SHARED_SEM, 0); // does buffer have items semaphore
-    status += sem_init(&sems[3], SHARED_SEM, 1); // buffer critical mutex
+    status += sem_init(&sems[1], SHARED_SEM, 1); // num_consumed mutex
 
     if (status != 0) {
         perror("sem_init");
@@ -496,26 +1030,36 @@ int main(int argc, char **argv) {
         if (pid > 0) {
             cpids[child_i] = pid;
         } else if (pid == 0 && child_i < P) { // Producer process
-            producer(N, num_produced, queue, sems);
+            producer(N, missing, num_missing, num_produced, queue, slab, sems);
 
             // Detach from shared memory
             shmdt(sems);
             shmdt(queue);
+            shmdt(slab);
             shmdt(num_produced);
             shmdt(num_consumed);
+            shmdt(breakers);
             
             // Cleanup cURL
             curl_global_cleanup();
 
             exit(0);
         } else if (pid == 0 && child_i >= P) { // Consumer process
-            consumer(sleep_time, queue, sems, num_consumed);
+            consumer(N, num_missing, sleep_time, queue, slab, frame, sems, num_consumed);
+
+            // Sync what is left of the last batch
+            checkpoint_close(0);
             
             // Detach from shared memory
             shmdt(num_produced);
             shmdt(num_consumed);
             shmdt(queue);
+            shmdt(slab);
             shmdt(sems);
+            shmdt(breakers);
+            if (frame != NULL) {
+                shmdt(frame);
+            }
 
             exit(0);
         } else {
@@ -533,27 +1077,68 @@ int main(int argc, char **argv) {
         }
     }
 
-    // Concatenate gathered fragments
-    // printf("Concatenating fragments...\n");
-    char** fragment_files = malloc(50 * sizeof(char*));
-    for(int i = 0; i < 50; i++){
-        fragment_files[i] = malloc(256 * sizeof(char));
-        sprintf(fragment_files[i], "./_tmp/%d.png", i+1);
+    // Read the journal again for what the consumers added, and hand the
+    // fragments to concatenate_pngs() as files, or place the ones resumed
+    // from it in the frame
+    breakers_close();
+    checkpoint_close(0);
+    if (checkpoint_open(checkpoint_dir, CHECKPOINT_SYNC_EVERY) != 0) {
+        exit(1);
+    }
+    free(missing);
+    if (frame != NULL) {
+        num_missing = place_fragments(N, num_fragments, frame);
+        if (num_missing < 0) {
+            fprintf(stderr, "%s: fragments do not fit the frame, concatenating them\n", argv[0]);
+            shmdt(frame);
+            frame = NULL;
+        }
+    }
+    if (frame == NULL) {
+        num_missing = extract_fragments(N, num_fragments);
+    }
+    if (num_missing > 0) {
+        fprintf(stderr, "%s: %d fragments missing, run again to fetch them\n", argv[0], num_missing);
+        checkpoint_close(0);
+        cleanup_resources(num_produced, num_consumed, sems, queue, slab, shmid_num_produced, shmid_num_consumed, shmid_sems, shmid_ring, shmid_slab);
+        exit(1);
     }
 
-    // Concatenate all the fragments
-    concatenate_pngs(fragment_files, 50);
+    if (frame != NULL) {
+        int written = frame_write(frame, "all.png");
+        shmdt(frame);
+        if (written != 0) {
+            fprintf(stderr, "%s: cannot write all.png\n", argv[0]);
+            checkpoint_close(0);
+            cleanup_resources(num_produced, num_consumed, sems, queue, slab, shmid_num_produced, shmid_num_consumed, shmid_sems, shmid_ring, shmid_slab);
+            exit(1);
+        }
+    } else {
+        // Concatenate gathered fragments
+        // printf("Concatenating fragments...\n");
+        char** fragment_files = malloc(num_fragments * sizeof(char*));
+        for(int i = 0; i < num_fragments; i++){
+            fragment_files[i] = malloc(256 * sizeof(char));
+            sprintf(fragment_files[i], "./_tmp/%d.png", i+1);
+        }
+
+        // Concatenate all the fragments
+        concatenate_pngs(fragment_files, num_fragments);
 
-    // Clean up
-    // printf("Cleaning up...\n");
-    for(int i = 0; i < 50; i++){
-        remove(fragment_files[i]);
-        free(fragment_files[i]);
+        // Clean up
+        // printf("Cleaning up...\n");
+        for(int i = 0; i < num_fragments; i++){
+            remove(fragment_files[i]);
+            free(fragment_files[i]);
+        }
+        free(fragment_files);
     }
-    free(fragment_files);
+
+    // all.png is written, the checkpoint is not needed any more
+    checkpoint_close(1);
 
     // Clean up shared resources
-    cleanup_resources(num_produced, num_consumed, sems, queue, shmid_num_produced, shmid_num_consumed, shmid_sems, shmid_stack);
+    cleanup_resources(num_produced, num_consumed, sems, queue, slab, shmid_num_produced, shmid_num_consumed, shmid_sems, shmid_ring, shmid_slab);
 
     // Stop timer and print execution time
     if (gettimeofday(&tv, NULL) != 0) {
@@ -0,0 +1,347 @@
+/** ringbench.c
+ * @brief contention benchmark of the fragment queue between paster2's
+ *        producers and consumers: the shm_stack guarded by semaphores it
+ *        used to pass fragments through, against the shm_ring.
+ *
+ * @Usage
+ * ringbench [-P NUM] [-C NUM] [-B SLOTS] [-n ITEMS] [-s BYTES] [-r TRIALS] [-q QUEUE]
+ *
+ * Every trial forks P producer and C consumer processes (default 10 and 10)
+ * that move ITEMS items (default 200000) of BYTES bytes each (default 4096,
+ * about the size of a fragment) through a queue of SLOTS slots (default 5)
+ * in shared memory, with no other work in between, so that they contend
+ * for the queue all the time. For each queue the best and median of the
+ * trials (default 5) are reported as items/s and ns/item, with the context
+ * switches per item of the median trial.
+ *
+ *   stack  push() and pop() of shm_stack.c behind a free spaces semaphore,
+ *          an items semaphore and a mutex, as paster2 did
+ *   ring   ring_push() and ring_pop() of shm_ring.c, the items in blocks of
+ *          a shm_slab.c slab, copied in by the producer and out by the
+ *          consumer
+ *
+ * -q runs only one of them. Consumers of the ring check that the items of
+ * every producer come out in the order it pushed them. BYTES may be up to
+ * SHM_SLAB_MAX_BLOCK; the stack, which holds 10240 bytes an item, is left
+ * out above that.
+ *
+ * The Makefile builds with -O0; for representative numbers build with
+ *   make clean ringbench CFLAGS="-Wall -O2 -std=c99"
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <semaphore.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "shm_stack.h"
+#include "shm_ring.h"
+#include "shm_slab.h"
+
+#define STACK_BUF_SIZE 10240 /* what push() and pop() always copy */
+#define MAX_TRIALS 100
+#define ALIGN_UP(n) (((n) + 63) & ~(size_t)63)
+
+/* the layout shm_stack.c keeps its items in */
+typedef struct recv_buf_flat {
+    char *buf;
+    size_t size;
+    size_t max_size;
+    int seq;
+} RECV_BUF;
+
+/* semaphores in front of the stack, as paster2 had them */
+typedef struct stack_sems {
+    sem_t spaces;
+    sem_t items;
+    sem_t mutex;
+} STACK_SEMS;
+
+typedef struct bench_cfg {
+    int P;
+    int C;
+    int B;
+    int n;
+    size_t bytes;
+} BENCH_CFG;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static long context_switches(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_CHILDREN, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+/**
+ * @brief items consumer c of the C pops out of n
+ */
+static int share(int n, int c, int C)
+{
+    return n / C + (c < n % C);
+}
+
+static void stack_producer(const BENCH_CFG *cfg, int p, struct int_stack *stack, STACK_SEMS *sems)
+{
+    RECV_BUF item;
+
+    item.buf = calloc(1, STACK_BUF_SIZE);
+    item.max_size = STACK_BUF_SIZE;
+    item.size = cfg->bytes;
+    for (int seq = p; seq < cfg->n; seq += cfg->P) {
+        item.seq = seq;
+        sem_wait(&sems->spaces);
+        sem_wait(&sems->mutex);
+        push(stack, item);
+        sem_post(&sems->mutex);
+        sem_post(&sems->items);
+    }
+    free(item.buf);
+}
+
+static int stack_consumer(const BENCH_CFG *cfg, int c, struct int_stack *stack, STACK_SEMS *sems)
+{
+    RECV_BUF item;
+    int count = share(cfg->n, c, cfg->C);
+
+    for (int i = 0; i < count; i++) {
+        item.buf = malloc(STACK_BUF_SIZE); /* as paster2 did for every fragment */
+        sem_wait(&sems->items);
+        sem_wait(&sems->mutex);
+        pop(stack, &item);
+        sem_post(&sems->mutex);
+        free(item.buf);
+        sem_post(&sems->spaces);
+    }
+    return 0;
+}
+
+static void ring_producer(const BENCH_CFG *cfg, int p, SHM_RING *ring, SHM_SLAB *slab)
+{
+    char *buf = calloc(1, cfg->bytes);
+
+    for (int seq = p; seq < cfg->n; seq += cfg->P) {
+        SLAB_HANDLE block = slab_alloc(slab, cfg->bytes);
+        memcpy(slab_ptr(slab, block), buf, cfg->bytes);
+        ring_push(ring, seq, block, cfg->bytes);
+    }
+    free(buf);
+}
+
+static int ring_consumer(const BENCH_CFG *cfg, int c, SHM_RING *ring, SHM_SLAB *slab)
+{
+    char *buf = malloc(cfg->bytes);
+    int *last = malloc(cfg->P * sizeof(int)); /* last seq seen of every producer */
+    int count = share(cfg->n, c, cfg->C);
+    int bad = 0;
+
+    for (int p = 0; p < cfg->P; p++) {
+        last[p] = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        int seq;
+        SLAB_HANDLE block;
+        size_t len;
+        ring_pop(ring, &seq, &block, &len);
+        if (block == 0 || seq <= last[seq % cfg->P] || len != cfg->bytes) {
+            bad = 1;
+        } else {
+            memcpy(buf, slab_ptr(slab, block), len);
+        }
+        slab_free(slab, block);
+        last[seq % cfg->P] = seq;
+    }
+    free(last);
+    free(buf);
+    return bad;
+}
+
+/**
+ * @brief run one trial of queue
+ * @return nanoseconds it took, -1 on error
+ */
+static double run_trial(const char *queue, const BENCH_CFG *cfg)
+{
+    int is_ring = strcmp(queue, "ring") == 0;
+    size_t ring_size = ALIGN_UP(sizeof_shm_ring(cfg->B));
+    size_t size = is_ring ? ring_size + sizeof_shm_slab(cfg->B + cfg->P + cfg->C, cfg->bytes)
+                          : sizeof(STACK_SEMS) + sizeof_shm_stack(cfg->B);
+    int shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    int nchildren = cfg->P + cfg->C;
+    int failed = 0;
+    char *shm;
+    double start;
+
+    if (shmid < 0) {
+        perror("shmget");
+        return -1;
+    }
+    shm = shmat(shmid, NULL, 0);
+    shmctl(shmid, IPC_RMID, NULL); /* goes away with the last detach */
+    if (shm == (void *)-1) {
+        perror("shmat");
+        return -1;
+    }
+
+    STACK_SEMS *sems = (STACK_SEMS *)shm;
+    struct int_stack *stack = (struct int_stack *)(shm + sizeof(STACK_SEMS));
+    SHM_RING *ring = (SHM_RING *)shm;
+    SHM_SLAB *slab = (SHM_SLAB *)(shm + ring_size);
+    if (is_ring) {
+        init_shm_ring(ring, cfg->B);
+        init_shm_slab(slab, cfg->B + cfg->P + cfg->C, cfg->bytes);
+    } else {
+        init_shm_stack(stack, cfg->B);
+        sem_init(&sems->spaces, 1, cfg->B);
+        sem_init(&sems->items, 1, 0);
+        sem_init(&sems->mutex, 1, 1);
+    }
+
+    start = now_ns();
+    for (int i = 0; i < nchildren; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            int bad = 0;
+            if (i < cfg->P) {
+                if (is_ring) {
+                    ring_producer(cfg, i, ring, slab);
+                } else {
+                    stack_producer(cfg, i, stack, sems);
+                }
+            } else if (is_ring) {
+                bad = ring_consumer(cfg, i - cfg->P, ring, slab);
+            } else {
+                bad = stack_consumer(cfg, i - cfg->P, stack, sems);
+            }
+            shmdt(shm);
+            _exit(bad);
+        }
+    }
+    for (int i = 0; i < nchildren; i++) {
+        int status;
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    double ns = now_ns() - start;
+
+    if (!is_ring) {
+        sem_destroy(&sems->spaces);
+        sem_destroy(&sems->items);
+        sem_destroy(&sems->mutex);
+    }
+    shmdt(shm);
+    if (failed) {
+        fprintf(stderr, "%s: items out of order or lost\n", queue);
+        return -1;
+    }
+    return ns;
+}
+
+static int run_queue(const char *queue, const BENCH_CFG *cfg, int trials)
+{
+    double ns[MAX_TRIALS];
+    double sorted[MAX_TRIALS];
+    long csw[MAX_TRIALS];
+    int median_i = 0;
+
+    for (int t = 0; t < trials; t++) {
+        long before = context_switches();
+        ns[t] = run_trial(queue, cfg);
+        if (ns[t] < 0) {
+            return -1;
+        }
+        csw[t] = context_switches() - before;
+        sorted[t] = ns[t];
+    }
+    qsort(sorted, trials, sizeof(double), cmp_double);
+    for (int t = 0; t < trials; t++) {
+        if (ns[t] == sorted[trials / 2]) {
+            median_i = t;
+        }
+    }
+    printf("%-6s %12.0f %12.0f %10.1f %10.1f %10.2f\n", queue,
+           cfg->n / (sorted[0] / 1e9), cfg->n / (sorted[trials / 2] / 1e9),
+           sorted[0] / cfg->n, sorted[trials / 2] / cfg->n,
+           (double)csw[median_i] / cfg->n);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    BENCH_CFG cfg = { 10, 10, 5, 200000, 4096 };
+    int trials = 5;
+    const char *only = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "P:C:B:n:s:r:q:")) != -1) {
+        switch (c) {
+        case 'P': cfg.P = atoi(optarg); break;
+        case 'C': cfg.C = atoi(optarg); break;
+        case 'B': cfg.B = atoi(optarg); break;
+        case 'n': cfg.n = atoi(optarg); break;
+        case 's': cfg.bytes = strtoul(optarg, NULL, 10); break;
+        case 'r': trials = atoi(optarg); break;
+        case 'q': only = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-P NUM] [-C NUM] [-B SLOTS] [-n ITEMS] "
+                    "[-s BYTES] [-r TRIALS] [-q stack|ring]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.P < 1 || cfg.C < 1 || cfg.B < 1 || cfg.n < 1 ||
+        cfg.bytes > SHM_SLAB_MAX_BLOCK || trials < 1 || trials > MAX_TRIALS ||
+        sizeof_shm_slab(cfg.B + cfg.P + cfg.C, cfg.bytes) == 0) {
+        fprintf(stderr, "%s: P, C, B, ITEMS and TRIALS (up to %d) must be positive, "
+                "B + P + C not too large, BYTES at most %d\n", argv[0], MAX_TRIALS,
+                SHM_SLAB_MAX_BLOCK);
+        return 1;
+    }
+
+    printf("P=%d C=%d B=%d items=%d bytes=%zu trials=%d\n",
+           cfg.P, cfg.C, cfg.B, cfg.n, cfg.bytes, trials);
+    printf("%-6s %12s %12s %10s %10s %10s\n", "queue",
+           "best items/s", "med items/s", "best ns", "med ns", "csw/item");
+    if (only != NULL && strcmp(only, "stack") == 0 && cfg.bytes > STACK_BUF_SIZE) {
+        fprintf(stderr, "%s: the stack holds at most %d bytes an item\n", argv[0], STACK_BUF_SIZE);
+        return 1;
+    }
+    if ((only == NULL || strcmp(only, "stack") == 0) && cfg.bytes <= STACK_BUF_SIZE) {
+        if (run_queue("stack", &cfg, trials) != 0) {
+            return 1;
+        }
+    }
+    if (only == NULL || strcmp(only, "ring") == 0) {
+        if (run_queue("ring", &cfg, trials) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
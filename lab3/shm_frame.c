@@ -0,0 +1,270 @@
+/**
+ * @file shm_frame.c
+ * @brief image assembled in shared memory by paster2's consumers, see
+ *        shm_frame.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "zutil.h"
+#include "shm_frame.h"
+
+#define CACHE_LINE 64
+#define ALIGN_UP(n) (((n) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1))
+
+struct shm_frame {
+    U32 width;
+    U32 rows;           /* room of every fragment but the last       */
+    int fragments;
+    size_t stride;      /* bytes of a filtered row, width * 4 + 1    */
+    size_t pixels;      /* offset of the rows from the frame         */
+    U32 heights[];      /* rows of each fragment, 0 until it is      */
+                        /* placed, then the rows                     */
+};
+
+/**
+ * @brief rows fragment seq has room for, see shm_frame.h
+ */
+static U32 room(const SHM_FRAME *f, int seq)
+{
+    return seq == f->fragments - 1 ? f->rows + f->fragments - 1 : f->rows;
+}
+
+static U32 be32(const U8 *p)
+{
+    return (U32)p[0] << 24 | (U32)p[1] << 16 | (U32)p[2] << 8 | p[3];
+}
+
+/**
+ * @brief find the IHDR data and the IDAT chunk of a png in memory
+ * @return 0 on success, -1 if it is not a png or has no or several IDATs
+ */
+static int png_chunks(const U8 *png, size_t len, const U8 **ihdr,
+                      const U8 **idat, U32 *idat_len)
+{
+    static const U8 sig[PNG_SIG_SIZE] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+    size_t pos = PNG_SIG_SIZE;
+
+    *ihdr = NULL;
+    *idat = NULL;
+    if (len < PNG_SIG_SIZE || memcmp(png, sig, PNG_SIG_SIZE) != 0) {
+        return -1;
+    }
+    while (pos + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE <= len) {
+        U32 n = be32(png + pos);
+        const U8 *type = png + pos + CHUNK_LEN_SIZE;
+        const U8 *data = type + CHUNK_TYPE_SIZE;
+        if (n > len - pos - CHUNK_LEN_SIZE - CHUNK_TYPE_SIZE - CHUNK_CRC_SIZE) {
+            return -1;
+        }
+        if (memcmp(type, "IHDR", 4) == 0 && n == DATA_IHDR_SIZE) {
+            *ihdr = data;
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            if (*idat != NULL) {
+                return -1;
+            }
+            *idat = data;
+            *idat_len = n;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+        pos += CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + n + CHUNK_CRC_SIZE;
+    }
+    return *ihdr != NULL && *idat != NULL ? 0 : -1;
+}
+
+/**
+ * @brief size and pixel data of a fragment, see frame_shape()
+ */
+static int parse_fragment(const U8 *png, size_t len, U32 *width, U32 *height,
+                          const U8 **idat, U32 *idat_len)
+{
+    const U8 *ihdr;
+
+    if (png_chunks(png, len, &ihdr, idat, idat_len) != 0) {
+        return -1;
+    }
+    /* bit depth 8, colour type 6, compression, filter, no interlace */
+    if (ihdr[8] != 8 || ihdr[9] != 6 || ihdr[10] != 0 || ihdr[11] != 0 || ihdr[12] != 0) {
+        return -1;
+    }
+    *width = be32(ihdr);
+    *height = be32(ihdr + 4);
+    return *width > 0 && *height > 0 ? 0 : -1;
+}
+
+int frame_shape(const U8 *png, size_t len, U32 *width, U32 *height)
+{
+    const U8 *idat;
+    U32 idat_len;
+
+    return parse_fragment(png, len, width, height, &idat, &idat_len);
+}
+
+size_t sizeof_shm_frame(U32 width, U32 rows, int fragments)
+{
+    size_t stride = (size_t)width * 4 + 1;
+    U64 total = (U64)rows * fragments + fragments - 1;
+
+    if (width == 0 || rows == 0 || fragments < 1 || total > (SIZE_MAX / 2) / stride) {
+        return 0;
+    }
+    return ALIGN_UP(sizeof(SHM_FRAME) + fragments * sizeof(U32)) + stride * total;
+}
+
+int init_shm_frame(SHM_FRAME *f, U32 width, U32 rows, int fragments)
+{
+    if (f == NULL || sizeof_shm_frame(width, rows, fragments) == 0) {
+        return 1;
+    }
+    f->width = width;
+    f->rows = rows;
+    f->fragments = fragments;
+    f->stride = (size_t)width * 4 + 1;
+    f->pixels = ALIGN_UP(sizeof(SHM_FRAME) + fragments * sizeof(U32));
+    memset(f->heights, 0, fragments * sizeof(U32));
+    return 0;
+}
+
+int frame_place(SHM_FRAME *f, int seq, const U8 *png, size_t len)
+{
+    const U8 *idat;
+    U32 idat_len;
+    U32 width;
+    U32 height;
+    z_stream strm;
+
+    if (seq < 0 || seq >= f->fragments ||
+        parse_fragment(png, len, &width, &height, &idat, &idat_len) != 0 || width != f->width ||
+        height > room(f, seq)) {
+        return -1;
+    }
+
+    /* inflate straight into its rows, exactly as many as it must give */
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit(&strm) != Z_OK) {
+        return -1;
+    }
+    strm.next_in = (U8 *)idat;
+    strm.avail_in = idat_len;
+    strm.next_out = (U8 *)f + f->pixels + f->stride * f->rows * seq;
+    strm.avail_out = f->stride * height;
+    int ret = inflate(&strm, Z_FINISH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END || strm.avail_out != 0) {
+        return -1;
+    }
+
+    f->heights[seq] = height;
+    return 0;
+}
+
+int frame_placed(const SHM_FRAME *f, int seq)
+{
+    return seq >= 0 && seq < f->fragments && f->heights[seq] > 0;
+}
+
+/**
+ * @brief deflate the rows of every fragment in turn into one zlib stream
+ * @param out receives the stream, to be free()d
+ * @return 0 on success, -1 on error
+ */
+static int deflate_rows(const SHM_FRAME *f, U64 raw_len, U8 **out, U64 *out_len)
+{
+    z_stream strm;
+    U64 cap = compressBound(raw_len);
+    U8 *buf = malloc(cap);
+    int ret = Z_OK;
+
+    memset(&strm, 0, sizeof(strm));
+    if (buf == NULL || deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        free(buf);
+        return -1;
+    }
+    strm.next_out = buf;
+    strm.avail_out = cap;
+    for (int seq = 0; seq < f->fragments && ret == Z_OK; seq++) {
+        int last = seq == f->fragments - 1;
+        strm.next_in = (U8 *)f + f->pixels + f->stride * f->rows * seq;
+        strm.avail_in = f->stride * f->heights[seq];
+        do {
+            if (strm.avail_out == 0) {
+                /* the bound is for one call, a stream fed in parts can pass it */
+                size_t used = strm.next_out - buf;
+                U8 *q = realloc(buf, cap * 2);
+                if (q == NULL) {
+                    ret = Z_MEM_ERROR;
+                    break;
+                }
+                strm.next_out = q + used;
+                strm.avail_out = cap;
+                buf = q;
+                cap *= 2;
+            }
+            ret = deflate(&strm, last ? Z_FINISH : Z_NO_FLUSH);
+        } while (ret == Z_OK && (last || strm.avail_in > 0));
+    }
+    *out_len = strm.total_out;
+    deflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        free(buf);
+        return -1;
+    }
+    *out = buf;
+    return 0;
+}
+
+int frame_write(const SHM_FRAME *f, const char *path)
+{
+    U32 height = 0;
+    U64 raw_len;
+    U64 def_len = 0;
+    U8 ihdr_data[DATA_IHDR_SIZE] = {0};
+    struct chunk ihdr = {DATA_IHDR_SIZE, {'I', 'H', 'D', 'R'}, ihdr_data, 0};
+    struct chunk idat = {0, {'I', 'D', 'A', 'T'}, NULL, 0};
+    struct chunk iend = {0, {'I', 'E', 'N', 'D'}, NULL, 0};
+    U32 width_be = htonl(f->width);
+    U32 height_be;
+    FILE *fp;
+
+    for (int seq = 0; seq < f->fragments; seq++) {
+        if (f->heights[seq] == 0) {
+            return -1;
+        }
+        height += f->heights[seq];
+    }
+    raw_len = f->stride * height;
+    height_be = htonl(height);
+
+    if (deflate_rows(f, raw_len, &idat.p_data, &def_len) != 0) {
+        fprintf(stderr, "Error: cannot deflate %s\n", path);
+        return -1;
+    }
+    idat.length = def_len;
+
+    memcpy(ihdr_data, &width_be, 4);
+    memcpy(ihdr_data + 4, &height_be, 4);
+    ihdr_data[8] = 8;   /* bit depth                    */
+    ihdr_data[9] = 6;   /* colour type, RGBA            */
+    update_chunk_crc(&ihdr);
+    update_chunk_crc(&idat);
+    update_chunk_crc(&iend);
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror("fopen");
+        free(idat.p_data);
+        return -1;
+    }
+    write_chunks_to_png_file(fp, &ihdr, &idat, &iend);
+    free(idat.p_data);
+    if (fclose(fp) != 0) {
+        perror("fclose");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * @file shm_frame.h
+ * @brief the rows of the image paster2 fetches, in shared memory, for its
+ *        consumers to inflate every fragment into as they take it off the
+ *        ring, so that all.png only needs deflating and writing at the end.
+ *
+ * The frame is laid out from one fragment: fragment seq gets the rows from
+ * seq times its height on, room for a fragment that tall, and the last one
+ * room for fragments - 1 rows more, which is where a server that splits
+ * the image into equal strips puts the rows left over (fragsrv does). The
+ * rows each fragment really has are kept, so fragments may be shorter than
+ * their room and all.png has no gaps. Every fragment must be as wide as the
+ * one the frame was laid out from; one that does not fit is not placed, and
+ * the caller falls back to concatenate_pngs().
+ *
+ * Fragments are 8-bit RGBA, not interlaced, with their pixels in a single
+ * IDAT chunk, as concatenate_pngs() expects them; other chunks are skipped.
+ *
+ * Each fragment has its own rows, so consumers place fragments without
+ * locking. The parent reads the frame once they have all exited.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "lab_png.h"
+
+typedef struct shm_frame SHM_FRAME;
+
+/**
+ * @brief Width and height of the fragment png of len bytes.
+ * @return 0 on success, -1 if it is not a fragment a frame takes
+ */
+int frame_shape(const U8 *png, size_t len, U32 *width, U32 *height);
+
+/**
+ * @brief Bytes of shared memory a frame of fragments fragments of width by
+ *        rows pixels takes, with the room the last one gets on top.
+ * @return 0 if that does not fit in memory
+ */
+size_t sizeof_shm_frame(U32 width, U32 rows, int fragments);
+
+/**
+ * @brief Initialize a frame in sizeof_shm_frame() bytes at f.
+ * @return 0 on success, non-zero on bad arguments
+ */
+int init_shm_frame(SHM_FRAME *f, U32 width, U32 rows, int fragments);
+
+/**
+ * @brief Inflate fragment seq, the png of len bytes, into its rows.
+ * @return 0 on success, -1 if it does not fit the frame or is damaged
+ */
+int frame_place(SHM_FRAME *f, int seq, const U8 *png, size_t len);
+
+/**
+ * @brief Whether fragment seq has been placed.
+ */
+int frame_placed(const SHM_FRAME *f, int seq);
+
+/**
+ * @brief Deflate the frame, all of whose fragments are placed, and write it
+ *        to path as one png.
+ * @return 0 on success, -1 on error
+ */
+int frame_write(const SHM_FRAME *f, const char *path);
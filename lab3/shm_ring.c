@@ -0,0 +1,131 @@
+/**
+ * @file shm_ring.c
+ * @brief lock-free FIFO of fragments in shared memory, see shm_ring.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "shm_ring.h"
+
+#define CACHE_LINE 64
+#define WAIT_FREE 0     /* producers, for the slot to be emptied */
+#define WAIT_FILLED 1   /* consumers, for it to be filled        */
+
+/*
+ * The turn of a slot free for pos is 2 pos and of one filled for it
+ * 2 pos + 1; with pos + 1 for filled, as in Vyukov's queue, a ring of one
+ * slot could not tell filled for pos from free for pos + 1. A turn is a
+ * futex word, so it is kept to its low 32 bits; the laps of a slot still
+ * differ there while the capacity is below 2^31. Positions are 64 bits:
+ * a 32-bit one would map pos and pos + 2^32 to different slots unless the
+ * capacity were a power of two, and 2^64 of them are never used up.
+ */
+typedef struct ring_slot {
+    atomic_uint turn;        /* see shm_ring.h                      */
+    atomic_uint waiters[2];  /* asleep on turn, by WAIT_FREE or     */
+                             /* WAIT_FILLED                         */
+    int seq;
+    SLAB_HANDLE block;
+    size_t len;
+} __attribute__((aligned(CACHE_LINE))) RING_SLOT;
+
+struct shm_ring {
+    atomic_ullong head __attribute__((aligned(CACHE_LINE))); /* next position to fill  */
+    atomic_ullong tail __attribute__((aligned(CACHE_LINE))); /* next position to empty */
+    unsigned int capacity __attribute__((aligned(CACHE_LINE)));
+    RING_SLOT slots[];
+};
+
+size_t sizeof_shm_ring(int capacity)
+{
+    return sizeof(SHM_RING) + (size_t)capacity * sizeof(RING_SLOT);
+}
+
+int init_shm_ring(SHM_RING *r, int capacity)
+{
+    if (r == NULL || capacity < 1 || capacity > INT_MAX / 2) {
+        return 1;
+    }
+    memset(r, 0, sizeof_shm_ring(capacity));
+    r->capacity = capacity;
+    for (int i = 0; i < capacity; i++) {
+        atomic_init(&r->slots[i].turn, 2 * i);
+    }
+    return 0;
+}
+
+/**
+ * @brief futex bit of whoever waits for why at pos: 16 bits a side, by the
+ *        lap pos is on, so a change of the slot wakes the one waiting for
+ *        it and not the ones waiting for later laps of the same slot.
+ */
+static unsigned int wait_bit(const SHM_RING *r, unsigned long long pos, int why)
+{
+    return 1u << (why * 16 + (pos / r->capacity) % 16);
+}
+
+/**
+ * @brief sleep until slot has the turn want. Whoever changes it checks the
+ *        waiters after the change, and this checks the turn after counting
+ *        itself in, so one of the two sees the other.
+ */
+static void wait_turn(SHM_RING *r, RING_SLOT *slot, unsigned int want,
+                      unsigned long long pos, int why)
+{
+    unsigned int turn;
+
+    while ((turn = atomic_load_explicit(&slot->turn, memory_order_acquire)) != want) {
+        atomic_fetch_add(&slot->waiters[why], 1);
+        if (atomic_load(&slot->turn) == turn) {
+            /* not a private futex, the other side is another process */
+            syscall(SYS_futex, &slot->turn, FUTEX_WAIT_BITSET, turn, NULL, NULL,
+                    wait_bit(r, pos, why));
+        }
+        atomic_fetch_sub(&slot->waiters[why], 1);
+    }
+}
+
+/**
+ * @brief give slot the turn of pos and wake whoever waits for it, for why
+ */
+static void pass_turn(SHM_RING *r, RING_SLOT *slot, unsigned int turn,
+                      unsigned long long pos, int why)
+{
+    atomic_store(&slot->turn, turn);
+    if (atomic_load(&slot->waiters[why]) > 0) {
+        syscall(SYS_futex, &slot->turn, FUTEX_WAKE_BITSET, INT_MAX, NULL, NULL,
+                wait_bit(r, pos, why));
+    }
+}
+
+void ring_push(SHM_RING *r, int seq, SLAB_HANDLE h, size_t len)
+{
+    unsigned long long pos = atomic_fetch_add_explicit(&r->head, 1, memory_order_relaxed);
+    RING_SLOT *slot = &r->slots[pos % r->capacity];
+
+    /* full while the consumer of pos - capacity has not emptied it */
+    wait_turn(r, slot, (unsigned int)(2 * pos), pos, WAIT_FREE);
+    slot->seq = seq;
+    slot->block = h;
+    slot->len = len;
+    pass_turn(r, slot, (unsigned int)(2 * pos + 1), pos, WAIT_FILLED);
+}
+
+void ring_pop(SHM_RING *r, int *seq, SLAB_HANDLE *h, size_t *len)
+{
+    unsigned long long pos = atomic_fetch_add_explicit(&r->tail, 1, memory_order_relaxed);
+    RING_SLOT *slot = &r->slots[pos % r->capacity];
+
+    /* empty while the producer of pos has not filled it */
+    wait_turn(r, slot, (unsigned int)(2 * pos + 1), pos, WAIT_FILLED);
+    *seq = slot->seq;
+    *h = slot->block;
+    *len = slot->len;
+    pass_turn(r, slot, (unsigned int)(2 * (pos + r->capacity)), pos + r->capacity, WAIT_FREE);
+}
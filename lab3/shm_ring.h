@@ -0,0 +1,59 @@
+/**
+ * @file shm_ring.h
+ * @brief bounded multi-producer multi-consumer FIFO of fragments, to be
+ *        placed in shared memory and used by any number of processes. An
+ *        entry is the slab handle (shm_slab.h) and length of a fragment,
+ *        its bytes stay where the producer put them.
+ *
+ * The ring is Vyukov's bounded MPMC queue, with tickets. Every slot has a
+ * turn number: a producer takes position pos with one fetch-and-add on
+ * the head counter, waits for the slot to be free for pos, copies the
+ * entry in and publishes it by marking the slot filled for pos. A
+ * consumer takes pos the same way on the tail counter, waits for the slot
+ * to be filled for pos, copies the entry out and marks it free for
+ * pos + capacity. No lock is taken, and producers and consumers only ever
+ * meet on a slot. The two counters and every slot header have a cache
+ * line of their own.
+ *
+ * Only a producer that finds its slot still full or a consumer that finds
+ * it still empty sleeps, in futex(2) on the slot's turn. The side that
+ * moves the turn on wakes it, and makes that system call only if someone
+ * is asleep on the slot.
+ *
+ * Fragments come out in the order their positions were claimed, so the
+ * ring is FIFO.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "shm_slab.h"
+
+typedef struct shm_ring SHM_RING;
+
+/**
+ * @brief Bytes of shared memory a ring of capacity slots takes.
+ */
+size_t sizeof_shm_ring(int capacity);
+
+/**
+ * @brief Initialize a ring in sizeof_shm_ring(capacity) bytes at r, which
+ *        must be aligned to a cache line, as shmat() memory is.
+ * @return 0 on success, non-zero if capacity is less than 1 or 2^30 or more
+ */
+int init_shm_ring(SHM_RING *r, int capacity);
+
+/**
+ * @brief Append fragment seq, len bytes in block h, sleeping while the
+ *        ring is full. The block is the consumer's to free from now on.
+ */
+void ring_push(SHM_RING *r, int seq, SLAB_HANDLE h, size_t len);
+
+/**
+ * @brief Take the oldest fragment out of the ring, sleeping while it is
+ *        empty.
+ * @param seq receives its sequence number
+ * @param h receives the block it is in, to slab_free() when done with it
+ * @param len receives how many bytes it has
+ */
+void ring_pop(SHM_RING *r, int *seq, SLAB_HANDLE *h, size_t *len);
@@ -0,0 +1,172 @@
+/**
+ * @file shm_slab.c
+ * @brief size class allocator in shared memory, see shm_slab.h.
+ */
+
+#include <string.h>
+#include <stdatomic.h>
+#include "shm_slab.h"
+
+#define CACHE_LINE 64
+#define SLAB_CLASSES 13     /* SHM_SLAB_MIN_BLOCK << 12 == SHM_SLAB_MAX_BLOCK */
+#define CLASS_MASK 63       /* blocks are 64-byte aligned, the low bits of a  */
+                            /* handle are free for its class                  */
+
+/*
+ * Free list of one class. head is the offset of the first free block in
+ * the low 32 bits and a tag in the high ones; a free block keeps the
+ * offset of the next one in its first 4 bytes.
+ */
+typedef struct slab_class {
+    _Atomic uint64_t head;
+} __attribute__((aligned(CACHE_LINE))) SLAB_CLASS;
+
+/*
+ * The arena is the home blocks, from the start of it to home_end, then the
+ * overflow area up to end. brk and overflow are the offsets in each not
+ * carved yet.
+ */
+struct shm_slab {
+    atomic_uint brk __attribute__((aligned(CACHE_LINE)));
+    atomic_uint overflow;
+    uint32_t home_end;
+    uint32_t end;
+    int home;                                            /* the home class */
+    SLAB_CLASS classes[SLAB_CLASSES];
+    char arena[] __attribute__((aligned(CACHE_LINE)));
+};
+
+static size_t class_size(int c)
+{
+    return (size_t)SHM_SLAB_MIN_BLOCK << c;
+}
+
+/**
+ * @brief the smallest class holding len bytes, SLAB_CLASSES if none does
+ */
+static int class_of(size_t len)
+{
+    int c = 0;
+
+    while (c < SLAB_CLASSES && class_size(c) < len) {
+        c++;
+    }
+    return c;
+}
+
+size_t sizeof_shm_slab(int blocks, size_t block_size)
+{
+    int home = class_of(block_size);
+    size_t size;
+
+    if (blocks < 1 || home == SLAB_CLASSES) {
+        return 0;
+    }
+    size = sizeof(SHM_SLAB) + (size_t)blocks * class_size(home) + SHM_SLAB_OVERFLOW;
+    return size > UINT32_MAX ? 0 : size;
+}
+
+int init_shm_slab(SHM_SLAB *s, int blocks, size_t block_size)
+{
+    size_t size = sizeof_shm_slab(blocks, block_size);
+
+    if (s == NULL || size == 0) {
+        return 1;
+    }
+    /* the arena is left alone, it is backed as blocks are carved off it */
+    memset(s, 0, sizeof(SHM_SLAB));
+    s->home = class_of(block_size);
+    s->end = size;
+    s->home_end = size - SHM_SLAB_OVERFLOW;
+    atomic_init(&s->brk, offsetof(SHM_SLAB, arena));
+    atomic_init(&s->overflow, s->home_end);
+    return 0;
+}
+
+/**
+ * @brief Carve size bytes off the part of the arena from *brk to end.
+ *        Failing leaves *brk alone, however often it is tried.
+ * @return offset of the bytes, 0 if there is no room
+ */
+static uint32_t carve(atomic_uint *brk, uint32_t end, size_t size)
+{
+    unsigned int off = atomic_load_explicit(brk, memory_order_relaxed);
+
+    do {
+        if ((uint64_t)off + size > end) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(brk, &off, off + size,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+    return off;
+}
+
+/**
+ * @brief the link to the next free block kept in the free block at off
+ */
+static atomic_uint *next_of(SHM_SLAB *s, uint32_t off)
+{
+    return (atomic_uint *)((char *)s + off);
+}
+
+SLAB_HANDLE slab_alloc(SHM_SLAB *s, size_t len)
+{
+    int c = class_of(len);
+
+    if (c == SLAB_CLASSES) {
+        return 0;
+    }
+    if (c < s->home) {
+        c = s->home;
+    }
+
+    /* Pop the free list; if the first block is taken and pushed back in
+     * the meantime, the tag has changed and the swap fails. */
+    SLAB_CLASS *cls = &s->classes[c];
+    uint64_t old = atomic_load_explicit(&cls->head, memory_order_acquire);
+    while ((uint32_t)old != 0) {
+        uint32_t next = atomic_load_explicit(next_of(s, (uint32_t)old), memory_order_relaxed);
+        uint64_t new = (((old >> 32) + 1) << 32) | next;
+        if (atomic_compare_exchange_weak_explicit(&cls->head, &old, new,
+                                                  memory_order_acquire,
+                                                  memory_order_acquire)) {
+            return (uint32_t)old | c;
+        }
+    }
+
+    /* none free, carve one, off the overflow area if not a home block */
+    uint32_t off = c == s->home ? carve(&s->brk, s->home_end, class_size(c)) : 0;
+    if (off == 0) {
+        off = carve(&s->overflow, s->end, class_size(c));
+    }
+    return off == 0 ? 0 : off | c;
+}
+
+size_t slab_size(SLAB_HANDLE h)
+{
+    return class_size(h & CLASS_MASK);
+}
+
+void *slab_ptr(SHM_SLAB *s, SLAB_HANDLE h)
+{
+    return (char *)s + (h & ~CLASS_MASK);
+}
+
+void slab_free(SHM_SLAB *s, SLAB_HANDLE h)
+{
+    if (h == 0) {
+        return;
+    }
+
+    SLAB_CLASS *cls = &s->classes[h & CLASS_MASK];
+    uint32_t off = h & ~CLASS_MASK;
+    uint64_t old = atomic_load_explicit(&cls->head, memory_order_relaxed);
+    uint64_t new;
+    do {
+        atomic_store_explicit(next_of(s, off), (uint32_t)old, memory_order_relaxed);
+        new = (((old >> 32) + 1) << 32) | off;
+    } while (!atomic_compare_exchange_weak_explicit(&cls->head, &old, new,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
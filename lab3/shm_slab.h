@@ -0,0 +1,77 @@
+/**
+ * @file shm_slab.h
+ * @brief allocator of fragment payloads in shared memory, for use by any
+ *        number of processes.
+ *
+ * Blocks come in size classes of SHM_SLAB_MIN_BLOCK, twice that, and so on
+ * up to SHM_SLAB_MAX_BLOCK bytes. A slab is made for n blocks of the size
+ * its users expect, the home class; a request gets a block of the smallest
+ * class that holds it, and never one below the home class. A freed block
+ * goes on the lock-free free
+ * list of its class, a stack popped and pushed with one compare-and-swap
+ * on its head, which carries a tag bumped with every change so that a
+ * block popped and pushed back in between is noticed. A class whose list
+ * is empty carves a new block off the arena.
+ *
+ * The processes map the segment at different addresses, so a block is
+ * named by a handle, its offset in the segment, which slab_ptr() turns
+ * into a pointer in the calling process.
+ *
+ * The arena has room for n blocks of the home class, which only that class
+ * carves, so a slab made for n blocks never runs out while at most n blocks
+ * no larger than the home class are allocated at a time. Larger blocks, and
+ * home blocks past n, are carved off an overflow area of SHM_SLAB_OVERFLOW
+ * bytes shared by all classes, which can be used up. Memory of a System V
+ * segment is only backed once it is touched, so the arena costs what the
+ * blocks carved off it take.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_SLAB_MIN_BLOCK 256              /* smallest class           */
+#define SHM_SLAB_MAX_BLOCK (1024 * 1024)    /* largest class, 1M        */
+#define SHM_SLAB_OVERFLOW (32 * SHM_SLAB_MAX_BLOCK) /* for larger blocks */
+
+typedef struct shm_slab SHM_SLAB;
+typedef uint32_t SLAB_HANDLE;               /* 0 for no block           */
+
+/**
+ * @brief Bytes of shared memory a slab for blocks blocks of up to
+ *        block_size bytes at a time takes.
+ * @return 0 if block_size is more than SHM_SLAB_MAX_BLOCK, or that is too
+ *         many blocks to give each a 32-bit handle
+ */
+size_t sizeof_shm_slab(int blocks, size_t block_size);
+
+/**
+ * @brief Initialize a slab in sizeof_shm_slab(blocks, block_size) bytes at
+ *        s, which must be aligned to a cache line, as shmat() memory is.
+ * @return 0 on success, non-zero if blocks is less than 1 or too many, or
+ *         block_size too large
+ */
+int init_shm_slab(SHM_SLAB *s, int blocks, size_t block_size);
+
+/**
+ * @brief Allocate a block of at least len bytes.
+ * @return its handle, 0 if len is more than SHM_SLAB_MAX_BLOCK or there is
+ *         no room left for a block of its class
+ */
+SLAB_HANDLE slab_alloc(SHM_SLAB *s, size_t len);
+
+/**
+ * @brief Bytes the block h holds, at least what it was allocated for.
+ */
+size_t slab_size(SLAB_HANDLE h);
+
+/**
+ * @brief Address of block h in this process.
+ */
+void *slab_ptr(SHM_SLAB *s, SLAB_HANDLE h);
+
+/**
+ * @brief Return block h to its free list; a 0 handle is ignored.
+ */
+void slab_free(SHM_SLAB *s, SLAB_HANDLE h);